@@ -34,6 +34,10 @@
 #include "armsoc_exa.h"
 
 #include "dri2.h"
+#include "windowstr.h"
+#include "property.h"
+#include "propertyst.h"
+#include <X11/Xatom.h>
 
 /* any point to support earlier? */
 #if DRI2INFOREC_VERSION < 4
@@ -73,8 +77,73 @@ struct ARMSOCDRI2BufferRec {
 #define ARMSOCBUF(p)	((struct ARMSOCDRI2BufferRec *)(p))
 #define DRIBUF(p)	((DRI2BufferPtr)(&(p)->base))
 
+/* Buckets of the swap latency histogram, from ScheduleSwap to completion,
+ * in powers of two milliseconds: <1ms, <2ms, <4ms, ... and the last one
+ * takes everything longer.
+ */
+#define ARMSOC_LATENCY_BUCKETS 8
+/* Vblanks missed between consecutive flips: 0, 1, 2, 3 or more */
+#define ARMSOC_MISSED_BUCKETS 4
 
-static Bool
+/**
+ * Swap statistics of a window. With the SwapStats option these are
+ * published as the _ARMSOC_SWAP_STATS property of the window, an array of
+ * CARD32 laid out like this structure.
+ */
+struct ARMSOCDRI2SwapStats {
+	CARD32 flips;
+	CARD32 blits;
+	CARD32 fake_flips;
+	CARD32 failures;
+	CARD32 canflip_changes;
+	CARD32 latency[ARMSOC_LATENCY_BUCKETS];
+	CARD32 missed[ARMSOC_MISSED_BUCKETS];
+};
+
+/* Per-window DRI2 state, kept in the window's devPrivates */
+struct ARMSOCDRI2WindowRec {
+	/**
+	 * target_msc of the previous swap. DRI2 doesn't tell us the swap
+	 * interval, but a plain SwapBuffers targets the previous target
+	 * plus the interval.
+	 */
+	CARD64 last_target_msc;
+
+	struct ARMSOCDRI2SwapStats stats;
+	/* frame of the previous completed flip, 0 if unknown */
+	unsigned int last_flip_frame;
+	/* when stats were last published */
+	CARD32 stats_time;
+	/* the back buffers could have been flipped but were allocated as
+	 * non-scanout to stay within the scanout memory budget */
+	Bool scanout_demoted;
+};
+
+static Atom swap_stats_atom;
+static Atom variable_refresh_atom;
+
+static DevPrivateKeyRec ARMSOCDRI2WindowPrivateKeyRec;
+
+static struct ARMSOCDRI2WindowRec *
+ARMSOCDRI2WindowPriv(DrawablePtr pDraw)
+{
+	return dixLookupPrivate(&((WindowPtr)pDraw)->devPrivates,
+			&ARMSOCDRI2WindowPrivateKeyRec);
+}
+
+/* Values returned by canflip() */
+enum {
+	/* the drawable can only be blitted */
+	FLIP_NONE = 0,
+	/* the drawable covers the whole root, flip every CRTC */
+	FLIP_FULLSCREEN,
+	/* the drawable covers one or more CRTCs exactly, flip just those */
+	FLIP_CRTC,
+	/* the drawable is shown on an overlay plane, flip the plane */
+	FLIP_PLANE,
+};
+
+static int
 canflip(DrawablePtr pDraw)
 {
 	ScreenPtr pScreen = pDraw->pScreen;
@@ -83,11 +152,22 @@ canflip(DrawablePtr pDraw)
 
 	if (pARMSOC->NoFlip) {
 		/* flipping is disabled by user option */
-		return FALSE;
-	} else {
-		return (pDraw->type == DRAWABLE_WINDOW) &&
-				DRI2CanFlip(pDraw);
+		return FLIP_NONE;
 	}
+
+	if (pDraw->type != DRAWABLE_WINDOW)
+		return FLIP_NONE;
+
+	if (DRI2CanFlip(pDraw) && !drmmode_crtc_shadowed(pScrn))
+		return FLIP_FULLSCREEN;
+
+	if (drmmode_crtcs_for_drawable(pDraw))
+		return FLIP_CRTC;
+
+	if (pARMSOC->overlays && drmmode_overlay_possible(pDraw))
+		return FLIP_PLANE;
+
+	return FLIP_NONE;
 }
 
 static inline void
@@ -117,13 +197,8 @@ MigratePixmapToGEM(struct ARMSOCRec *pARMSOC, DrawablePtr pDraw)
         return bo;
     }
 
-    /* create the GEM buffer */
-    bo = armsoc_bo_new_with_dim(pARMSOC->dev,
-                                pDraw->width,
-                                pDraw->height,
-                                pDraw->depth,
-                                pDraw->bitsPerPixel,
-				ARMSOC_BO_NON_SCANOUT);
+    /* copy the pixel data drawn so far to a GEM buffer */
+    bo = ARMSOCPixmapMoveToBo(pPixmap);
     if (!bo) {
         ErrorF("MigratePixmapToGEM: bo alloc failed\n");
         return NULL;
@@ -132,19 +207,6 @@ MigratePixmapToGEM(struct ARMSOCRec *pARMSOC, DrawablePtr pDraw)
     addr = armsoc_bo_map(bo);
     pitch = armsoc_bo_pitch(bo);
 
-    /* copy the pixel data to the new location */
-    if (pitch == pPixmap->devKind) {
-        memcpy(addr, pPixmap->devPrivate.ptr, armsoc_bo_size(bo));
-    } else {
-        int y;
-        unsigned char *data = pPixmap->devPrivate.ptr;
-        for (y = 0; y < pPixmap->drawable.height; y++) {
-            memcpy(addr + y * pitch, 
-                   data + y * pPixmap->devKind,
-                   pPixmap->devKind);
-        }
-    }
-
     armsoc_bo_set_backup(bo, pPixmap->devKind, pPixmap->devPrivate.ptr);
     pPixmap->devKind = pitch;
     pPixmap->devPrivate.ptr = addr;
@@ -155,15 +217,49 @@ MigratePixmapToGEM(struct ARMSOCRec *pARMSOC, DrawablePtr pDraw)
     return bo;
 }
 
+/*
+ * The depth and bpp of the buffers a client asked for with
+ * DRI2GetBuffersWithFormat, where the format is the depth of the buffer.
+ * 0 (DRI2GetBuffers) and formats we have no framebuffer format for get
+ * the drawable's.
+ */
+static void
+ARMSOCDRI2FormatDepth(DrawablePtr pDraw, unsigned int format,
+		int *depth, int *bpp)
+{
+	*depth = pDraw->depth;
+	*bpp = pDraw->bitsPerPixel;
+
+	switch (format) {
+	case 15:
+	case 16:
+		*depth = format;
+		*bpp = 16;
+		break;
+	case 24:
+	case 30:
+		*depth = format;
+		*bpp = 32;
+		break;
+	case 32:
+		/* 32 bits per pixel in the drawable's own layout */
+		if (pDraw->bitsPerPixel != 32) {
+			*depth = 24;
+			*bpp = 32;
+		}
+		break;
+	}
+}
+
 /**
  * Create Buffer.
  *
  * Note that 'format' is used from the client side to specify the DRI buffer
  * format, which could differ from the drawable format.  For example, the
  * drawable could be 32b RGB, but the DRI buffer some YUV format (video) or
- * perhaps lower bit depth RGB (GL).  The color conversion is handled when
- * blitting to front buffer, and page-flipping (overlay or flipchain) can
- * only be used if the display supports.
+ * perhaps lower bit depth RGB (GL).  Back buffers are allocated in the
+ * requested format. They are flipped as they are where the display can
+ * scan that format out, and converted when blitting to the front buffer.
  */
 static DRI2BufferPtr
 ARMSOCDRI2CreateBuffer(DrawablePtr pDraw, unsigned int attachment,
@@ -174,6 +270,8 @@ ARMSOCDRI2CreateBuffer(DrawablePtr pDraw, unsigned int attachment,
 	struct ARMSOCDRI2BufferRec *buf = calloc(1, sizeof(*buf));
 	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
 	struct armsoc_bo *bo;
+	enum armsoc_buf_type buf_type;
+	int flip, depth, bpp;
 
 	DEBUG_MSG("pDraw=%p, attachment=%d, format=%08x",
 			pDraw, attachment, format);
@@ -199,38 +297,114 @@ ARMSOCDRI2CreateBuffer(DrawablePtr pDraw, unsigned int attachment,
 	        return NULL;
 	    }
 	    DRIBUF(buf)->pitch = armsoc_bo_pitch(bo);
-	    DRIBUF(buf)->name = armsoc_bo_name(bo);
+	    DRIBUF(buf)->name = armsoc_bo_export_name(bo);
             buf->bo = bo;
 	    return DRIBUF(buf);
 	}
 
+	/* The front buffer of a window flipped on just the CRTCs it covers,
+	 * or on an overlay plane, is the buffer those scan out, so that the
+	 * flip can exchange it with the back buffer like the root is in the
+	 * fullscreen case.
+	 */
+	flip = canflip(pDraw);
+	if (attachment == DRI2BufferFrontLeft &&
+			(flip == FLIP_CRTC || flip == FLIP_PLANE)) {
+		if (flip == FLIP_CRTC)
+			bo = drmmode_scanout_bo_for_drawable(pDraw);
+		else
+			bo = drmmode_overlay_bo_for_drawable(pDraw);
+		if (bo && armsoc_bo_width(bo) == pDraw->width &&
+				armsoc_bo_height(bo) == pDraw->height &&
+				armsoc_bo_bpp(bo) == pDraw->bitsPerPixel) {
+			armsoc_bo_reference(bo);
+		} else if (armsoc_scanout_buf_type(pARMSOC->dev,
+				pDraw->width, pDraw->height,
+				pDraw->bitsPerPixel) != ARMSOC_BO_SCANOUT) {
+			bo = NULL;
+		} else {
+			bo = armsoc_bo_new_with_dim(pARMSOC->dev,
+					pDraw->width, pDraw->height,
+					pDraw->depth, pDraw->bitsPerPixel,
+					ARMSOC_BO_SCANOUT);
+			if (bo && !armsoc_bo_get_fb(bo) &&
+					armsoc_bo_add_fb(bo)) {
+				armsoc_bo_unreference(bo);
+				bo = NULL;
+			}
+		}
+
+		if (bo) {
+			DRIBUF(buf)->pitch = armsoc_bo_pitch(bo);
+			DRIBUF(buf)->name = armsoc_bo_export_name(bo);
+			buf->bo = bo;
+			return DRIBUF(buf);
+		}
+		/* otherwise use the root below, ScheduleSwap will blit */
+	}
+
 	/* We are not interested in anything other than back buffer requests ... */
 	if (attachment != DRI2BufferBackLeft || pDraw->type != DRAWABLE_WINDOW) {
 		/* ... and just return some dummy UMP buffer */
 		bo = pARMSOC->scanout;
 		DRIBUF(buf)->pitch = armsoc_bo_pitch(bo);
-		DRIBUF(buf)->name = armsoc_bo_name(bo);
+		DRIBUF(buf)->name = armsoc_bo_export_name(bo);
 		buf->bo = bo;
 		armsoc_bo_reference(bo);
 		return DRIBUF(buf);
 	}
 
+	ARMSOCDRI2FormatDepth(pDraw, format, &depth, &bpp);
+	DRIBUF(buf)->cpp = bpp / 8;
+
+	/* A window flipped on its CRTCs is exchanged with buffers in the
+	 * format of what they scan out, which a page flip cannot change.
+	 * Overlay planes take any format they list.
+	 */
+	if (flip == FLIP_CRTC || flip == FLIP_FULLSCREEN)
+		flip = depth == pDraw->depth && bpp == pDraw->bitsPerPixel ?
+				flip : FLIP_NONE;
+
+	/* Scanout buffers of a window that no longer flips are not reused,
+	 * so that their memory goes back to the windows that do. Nor are the
+	 * ordinary buffers a flipping window was demoted to, once scanout
+	 * memory fits it again.
+	 */
 	bo = armsoc_bo_from_drawable(pDraw);
-	if (bo && armsoc_bo_width(bo) == pDraw->width && armsoc_bo_height(bo) == pDraw->height && armsoc_bo_bpp(bo) == pDraw->bitsPerPixel) {
+	if (bo && armsoc_bo_width(bo) == pDraw->width && armsoc_bo_height(bo) == pDraw->height &&
+			armsoc_bo_depth(bo) == depth && armsoc_bo_bpp(bo) == bpp &&
+			(flip ? armsoc_bo_buf_type(bo) == ARMSOC_BO_SCANOUT ||
+				!armsoc_scanout_fits(pARMSOC->dev, pDraw->width,
+					pDraw->height, bpp) :
+				armsoc_bo_buf_type(bo) != ARMSOC_BO_SCANOUT)) {
 		// Reuse existing
 		DRIBUF(buf)->pitch = armsoc_bo_pitch(bo);
-		DRIBUF(buf)->name = armsoc_bo_name(bo);
+		DRIBUF(buf)->name = armsoc_bo_export_name(bo);
 		buf->bo = bo;
 		armsoc_bo_reference(bo);
 		return DRIBUF(buf);
 	}
 
+	buf_type = ARMSOC_BO_NON_SCANOUT;
+	if (flip)
+		buf_type = armsoc_scanout_buf_type(pARMSOC->dev,
+				pDraw->width, pDraw->height, bpp);
+	ARMSOCDRI2WindowPriv(pDraw)->scanout_demoted =
+			flip && buf_type != ARMSOC_BO_SCANOUT;
+
 	bo = armsoc_bo_new_with_dim(pARMSOC->dev,
                                 pDraw->width,
                                 pDraw->height,
-                                pDraw->depth,
-                                pDraw->bitsPerPixel,
-				canflip(pDraw) ? ARMSOC_BO_SCANOUT : ARMSOC_BO_NON_SCANOUT);
+                                depth,
+                                bpp,
+				buf_type);
+	if (!bo && buf_type == ARMSOC_BO_SCANOUT) {
+		/* contiguous memory may be too fragmented even within the
+		 * budget, blit from an ordinary buffer then */
+		buf_type = ARMSOC_BO_NON_SCANOUT;
+		bo = armsoc_bo_new_with_dim(pARMSOC->dev, pDraw->width,
+				pDraw->height, depth, bpp, buf_type);
+	}
 	if (!bo) {
 	        ErrorF("ARMSOCDRI2CreateBuffer: BO alloc failed\n");
 		free(buf);
@@ -238,17 +412,17 @@ ARMSOCDRI2CreateBuffer(DrawablePtr pDraw, unsigned int attachment,
 	}
 
 	armsoc_bo_set_drawable(bo, pDraw);
-	DRIBUF(buf)->name = armsoc_bo_name(bo);
+	DRIBUF(buf)->name = armsoc_bo_export_name(bo);
 	DRIBUF(buf)->pitch = armsoc_bo_pitch(bo);
 	buf->bo = bo;
 
-	if (canflip(pDraw) && attachment != DRI2BufferFrontLeft) {
+	if (buf_type == ARMSOC_BO_SCANOUT && attachment != DRI2BufferFrontLeft) {
 		/* Create an fb around this buffer. This will fail and we will
 		 * fall back to blitting if the display controller hardware
 		 * cannot scan out this buffer (for example, if it doesn't
 		 * support the format or there was insufficient scanout memory
 		 * at buffer creation time). */
-		int ret = armsoc_bo_add_fb(bo);
+		int ret = armsoc_bo_get_fb(bo) ? 0 : armsoc_bo_add_fb(bo);
 		if (ret) {
 			WARNING_MSG(
 					"Falling back to blitting a flippable window");
@@ -276,11 +450,10 @@ ARMSOCDRI2DestroyBuffer(DrawablePtr pDraw, DRI2BufferPtr buffer)
 
 	bo = buf->bo;
 	if (pDraw->type == DRAWABLE_PIXMAP && armsoc_bo_refcnt(bo) == 1) {
-		/* We're about to destroy the bo behind a migrated pixmap.
-		 * Restore original devKind/devPrivate.ptr.
+		/* We're about to drop the bo behind a migrated pixmap.
+		 * Move it back to its original devKind/devPrivate.ptr.
 		 */
-		PixmapPtr pPixmap = (PixmapPtr) pDraw;
-		armsoc_bo_get_backup(bo, &pPixmap->devKind, &pPixmap->devPrivate.ptr);
+		ARMSOCPixmapMoveFromBo((PixmapPtr) pDraw, bo);
 	}
 
 	armsoc_bo_unreference(bo);
@@ -305,7 +478,6 @@ ARMSOCDRI2CopyRegion(DrawablePtr pDraw, RegionPtr pRegion,
 	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
 	RegionPtr pCopyClip;
 	GCPtr pGC;
-        PixmapPtr pScratchPixmap;
         struct ARMSOCDRI2BufferRec *src = ARMSOCBUF(pSrcBuffer);
 
 	DEBUG_MSG("pDraw=%p, pDstBuffer=%p pSrcBuffer=%p",
@@ -327,22 +499,30 @@ ARMSOCDRI2CopyRegion(DrawablePtr pDraw, RegionPtr pRegion,
 	 * buffers, I think we could do something more clever
 	 * here.
 	 */
+	ARMSOCCopyBoToDrawable(src->bo, pDraw, pGC);
+	FreeScratchGC(pGC);
+}
+
+/*
+ * The CRTC showing most of the drawable, whose frames it is synced to.
+ */
+static xf86CrtcPtr
+ARMSOCDRI2DrawableCrtc(DrawablePtr pDraw)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pDraw->pScreen);
+	BoxRec box;
 
-        pScratchPixmap = GetScratchPixmapHeader(pScreen,
-		armsoc_bo_width(src->bo), armsoc_bo_height(src->bo),
-		armsoc_bo_depth(src->bo), armsoc_bo_bpp(src->bo),
-		armsoc_bo_pitch(src->bo), armsoc_bo_map(src->bo));
-		
+	box.x1 = pDraw->x;
+	box.y1 = pDraw->y;
+	box.x2 = box.x1 + pDraw->width;
+	box.y2 = box.y1 + pDraw->height;
 
-	pGC->ops->CopyArea((DrawablePtr) pScratchPixmap, pDraw, pGC,
-			0, 0, pDraw->width, pDraw->height, 0, 0);
-	FreeScratchPixmapHeader(pScratchPixmap);
-	FreeScratchGC(pGC);
+	return drmmode_crtc_covering_box(pScrn, &box);
 }
 
 /**
  * Get current frame count and frame count timestamp, based on drawable's
- * crtc.
+ * crtc. Without vblank queries they come from the CRTC's frame clock.
  */
 static int
 ARMSOCDRI2GetMSC(DrawablePtr pDraw, CARD64 *ust, CARD64 *msc)
@@ -350,35 +530,118 @@ ARMSOCDRI2GetMSC(DrawablePtr pDraw, CARD64 *ust, CARD64 *msc)
 	ScreenPtr pScreen = pDraw->pScreen;
 	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
 	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	xf86CrtcPtr crtc = ARMSOCDRI2DrawableCrtc(pDraw);
 	drmVBlank vbl = { .request = {
 		.type = DRM_VBLANK_RELATIVE,
 		.sequence = 0,
 	} };
+	uint64_t crtc_ust, crtc_msc;
 	int ret;
 
-	if (!pARMSOC->drmmode_interface->vblank_query_supported)
-		return FALSE;
-
-	ret = drmWaitVBlank(pARMSOC->drmFD, &vbl);
-	if (ret) {
-		ERROR_MSG("get vblank counter failed: %s", strerror(errno));
-		return FALSE;
+	/* not shown anywhere, there are no frames to count */
+	if (!crtc) {
+		crtc_ust = crtc_msc = 0;
+	} else if (!pARMSOC->drmmode_interface->vblank_query_supported) {
+		drmmode_crtc_get_ust_msc(crtc, &crtc_ust, &crtc_msc);
+	} else {
+		vbl.request.type |= drmmode_crtc_vblank_pipe(crtc);
+		ret = drmWaitVBlank(pARMSOC->drmFD, &vbl);
+		if (ret) {
+			ERROR_MSG("get vblank counter failed: %s",
+					strerror(errno));
+			return FALSE;
+		}
+		crtc_ust = ((CARD64)vbl.reply.tval_sec * 1000000)
+			+ vbl.reply.tval_usec;
+		crtc_msc = vbl.reply.sequence;
 	}
 
 	if (ust)
-		*ust = ((CARD64)vbl.reply.tval_sec * 1000000)
-			+ vbl.reply.tval_usec;
+		*ust = crtc_ust;
 
 	if (msc)
-		*msc = vbl.reply.sequence;
+		*msc = crtc_msc;
 
 	return TRUE;
 }
 
+/*
+ * Work out whether the client asked for swap interval 0, in which case
+ * the flip doesn't need to wait for vblank.
+ */
+static Bool
+swap_interval_is_zero(DrawablePtr pDraw, CARD64 target_msc,
+		CARD64 divisor, CARD64 remainder)
+{
+	struct ARMSOCDRI2WindowRec *priv;
+	CARD64 last_target_msc;
+
+	if (pDraw->type != DRAWABLE_WINDOW)
+		return FALSE;
+
+	priv = ARMSOCDRI2WindowPriv(pDraw);
+	last_target_msc = priv->last_target_msc;
+	priv->last_target_msc = target_msc;
+
+	/* explicit OML_sync_control targets are honoured as they are */
+	if (divisor || remainder)
+		return FALSE;
+
+	return target_msc == last_target_msc;
+}
+
+/*
+ * Whether a window wants variable refresh while it flips. Windows are in
+ * unless their _VARIABLE_REFRESH property says 0, which lets compositors
+ * and clients opt windows in or out.
+ */
+static Bool
+ARMSOCDRI2WindowWantsVRR(WindowPtr pWin)
+{
+	PropertyPtr prop;
+
+	if (dixLookupProperty(&prop, pWin, variable_refresh_atom,
+			serverClient, DixReadAccess) != Success)
+		return TRUE;
+
+	if (prop->type != XA_CARDINAL || prop->format != 32 || !prop->size)
+		return TRUE;
+
+	return *(CARD32 *)prop->data != 0;
+}
+
+/*
+ * Variable refresh follows flipping: it is on for the CRTCs a window flips
+ * on while the window is flipped there, and off again once it is blitted.
+ */
+static void
+ARMSOCDRI2UpdateVRR(DrawablePtr pDraw, int flip)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pDraw->pScreen);
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	unsigned int crtc_mask = 0;
+
+	if (!pARMSOC->variableRefresh || pDraw->type != DRAWABLE_WINDOW)
+		return;
+
+	if (flip == FLIP_FULLSCREEN)
+		crtc_mask = ~0U;
+	else if (flip == FLIP_CRTC)
+		crtc_mask = drmmode_crtcs_for_drawable(pDraw);
+
+	if (crtc_mask && !ARMSOCDRI2WindowWantsVRR((WindowPtr)pDraw))
+		crtc_mask = 0;
+
+	drmmode_set_vrr(pDraw, crtc_mask);
+}
+
 #define ARMSOC_SWAP_FAKE_FLIP (1 << 0)
 #define ARMSOC_SWAP_FAIL      (1 << 1)
+#define ARMSOC_SWAP_CRTC_FLIP (1 << 2)
+#define ARMSOC_SWAP_PLANE_FLIP (1 << 3)
 
 struct ARMSOCDRISwapCmd {
+	struct ARMSOCFlipEvent base;
 	int type;
 	ClientPtr client;
 	ScreenPtr pScreen;
@@ -392,6 +655,12 @@ struct ARMSOCDRISwapCmd {
 	int swapCount;
 	int flags;
 	void *data;
+	/* when the swap was scheduled, in us */
+	CARD64 scheduled;
+	/* as reported by the last page flip event */
+	unsigned int frame;
+	unsigned int tv_sec;
+	unsigned int tv_usec;
 };
 
 static const char * const swap_names[] = {
@@ -400,6 +669,82 @@ static const char * const swap_names[] = {
 		[DRI2_FLIP_COMPLETE] = "flip,"
 };
 
+static void
+ARMSOCDRI2PublishStats(DrawablePtr pDraw)
+{
+	struct ARMSOCDRI2WindowRec *priv = ARMSOCDRI2WindowPriv(pDraw);
+	CARD32 now = GetTimeInMillis();
+
+	if (now - priv->stats_time < ARMSOC_STATS_INTERVAL)
+		return;
+
+	priv->stats_time = now;
+	dixChangeWindowProperty(serverClient, (WindowPtr)pDraw,
+			swap_stats_atom, XA_INTEGER, 32, PropModeReplace,
+			sizeof(priv->stats) / sizeof(CARD32), &priv->stats,
+			TRUE);
+}
+
+/*
+ * Account a completed swap in the window's statistics.
+ */
+static void
+ARMSOCDRI2UpdateStats(DrawablePtr pDraw, struct ARMSOCDRISwapCmd *cmd)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pDraw->pScreen);
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct ARMSOCDRI2WindowRec *priv;
+	CARD64 completed, latency;
+	int bucket;
+
+	if (pDraw->type != DRAWABLE_WINDOW)
+		return;
+
+	priv = ARMSOCDRI2WindowPriv(pDraw);
+
+	if (cmd->type == DRI2_BLIT_COMPLETE) {
+		priv->stats.blits++;
+	} else if (cmd->flags & ARMSOC_SWAP_FAKE_FLIP) {
+		priv->stats.fake_flips++;
+	} else {
+		priv->stats.flips++;
+		if (cmd->frame && priv->last_flip_frame &&
+				cmd->frame > priv->last_flip_frame) {
+			bucket = min(cmd->frame - priv->last_flip_frame - 1,
+					ARMSOC_MISSED_BUCKETS - 1);
+			priv->stats.missed[bucket]++;
+		}
+		priv->last_flip_frame = cmd->frame;
+	}
+
+	/* event timestamps are CLOCK_MONOTONIC, like GetTimeInMicros() */
+	if (cmd->tv_sec || cmd->tv_usec)
+		completed = (CARD64)cmd->tv_sec * 1000000 + cmd->tv_usec;
+	else
+		completed = GetTimeInMicros();
+	latency = completed > cmd->scheduled ?
+			(completed - cmd->scheduled) / 1000 : 0;
+	for (bucket = 0; latency && bucket < ARMSOC_LATENCY_BUCKETS - 1;
+			bucket++)
+		latency >>= 1;
+	priv->stats.latency[bucket]++;
+
+	if (pARMSOC->swapStats)
+		ARMSOCDRI2PublishStats(pDraw);
+}
+
+static void
+ARMSOCDRI2FlipHandler(struct ARMSOCFlipEvent *event, unsigned int frame,
+		unsigned int tv_sec, unsigned int tv_usec)
+{
+	struct ARMSOCDRISwapCmd *cmd = (struct ARMSOCDRISwapCmd *)event;
+
+	cmd->frame = frame;
+	cmd->tv_sec = tv_sec;
+	cmd->tv_usec = tv_usec;
+	ARMSOCDRI2SwapComplete(cmd);
+}
+
 void
 ARMSOCDRI2SwapComplete(struct ARMSOCDRISwapCmd *cmd)
 {
@@ -435,14 +780,20 @@ ARMSOCDRI2SwapComplete(struct ARMSOCDRISwapCmd *cmd)
 							cmd->pDstBuffer);
 			}
 
-			DRI2SwapComplete(cmd->client, pDraw, 0, 0, 0, cmd->type,
+			DRI2SwapComplete(cmd->client, pDraw, cmd->frame,
+					cmd->tv_sec, cmd->tv_usec, cmd->type,
 					cmd->func, cmd->data);
+			ARMSOCDRI2UpdateStats(pDraw, cmd);
 
 			if (cmd->type != DRI2_BLIT_COMPLETE &&
 			   (cmd->flags & ARMSOC_SWAP_FAKE_FLIP) == 0) {
 				assert(cmd->type == DRI2_FLIP_COMPLETE);
 				armsoc_bo_set_drawable(old_dst_bo, pDraw);
-				set_scanout_bo(pScrn, old_src_bo);
+				/* a flip on a subset of the CRTCs or on an
+				 * overlay leaves the root framebuffer alone */
+				if (!(cmd->flags & (ARMSOC_SWAP_CRTC_FLIP |
+						ARMSOC_SWAP_PLANE_FLIP)))
+					set_scanout_bo(pScrn, old_src_bo);
 			}
 		}
 	}
@@ -485,6 +836,9 @@ ARMSOCDRI2ScheduleSwap(ClientPtr client, DrawablePtr pDraw,
 	struct armsoc_bo *src_bo, *dst_bo;
 	int src_fb_id, dst_fb_id;
 	int new_canflip, ret, do_flip;
+	Bool async;
+	xf86CrtcPtr crtc = NULL;
+	uint64_t ust, msc = 0;
 
 	src_bo = src->bo;
 	dst_bo = dst->bo;
@@ -492,7 +846,9 @@ ARMSOCDRI2ScheduleSwap(ClientPtr client, DrawablePtr pDraw,
 	src_fb_id = armsoc_bo_get_fb(src_bo);
 	dst_fb_id = armsoc_bo_get_fb(dst_bo);
 
-	do_flip = src_fb_id && dst_fb_id && canflip(pDraw);
+	new_canflip = canflip(pDraw);
+	do_flip = src_fb_id && dst_fb_id && new_canflip;
+	async = swap_interval_is_zero(pDraw, *target_msc, divisor, remainder);
 
 	/* Mali does not always call GetBuffers before SwapBuffers. This means
 	 * that when we change resolution, we change scanout but Mali does not
@@ -502,16 +858,29 @@ ARMSOCDRI2ScheduleSwap(ClientPtr client, DrawablePtr pDraw,
 	 * stale scanout buffer.
 	 * Work around this Mali issue by detecting the case and bailing out.
 	 */
-	if (do_flip && dst_bo != pARMSOC->scanout) {
+	if (do_flip && new_canflip == FLIP_FULLSCREEN &&
+			dst_bo != pARMSOC->scanout) {
 		ErrorF("BAD MALI! Rejecting flip where dst is "
 			"non-scanout BO %d\n", armsoc_bo_name(dst_bo));
+		if (pDraw->type == DRAWABLE_WINDOW)
+			ARMSOCDRI2WindowPriv(pDraw)->stats.failures++;
 		return FALSE;
 	}
 
+	/* When flipping only the CRTCs the window covers or an overlay, the
+	 * root must never be handed to the client as a back buffer. This
+	 * happens for the frame after the window stopped being fullscreen,
+	 * until the client picks up its re-allocated buffers.
+	 */
+	if (do_flip && (new_canflip == FLIP_CRTC ||
+			new_canflip == FLIP_PLANE) && dst_bo == pARMSOC->scanout)
+		do_flip = FALSE;
+
 	cmd = calloc(1, sizeof(*cmd));
 	if (!cmd)
 		return FALSE;
 
+	cmd->base.handler = ARMSOCDRI2FlipHandler;
 	cmd->client = client;
 	cmd->pScreen = pScreen;
 	cmd->draw_id = pDraw->id;
@@ -521,6 +890,35 @@ ARMSOCDRI2ScheduleSwap(ClientPtr client, DrawablePtr pDraw,
 	cmd->flags = 0;
 	cmd->func = func;
 	cmd->data = data;
+	cmd->scheduled = GetTimeInMicros();
+
+	/* Without vblank events swaps are paced by the frame clock: they
+	 * report the frame they were done in, and blits complete no earlier
+	 * than the frame they target, which keeps the client to its swap
+	 * interval. Flips are paced by the flip itself.
+	 */
+	if (!pARMSOC->drmmode_interface->vblank_query_supported)
+		crtc = ARMSOCDRI2DrawableCrtc(pDraw);
+	if (crtc) {
+		drmmode_crtc_get_ust_msc(crtc, &ust, &msc);
+		cmd->frame = msc;
+		cmd->tv_sec = ust / 1000000;
+		cmd->tv_usec = ust % 1000000;
+
+		if (async) {
+			*target_msc = msc;
+		} else if (divisor && *target_msc <= msc) {
+			*target_msc = msc - msc % divisor + remainder;
+			if (*target_msc <= msc)
+				*target_msc += divisor;
+		} else if (*target_msc < msc) {
+			*target_msc = msc;
+		}
+
+		if (pDraw->type == DRAWABLE_WINDOW)
+			ARMSOCDRI2WindowPriv(pDraw)->last_target_msc =
+					*target_msc;
+	}
 
 	DEBUG_MSG("%d -> %d", pSrcBuffer->attachment, pDstBuffer->attachment);
 
@@ -531,7 +929,6 @@ ARMSOCDRI2ScheduleSwap(ClientPtr client, DrawablePtr pDraw,
 	ARMSOCDRI2ReferenceBuffer(pDstBuffer);
 	pARMSOC->pending_flips++;
 
-	new_canflip = canflip(pDraw);
 	if ((src->previous_canflip != new_canflip) ||
 	    (dst->previous_canflip != new_canflip)) {
 		/* The drawable has transitioned between being flippable and
@@ -546,6 +943,20 @@ ARMSOCDRI2ScheduleSwap(ClientPtr client, DrawablePtr pDraw,
 
 		PixmapPtr pPix = pScreen->GetWindowPixmap((WindowPtr)pDraw);
 		pPix->drawable.serialNumber = NEXT_SERIAL_NUMBER;
+		ARMSOCDRI2WindowPriv(pDraw)->stats.canflip_changes++;
+	}
+
+	/* Likewise once the scanout memory a flippable window was refused
+	 * has been freed by others.
+	 */
+	if (new_canflip && pDraw->type == DRAWABLE_WINDOW &&
+			ARMSOCDRI2WindowPriv(pDraw)->scanout_demoted &&
+			armsoc_scanout_fits(pARMSOC->dev, pDraw->width,
+					pDraw->height, pDraw->bitsPerPixel)) {
+		PixmapPtr pPix = pScreen->GetWindowPixmap((WindowPtr)pDraw);
+
+		pPix->drawable.serialNumber = NEXT_SERIAL_NUMBER;
+		ARMSOCDRI2WindowPriv(pDraw)->scanout_demoted = FALSE;
 	}
 
 	src->previous_canflip = new_canflip;
@@ -569,9 +980,40 @@ ARMSOCDRI2ScheduleSwap(ClientPtr client, DrawablePtr pDraw,
 	do_flip = do_flip &&
 			(armsoc_bo_height(src_bo) == armsoc_bo_height(dst_bo));
 
+	/* A page flip cannot change the format that is scanned out. Back
+	 * buffers the client asked for in another format than the window's
+	 * are shown on an overlay plane that takes it, or converted by the
+	 * blit.
+	 */
+	do_flip = do_flip && (new_canflip == FLIP_PLANE ||
+			armsoc_bo_format(src_bo) == armsoc_bo_format(dst_bo));
+
+	if (do_flip && new_canflip == FLIP_PLANE) {
+		DEBUG_MSG("overlay flip:  %d -> %d", src_fb_id, dst_fb_id);
+		armsoc_bo_do_pending_deletions();
+
+		/* the swap completes once the plane shows the new buffer */
+		cmd->type = DRI2_FLIP_COMPLETE;
+		cmd->flags |= ARMSOC_SWAP_PLANE_FLIP;
+		cmd->swapCount = 1;
+		ARMSOCDRI2UpdateVRR(pDraw, FLIP_PLANE);
+		if (!drmmode_overlay_flip(pDraw, src_bo, &cmd->base))
+			return TRUE;
+		cmd->flags &= ~ARMSOC_SWAP_PLANE_FLIP;
+		cmd->swapCount = 0;
+
+		/* the plane refused the buffer, blit this frame and the
+		 * window is not promoted again */
+		ARMSOCDRI2WindowPriv(pDraw)->stats.failures++;
+		do_flip = FALSE;
+	}
+
 	if (do_flip) {
 		DEBUG_MSG("can flip:  %d -> %d", src_fb_id, dst_fb_id);
 		cmd->type = DRI2_FLIP_COMPLETE;
+		if (new_canflip == FLIP_CRTC)
+			cmd->flags |= ARMSOC_SWAP_CRTC_FLIP;
+		ARMSOCDRI2UpdateVRR(pDraw, new_canflip);
 
 		/* Mali sometimes asks us to destroy DRI2 buffers for windows before
 		 * it has finished reading from them, so we don't free unused BOs
@@ -581,9 +1023,10 @@ ARMSOCDRI2ScheduleSwap(ClientPtr client, DrawablePtr pDraw,
 		armsoc_bo_do_pending_deletions();
 
 		/* TODO: MIDEGL-1461: Handle rollback if multiple CRTC flip is
-		 * only partially successful
+		 * only partially successful. This can only happen on the
+		 * legacy path, atomic flips are all or nothing.
 		 */
-		ret = drmmode_page_flip(pDraw, src_fb_id, cmd);
+		ret = drmmode_page_flip(pDraw, src_bo, &cmd->base, async);
 
 		/* If using page flip events, we'll trigger an immediate
 		 * completion in the case that no CRTCs were enabled to be
@@ -595,6 +1038,8 @@ ARMSOCDRI2ScheduleSwap(ClientPtr client, DrawablePtr pDraw,
 			 * Error while flipping; bail.
 			 */
 			cmd->flags |= ARMSOC_SWAP_FAIL;
+			if (pDraw->type == DRAWABLE_WINDOW)
+				ARMSOCDRI2WindowPriv(pDraw)->stats.failures++;
 
 			if (pARMSOC->drmmode_interface->use_page_flip_events)
 				cmd->swapCount = -(ret + 1);
@@ -628,15 +1073,47 @@ ARMSOCDRI2ScheduleSwap(ClientPtr client, DrawablePtr pDraw,
 		RegionRec region;
 		RegionInit(&region, &box, 0);
 		ARMSOCDRI2CopyRegion(pDraw, &region, pDstBuffer, pSrcBuffer);
+		ARMSOCDRI2UpdateVRR(pDraw, FLIP_NONE);
+		/* CRTCs this window was previously flipped on can go back to
+		 * the root framebuffer now that it has the window's contents.
+		 */
+		drmmode_scanout_restore(pScrn, src_bo);
+		drmmode_scanout_restore(pScrn, dst_bo);
+		drmmode_overlay_restore(pScrn, pDraw);
 		cmd->type = DRI2_BLIT_COMPLETE;
+		if (crtc && *target_msc > msc &&
+				drmmode_crtc_queue_msc(crtc, *target_msc,
+						&cmd->base))
+			return TRUE;
 		ARMSOCDRI2SwapComplete(cmd);
 	}
 
 	return TRUE;
 }
 
+struct ARMSOCDRI2WaitMSCCmd {
+	struct ARMSOCFlipEvent base;
+	ClientPtr client;
+	XID draw_id;
+};
+
+static void
+ARMSOCDRI2WaitMSCHandler(struct ARMSOCFlipEvent *event, unsigned int frame,
+		unsigned int tv_sec, unsigned int tv_usec)
+{
+	struct ARMSOCDRI2WaitMSCCmd *cmd = (struct ARMSOCDRI2WaitMSCCmd *)event;
+	DrawablePtr pDraw;
+
+	if (dixLookupDrawable(&pDraw, cmd->draw_id, serverClient, M_ANY,
+			DixWriteAccess) == Success)
+		DRI2WaitMSCComplete(cmd->client, pDraw, frame, tv_sec,
+				tv_usec);
+	free(cmd);
+}
+
 /**
- * Request a DRM event when the requested conditions will be satisfied.
+ * Request a DRM event when the requested conditions will be satisfied,
+ * or a frame clock one where the kernel has no vblank events.
  *
  * We need to handle the event and ask the server to wake up the client when
  * we receive it.
@@ -647,8 +1124,56 @@ ARMSOCDRI2ScheduleWaitMSC(ClientPtr client, DrawablePtr pDraw,
 {
 	ScreenPtr pScreen = pDraw->pScreen;
 	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	xf86CrtcPtr crtc = ARMSOCDRI2DrawableCrtc(pDraw);
+	struct ARMSOCDRI2WaitMSCCmd *cmd;
+	drmVBlank vbl;
+	CARD64 ust, msc;
+
+	if (!crtc) {
+		DRI2WaitMSCComplete(client, pDraw, target_msc, 0, 0);
+		return TRUE;
+	}
+
+	if (!ARMSOCDRI2GetMSC(pDraw, &ust, &msc))
+		return FALSE;
+
+	if (divisor && target_msc <= msc) {
+		target_msc = msc - msc % divisor + remainder;
+		if (target_msc <= msc)
+			target_msc += divisor;
+	} else if (target_msc < msc) {
+		target_msc = msc;
+	}
 
-	ERROR_MSG("not implemented");
+	cmd = calloc(1, sizeof(*cmd));
+	if (!cmd)
+		return FALSE;
+
+	cmd->base.handler = ARMSOCDRI2WaitMSCHandler;
+	cmd->client = client;
+	cmd->draw_id = pDraw->id;
+
+	if (!pARMSOC->drmmode_interface->vblank_query_supported) {
+		if (!drmmode_crtc_queue_msc(crtc, target_msc, &cmd->base))
+			goto fail;
+	} else {
+		vbl.request.type = DRM_VBLANK_ABSOLUTE | DRM_VBLANK_EVENT |
+				drmmode_crtc_vblank_pipe(crtc);
+		vbl.request.sequence = target_msc;
+		vbl.request.signal = (unsigned long)cmd;
+		if (drmWaitVBlank(pARMSOC->drmFD, &vbl)) {
+			ERROR_MSG("wait for vblank failed: %s",
+					strerror(errno));
+			goto fail;
+		}
+	}
+
+	DRI2BlockClient(client, pDraw);
+	return TRUE;
+
+fail:
+	free(cmd);
 	return FALSE;
 }
 
@@ -683,6 +1208,24 @@ ARMSOCDRI2ScreenInit(ScreenPtr pScreen)
 		return FALSE;
 	}
 
+	if (!dixRegisterPrivateKey(&ARMSOCDRI2WindowPrivateKeyRec,
+			PRIVATE_WINDOW, sizeof(struct ARMSOCDRI2WindowRec))) {
+		ERROR_MSG("Failed to register DRI2 window private");
+		return FALSE;
+	}
+
+	if (pARMSOC->swapStats) {
+		static const char name[] = "_ARMSOC_SWAP_STATS";
+
+		swap_stats_atom = MakeAtom(name, sizeof(name) - 1, TRUE);
+	}
+
+	if (pARMSOC->variableRefresh) {
+		static const char name[] = "_VARIABLE_REFRESH";
+
+		variable_refresh_atom = MakeAtom(name, sizeof(name) - 1, TRUE);
+	}
+
 	return DRI2ScreenInit(pScreen, &info);
 }
 
@@ -0,0 +1,361 @@
+/* -*- mode: C; c-file-style: "k&r"; tab-width 4; indent-tabs-mode: t; -*- */
+
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_DRI3
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "armsoc_driver.h"
+#include "armsoc_dumb.h"
+
+#include "dri3.h"
+
+#if DRI3_SCREEN_INFO_VERSION >= 2
+#include <drm_fourcc.h>
+#endif
+
+/*
+ * DRI3 lets clients allocate their own buffers and share them with us as
+ * dma_bufs, so there are no per-drawable buffers to manage here. Imported
+ * buffers are wrapped as bos and become the storage of the pixmap they are
+ * attached to, which DRI2 and Present then find through the bo/drawable
+ * hash like any other GEM backed pixmap.
+ */
+
+static int
+ARMSOCDRI3Open(ScreenPtr pScreen, RRProviderPtr provider, int *fdp)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	drm_magic_t magic;
+	int fd;
+
+	fd = open(pARMSOC->deviceName, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		ERROR_MSG("DRI3Open: cannot open %s: %s",
+				pARMSOC->deviceName, strerror(errno));
+		return BadAlloc;
+	}
+
+	/* Render nodes cannot get a magic and do not need one. Primary
+	 * nodes have to be authenticated by the master, which is us. */
+	if (!drmGetMagic(fd, &magic) && drmAuthMagic(pARMSOC->drmFD, magic)) {
+		ERROR_MSG("DRI3Open: drmAuthMagic failed: %s",
+				strerror(errno));
+		close(fd);
+		return BadMatch;
+	}
+
+	*fdp = fd;
+	return Success;
+}
+
+static PixmapPtr
+ARMSOCDRI3PixmapFromFd(ScreenPtr pScreen, int fd, CARD16 width,
+		CARD16 height, CARD16 stride, CARD8 depth, CARD8 bpp)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct armsoc_bo *bo;
+	PixmapPtr pPixmap;
+
+	if (!width || !height || depth < 8 || (bpp != 16 && bpp != 32))
+		return NULL;
+
+	bo = armsoc_bo_from_dmabuf(pARMSOC->dev, fd, width, height, depth,
+			bpp, stride);
+	if (!bo)
+		return NULL;
+
+	pPixmap = (*pScreen->CreatePixmap)(pScreen, 0, 0, depth, 0);
+	if (!pPixmap) {
+		armsoc_bo_unreference(bo);
+		return NULL;
+	}
+
+	if (!ARMSOCPixmapSetBo(pPixmap, bo)) {
+		ERROR_MSG("DRI3PixmapFromFd: cannot map imported buffer");
+		(*pScreen->DestroyPixmap)(pPixmap);
+		armsoc_bo_unreference(bo);
+		return NULL;
+	}
+
+	/* the pixmap holds its own reference now */
+	armsoc_bo_unreference(bo);
+
+	DEBUG_MSG("imported %dx%d pixmap %p, pitch %d", width, height,
+			pPixmap, stride);
+	return pPixmap;
+}
+
+/*
+ * Find the bo behind a pixmap, moving the pixmap into one if it is still
+ * in malloc'ed memory. The pixmap keeps the bo from then on.
+ */
+static struct armsoc_bo *
+ARMSOCDRI3PixmapBo(ScreenPtr pScreen, PixmapPtr pPixmap)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct armsoc_bo *bo;
+
+	if (pPixmap == (*pScreen->GetScreenPixmap)(pScreen))
+		return pARMSOC->fb_bo;
+
+	bo = ARMSOCPixmapGetBo(pPixmap);
+	if (bo)
+		return bo;
+
+	/* e.g. migrated for DRI2, but not yet owned by the pixmap */
+	bo = armsoc_bo_from_drawable(&pPixmap->drawable);
+	if (bo)
+		return ARMSOCPixmapSetBo(pPixmap, bo) ? bo : NULL;
+
+	if (pPixmap->drawable.bitsPerPixel != 16 &&
+			pPixmap->drawable.bitsPerPixel != 32)
+		return NULL;
+
+	bo = ARMSOCPixmapMoveToBo(pPixmap);
+	if (!bo)
+		return NULL;
+
+	if (!ARMSOCPixmapSetBo(pPixmap, bo)) {
+		armsoc_bo_unreference(bo);
+		return NULL;
+	}
+
+	armsoc_bo_unreference(bo);
+	return bo;
+}
+
+static int
+ARMSOCDRI3FdFromPixmap(ScreenPtr pScreen, PixmapPtr pPixmap,
+		CARD16 *stride, CARD32 *size)
+{
+	struct armsoc_bo *bo = ARMSOCDRI3PixmapBo(pScreen, pPixmap);
+
+	if (!bo || armsoc_bo_pitch(bo) > UINT16_MAX)
+		return -1;
+
+	*stride = armsoc_bo_pitch(bo);
+	*size = armsoc_bo_size(bo);
+	return armsoc_bo_export_dmabuf(bo);
+}
+
+#if DRI3_SCREEN_INFO_VERSION >= 2
+/* Pixmap formats clients can share with us, all of them linear */
+static const uint32_t armsoc_dri3_formats[] = {
+	DRM_FORMAT_XRGB8888,
+	DRM_FORMAT_ARGB8888,
+	DRM_FORMAT_RGB565,
+	DRM_FORMAT_XRGB2101010,
+};
+
+/*
+ * Whether buffers of the drawable's size may have a layout only the display
+ * can read. Everything else is drawn to and read by the CPU, so only
+ * windows that are flipped fullscreen qualify, and only if the user allows
+ * it: when such a window stops being flipped, the frames until its client
+ * reallocates cannot be copied correctly.
+ */
+static Bool
+ARMSOCDRI3ScanoutOnly(ScreenPtr pScreen, CARD16 width, CARD16 height)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+
+	return pARMSOC->scanoutModifiers && !pARMSOC->NoFlip &&
+			width == pScrn->virtualX && height == pScrn->virtualY;
+}
+
+static Bool
+ARMSOCDRI3ScanoutModifier(ScreenPtr pScreen, uint32_t format,
+		uint64_t modifier)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	uint64_t *modifiers;
+	int i, count;
+
+	count = drmmode_scanout_modifiers(pScrn, format, &modifiers);
+	for (i = 0; i < count; i++)
+		if (modifiers[i] == modifier)
+			break;
+	free(modifiers);
+	return i < count;
+}
+
+static PixmapPtr
+ARMSOCDRI3PixmapFromFds(ScreenPtr pScreen, CARD8 num_fds, const int *fds,
+		CARD16 width, CARD16 height, const CARD32 *strides,
+		const CARD32 *offsets, CARD8 depth, CARD8 bpp,
+		CARD64 modifier)
+{
+	PixmapPtr pPixmap;
+
+	/* only single plane buffers at offset 0 */
+	if (num_fds != 1 || offsets[0] != 0 || strides[0] > UINT16_MAX)
+		return NULL;
+	if (modifier != DRM_FORMAT_MOD_INVALID &&
+			modifier != DRM_FORMAT_MOD_LINEAR &&
+			(!ARMSOCDRI3ScanoutOnly(pScreen, width, height) ||
+			 !ARMSOCDRI3ScanoutModifier(pScreen,
+					armsoc_drm_format(depth, bpp),
+					modifier)))
+		return NULL;
+
+	pPixmap = ARMSOCDRI3PixmapFromFd(pScreen, fds[0], width, height,
+			strides[0], depth, bpp);
+	if (pPixmap && modifier != DRM_FORMAT_MOD_INVALID &&
+			armsoc_bo_set_modifier(ARMSOCPixmapGetBo(pPixmap),
+					modifier)) {
+		(*pScreen->DestroyPixmap)(pPixmap);
+		return NULL;
+	}
+
+	return pPixmap;
+}
+
+static int
+ARMSOCDRI3FdsFromPixmap(ScreenPtr pScreen, PixmapPtr pPixmap, int *fds,
+		uint32_t *strides, uint32_t *offsets, uint64_t *modifier)
+{
+	struct armsoc_bo *bo = ARMSOCDRI3PixmapBo(pScreen, pPixmap);
+
+	if (!bo)
+		return 0;
+
+	fds[0] = armsoc_bo_export_dmabuf(bo);
+	if (fds[0] < 0)
+		return 0;
+
+	strides[0] = armsoc_bo_pitch(bo);
+	offsets[0] = 0;
+	*modifier = armsoc_bo_modifier(bo);
+	return 1;
+}
+
+static int
+ARMSOCDRI3GetFormats(ScreenPtr pScreen, CARD32 *num_formats,
+		CARD32 **formats)
+{
+	*formats = malloc(sizeof(armsoc_dri3_formats));
+	if (!*formats) {
+		*num_formats = 0;
+		return FALSE;
+	}
+
+	memcpy(*formats, armsoc_dri3_formats, sizeof(armsoc_dri3_formats));
+	*num_formats = ARRAY_SIZE(armsoc_dri3_formats);
+	return TRUE;
+}
+
+static int
+ARMSOCDRI3GetModifiers(ScreenPtr pScreen, uint32_t format,
+		uint32_t *num_modifiers, uint64_t **modifiers)
+{
+	int i;
+
+	*num_modifiers = 0;
+	*modifiers = NULL;
+
+	for (i = 0; i < ARRAY_SIZE(armsoc_dri3_formats); i++)
+		if (armsoc_dri3_formats[i] == format)
+			break;
+	if (i == ARRAY_SIZE(armsoc_dri3_formats))
+		return TRUE;
+
+	/* any pixmap may end up drawn to or read by the CPU */
+	*modifiers = malloc(sizeof(**modifiers));
+	if (!*modifiers)
+		return FALSE;
+
+	(*modifiers)[0] = DRM_FORMAT_MOD_LINEAR;
+	*num_modifiers = 1;
+	return TRUE;
+}
+
+/*
+ * Windows that are flipped fullscreen are offered everything the primary
+ * planes can scan out, such as compressed (AFBC) layouts, which halve the
+ * memory traffic of scanning out on SoCs that have them.
+ */
+static int
+ARMSOCDRI3GetDrawableModifiers(DrawablePtr pDraw, uint32_t format,
+		uint32_t *num_modifiers, uint64_t **modifiers)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pDraw->pScreen);
+	int count;
+
+	*num_modifiers = 0;
+	*modifiers = NULL;
+
+	if (pDraw->type != DRAWABLE_WINDOW ||
+			!ARMSOCDRI3ScanoutOnly(pDraw->pScreen, pDraw->width,
+					pDraw->height))
+		return TRUE;
+
+	count = drmmode_scanout_modifiers(pScrn, format, modifiers);
+	*num_modifiers = count;
+	return TRUE;
+}
+#endif
+
+static dri3_screen_info_rec armsoc_dri3_screen_info = {
+#if DRI3_SCREEN_INFO_VERSION >= 2
+	.version = 2,
+#else
+	.version = 0,
+#endif
+	.open = ARMSOCDRI3Open,
+	.pixmap_from_fd = ARMSOCDRI3PixmapFromFd,
+	.fd_from_pixmap = ARMSOCDRI3FdFromPixmap,
+#if DRI3_SCREEN_INFO_VERSION >= 2
+	.pixmap_from_fds = ARMSOCDRI3PixmapFromFds,
+	.fds_from_pixmap = ARMSOCDRI3FdsFromPixmap,
+	.get_formats = ARMSOCDRI3GetFormats,
+	.get_modifiers = ARMSOCDRI3GetModifiers,
+	.get_drawable_modifiers = ARMSOCDRI3GetDrawableModifiers,
+#endif
+};
+
+Bool
+ARMSOCDRI3ScreenInit(ScreenPtr pScreen)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+
+	if (!dri3_screen_init(pScreen, &armsoc_dri3_screen_info)) {
+		WARNING_MSG("dri3_screen_init failed");
+		return FALSE;
+	}
+
+	INFO_MSG("DRI3 enabled");
+	return TRUE;
+}
+
+#endif /* HAVE_DRI3 */
@@ -41,12 +41,21 @@
 #include "config.h"
 #endif
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#include <signal.h>
+#endif
+
 #include "armsoc_driver.h"
 
 #include "micmap.h"
 
 #include "xf86cmap.h"
 #include "xf86RandR12.h"
+#include "damage.h"
+#include "xorgVersion.h"
+#include "property.h"
+#include <X11/Xatom.h>
 
 #include "compat-api.h"
 
@@ -69,6 +78,7 @@ static void ARMSOCLoadPalette(ScrnInfoPtr pScrn, int numColors, int *indices,
 static Bool ARMSOCCloseScreen(CLOSE_SCREEN_ARGS_DECL);
 static Bool ARMSOCCreateScreenResources(ScreenPtr pScreen);
 static void ARMSOCBlockHandler(BLOCKHANDLER_ARGS_DECL);
+static Bool ARMSOCScreenDestroyPixmap(PixmapPtr pPixmap);
 static Bool ARMSOCSwitchMode(SWITCH_MODE_ARGS_DECL);
 static void ARMSOCAdjustFrame(ADJUST_FRAME_ARGS_DECL);
 static Bool ARMSOCEnterVT(VT_FUNC_ARGS_DECL);
@@ -108,6 +118,15 @@ enum {
 	OPTION_DRIVERNAME,
 	OPTION_DRI_NUM_BUF,
 	OPTION_INIT_FROM_FBDEV,
+	OPTION_SWAP_STATS,
+	OPTION_ATOMIC,
+	OPTION_OVERLAYS,
+	OPTION_SEAMLESS_BOOT,
+	OPTION_MAX_SCANOUT_SIZE,
+	OPTION_VARIABLE_REFRESH,
+	OPTION_SCANOUT_MODIFIERS,
+	OPTION_SCANOUT_BUDGET,
+	OPTION_SCANOUT_POOL,
 };
 
 /** Supported options. */
@@ -119,6 +138,15 @@ static const OptionInfoRec ARMSOCOptions[] = {
 	{ OPTION_DRIVERNAME, "DriverName", OPTV_STRING,  {0}, FALSE },
 	{ OPTION_DRI_NUM_BUF, "DRI2MaxBuffers", OPTV_INTEGER, {-1}, FALSE },
 	{ OPTION_INIT_FROM_FBDEV, "InitFromFBDev", OPTV_STRING, {0}, FALSE },
+	{ OPTION_SWAP_STATS, "SwapStats",  OPTV_BOOLEAN, {0}, FALSE },
+	{ OPTION_ATOMIC,     "Atomic",     OPTV_BOOLEAN, {0}, FALSE },
+	{ OPTION_OVERLAYS,   "Overlays",   OPTV_BOOLEAN, {0}, FALSE },
+	{ OPTION_SEAMLESS_BOOT, "SeamlessBoot", OPTV_BOOLEAN, {0}, FALSE },
+	{ OPTION_MAX_SCANOUT_SIZE, "MaxScanoutSize", OPTV_STRING, {0}, FALSE },
+	{ OPTION_VARIABLE_REFRESH, "VariableRefresh", OPTV_BOOLEAN, {0}, FALSE },
+	{ OPTION_SCANOUT_MODIFIERS, "ScanoutModifiers", OPTV_BOOLEAN, {0}, FALSE },
+	{ OPTION_SCANOUT_BUDGET, "ScanoutBudget", OPTV_INTEGER, {0}, FALSE },
+	{ OPTION_SCANOUT_POOL, "ScanoutPool", OPTV_INTEGER, {0}, FALSE },
 	{ -1,                NULL,         OPTV_NONE,    {0}, FALSE }
 };
 
@@ -132,7 +160,8 @@ static struct ARMSOCConnection {
 	int fd;
 	int open_count;
 	int master_count;
-} connection = {NULL, NULL, 0, -1, 0, 0};
+	int event_count;
+} connection = {NULL, NULL, 0, -1, 0, 0, 0};
 
 static int
 ARMSOCSetDRMMaster(void)
@@ -167,6 +196,64 @@ ARMSOCDropDRMMaster(void)
 	return ret;
 }
 
+/*
+ * Page flip and vblank events of all screens arrive on the one fd they
+ * share, so it is watched once per connection rather than once per screen.
+ * Each event carries its own handler, which knows the screen it is for.
+ */
+#ifdef HAVE_NOTIFY_FD
+static void
+ARMSOCDRMNotify(int fd, int ready, void *data)
+{
+	drmmode_handle_events(fd);
+}
+#else
+static void
+ARMSOCDRMWakeupHandler(pointer data, int err, pointer p)
+{
+	fd_set *read_mask = p;
+
+	if (err >= 0 && connection.fd >= 0 &&
+			FD_ISSET(connection.fd, read_mask))
+		drmmode_handle_events(connection.fd);
+}
+#endif
+
+static void
+ARMSOCWatchDRMEvents(void)
+{
+	assert(connection.fd >= 0);
+
+	if (connection.event_count++)
+		return;
+
+#ifdef HAVE_NOTIFY_FD
+	SetNotifyFd(connection.fd, ARMSOCDRMNotify, X_NOTIFY_READ, NULL);
+#else
+	AddGeneralSocket(connection.fd);
+	RegisterBlockAndWakeupHandlers((BlockHandlerProcPtr)NoopDDA,
+			ARMSOCDRMWakeupHandler, NULL);
+#endif
+}
+
+static void
+ARMSOCUnwatchDRMEvents(void)
+{
+	assert(connection.fd >= 0);
+	assert(connection.event_count > 0);
+
+	if (--connection.event_count)
+		return;
+
+#ifdef HAVE_NOTIFY_FD
+	RemoveNotifyFd(connection.fd);
+#else
+	RemoveBlockAndWakeupHandlers((BlockHandlerProcPtr)NoopDDA,
+			ARMSOCDRMWakeupHandler, NULL);
+	RemoveGeneralSocket(connection.fd);
+#endif
+}
+
 static void
 ARMSOCShowDriverInfo(int fd)
 {
@@ -341,20 +428,278 @@ ARMSOCCloseDRM(ScrnInfoPtr pScrn)
 	}
 }
 
+/*
+ * The pixman format of a packed true colour layout given as bit offset
+ * and length of each channel, or 0 if pixman cannot read it.
+ */
+static pixman_format_code_t ARMSOCPixmanFormat(int bpp, int r_off, int r_len,
+		int g_off, int g_len, int b_off, int b_len)
+{
+	pixman_format_code_t format;
+	int type;
+
+	if (bpp % 8 || r_len + g_len + b_len > bpp)
+		return 0;
+
+	if (b_off == 0 && g_off == b_len && r_off == g_off + g_len)
+		type = PIXMAN_TYPE_ARGB;
+	else if (r_off == 0 && g_off == r_len && b_off == g_off + g_len)
+		type = PIXMAN_TYPE_ABGR;
+	else
+		return 0;
+
+	format = PIXMAN_FORMAT(bpp, type, 0, r_len, g_len, b_len);
+	return pixman_format_supported_source(format) ? format : 0;
+}
+
+pixman_format_code_t ARMSOCScreenFormat(ScrnInfoPtr pScrn)
+{
+	return ARMSOCPixmanFormat(pScrn->bitsPerPixel,
+			pScrn->offset.red, pScrn->weight.red,
+			pScrn->offset.green, pScrn->weight.green,
+			pScrn->offset.blue, pScrn->weight.blue);
+}
+
+/*
+ * The pixman format of a KMS framebuffer of the given depth and bpp, as
+ * drmModeAddFB() interprets them.
+ */
+pixman_format_code_t ARMSOCDepthFormat(int depth, int bpp)
+{
+	switch (bpp) {
+	case 16:
+		return depth == 15 ? PIXMAN_x1r5g5b5 : PIXMAN_r5g6b5;
+	case 24:
+		return PIXMAN_r8g8b8;
+	case 32:
+		if (depth == 30)
+			return PIXMAN_x2r10g10b10;
+		return depth == 32 ? PIXMAN_a8r8g8b8 : PIXMAN_x8r8g8b8;
+	default:
+		return 0;
+	}
+}
+
+/* Rows converted at a time, through a buffer small enough to stay cached */
+#define ARMSOC_COPY_ROWS	16
+/* Most threads a copy is split across */
+#define ARMSOC_COPY_THREADS	8
+
+struct ARMSOCCopyBand {
+	const unsigned char *src;
+	int src_pitch;
+	pixman_format_code_t src_format;
+	unsigned char *dst;
+	int dst_pitch;
+	pixman_format_code_t dst_format;
+	int width, height;
+	Bool ok;
+};
+
+/*
+ * Convert one band of rows. The source is read row by row with memcpy
+ * into a cached buffer, which both aligns it for pixman and is the fast
+ * way to read from an uncached mapping. The destination is written
+ * directly where pixman can, and through a second buffer where not.
+ */
+static void *ARMSOCCopyBandRun(void *data)
+{
+	struct ARMSOCCopyBand *band = data;
+	int src_row = band->width * PIXMAN_FORMAT_BPP(band->src_format) / 8;
+	int dst_row = band->width * PIXMAN_FORMAT_BPP(band->dst_format) / 8;
+	int src_tmp_pitch = (src_row + 3) & ~3;
+	int dst_tmp_pitch = (dst_row + 3) & ~3;
+	Bool dst_direct = !(band->dst_pitch % sizeof(uint32_t)) &&
+			!((uintptr_t)band->dst % sizeof(uint32_t));
+	unsigned char *src_tmp, *dst_tmp = NULL;
+	int y, i;
+
+	band->ok = FALSE;
+	src_tmp = malloc(src_tmp_pitch * ARMSOC_COPY_ROWS);
+	if (!dst_direct)
+		dst_tmp = malloc(dst_tmp_pitch * ARMSOC_COPY_ROWS);
+	if (!src_tmp || (!dst_direct && !dst_tmp))
+		goto out;
+
+	for (y = 0; y < band->height; y += ARMSOC_COPY_ROWS) {
+		int rows = min(ARMSOC_COPY_ROWS, band->height - y);
+		unsigned char *dst = band->dst + y * band->dst_pitch;
+		pixman_image_t *src_img, *dst_img;
+
+		for (i = 0; i < rows; i++)
+			memcpy(src_tmp + i * src_tmp_pitch,
+					band->src + (y + i) * band->src_pitch,
+					src_row);
+
+		src_img = pixman_image_create_bits(band->src_format,
+				band->width, rows, (uint32_t *)src_tmp,
+				src_tmp_pitch);
+		dst_img = pixman_image_create_bits(band->dst_format,
+				band->width, rows,
+				(uint32_t *)(dst_direct ? dst : dst_tmp),
+				dst_direct ? band->dst_pitch : dst_tmp_pitch);
+		if (src_img && dst_img)
+			pixman_image_composite32(PIXMAN_OP_SRC, src_img, NULL,
+					dst_img, 0, 0, 0, 0, 0, 0,
+					band->width, rows);
+		if (src_img)
+			pixman_image_unref(src_img);
+		if (dst_img)
+			pixman_image_unref(dst_img);
+		if (!src_img || !dst_img)
+			goto out;
+
+		if (!dst_direct)
+			for (i = 0; i < rows; i++)
+				memcpy(dst + i * band->dst_pitch,
+						dst_tmp + i * dst_tmp_pitch,
+						dst_row);
+	}
+	band->ok = TRUE;
+
+out:
+	free(src_tmp);
+	free(dst_tmp);
+	return NULL;
+}
+
+/*
+ * Copy a width x height area between two buffers of any pixel format
+ * pixman knows, and any pitch. src and dst point at the first pixel of
+ * the area. The rows are split into bands converted on all CPUs.
+ */
+Bool ARMSOCCopyConvert(const void *src, int src_pitch,
+		pixman_format_code_t src_format, void *dst, int dst_pitch,
+		pixman_format_code_t dst_format, int width, int height)
+{
+	struct ARMSOCCopyBand bands[ARMSOC_COPY_THREADS];
+#ifdef HAVE_PTHREAD
+	pthread_t threads[ARMSOC_COPY_THREADS];
+	Bool started[ARMSOC_COPY_THREADS];
+	sigset_t blocked, saved;
+#endif
+	long num_bands = 1;
+	int rows, i;
+	Bool ret = TRUE;
+
+	if (!src_format || !dst_format ||
+			!pixman_format_supported_destination(dst_format) ||
+			width <= 0 || height <= 0)
+		return FALSE;
+
+#ifdef HAVE_PTHREAD
+	num_bands = sysconf(_SC_NPROCESSORS_ONLN);
+	num_bands = max(1, min(num_bands, ARMSOC_COPY_THREADS));
+	/* no point in threads that would convert less than a batch */
+	num_bands = max(1, min(num_bands, height / ARMSOC_COPY_ROWS));
+#endif
+	rows = (height + num_bands - 1) / num_bands;
+
+	for (i = 0; i < num_bands; i++) {
+		int y = i * rows;
+
+		bands[i].src = (const unsigned char *)src + y * src_pitch;
+		bands[i].src_pitch = src_pitch;
+		bands[i].src_format = src_format;
+		bands[i].dst = (unsigned char *)dst + y * dst_pitch;
+		bands[i].dst_pitch = dst_pitch;
+		bands[i].dst_format = dst_format;
+		bands[i].width = width;
+		bands[i].height = min(rows, height - y);
+	}
+
+#ifdef HAVE_PTHREAD
+	/* the workers inherit a mask blocking all signals, so that the
+	 * server's input and timer signals are only delivered to its own
+	 * threads, like the server does for its input thread */
+	sigfillset(&blocked);
+	pthread_sigmask(SIG_BLOCK, &blocked, &saved);
+	for (i = 1; i < num_bands; i++)
+		started[i] = !pthread_create(&threads[i], NULL,
+				ARMSOCCopyBandRun, &bands[i]);
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+	/* this thread does the first band itself */
+	ARMSOCCopyBandRun(&bands[0]);
+	for (i = 1; i < num_bands; i++) {
+		if (started[i])
+			pthread_join(threads[i], NULL);
+		else
+			ARMSOCCopyBandRun(&bands[i]);
+	}
+#else
+	ARMSOCCopyBandRun(&bands[0]);
+#endif
+
+	for (i = 0; i < num_bands; i++)
+		ret &= bands[i].ok;
+	return ret;
+}
+
+/*
+ * Copy a buffer holding a drawable's contents to the drawable, through
+ * the given validated GC. Core CopyArea only copies between drawables of
+ * the same depth, so a buffer in another format, such as a 16bpp DRI2
+ * back buffer of a depth 24 window, is converted by pixman first.
+ */
+void ARMSOCCopyBoToDrawable(struct armsoc_bo *bo, DrawablePtr pDraw,
+		GCPtr pGC)
+{
+	ScreenPtr pScreen = pDraw->pScreen;
+	int depth = armsoc_bo_depth(bo), bpp = armsoc_bo_bpp(bo);
+	int width = armsoc_bo_width(bo), height = armsoc_bo_height(bo);
+	int pitch = armsoc_bo_pitch(bo);
+	unsigned char *bits = armsoc_bo_map(bo), *tmp = NULL;
+	PixmapPtr pScratchPixmap;
+
+	if (!bits)
+		return;
+
+	if (depth != pDraw->depth || bpp != pDraw->bitsPerPixel) {
+		int tmp_pitch;
+
+		width = min(width, pDraw->width);
+		height = min(height, pDraw->height);
+		tmp_pitch = (width * pDraw->bitsPerPixel / 8 + 3) & ~3;
+		tmp = malloc(tmp_pitch * height);
+		if (!tmp || !ARMSOCCopyConvert(bits, pitch,
+				ARMSOCDepthFormat(depth, bpp), tmp, tmp_pitch,
+				ARMSOCDepthFormat(pDraw->depth,
+						pDraw->bitsPerPixel),
+				width, height)) {
+			free(tmp);
+			return;
+		}
+
+		bits = tmp;
+		pitch = tmp_pitch;
+		depth = pDraw->depth;
+		bpp = pDraw->bitsPerPixel;
+	}
+
+	pScratchPixmap = GetScratchPixmapHeader(pScreen, width, height,
+			depth, bpp, pitch, bits);
+	if (pScratchPixmap) {
+		pGC->ops->CopyArea((DrawablePtr) pScratchPixmap, pDraw, pGC,
+				0, 0, pDraw->width, pDraw->height, 0, 0);
+		FreeScratchPixmapHeader(pScratchPixmap);
+	}
+	free(tmp);
+}
+
 static Bool ARMSOCCopyFB(ScrnInfoPtr pScrn, const char *fb_dev)
 {
 	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
-	int src_cpp;
+	int src_cpp, dst_cpp;
 	uint32_t src_pitch;
-	int src_pixman_stride;
-	int dst_pixman_stride;
 	int dst_width, dst_height, dst_bpp, dst_pitch;
 	unsigned int src_size = 0;
 	unsigned char *src = NULL, *dst = NULL;
 	struct fb_var_screeninfo vinfo;
+	struct fb_fix_screeninfo finfo;
+	pixman_format_code_t src_format, dst_format;
 	int fd = -1;
-	int width, height;
-	pixman_bool_t pixman_ret;
+	int width, height, y;
 	Bool ret = FALSE;
 
 	dst = armsoc_bo_map(pARMSOC->scanout);
@@ -363,23 +708,45 @@ static Bool ARMSOCCopyFB(ScrnInfoPtr pScrn, const char *fb_dev)
 		goto exit;
 	}
 
-	fd = open(fb_dev, O_RDONLY | O_SYNC);
+	/* No O_SYNC: the buffer is only read, once, and uncached reads
+	 * would make that the slowest part of the copy */
+	fd = open(fb_dev, O_RDONLY);
 	if (fd == -1) {
 		ERROR_MSG("Couldn't open %s", fb_dev);
 		goto exit;
 	}
 
-	if (ioctl(fd, FBIOGET_VSCREENINFO, &vinfo) < 0) {
-		ERROR_MSG("Vscreeninfo ioctl failed");
+	if (ioctl(fd, FBIOGET_VSCREENINFO, &vinfo) < 0 ||
+			ioctl(fd, FBIOGET_FSCREENINFO, &finfo) < 0) {
+		ERROR_MSG("Screeninfo ioctl failed");
 		goto exit;
 	}
 
 	src_cpp = (vinfo.bits_per_pixel + 7) / 8;
-	src_pitch = vinfo.xres_virtual * src_cpp;
+	src_pitch = finfo.line_length ? finfo.line_length :
+			vinfo.xres_virtual * src_cpp;
 	src_size = vinfo.yres_virtual * src_pitch;
 
+	src_format = 0;
+	if (vinfo.grayscale == 0 && vinfo.nonstd == 0 &&
+			(finfo.visual == FB_VISUAL_TRUECOLOR ||
+			finfo.visual == FB_VISUAL_DIRECTCOLOR) &&
+			!vinfo.red.msb_right && !vinfo.green.msb_right &&
+			!vinfo.blue.msb_right)
+		src_format = ARMSOCPixmanFormat(vinfo.bits_per_pixel,
+				vinfo.red.offset, vinfo.red.length,
+				vinfo.green.offset, vinfo.green.length,
+				vinfo.blue.offset, vinfo.blue.length);
+	dst_format = ARMSOCScreenFormat(pScrn);
+	if (!src_format || !dst_format) {
+		ERROR_MSG("Cannot convert from the format of %s (%d bpp) to the scanout buffer",
+				fb_dev, vinfo.bits_per_pixel);
+		goto exit;
+	}
+
 	src = mmap(NULL, src_size, PROT_READ, MAP_SHARED, fd, 0);
 	if (src == MAP_FAILED) {
+		src = NULL;
 		ERROR_MSG("Couldn't mmap %s", fb_dev);
 		goto exit;
 	}
@@ -388,81 +755,34 @@ static Bool ARMSOCCopyFB(ScrnInfoPtr pScrn, const char *fb_dev)
 	dst_height = armsoc_bo_height(pARMSOC->scanout);
 	dst_bpp = armsoc_bo_bpp(pARMSOC->scanout);
 	dst_pitch = armsoc_bo_pitch(pARMSOC->scanout);
+	dst_cpp = (dst_bpp + 7) / 8;
 
 	width = min(vinfo.xres, dst_width);
 	height = min(vinfo.yres, dst_height);
 
-	/* The stride parameters pixman takes are in multiples of uint32_t,
-	 * which is the data type of the pointer passed */
-	src_pixman_stride = src_pitch/sizeof(uint32_t);
-	dst_pixman_stride = dst_pitch/sizeof(uint32_t);
-
-	/* We could handle the cases where stride is not a multiple of uint32_t,
-	 * but they will be rare so not currently worth the added complexity */
-	if (src_pitch%sizeof(uint32_t) || dst_pitch%sizeof(uint32_t)) {
-		ERROR_MSG(
-				"Buffer strides need to be a multiple of 4 bytes to initialize from fbdev device");
-		goto exit;
-	}
-
-	/* similarly using pixman_blt doesn't allow for format conversion, so
-	 * check if they don't match and print a message */
-	if (vinfo.bits_per_pixel != dst_bpp || vinfo.grayscale != 0 ||
-			vinfo.nonstd != 0 ||
-			vinfo.red.offset != pScrn->offset.red ||
-			vinfo.red.length != pScrn->weight.red ||
-			vinfo.red.msb_right != 0 ||
-			vinfo.green.offset != pScrn->offset.green ||
-			vinfo.green.length != pScrn->weight.green ||
-			vinfo.green.msb_right != 0 ||
-			vinfo.blue.offset != pScrn->offset.blue ||
-			vinfo.blue.length != pScrn->weight.blue ||
-			vinfo.blue.msb_right != 0) {
-		ERROR_MSG("Format of %s does not match scanout buffer", fb_dev);
-		goto exit;
-	}
-
 	armsoc_bo_cpu_prep(pARMSOC->scanout, ARMSOC_GEM_WRITE);
 
 	/* NB: We have to call pixman direct instead of wrapping the buffers as
 	 * Pixmaps as this function is called from ScreenInit. Pixmaps cannot be
 	 * created until X calls CreateScratchPixmapsForScreen(), and the screen
 	 * pixmap is not initialized until X calls CreateScreenResources */
-	pixman_ret = pixman_blt((uint32_t *)src, (uint32_t *)dst,
-			src_pixman_stride, dst_pixman_stride,
-			vinfo.bits_per_pixel, dst_bpp, vinfo.xoffset,
-			vinfo.yoffset, 0, 0, width, height);
-	if (!pixman_ret) {
+	if (!ARMSOCCopyConvert(src + vinfo.yoffset * src_pitch +
+				vinfo.xoffset * src_cpp, src_pitch,
+				src_format, dst, dst_pitch, dst_format,
+				width, height)) {
 		armsoc_bo_cpu_fini(pARMSOC->scanout, 0);
-		ERROR_MSG("Pixman failed to blit from %s to scanout buffer",
+		ERROR_MSG("Pixman failed to copy from %s to scanout buffer",
 				fb_dev);
 		goto exit;
 	}
 
-	/* fill any area not covered by the blit */
-	if (width < dst_width) {
-		pixman_ret = pixman_fill((uint32_t *)dst, dst_pixman_stride,
-				dst_bpp, width, 0, dst_width-width, dst_height,
-				0);
-		if (!pixman_ret) {
-			armsoc_bo_cpu_fini(pARMSOC->scanout, 0);
-			ERROR_MSG(
-					"Pixman failed to fill margin of scanout buffer");
-			goto exit;
-		}
-	}
-
-	if (height < dst_height) {
-		pixman_ret = pixman_fill((uint32_t *)dst, dst_pixman_stride,
-				dst_bpp, 0, height, width, dst_height-height,
-				0);
-		if (!pixman_ret) {
-			armsoc_bo_cpu_fini(pARMSOC->scanout, 0);
-			ERROR_MSG(
-					"Pixman failed to fill margin of scanout buffer");
-			goto exit;
-		}
-	}
+	/* clear any area not covered by the copy */
+	if (width < dst_width)
+		for (y = 0; y < height; y++)
+			memset(dst + y * dst_pitch + width * dst_cpp, 0,
+					(dst_width - width) * dst_cpp);
+	for (y = height; y < dst_height; y++)
+		memset(dst + y * dst_pitch, 0, dst_width * dst_cpp);
 
 	armsoc_bo_cpu_fini(pARMSOC->scanout, 0);
 
@@ -731,6 +1051,8 @@ ARMSOCPreInit(ScrnInfoPtr pScrn, int flags)
 	rgb defaultMask = { 0, 0, 0 };
 	Gamma defaultGamma = { 0.0, 0.0, 0.0 };
 	int driNumBufs;
+	const char *maxScanoutSize;
+	int scanoutBudget;
 
 	TRACE_ENTER();
 
@@ -850,6 +1172,52 @@ ARMSOCPreInit(ScrnInfoPtr pScrn, int flags)
 			OPTION_NO_FLIP, FALSE);
 	INFO_MSG("Buffer Flipping is %s",
 				pARMSOC->NoFlip ? "Disabled" : "Enabled");
+	/* Determine if user wants swap statistics on windows: */
+	pARMSOC->swapStats = xf86ReturnOptValBool(pARMSOC->pOptionInfo,
+			OPTION_SWAP_STATS, FALSE);
+	/* Determine if user wants atomic modesetting: */
+	pARMSOC->atomic = xf86ReturnOptValBool(pARMSOC->pOptionInfo,
+			OPTION_ATOMIC, FALSE);
+	/* Determine if user wants windows promoted to overlay planes: */
+	pARMSOC->overlays = xf86ReturnOptValBool(pARMSOC->pOptionInfo,
+			OPTION_OVERLAYS, FALSE);
+	/* Determine if user wants to take over what the kernel shows: */
+	pARMSOC->seamlessBoot = xf86ReturnOptValBool(pARMSOC->pOptionInfo,
+			OPTION_SEAMLESS_BOOT, FALSE);
+	/* Determine the desktop size the scanout should be able to take: */
+	maxScanoutSize = xf86GetOptValString(pARMSOC->pOptionInfo,
+			OPTION_MAX_SCANOUT_SIZE);
+	if (maxScanoutSize && (sscanf(maxScanoutSize, "%dx%d",
+				&pARMSOC->maxScanoutWidth,
+				&pARMSOC->maxScanoutHeight) != 2 ||
+			pARMSOC->maxScanoutWidth <= 0 ||
+			pARMSOC->maxScanoutHeight <= 0)) {
+		WARNING_MSG("Invalid MaxScanoutSize \"%s\"", maxScanoutSize);
+		pARMSOC->maxScanoutWidth = pARMSOC->maxScanoutHeight = 0;
+	}
+	/* Determine if user wants variable refresh for flipping windows: */
+	pARMSOC->variableRefresh = xf86ReturnOptValBool(pARMSOC->pOptionInfo,
+			OPTION_VARIABLE_REFRESH, FALSE);
+	/* Determine if user wants DRI3 clients offered non-linear buffers: */
+	pARMSOC->scanoutModifiers = xf86ReturnOptValBool(pARMSOC->pOptionInfo,
+			OPTION_SCANOUT_MODIFIERS, FALSE);
+	/* Determine how much memory buffers that would rather be scanned out
+	 * may take, in MiB: */
+	if (xf86GetOptValInteger(pARMSOC->pOptionInfo, OPTION_SCANOUT_BUDGET,
+			&scanoutBudget)) {
+		if (scanoutBudget < 0) {
+			WARNING_MSG("Invalid ScanoutBudget %d", scanoutBudget);
+		} else {
+			armsoc_device_set_scanout_budget(pARMSOC->dev,
+					(uint64_t)scanoutBudget << 20);
+			INFO_MSG("Scanout memory budget is %d MiB",
+					scanoutBudget);
+		}
+	}
+	/* Determine how many fullscreen buffers to reserve for flipping: */
+	if (!xf86GetOptValInteger(pARMSOC->pOptionInfo, OPTION_SCANOUT_POOL,
+			&pARMSOC->scanoutPool) || pARMSOC->scanoutPool < 0)
+		pARMSOC->scanoutPool = 0;
 
 	/*
 	 * Select the video modes:
@@ -887,6 +1255,19 @@ ARMSOCPreInit(ScrnInfoPtr pScrn, int flags)
 		goto fail2;
 	}
 
+	/* ... and a framebuffer format for it: */
+	switch (pScrn->depth) {
+	case 15:
+	case 16:
+	case 24:
+	case 30:
+		break;
+	default:
+		ERROR_MSG("The requested depth (%d) is unsupported.",
+				pScrn->depth);
+		goto fail2;
+	}
+
 
 	/* Load external sub-modules now: */
 
@@ -911,7 +1292,7 @@ fail:
 
 
 /**
- * Initialize EXA and DRI2
+ * Initialize EXA, DRI2 and DRI3
  */
 static void
 ARMSOCAccelInit(ScreenPtr pScreen)
@@ -920,6 +1301,226 @@ ARMSOCAccelInit(ScreenPtr pScreen)
 	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
 
 	pARMSOC->dri = ARMSOCDRI2ScreenInit(pScreen);
+#ifdef HAVE_DRI3
+	pARMSOC->dri3 = ARMSOCDRI3ScreenInit(pScreen);
+	if (pARMSOC->dri3 && !ARMSOCPresentScreenInit(pScreen))
+		WARNING_MSG("Present initialization failed");
+#endif
+}
+
+struct ARMSOCPixmapRec {
+	/* storage owned by the pixmap, see ARMSOCPixmapSetBo() */
+	struct armsoc_bo *bo;
+	/* the bo a DRI2 buffer last moved the pixmap into, kept for the
+	 * next move, and what has been drawn since it moved out */
+	struct armsoc_bo *spare_bo;
+	DamagePtr damage;
+};
+
+static DevPrivateKeyRec ARMSOCPixmapPrivateKeyRec;
+
+#define ARMSOCPixmapPriv(pPixmap) ((struct ARMSOCPixmapRec *) \
+	dixGetPrivateAddr(&(pPixmap)->devPrivates, &ARMSOCPixmapPrivateKeyRec))
+
+/* Smaller pixmaps are cheap enough to copy whole when they are moved
+ * into a bo, and are not worth tracking damage on. */
+#define ARMSOC_DAMAGE_MIN_PIXELS (64 * 64)
+
+Bool
+ARMSOCPixmapPrivateInit(ScreenPtr pScreen)
+{
+	return dixRegisterPrivateKey(&ARMSOCPixmapPrivateKeyRec,
+			PRIVATE_PIXMAP, sizeof(struct ARMSOCPixmapRec));
+}
+
+/**
+ * Return the bo a pixmap was pointed at with ARMSOCPixmapSetBo(), if any.
+ */
+struct armsoc_bo *
+ARMSOCPixmapGetBo(PixmapPtr pPixmap)
+{
+	return ARMSOCPixmapPriv(pPixmap)->bo;
+}
+
+/**
+ * Make a bo the storage of a pixmap for the rest of the pixmap's life.
+ * The pixmap takes its own reference, dropped when it is destroyed.
+ */
+Bool
+ARMSOCPixmapSetBo(PixmapPtr pPixmap, struct armsoc_bo *bo)
+{
+	ScreenPtr pScreen = pPixmap->drawable.pScreen;
+	struct ARMSOCPixmapRec *priv = ARMSOCPixmapPriv(pPixmap);
+	struct armsoc_bo *old_bo = priv->bo;
+	void *ptr = armsoc_bo_map(bo);
+
+	if (!ptr)
+		return FALSE;
+
+	if (!pScreen->ModifyPixmapHeader(pPixmap, armsoc_bo_width(bo),
+			armsoc_bo_height(bo), armsoc_bo_depth(bo),
+			armsoc_bo_bpp(bo), armsoc_bo_pitch(bo), ptr))
+		return FALSE;
+
+	ARMSOCPixmapStopDamage(pPixmap);
+
+	armsoc_bo_reference(bo);
+	priv->bo = bo;
+	armsoc_bo_set_drawable(bo, &pPixmap->drawable);
+
+	if (old_bo) {
+		if (old_bo != bo)
+			armsoc_bo_clear_drawable(old_bo);
+		armsoc_bo_unreference(old_bo);
+	}
+
+	return TRUE;
+}
+
+/**
+ * Stop tracking what is drawn to a pixmap, once it has moved into a bo,
+ * and drop any bo kept for it.
+ */
+void
+ARMSOCPixmapStopDamage(PixmapPtr pPixmap)
+{
+	struct ARMSOCPixmapRec *priv = ARMSOCPixmapPriv(pPixmap);
+
+	if (priv->spare_bo) {
+		armsoc_bo_unreference(priv->spare_bo);
+		priv->spare_bo = NULL;
+	}
+
+	if (!priv->damage)
+		return;
+
+#if XORG_VERSION_CURRENT >= XORG_VERSION_NUMERIC(1, 14, 99, 2, 0)
+	DamageUnregister(priv->damage);
+#else
+	DamageUnregister(&pPixmap->drawable, priv->damage);
+#endif
+	DamageDestroy(priv->damage);
+	priv->damage = NULL;
+}
+
+/**
+ * Start tracking what is drawn to a pixmap that has just given up the bo
+ * it was moved into, keeping that bo for the next move.
+ */
+static void
+ARMSOCPixmapTrackDamage(PixmapPtr pPixmap, struct armsoc_bo *bo)
+{
+	ScreenPtr pScreen = pPixmap->drawable.pScreen;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR_FROM_SCREEN(pScreen);
+	struct ARMSOCPixmapRec *priv = ARMSOCPixmapPriv(pPixmap);
+
+	if (priv->damage || !pARMSOC->trackPixmapDamage ||
+			pPixmap->drawable.width * pPixmap->drawable.height <
+				ARMSOC_DAMAGE_MIN_PIXELS)
+		return;
+
+	priv->damage = DamageCreate(NULL, NULL, DamageReportNone, TRUE,
+			pScreen, pPixmap);
+	if (!priv->damage)
+		return;
+
+	DamageRegister(&pPixmap->drawable, priv->damage);
+	armsoc_bo_reference(bo);
+	priv->spare_bo = bo;
+}
+
+/**
+ * Copy a pixmap still in system memory into a bo for DRI2 or DRI3, and
+ * return the bo with a reference for the caller. The bo the pixmap last
+ * gave up is reused when it was kept, and then only what has been drawn
+ * since is copied; a new bo gets everything.
+ */
+struct armsoc_bo *
+ARMSOCPixmapMoveToBo(PixmapPtr pPixmap)
+{
+	ScreenPtr pScreen = pPixmap->drawable.pScreen;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR_FROM_SCREEN(pScreen);
+	struct ARMSOCPixmapRec *priv = ARMSOCPixmapPriv(pPixmap);
+	struct armsoc_bo *bo = priv->spare_bo;
+	int cpp = pPixmap->drawable.bitsPerPixel / 8;
+	unsigned char *src = pPixmap->devPrivate.ptr;
+	unsigned char *dst;
+	BoxRec full = {
+		.x1 = 0, .y1 = 0,
+		.x2 = pPixmap->drawable.width, .y2 = pPixmap->drawable.height,
+	};
+	BoxPtr box = &full;
+	RegionRec bounds;
+	int i, y, pitch, n = 1;
+
+	priv->spare_bo = NULL;
+	if (!bo) {
+		bo = armsoc_bo_new_with_dim(pARMSOC->dev,
+				pPixmap->drawable.width,
+				pPixmap->drawable.height,
+				pPixmap->drawable.depth,
+				pPixmap->drawable.bitsPerPixel,
+				ARMSOC_BO_NON_SCANOUT);
+		if (!bo)
+			return NULL;
+	} else if (priv->damage) {
+		RegionPtr region = DamageRegion(priv->damage);
+
+		RegionInit(&bounds, &full, 1);
+		RegionIntersect(region, region, &bounds);
+		RegionUninit(&bounds);
+		box = RegionRects(region);
+		n = RegionNumRects(region);
+	}
+
+	dst = armsoc_bo_map(bo);
+	if (!dst) {
+		ARMSOCPixmapStopDamage(pPixmap);
+		armsoc_bo_unreference(bo);
+		return NULL;
+	}
+	pitch = armsoc_bo_pitch(bo);
+
+	for (i = 0; i < n; i++, box++) {
+		int offset = box->x1 * cpp;
+		int len = (box->x2 - box->x1) * cpp;
+
+		for (y = box->y1; y < box->y2; y++)
+			memcpy(dst + y * pitch + offset,
+					src + y * pPixmap->devKind + offset,
+					len);
+	}
+
+	ARMSOCPixmapStopDamage(pPixmap);
+	return bo;
+}
+
+/**
+ * Move a pixmap that was moved into a bo for a DRI2 buffer back to its
+ * system memory, as that buffer is destroyed. Whatever was rendered into
+ * the bo is copied back first. The bo is kept, and what is drawn from
+ * now on tracked, so that the next move only has to copy that.
+ */
+void
+ARMSOCPixmapMoveFromBo(PixmapPtr pPixmap, struct armsoc_bo *bo)
+{
+	unsigned char *src = armsoc_bo_map(bo);
+	int pitch = armsoc_bo_pitch(bo);
+	int len = pPixmap->drawable.width * pPixmap->drawable.bitsPerPixel / 8;
+	unsigned char *dst;
+	int y;
+
+	armsoc_bo_get_backup(bo, &pPixmap->devKind, &pPixmap->devPrivate.ptr);
+	armsoc_bo_clear_drawable(bo);
+
+	dst = pPixmap->devPrivate.ptr;
+	if (!src || !dst)
+		return;
+
+	for (y = 0; y < pPixmap->drawable.height; y++)
+		memcpy(dst + y * pPixmap->devKind, src + y * pitch, len);
+
+	ARMSOCPixmapTrackDamage(pPixmap, bo);
 }
 
 /**
@@ -960,15 +1561,54 @@ ARMSOCScreenInit(SCREEN_INIT_ARGS_DECL)
 		width = pScrn->virtualX;
 	if (pScrn->virtualY > height)
 		height = pScrn->virtualY;
-	pARMSOC->scanout = armsoc_bo_new_with_dim(pARMSOC->dev, width,
-			height, pScrn->depth, pScrn->bitsPerPixel,
-			ARMSOC_BO_SCANOUT);
+	/* Over-allocate if asked to, so that the desktop can later grow
+	 * without a new scanout buffer */
+	if (pARMSOC->maxScanoutWidth * pARMSOC->maxScanoutHeight >
+			width * height) {
+		pARMSOC->scanout = armsoc_bo_new_with_dim(pARMSOC->dev,
+				max(width, pARMSOC->maxScanoutWidth),
+				max(height, pARMSOC->maxScanoutHeight),
+				pScrn->depth, pScrn->bitsPerPixel,
+				ARMSOC_BO_SCANOUT);
+		if (pARMSOC->scanout &&
+				armsoc_bo_resize(pARMSOC->scanout, width, height)) {
+			armsoc_bo_unreference(pARMSOC->scanout);
+			pARMSOC->scanout = NULL;
+		}
+		if (!pARMSOC->scanout)
+			WARNING_MSG("Cannot allocate a %dx%d scanout buffer",
+					pARMSOC->maxScanoutWidth,
+					pARMSOC->maxScanoutHeight);
+	}
+	if (!pARMSOC->scanout)
+		pARMSOC->scanout = armsoc_bo_new_with_dim(pARMSOC->dev, width,
+				height, pScrn->depth, pScrn->bitsPerPixel,
+				ARMSOC_BO_SCANOUT);
 	if (!pARMSOC->scanout) {
 		ERROR_MSG("Cannot allocate scanout buffer\n");
 		goto fail1;
 	}
 	pScrn->displayWidth = armsoc_bo_pitch(pARMSOC->scanout) /
 			((pScrn->bitsPerPixel+7) / 8);
+
+	/* Reserve the buffers fullscreen windows flip between while
+	 * contiguous memory is not fragmented yet. They are big enough for
+	 * the largest desktop asked for, and kept over server regenerations.
+	 */
+	if (pARMSOC->scanoutPool) {
+		int reserved = armsoc_device_reserve_scanout(pARMSOC->dev,
+				pARMSOC->scanoutPool,
+				max(width, pARMSOC->maxScanoutWidth),
+				max(height, pARMSOC->maxScanoutHeight),
+				pScrn->depth, pScrn->bitsPerPixel);
+
+		if (reserved < pARMSOC->scanoutPool)
+			WARNING_MSG("Reserved %d of %d scanout buffers",
+					reserved, pARMSOC->scanoutPool);
+		else
+			INFO_MSG("Reserved %d scanout buffers", reserved);
+	}
+
 	xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
 
 	/* need to point to new screen on server regeneration */
@@ -1016,6 +1656,11 @@ ARMSOCScreenInit(SCREEN_INIT_ARGS_DECL)
 		goto fail3;
 	}
 
+	if (!ARMSOCPixmapPrivateInit(pScreen)) {
+		ERROR_MSG("Cannot register pixmap private!");
+		goto fail3;
+	}
+
 	/* Initialize some generic 2D drawing functions: */
 	if (!fbScreenInit(pScreen, armsoc_bo_map(pARMSOC->scanout),
 			pScrn->virtualX, pScrn->virtualY,
@@ -1064,7 +1709,10 @@ ARMSOCScreenInit(SCREEN_INIT_ARGS_DECL)
 
 	fbdev = xf86GetOptValString(pARMSOC->pOptionInfo,
 			OPTION_INIT_FROM_FBDEV);
-	if (fbdev && *fbdev != '\0') {
+	if (pARMSOC->seamlessBoot && drmmode_copy_boot_fb(pScrn)) {
+		/* the scanout buffer starts out with what is on screen */
+		pScreen->canDoBGNoneRoot = TRUE;
+	} else if (fbdev && *fbdev != '\0') {
 		if (ARMSOCCopyFB(pScrn, fbdev)) {
 			/* Only allow None BG root if we initialized the scanout
 			 * buffer */
@@ -1122,7 +1770,10 @@ ARMSOCScreenInit(SCREEN_INIT_ARGS_DECL)
 	wrap(pARMSOC, pScreen, CreateScreenResources,
 			ARMSOCCreateScreenResources);
 	wrap(pARMSOC, pScreen, BlockHandler, ARMSOCBlockHandler);
+	wrap(pARMSOC, pScreen, DestroyPixmap, ARMSOCScreenDestroyPixmap);
+	pARMSOC->trackPixmapDamage = pARMSOC->dri && DamageSetup(pScreen);
 	drmmode_screen_init(pScrn);
+	ARMSOCWatchDRMEvents();
 
 	TRACE_EXIT();
 	return TRUE;
@@ -1196,11 +1847,19 @@ ARMSOCCloseScreen(CLOSE_SCREEN_ARGS_DECL)
 {
 	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
 	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct armsoc_scanout_stats stats;
 	Bool ret;
 
 	TRACE_ENTER();
 
+	ARMSOCUnwatchDRMEvents();
 	drmmode_screen_fini(pScrn);
+
+	armsoc_device_get_scanout_stats(pARMSOC->dev, &stats);
+	INFO_MSG("Scanout memory: %u buffers allocated, %u taken from the pool, %u refused by the kernel, %u demoted for the budget, %u KiB at most",
+			stats.allocs, stats.pooled, stats.failures,
+			stats.demoted, stats.peak_kb);
+
 	drmmode_cursor_fini(pScreen);
 
 	/* pScreen->devPrivate holds the root pixmap created around our bo by miCreateResources which is installed
@@ -1217,6 +1876,7 @@ ARMSOCCloseScreen(CLOSE_SCREEN_ARGS_DECL)
 	unwrap(pARMSOC, pScreen, CloseScreen);
 	unwrap(pARMSOC, pScreen, BlockHandler);
 	unwrap(pARMSOC, pScreen, CreateScreenResources);
+	unwrap(pARMSOC, pScreen, DestroyPixmap);
 
 	ret = (*pScreen->CloseScreen)(CLOSE_SCREEN_ARGS);
 
@@ -1266,6 +1926,36 @@ ARMSOCCreateScreenResources(ScreenPtr pScreen)
 }
 
 
+/*
+ * With the SwapStats option, the scanout memory statistics are published
+ * as the _ARMSOC_SCANOUT_STATS property of the root window when they
+ * change, at most every ARMSOC_STATS_INTERVAL.
+ */
+static void
+ARMSOCPublishScanoutStats(ScreenPtr pScreen)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	static const char name[] = "_ARMSOC_SCANOUT_STATS";
+	struct armsoc_scanout_stats stats;
+	CARD32 now = GetTimeInMillis();
+
+	if (!pScreen->root ||
+			now - pARMSOC->scanoutStatsTime < ARMSOC_STATS_INTERVAL)
+		return;
+
+	armsoc_device_get_scanout_stats(pARMSOC->dev, &stats);
+	if (!memcmp(&stats, &pARMSOC->scanoutStats, sizeof(stats)))
+		return;
+
+	pARMSOC->scanoutStats = stats;
+	pARMSOC->scanoutStatsTime = now;
+	dixChangeWindowProperty(serverClient, pScreen->root,
+			MakeAtom(name, sizeof(name) - 1, TRUE), XA_INTEGER, 32,
+			PropModeReplace, sizeof(stats) / sizeof(CARD32), &stats,
+			TRUE);
+}
+
 static void
 ARMSOCBlockHandler(BLOCKHANDLER_ARGS_DECL)
 {
@@ -1276,6 +1966,54 @@ ARMSOCBlockHandler(BLOCKHANDLER_ARGS_DECL)
 	swap(pARMSOC, pScreen, BlockHandler);
 	(*pScreen->BlockHandler) (BLOCKHANDLER_ARGS);
 	swap(pARMSOC, pScreen, BlockHandler);
+
+	if (pScrn->vtSema) {
+		drmmode_scanout_validate(pScrn);
+		drmmode_cursor_flush(pScrn);
+		drmmode_color_flush(pScrn);
+	}
+
+	if (pARMSOC->swapStats)
+		ARMSOCPublishScanoutStats(pScreen);
+}
+
+static Bool
+ARMSOCScreenDestroyPixmap(PixmapPtr pPixmap)
+{
+	ScreenPtr pScreen = pPixmap->drawable.pScreen;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR_FROM_SCREEN(pScreen);
+	struct armsoc_bo *bo;
+	Bool ret;
+
+	if (pPixmap->refcnt == 1) {
+		/* Anything else holding the bo must not find it through
+		 * the pixmap once it is gone */
+		bo = armsoc_bo_from_drawable(&pPixmap->drawable);
+		if (bo)
+			armsoc_bo_clear_drawable(bo);
+
+		bo = ARMSOCPixmapGetBo(pPixmap);
+		if (bo) {
+			ARMSOCPixmapPriv(pPixmap)->bo = NULL;
+			armsoc_bo_unreference(bo);
+		}
+
+		bo = ARMSOCPixmapPriv(pPixmap)->spare_bo;
+		if (bo) {
+			ARMSOCPixmapPriv(pPixmap)->spare_bo = NULL;
+			armsoc_bo_unreference(bo);
+		}
+
+		/* damage is torn down along with the pixmap by the
+		 * damage layer itself */
+		ARMSOCPixmapPriv(pPixmap)->damage = NULL;
+	}
+
+	swap(pARMSOC, pScreen, DestroyPixmap);
+	ret = (*pScreen->DestroyPixmap) (pPixmap);
+	swap(pARMSOC, pScreen, DestroyPixmap);
+
+	return ret;
 }
 
 
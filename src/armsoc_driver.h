@@ -36,6 +36,7 @@
 #include "xf86RAC.h"
 #endif
 #include "xf86drm.h"
+#include "xf86Crtc.h"
 #include <errno.h>
 #include "armsoc_exa.h"
 
@@ -46,8 +47,6 @@
 /* Driver name as used in config file */
 #define ARMSOC_DRIVER_NAME	"armsoc"
 
-#define ARMSOC_SUPPORT_GAMMA 0
-
 /**
  * This controls whether debug statements (and function "trace" enter/exit)
  * messages are sent to the log file (TRUE) or are ignored (FALSE).
@@ -115,11 +114,28 @@ struct ARMSOCRec {
 
 	/** record if ARMSOCDRI2ScreenInit() was successful */
 	Bool				dri;
+	/** record if ARMSOCDRI3ScreenInit() was successful */
+	Bool				dri3;
+	/** record if pixmaps moved into a bo for DRI2 track damage */
+	Bool				trackPixmapDamage;
 
 	/** user-configurable option: */
 	Bool				NoFlip;
+	Bool				swapStats;
+	Bool				atomic;
+	Bool				overlays;
+	Bool				seamlessBoot;
+	int				maxScanoutWidth;
+	int				maxScanoutHeight;
+	Bool				variableRefresh;
+	Bool				scanoutModifiers;
+	int				scanoutPool;
 	unsigned			driNumBufs;
 
+	/** scanout memory statistics as last published, and when */
+	struct armsoc_scanout_stats	scanoutStats;
+	CARD32				scanoutStatsTime;
+
 	/** File descriptor of the connection with the DRM. */
 	int					drmFD;
 
@@ -142,6 +158,8 @@ struct ARMSOCRec {
 	CloseScreenProcPtr				SavedCloseScreen;
 	CreateScreenResourcesProcPtr	SavedCreateScreenResources;
 	ScreenBlockHandlerProcPtr		SavedBlockHandler;
+	CreatePixmapProcPtr				SavedCreatePixmap;
+	DestroyPixmapProcPtr			SavedDestroyPixmap;
 
 	/** Pointer to the entity structure for this screen. */
 	EntityInfoPtr		pEntityInfo;
@@ -188,6 +206,18 @@ struct ARMSOCRec {
 #  define ARRAY_SIZE(a)  (sizeof(a) / sizeof(a[0]))
 #endif
 
+/* How often statistics properties are updated at most, in ms */
+#define ARMSOC_STATS_INTERVAL 1000
+
+/**
+ * Page flip and vblank events are delivered through this. Users embed it
+ * as the first member of the data they pass along with the request.
+ */
+struct ARMSOCFlipEvent {
+	void (*handler)(struct ARMSOCFlipEvent *event, unsigned int frame,
+			unsigned int tv_sec, unsigned int tv_usec);
+};
+
 /**
  * drmmode functions..
  */
@@ -195,10 +225,35 @@ Bool drmmode_pre_init(ScrnInfoPtr pScrn, int fd, int cpp);
 void drmmode_screen_init(ScrnInfoPtr pScrn);
 void drmmode_screen_fini(ScrnInfoPtr pScrn);
 void drmmode_adjust_frame(ScrnInfoPtr pScrn, int x, int y);
-Bool drmmode_page_flip(DrawablePtr draw, uint32_t fb_id, void *priv);
+int drmmode_page_flip(DrawablePtr draw, struct armsoc_bo *bo,
+		struct ARMSOCFlipEvent *event, Bool async);
+Bool drmmode_async_flip_supported(ScrnInfoPtr pScrn);
+xf86CrtcPtr drmmode_crtc_covering_box(ScrnInfoPtr pScrn, BoxPtr box);
+uint32_t drmmode_crtc_vblank_pipe(xf86CrtcPtr crtc);
+void drmmode_crtc_get_ust_msc(xf86CrtcPtr crtc, uint64_t *ust,
+		uint64_t *msc);
+Bool drmmode_crtc_queue_msc(xf86CrtcPtr crtc, uint64_t msc,
+		struct ARMSOCFlipEvent *event);
+unsigned int drmmode_crtcs_for_drawable(DrawablePtr pDraw);
+struct armsoc_bo *drmmode_scanout_bo_for_drawable(DrawablePtr pDraw);
+void drmmode_scanout_restore(ScrnInfoPtr pScrn, struct armsoc_bo *bo);
+void drmmode_scanout_validate(ScrnInfoPtr pScrn);
+Bool drmmode_overlay_possible(DrawablePtr pDraw);
+struct armsoc_bo *drmmode_overlay_bo_for_drawable(DrawablePtr pDraw);
+int drmmode_overlay_flip(DrawablePtr pDraw, struct armsoc_bo *bo,
+		struct ARMSOCFlipEvent *event);
+void drmmode_overlay_restore(ScrnInfoPtr pScrn, DrawablePtr pDraw);
+void drmmode_handle_events(int fd);
 void drmmode_wait_for_event(ScrnInfoPtr pScrn);
+Bool drmmode_copy_boot_fb(ScrnInfoPtr pScrn);
+Bool drmmode_crtc_shadowed(ScrnInfoPtr pScrn);
+void drmmode_set_vrr(DrawablePtr pDraw, unsigned int crtc_mask);
+int drmmode_scanout_modifiers(ScrnInfoPtr pScrn, uint32_t format,
+		uint64_t **modifiers);
 Bool drmmode_cursor_init(ScreenPtr pScreen);
 void drmmode_cursor_fini(ScreenPtr pScreen);
+void drmmode_cursor_flush(ScrnInfoPtr pScrn);
+void drmmode_color_flush(ScrnInfoPtr pScrn);
 
 
 /**
@@ -209,6 +264,35 @@ Bool ARMSOCDRI2ScreenInit(ScreenPtr pScreen);
 void ARMSOCDRI2CloseScreen(ScreenPtr pScreen);
 void ARMSOCDRI2SwapComplete(struct ARMSOCDRISwapCmd *cmd);
 
+/**
+ * DRI3 and Present functions..
+ */
+#ifdef HAVE_DRI3
+Bool ARMSOCDRI3ScreenInit(ScreenPtr pScreen);
+Bool ARMSOCPresentScreenInit(ScreenPtr pScreen);
+#endif
+
+/**
+ * Pixmaps backed directly by a bo..
+ */
+Bool ARMSOCPixmapPrivateInit(ScreenPtr pScreen);
+struct armsoc_bo *ARMSOCPixmapGetBo(PixmapPtr pPixmap);
+Bool ARMSOCPixmapSetBo(PixmapPtr pPixmap, struct armsoc_bo *bo);
+void ARMSOCPixmapStopDamage(PixmapPtr pPixmap);
+struct armsoc_bo *ARMSOCPixmapMoveToBo(PixmapPtr pPixmap);
+void ARMSOCPixmapMoveFromBo(PixmapPtr pPixmap, struct armsoc_bo *bo);
+
+/**
+ * Copying between pixel formats..
+ */
+pixman_format_code_t ARMSOCScreenFormat(ScrnInfoPtr pScrn);
+pixman_format_code_t ARMSOCDepthFormat(int depth, int bpp);
+Bool ARMSOCCopyConvert(const void *src, int src_pitch,
+		pixman_format_code_t src_format, void *dst, int dst_pitch,
+		pixman_format_code_t dst_format, int width, int height);
+void ARMSOCCopyBoToDrawable(struct armsoc_bo *bo, DrawablePtr pDraw,
+		GCPtr pGC);
+
 /**
  * DRI2 util functions..
  */
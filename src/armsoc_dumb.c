@@ -30,6 +30,7 @@
 #include <xf86.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
+#include <drm_fourcc.h>
 
 #include "armsoc_dumb.h"
 #include "drmmode_driver.h"
@@ -37,11 +38,35 @@
 
 #define ALIGN(val, align)	(((val) + (align) - 1) & ~((align) - 1))
 
+#ifndef DRM_FORMAT_MOD_LINEAR
+#define DRM_FORMAT_MOD_LINEAR 0
+#endif
+
 struct armsoc_device {
 	int fd;
 	int (*create_custom_gem)(int fd, struct armsoc_create_gem *create_gem);
+	/* memory held by the scanout bos we allocated, and the most that
+	 * optional ones may take, 0 for no limit */
+	uint64_t scanout_held;
+	uint64_t scanout_peak;
+	uint64_t scanout_budget;
+	struct armsoc_scanout_stats stats;
+	/* scanout bos reserved up front that are not in use, and how many
+	 * were reserved in all */
+	struct xorg_list scanout_pool;
+	int scanout_pool_size;
+	/* what the pool was reserved with, to top it up again */
+	int pool_count;
+	uint32_t pool_width;
+	uint32_t pool_height;
+	uint8_t pool_depth;
+	uint8_t pool_bpp;
 };
 
+/* Optional scanout bos stop at this fraction of the budget, leaving the
+ * rest for the ones that have no fallback, like the root framebuffer */
+#define SCANOUT_BUDGET_SOFT(budget)	((budget) - (budget) / 8)
+
 struct armsoc_bo {
 	struct armsoc_device *dev;
 	uint32_t handle;
@@ -53,28 +78,60 @@ struct armsoc_bo {
 	uint8_t depth;
 	uint8_t bpp;
 	uint32_t pitch;
+	/* fourcc and layout the fb is created with, 0 if the format has no
+	 * fourcc we know of */
+	uint32_t format;
+	uint64_t modifier;
 	int refcnt;
 	int dmabuf;
-	/* initial size of backing memory. Used on resize to
+	/* initial size and pitch of backing memory. Used on resize to
 	 * check if the new size will fit
 	 */
 	uint32_t original_size;
+	uint32_t original_pitch;
 	uint32_t name;
 	int orig_dev_kind;
 	void *orig_devprivate_ptr;
 	DrawablePtr pDraw;
 	UT_hash_handle hh;
 	struct xorg_list entry;
+	/* when it went on the pending deletion list */
+	CARD32 release_time;
+	/* imported from a dma_buf rather than allocated by us */
+	int imported;
+	UT_hash_handle hh_import;
+	enum armsoc_buf_type buf_type;
+	/* reserved in the scanout pool, which it goes back to instead of
+	 * being destroyed */
+	int pooled;
+	struct xorg_list pool_link;
+	/* its name or a dma_buf was handed out, so others may still hold it */
+	int exported;
 };
 
 /* Hash that links BOs to drawables */
 static struct armsoc_bo *hash = NULL;
 
+/* Hash of imported BOs by GEM handle. Importing the same dma_buf twice
+ * gives back the same handle, which must only be closed once. */
+static struct armsoc_bo *import_hash = NULL;
+
 /* Mali sometimes asks us to destroy BOs for windows before it has finished
  * reading from them. To work around this, we don't free BOs immediately,
  * instead we put them on a list to be deleted at a later moment when we are
- * more confident that rendering has finished. */
+ * more confident that rendering has finished. That is the next DRI2 flip,
+ * or a while after they were released, for screens that never flip. */
 static struct xorg_list pending_deletions;
+static OsTimerPtr pending_timer;
+
+/* how long released bos wait for deletion at most, in ms */
+#define PENDING_DELETION_DELAY	1000
+
+static void armsoc_bo_del(struct armsoc_bo *bo);
+static struct armsoc_bo *armsoc_scanout_pool_find(struct armsoc_device *dev,
+		uint32_t width, uint32_t height, uint8_t bpp);
+static struct armsoc_bo *armsoc_scanout_pool_get(struct armsoc_device *dev,
+		uint32_t width, uint32_t height, uint8_t depth, uint8_t bpp);
 
 struct armsoc_bo *armsoc_bo_from_drawable(DrawablePtr pDraw)
 {
@@ -83,9 +140,24 @@ struct armsoc_bo *armsoc_bo_from_drawable(DrawablePtr pDraw)
 	return ret;
 }
 
+void armsoc_bo_clear_drawable(struct armsoc_bo *bo)
+{
+	if (!bo->pDraw)
+		return;
+
+	HASH_DEL(hash, bo);
+	bo->pDraw = NULL;
+}
+
 void armsoc_bo_set_drawable(struct armsoc_bo *bo, DrawablePtr pDraw)
 {
 	struct armsoc_bo *replaced;
+
+	if (bo->pDraw == pDraw)
+		return;
+
+	/* the key of an entry can't change while it is in the hash */
+	armsoc_bo_clear_drawable(bo);
 	bo->pDraw = pDraw;
 	HASH_REPLACE_PTR(hash, pDraw, bo, replaced);
 	if (replaced)
@@ -111,21 +183,85 @@ struct armsoc_device *armsoc_device_new(int fd,
 			int (*create_custom_gem)(int fd,
 				struct armsoc_create_gem *create_gem))
 {
-	struct armsoc_device *new_dev = malloc(sizeof(*new_dev));
+	struct armsoc_device *new_dev = calloc(1, sizeof(*new_dev));
 	if (!new_dev)
 		return NULL;
 
 	new_dev->fd = fd;
 	new_dev->create_custom_gem = create_custom_gem;
-	xorg_list_init(&pending_deletions);
+	xorg_list_init(&new_dev->scanout_pool);
+	/* shared by all devices */
+	if (!pending_deletions.next)
+		xorg_list_init(&pending_deletions);
 	return new_dev;
 }
 
 void armsoc_device_del(struct armsoc_device *dev)
 {
+	struct armsoc_bo *bo, *tmp;
+
+	/* the timer must not find bos of a device that is gone */
+	xorg_list_for_each_entry_safe(bo, tmp, &pending_deletions, entry) {
+		if (bo->dev != dev)
+			continue;
+		xorg_list_del(&bo->entry);
+		armsoc_bo_del(bo);
+	}
+	if (xorg_list_is_empty(&pending_deletions)) {
+		TimerFree(pending_timer);
+		pending_timer = NULL;
+	}
+
+	/* pooled bos still in use are lost with the device, like any other */
+	xorg_list_for_each_entry_safe(bo, tmp, &dev->scanout_pool, pool_link) {
+		xorg_list_del(&bo->pool_link);
+		bo->pooled = 0;
+		armsoc_bo_del(bo);
+	}
 	free(dev);
 }
 
+void armsoc_device_set_scanout_budget(struct armsoc_device *dev,
+		uint64_t budget)
+{
+	dev->scanout_budget = budget;
+}
+
+void armsoc_device_get_scanout_stats(struct armsoc_device *dev,
+		struct armsoc_scanout_stats *stats)
+{
+	*stats = dev->stats;
+	stats->held_kb = dev->scanout_held >> 10;
+	stats->peak_kb = dev->scanout_peak >> 10;
+	stats->budget_kb = dev->scanout_budget >> 10;
+}
+
+Bool armsoc_scanout_fits(struct armsoc_device *dev, uint32_t width,
+		uint32_t height, uint8_t bpp)
+{
+	uint64_t size = (uint64_t)width * height * ((bpp + 7) / 8);
+
+	/* the pool is accounted already */
+	if (armsoc_scanout_pool_find(dev, width, height, bpp))
+		return TRUE;
+
+	return !dev->scanout_budget || dev->scanout_held + size <=
+			SCANOUT_BUDGET_SOFT(dev->scanout_budget);
+}
+
+enum armsoc_buf_type armsoc_scanout_buf_type(struct armsoc_device *dev,
+		uint32_t width, uint32_t height, uint8_t bpp)
+{
+	if (armsoc_scanout_fits(dev, width, height, bpp))
+		return ARMSOC_BO_SCANOUT;
+
+	if (!dev->stats.demoted)
+		xf86DrvMsg(-1, X_WARNING,
+			"Scanout memory budget reached, allocating buffers that could be flipped as non-scanout\n");
+	dev->stats.demoted++;
+	return ARMSOC_BO_NON_SCANOUT;
+}
+
 /* buffer-object related functions:
  */
 
@@ -142,10 +278,11 @@ int armsoc_bo_set_dmabuf(struct armsoc_bo *bo)
 	prime_handle.flags  = 0;
 	res  = drmIoctl(bo->dev->fd, DRM_IOCTL_PRIME_HANDLE_TO_FD,
 						&prime_handle);
-	if (res)
+	if (res) {
 		res = errno;
-	else
+	} else {
 		bo->dmabuf = prime_handle.fd;
+	}
 
 	return res;
 }
@@ -165,7 +302,8 @@ int armsoc_bo_has_dmabuf(struct armsoc_bo *bo)
 	return bo->dmabuf >= 0;
 }
 
-struct armsoc_bo *armsoc_bo_new_with_dim(struct armsoc_device *dev,
+/* Allocate a new bo from the kernel */
+static struct armsoc_bo *armsoc_bo_create(struct armsoc_device *dev,
 			uint32_t width, uint32_t height, uint8_t depth,
 			uint8_t bpp, enum armsoc_buf_type buf_type)
 {
@@ -184,6 +322,8 @@ struct armsoc_bo *armsoc_bo_new_with_dim(struct armsoc_device *dev,
 	create_gem.bpp = bpp;
 	res = dev->create_custom_gem(dev->fd, &create_gem);
 	if (res) {
+		if (buf_type == ARMSOC_BO_SCANOUT)
+			dev->stats.failures++;
 		free(new_buf);
 		xf86DrvMsg(-1, X_ERROR,
 			"_CREATE_GEM({height: %d, width: %d, bpp: %d buf_type: 0x%X}) failed. errno: %d - %s\n",
@@ -202,10 +342,23 @@ struct armsoc_bo *armsoc_bo_new_with_dim(struct armsoc_device *dev,
 	new_buf->width = create_gem.width;
 	new_buf->height = create_gem.height;
 	new_buf->original_size = create_gem.size;
+	new_buf->original_pitch = create_gem.pitch;
 	new_buf->depth = depth;
 	new_buf->bpp = create_gem.bpp;
+	new_buf->format = armsoc_drm_format(depth, create_gem.bpp);
+	new_buf->modifier = DRM_FORMAT_MOD_LINEAR;
 	new_buf->refcnt = 1;
 	new_buf->dmabuf = -1;
+	new_buf->imported = 0;
+	new_buf->buf_type = buf_type;
+	new_buf->pooled = 0;
+	new_buf->exported = 0;
+
+	if (buf_type == ARMSOC_BO_SCANOUT) {
+		dev->stats.allocs++;
+		dev->scanout_held += new_buf->original_size;
+		dev->scanout_peak = max(dev->scanout_peak, dev->scanout_held);
+	}
 
 	if (create_gem.name)
 		new_buf->name = create_gem.name;
@@ -215,10 +368,175 @@ struct armsoc_bo *armsoc_bo_new_with_dim(struct armsoc_device *dev,
 	return new_buf;
 }
 
+/*
+ * Scanout bos come from the pool when there is one free that is big
+ * enough. They are cleared like new ones from the kernel. Pooled bos that
+ * were freed rather than returned are replaced here, when the pool is
+ * found short, instead of wherever the last reference went.
+ */
+struct armsoc_bo *armsoc_bo_new_with_dim(struct armsoc_device *dev,
+			uint32_t width, uint32_t height, uint8_t depth,
+			uint8_t bpp, enum armsoc_buf_type buf_type)
+{
+	struct armsoc_bo *new_buf = NULL;
+
+	if (buf_type == ARMSOC_BO_SCANOUT) {
+		new_buf = armsoc_scanout_pool_get(dev, width, height, depth,
+				bpp);
+		if (!new_buf && dev->scanout_pool_size < dev->pool_count &&
+				armsoc_device_reserve_scanout(dev,
+					dev->pool_count, dev->pool_width,
+					dev->pool_height, dev->pool_depth,
+					dev->pool_bpp))
+			new_buf = armsoc_scanout_pool_get(dev, width,
+					height, depth, bpp);
+	}
+	if (!new_buf)
+		new_buf = armsoc_bo_create(dev, width, height, depth, bpp,
+				buf_type);
+	return new_buf;
+}
+
+/*
+ * Wrap a GEM handle we hold a reference to. Imported bos share the same
+ * handle for the same buffer, so importing it again finds the existing bo,
+ * even one waiting for deletion: its handle must not be closed while a new
+ * bo uses it. The handle is closed if the import fails.
+ */
+static struct armsoc_bo *armsoc_bo_import(struct armsoc_device *dev,
+			uint32_t handle, off_t size, uint32_t width,
+			uint32_t height, uint8_t depth, uint8_t bpp,
+			uint32_t pitch)
+{
+	struct armsoc_bo *new_buf;
+
+	HASH_FIND(hh_import, import_hash, &handle, sizeof(handle), new_buf);
+	if (new_buf && !new_buf->refcnt) {
+		/* revive it, with the layout it is imported with now */
+		if ((off_t)pitch * height > new_buf->size ||
+				pitch < width * ((bpp + 7) / 8))
+			return NULL;
+		xorg_list_del(&new_buf->entry);
+		new_buf->refcnt = 1;
+		new_buf->pDraw = NULL;
+		if (new_buf->width != width || new_buf->height != height ||
+				new_buf->depth != depth || new_buf->bpp != bpp ||
+				new_buf->pitch != pitch) {
+			if (new_buf->fb_id && armsoc_bo_rm_fb(new_buf))
+				new_buf->fb_id = 0;
+			new_buf->width = width;
+			new_buf->height = height;
+			new_buf->depth = depth;
+			new_buf->bpp = bpp;
+			new_buf->pitch = pitch;
+			new_buf->original_pitch = pitch;
+			new_buf->format = armsoc_drm_format(depth, bpp);
+		}
+		new_buf->modifier = DRM_FORMAT_MOD_LINEAR;
+		return new_buf;
+	}
+	if (new_buf) {
+		if (new_buf->width != width || new_buf->height != height ||
+				new_buf->bpp != bpp || new_buf->pitch != pitch)
+			return NULL;
+		armsoc_bo_reference(new_buf);
+		return new_buf;
+	}
+
+	if (size == (off_t)-1 || size < (off_t)pitch * height ||
+			pitch < width * ((bpp + 7) / 8)) {
+		xf86DrvMsg(-1, X_ERROR,
+			"buffer too small for %dx%d, pitch %d\n",
+			width, height, pitch);
+		goto fail;
+	}
+
+	new_buf = malloc(sizeof(*new_buf));
+	if (!new_buf)
+		goto fail;
+
+	new_buf->dev = dev;
+	new_buf->handle = handle;
+	new_buf->size = size;
+	new_buf->map_addr = NULL;
+	new_buf->pDraw = NULL;
+	new_buf->fb_id = 0;
+	new_buf->pitch = pitch;
+	new_buf->width = width;
+	new_buf->height = height;
+	new_buf->original_size = size;
+	new_buf->original_pitch = pitch;
+	new_buf->depth = depth;
+	new_buf->bpp = bpp;
+	new_buf->format = armsoc_drm_format(depth, bpp);
+	new_buf->modifier = DRM_FORMAT_MOD_LINEAR;
+	new_buf->refcnt = 1;
+	new_buf->dmabuf = -1;
+	new_buf->name = 0;
+	new_buf->imported = 1;
+	/* someone else's memory, not accounted to us */
+	new_buf->buf_type = ARMSOC_BO_NON_SCANOUT;
+	new_buf->pooled = 0;
+	new_buf->exported = 1;
+
+	HASH_ADD(hh_import, import_hash, handle, sizeof(new_buf->handle),
+			new_buf);
+	return new_buf;
+
+fail:
+	{
+		struct drm_gem_close close_bo = { .handle = handle };
+
+		drmIoctl(dev->fd, DRM_IOCTL_GEM_CLOSE, &close_bo);
+	}
+	return NULL;
+}
+
+struct armsoc_bo *armsoc_bo_from_dmabuf(struct armsoc_device *dev, int fd,
+			uint32_t width, uint32_t height, uint8_t depth,
+			uint8_t bpp, uint32_t pitch)
+{
+	uint32_t handle;
+	int res;
+
+	res = drmPrimeFDToHandle(dev->fd, fd, &handle);
+	if (res) {
+		xf86DrvMsg(-1, X_ERROR,
+			"drmPrimeFDToHandle failed. errno: %d - %s\n",
+			errno, strerror(errno));
+		return NULL;
+	}
+
+	/* dma_buf fds report their size through lseek */
+	return armsoc_bo_import(dev, handle, lseek(fd, 0, SEEK_END), width,
+			height, depth, bpp, pitch);
+}
+
+struct armsoc_bo *armsoc_bo_from_handle(struct armsoc_device *dev,
+			uint32_t handle, uint32_t width, uint32_t height,
+			uint8_t depth, uint8_t bpp, uint32_t pitch)
+{
+	return armsoc_bo_import(dev, handle, (off_t)pitch * height, width,
+			height, depth, bpp, pitch);
+}
+
+int armsoc_bo_export_dmabuf(struct armsoc_bo *bo)
+{
+	int fd;
+
+	assert(bo->refcnt > 0);
+	if (drmPrimeHandleToFD(bo->dev->fd, bo->handle, DRM_CLOEXEC, &fd))
+		return -1;
+
+	bo->exported = 1;
+	return fd;
+}
+
 static void armsoc_bo_del(struct armsoc_bo *bo)
 {
 	int res;
 	struct drm_mode_destroy_dumb destroy_dumb;
+	struct armsoc_device *dev;
 
 	if (!bo)
 		return;
@@ -228,6 +546,20 @@ static void armsoc_bo_del(struct armsoc_bo *bo)
 	assert(bo->refcnt == 0);
 	assert(bo->dmabuf < 0);
 
+	/* back to the pool, keeping the mapping and the fb for next time,
+	 * unless other clients can still reach it. Those are replaced. */
+	if (bo->pooled && !bo->exported) {
+		bo->pDraw = NULL;
+		bo->orig_dev_kind = 0;
+		bo->orig_devprivate_ptr = NULL;
+		xorg_list_add(&bo->pool_link, &bo->dev->scanout_pool);
+		return;
+	}
+	if (bo->pooled) {
+		bo->pooled = 0;
+		bo->dev->scanout_pool_size--;
+	}
+
 	if (bo->map_addr) {
 		/* always map/unmap the full buffer for consistency */
 		munmap(bo->map_addr, bo->original_size);
@@ -239,8 +571,25 @@ static void armsoc_bo_del(struct armsoc_bo *bo)
 			xf86DrvMsg(-1, X_ERROR, "drmModeRmFb failed %d : %s\n",
 				res, strerror(errno));
 	}
+	if (bo->imported) {
+		struct drm_gem_close close_bo = { .handle = bo->handle };
+
+		HASH_DELETE(hh_import, import_hash, bo);
+
+		res = drmIoctl(bo->dev->fd, DRM_IOCTL_GEM_CLOSE, &close_bo);
+		if (res)
+			xf86DrvMsg(-1, X_ERROR, "gem close failed %d : %s\n",
+				res, strerror(errno));
+		free(bo);
+		return;
+	}
+
+	if (bo->buf_type == ARMSOC_BO_SCANOUT)
+		bo->dev->scanout_held -= bo->original_size;
+
+	dev = bo->dev;
 	destroy_dumb.handle = bo->handle;
-	res = drmIoctl(bo->dev->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy_dumb);
+	res = drmIoctl(dev->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy_dumb);
 	if (res)
 		xf86DrvMsg(-1, X_ERROR, "destroy dumb failed %d : %s\n",
 			res, strerror(errno));
@@ -250,13 +599,31 @@ static void armsoc_bo_del(struct armsoc_bo *bo)
 
 void armsoc_bo_do_pending_deletions(void)
 {
-	struct armsoc_bo *bo;
+	struct armsoc_bo *bo, *tmp;
 
-	xorg_list_for_each_entry(bo, &pending_deletions, entry)
+	xorg_list_for_each_entry_safe(bo, tmp, &pending_deletions, entry) {
+		xorg_list_del(&bo->entry);
 		armsoc_bo_del(bo);
+	}
+}
 
-	/* set list to empty */
-	xorg_list_del(&pending_deletions);
+/* Deletes the bos released long enough ago, and runs again when the next
+ * one is due */
+static CARD32 armsoc_bo_pending_timer(OsTimerPtr timer, CARD32 now,
+		pointer arg)
+{
+	struct armsoc_bo *bo, *tmp;
+
+	xorg_list_for_each_entry_safe(bo, tmp, &pending_deletions, entry) {
+		CARD32 age = now - bo->release_time;
+
+		/* the list is oldest first */
+		if (age < PENDING_DELETION_DELAY)
+			return PENDING_DELETION_DELAY - age;
+		xorg_list_del(&bo->entry);
+		armsoc_bo_del(bo);
+	}
+	return 0;
 }
 
 void armsoc_bo_unreference(struct armsoc_bo *bo)
@@ -268,10 +635,21 @@ void armsoc_bo_unreference(struct armsoc_bo *bo)
 	if (--bo->refcnt > 0)
 		return;
 
-	if (bo->pDraw)
+	/* a bo revived later must be hashed again by armsoc_bo_set_drawable */
+	if (bo->pDraw) {
 		HASH_DEL(hash, bo);
+		bo->pDraw = NULL;
+	}
 
-	xorg_list_add(&bo->entry, &pending_deletions);
+	/* imported bos stay in import_hash until deleted, so that importing
+	 * the same dma_buf again revives them rather than sharing the handle
+	 * with a second bo */
+	bo->release_time = GetTimeInMillis();
+	if (xorg_list_is_empty(&pending_deletions))
+		pending_timer = TimerSet(pending_timer, 0,
+				PENDING_DELETION_DELAY,
+				armsoc_bo_pending_timer, NULL);
+	xorg_list_append(&bo->entry, &pending_deletions);
 }
 
 void armsoc_bo_reference(struct armsoc_bo *bo)
@@ -291,6 +669,14 @@ uint32_t armsoc_bo_name(struct armsoc_bo *bo)
 	return bo->name;
 }
 
+uint32_t armsoc_bo_export_name(struct armsoc_bo *bo)
+{
+	assert(bo->refcnt > 0);
+	if (bo->name)
+		bo->exported = 1;
+	return bo->name;
+}
+
 uint32_t armsoc_bo_handle(struct armsoc_bo *bo)
 {
 	assert(bo->refcnt > 0);
@@ -333,6 +719,54 @@ uint32_t armsoc_bo_pitch(struct armsoc_bo *bo)
 	return bo->pitch;
 }
 
+enum armsoc_buf_type armsoc_bo_buf_type(struct armsoc_bo *bo)
+{
+	assert(bo->refcnt > 0);
+	return bo->buf_type;
+}
+
+uint32_t armsoc_bo_format(struct armsoc_bo *bo)
+{
+	assert(bo->refcnt > 0);
+	return bo->format;
+}
+
+uint64_t armsoc_bo_modifier(struct armsoc_bo *bo)
+{
+	assert(bo->refcnt > 0);
+	return bo->modifier;
+}
+
+int armsoc_bo_set_modifier(struct armsoc_bo *bo, uint64_t modifier)
+{
+	assert(bo->refcnt > 0);
+
+	if (bo->modifier == modifier)
+		return 0;
+
+	/* the fb was made for the old layout */
+	if (bo->fb_id && armsoc_bo_rm_fb(bo))
+		return -1;
+
+	bo->modifier = modifier;
+	return 0;
+}
+
+uint32_t armsoc_drm_format(uint8_t depth, uint8_t bpp)
+{
+	if (bpp == 32 && depth == 24)
+		return DRM_FORMAT_XRGB8888;
+	if (bpp == 32 && depth == 32)
+		return DRM_FORMAT_ARGB8888;
+	if (bpp == 32 && depth == 30)
+		return DRM_FORMAT_XRGB2101010;
+	if (bpp == 16 && depth == 16)
+		return DRM_FORMAT_RGB565;
+	if (bpp == 16 && depth == 15)
+		return DRM_FORMAT_XRGB1555;
+	return 0;
+}
+
 void *armsoc_bo_map(struct armsoc_bo *bo)
 {
 	assert(bo->refcnt > 0);
@@ -343,13 +777,29 @@ void *armsoc_bo_map(struct armsoc_bo *bo)
 		map_dumb.handle = bo->handle;
 
 		res = drmIoctl(bo->dev->fd, DRM_IOCTL_MODE_MAP_DUMB, &map_dumb);
-		if (res)
-			return NULL;
-
-		/* always map/unmap the full buffer for consistency */
-		bo->map_addr = mmap(NULL, bo->original_size,
-				PROT_READ | PROT_WRITE, MAP_SHARED,
-				bo->dev->fd, map_dumb.offset);
+		if (res) {
+			int fd;
+
+			if (!bo->imported)
+				return NULL;
+
+			/* Not every driver can map an imported buffer
+			 * through the dumb interface, but the dma_buf
+			 * itself can be mapped. */
+			fd = armsoc_bo_export_dmabuf(bo);
+			if (fd < 0)
+				return NULL;
+
+			bo->map_addr = mmap(NULL, bo->original_size,
+					PROT_READ | PROT_WRITE, MAP_SHARED,
+					fd, 0);
+			close(fd);
+		} else {
+			/* always map/unmap the full buffer for consistency */
+			bo->map_addr = mmap(NULL, bo->original_size,
+					PROT_READ | PROT_WRITE, MAP_SHARED,
+					bo->dev->fd, map_dumb.offset);
+		}
 
 		if (bo->map_addr == MAP_FAILED)
 			bo->map_addr = NULL;
@@ -399,8 +849,36 @@ int armsoc_bo_add_fb(struct armsoc_bo *bo)
 	assert(bo->refcnt > 0);
 	assert(bo->fb_id == 0);
 
-	ret = drmModeAddFB(bo->dev->fd, bo->width, bo->height, bo->depth,
-			bo->bpp, bo->pitch, bo->handle, &bo->fb_id);
+	if (bo->modifier != DRM_FORMAT_MOD_LINEAR) {
+#ifdef HAVE_DRMMODEADDFB2WITHMODIFIERS
+		uint32_t handles[4] = { bo->handle };
+		uint32_t pitches[4] = { bo->pitch };
+		uint32_t offsets[4] = { 0 };
+		uint64_t modifiers[4] = { bo->modifier };
+
+		ret = drmModeAddFB2WithModifiers(bo->dev->fd, bo->width,
+				bo->height, bo->format, handles, pitches,
+				offsets, modifiers, &bo->fb_id,
+				DRM_MODE_FB_MODIFIERS);
+#else
+		ret = -1;
+#endif
+	} else {
+		uint32_t handles[4] = { bo->handle };
+		uint32_t pitches[4] = { bo->pitch };
+		uint32_t offsets[4] = { 0 };
+
+		ret = -1;
+		if (bo->format)
+			ret = drmModeAddFB2(bo->dev->fd, bo->width,
+					bo->height, bo->format, handles,
+					pitches, offsets, &bo->fb_id, 0);
+		/* kernels without AddFB2, formats without a fourcc */
+		if (ret < 0)
+			ret = drmModeAddFB(bo->dev->fd, bo->width,
+					bo->height, bo->depth, bo->bpp,
+					bo->pitch, bo->handle, &bo->fb_id);
+	}
 	if (ret < 0) {
 		bo->fb_id = 0;
 		return ret;
@@ -430,6 +908,15 @@ uint32_t armsoc_bo_get_fb(struct armsoc_bo *bo)
 	return bo->fb_id;
 }
 
+uint32_t armsoc_bo_detach_fb(struct armsoc_bo *bo)
+{
+	uint32_t fb_id = bo->fb_id;
+
+	assert(bo->refcnt > 0);
+	bo->fb_id = 0;
+	return fb_id;
+}
+
 int armsoc_bo_clear(struct armsoc_bo *bo)
 {
 	unsigned char *dst;
@@ -452,6 +939,66 @@ int armsoc_bo_clear(struct armsoc_bo *bo)
 	return 0;
 }
 
+int armsoc_bo_clear_area(struct armsoc_bo *bo, uint32_t x, uint32_t y,
+		uint32_t width, uint32_t height)
+{
+	uint32_t cpp = (bo->bpp + 7) / 8;
+	unsigned char *dst;
+	uint32_t i;
+
+	assert(bo->refcnt > 0);
+	assert(x + width <= bo->width && y + height <= bo->height);
+	dst = armsoc_bo_map(bo);
+	if (!dst) {
+		xf86DrvMsg(-1, X_ERROR,
+				"Couldn't map scanout bo\n");
+		return -1;
+	}
+	if (armsoc_bo_cpu_prep(bo, ARMSOC_GEM_WRITE)) {
+		xf86DrvMsg(-1, X_ERROR,
+			" %s: armsoc_bo_cpu_prep failed - unable to synchronise access.\n",
+			__func__);
+		return -1;
+	}
+	dst += y * bo->pitch + x * cpp;
+	for (i = 0; i < height; i++)
+		memset(dst + i * bo->pitch, 0x0, width * cpp);
+	(void)armsoc_bo_cpu_fini(bo, ARMSOC_GEM_WRITE);
+	return 0;
+}
+
+/*
+ * The pitch of the bo at a new width. The pitch the backend allocated the
+ * buffer with is known to be good, and keeping it means the pixels that
+ * stay on screen need not move, so it is kept whenever the width fits.
+ */
+uint32_t armsoc_bo_resize_pitch(struct armsoc_bo *bo, uint32_t new_width)
+{
+	uint32_t new_pitch = new_width * ((armsoc_bo_bpp(bo)+7)/8);
+
+	if (new_pitch <= bo->original_pitch)
+		return bo->original_pitch;
+
+	/* Align pitch to 64 byte */
+	return ALIGN(new_pitch, 64);
+}
+
+static uint32_t armsoc_bo_resize_size(struct armsoc_bo *bo,
+		uint32_t new_width, uint32_t new_height)
+{
+	return ((new_height-1) * armsoc_bo_resize_pitch(bo, new_width)) +
+			(new_width * ((armsoc_bo_bpp(bo)+7)/8));
+}
+
+int armsoc_bo_resize_fits(struct armsoc_bo *bo, uint32_t new_width,
+		uint32_t new_height)
+{
+	assert(bo->refcnt > 0);
+	return new_width > 0 && new_height > 0 &&
+		armsoc_bo_resize_size(bo, new_width, new_height) <=
+			bo->original_size;
+}
+
 int armsoc_bo_resize(struct armsoc_bo *bo, uint32_t new_width,
 						uint32_t new_height)
 {
@@ -470,15 +1017,8 @@ int armsoc_bo_resize(struct armsoc_bo *bo, uint32_t new_width,
 	xf86DrvMsg(-1, X_INFO, "Resizing bo from %dx%d to %dx%d\n",
 			bo->width, bo->height, new_width, new_height);
 
-	/* TODO: MIDEGL-1563: Get pitch from DRM as
-	 * only DRM knows the ideal pitch and alignment
-	 * requirements
-	 * */
-	new_pitch  = new_width * ((armsoc_bo_bpp(bo)+7)/8);
-	/* Align pitch to 64 byte */
-	new_pitch  = ALIGN(new_pitch, 64);
-	new_size   = (((new_height-1) * new_pitch) +
-			(new_width * ((armsoc_bo_bpp(bo)+7)/8)));
+	new_pitch  = armsoc_bo_resize_pitch(bo, new_width);
+	new_size   = armsoc_bo_resize_size(bo, new_width, new_height);
 
 	if (new_size <= bo->original_size) {
 		bo->width  = new_width;
@@ -490,3 +1030,93 @@ int armsoc_bo_resize(struct armsoc_bo *bo, uint32_t new_width,
 	xf86DrvMsg(-1, X_ERROR, "Failed to resize buffer\n");
 	return -1;
 }
+
+/*
+ * The smallest free pooled bo that can be resized to width x height.
+ * Buffers much smaller than the pooled ones, like cursors, are left to the
+ * kernel rather than taking up a whole pooled bo.
+ */
+static struct armsoc_bo *armsoc_scanout_pool_find(struct armsoc_device *dev,
+		uint32_t width, uint32_t height, uint8_t bpp)
+{
+	uint64_t size = (uint64_t)width * height * ((bpp + 7) / 8);
+	struct armsoc_bo *bo, *best = NULL;
+
+	xorg_list_for_each_entry(bo, &dev->scanout_pool, pool_link) {
+		if (bo->bpp != bpp || !width || !height ||
+				armsoc_bo_resize_size(bo, width, height) >
+					bo->original_size ||
+				size * 4 < bo->original_size)
+			continue;
+		if (!best || bo->original_size < best->original_size)
+			best = bo;
+	}
+
+	return best;
+}
+
+static struct armsoc_bo *armsoc_scanout_pool_get(struct armsoc_device *dev,
+		uint32_t width, uint32_t height, uint8_t depth, uint8_t bpp)
+{
+	struct armsoc_bo *bo = armsoc_scanout_pool_find(dev, width, height,
+			bpp);
+
+	if (!bo)
+		return NULL;
+
+	xorg_list_del(&bo->pool_link);
+	bo->refcnt = 1;
+
+	/* the fb is kept if it still describes the buffer */
+	if (bo->fb_id && (bo->width != width || bo->height != height ||
+			bo->depth != depth ||
+			bo->modifier != DRM_FORMAT_MOD_LINEAR) &&
+			armsoc_bo_rm_fb(bo))
+		bo->fb_id = 0;
+	if ((bo->width != width || bo->height != height) &&
+			armsoc_bo_resize(bo, width, height)) {
+		/* cannot happen, it was found to fit */
+		bo->refcnt = 0;
+		xorg_list_add(&bo->pool_link, &dev->scanout_pool);
+		return NULL;
+	}
+
+	bo->depth = depth;
+	bo->format = armsoc_drm_format(depth, bpp);
+	bo->modifier = DRM_FORMAT_MOD_LINEAR;
+	/* nothing of its last user is left for the next one to see */
+	armsoc_bo_clear(bo);
+	dev->stats.pooled++;
+	return bo;
+}
+
+int armsoc_device_reserve_scanout(struct armsoc_device *dev, int count,
+		uint32_t width, uint32_t height, uint8_t depth, uint8_t bpp)
+{
+	dev->pool_count = count;
+	dev->pool_width = width;
+	dev->pool_height = height;
+	dev->pool_depth = depth;
+	dev->pool_bpp = bpp;
+
+	while (dev->scanout_pool_size < count) {
+		struct armsoc_bo *bo = armsoc_bo_create(dev, width, height,
+				depth, bpp, ARMSOC_BO_SCANOUT);
+
+		if (!bo)
+			break;
+
+		/* only keep buffers the display is known to take */
+		if (armsoc_bo_add_fb(bo)) {
+			armsoc_bo_unreference(bo);
+			break;
+		}
+
+		bo->pooled = 1;
+		bo->refcnt = 0;
+		xorg_list_add(&bo->pool_link, &dev->scanout_pool);
+		dev->scanout_pool_size++;
+	}
+
+	return dev->scanout_pool_size;
+}
@@ -41,6 +41,25 @@ enum armsoc_buf_type {
 	ARMSOC_BO_NON_SCANOUT
 };
 
+/*
+ * Scanout memory use, for spotting when contiguous memory runs short.
+ * Published as an array of CARD32 laid out like this structure.
+ */
+struct armsoc_scanout_stats {
+	/* scanout bos allocated */
+	uint32_t allocs;
+	/* scanout allocations the kernel refused */
+	uint32_t failures;
+	/* allocations made non-scanout to stay within the budget */
+	uint32_t demoted;
+	/* memory held by scanout bos now, at most, and the budget, in KiB */
+	uint32_t held_kb;
+	uint32_t peak_kb;
+	uint32_t budget_kb;
+	/* scanout allocations served from the pool */
+	uint32_t pooled;
+};
+
 /*
  * Generic GEM object information used to abstract custom GEM creation
  * for every DRM driver.
@@ -60,6 +79,7 @@ struct armsoc_create_gem {
 
 void armsoc_bo_do_pending_deletions(void);
 void armsoc_bo_set_drawable(struct armsoc_bo *bo, DrawablePtr pDraw);
+void armsoc_bo_clear_drawable(struct armsoc_bo *bo);
 struct armsoc_bo *armsoc_bo_from_drawable(DrawablePtr pDraw);
 void armsoc_bo_set_backup(struct armsoc_bo *bo, int devkind, void *ptr);
 void armsoc_bo_get_backup(struct armsoc_bo *bo, int *devkind, void **ptr);
@@ -67,7 +87,27 @@ void armsoc_bo_get_backup(struct armsoc_bo *bo, int *devkind, void **ptr);
 struct armsoc_device *armsoc_device_new(int fd,
 	int (*create_custom_gem)(int fd, struct armsoc_create_gem *create_gem));
 void armsoc_device_del(struct armsoc_device *dev);
+/* Limit the memory of scanout bos that could be allocated as ordinary
+ * ones instead, in bytes. 0 for no limit. */
+void armsoc_device_set_scanout_budget(struct armsoc_device *dev,
+		uint64_t budget);
+void armsoc_device_get_scanout_stats(struct armsoc_device *dev,
+		struct armsoc_scanout_stats *stats);
+/* Reserve up to count scanout bos of the size, with fbs, in a pool that
+ * scanout allocations are served from first. Returns the number reserved
+ * so far, which can be less if memory runs out. */
+int armsoc_device_reserve_scanout(struct armsoc_device *dev, int count,
+		uint32_t width, uint32_t height, uint8_t depth, uint8_t bpp);
+/* Whether a scanout bo of the size fits in the pool or the budget */
+Bool armsoc_scanout_fits(struct armsoc_device *dev, uint32_t width,
+		uint32_t height, uint8_t bpp);
+/* The type to allocate a bo that would rather be scanout in: scanout
+ * while it fits in the budget, counted as demoted otherwise */
+enum armsoc_buf_type armsoc_scanout_buf_type(struct armsoc_device *dev,
+		uint32_t width, uint32_t height, uint8_t bpp);
 uint32_t armsoc_bo_name(struct armsoc_bo *bo);
+/* The name, for handing to a client: the bo is no longer private then */
+uint32_t armsoc_bo_export_name(struct armsoc_bo *bo);
 uint32_t armsoc_bo_handle(struct armsoc_bo *bo);
 void *armsoc_bo_map(struct armsoc_bo *bo);
 int armsoc_get_param(struct armsoc_device *dev, uint64_t param,
@@ -82,11 +122,30 @@ struct armsoc_bo *armsoc_bo_new_with_dim(struct armsoc_device *dev,
 			uint32_t width,
 			uint32_t height, uint8_t depth, uint8_t bpp,
 			enum armsoc_buf_type buf_type);
+/* Wrap a dma_buf imported from another process or device. */
+struct armsoc_bo *armsoc_bo_from_dmabuf(struct armsoc_device *dev, int fd,
+			uint32_t width, uint32_t height, uint8_t depth,
+			uint8_t bpp, uint32_t pitch);
+/* Wrap a GEM handle handed to us by the kernel, e.g. by drmModeGetFB().
+ * The bo owns the handle from then on. */
+struct armsoc_bo *armsoc_bo_from_handle(struct armsoc_device *dev,
+			uint32_t handle, uint32_t width, uint32_t height,
+			uint8_t depth, uint8_t bpp, uint32_t pitch);
+/* Returns a new dma_buf fd for the bo, which the caller must close. */
+int armsoc_bo_export_dmabuf(struct armsoc_bo *bo);
 uint32_t armsoc_bo_width(struct armsoc_bo *bo);
 uint32_t armsoc_bo_height(struct armsoc_bo *bo);
 uint8_t armsoc_bo_bpp(struct armsoc_bo *bo);
 uint8_t armsoc_bo_depth(struct armsoc_bo *bo);
 uint32_t armsoc_bo_pitch(struct armsoc_bo *bo);
+enum armsoc_buf_type armsoc_bo_buf_type(struct armsoc_bo *bo);
+/* DRM fourcc of the bo's pixels, 0 if there is none for its depth/bpp */
+uint32_t armsoc_bo_format(struct armsoc_bo *bo);
+/* Layout of the bo, DRM_FORMAT_MOD_LINEAR unless set otherwise. Only
+ * linear bos can be accessed by the CPU. */
+uint64_t armsoc_bo_modifier(struct armsoc_bo *bo);
+int armsoc_bo_set_modifier(struct armsoc_bo *bo, uint64_t modifier);
+uint32_t armsoc_drm_format(uint8_t depth, uint8_t bpp);
 
 void armsoc_bo_reference(struct armsoc_bo *bo);
 void armsoc_bo_unreference(struct armsoc_bo *bo);
@@ -99,7 +158,17 @@ int armsoc_bo_set_dmabuf(struct armsoc_bo *bo);
 void armsoc_bo_clear_dmabuf(struct armsoc_bo *bo);
 int armsoc_bo_has_dmabuf(struct armsoc_bo *bo);
 int armsoc_bo_clear(struct armsoc_bo *bo);
+int armsoc_bo_clear_area(struct armsoc_bo *bo, uint32_t x, uint32_t y,
+		uint32_t width, uint32_t height);
 int armsoc_bo_rm_fb(struct armsoc_bo *bo);
+/* Forget the bo's fb without removing it, e.g. while it is still being
+ * scanned out. The caller removes it with drmModeRmFB() later. */
+uint32_t armsoc_bo_detach_fb(struct armsoc_bo *bo);
+/* Resizing keeps the pitch the bo was allocated with if the new width
+ * fits in it, so pixels stay where they were. */
+uint32_t armsoc_bo_resize_pitch(struct armsoc_bo *bo, uint32_t new_width);
+int armsoc_bo_resize_fits(struct armsoc_bo *bo, uint32_t new_width,
+						uint32_t new_height);
 int armsoc_bo_resize(struct armsoc_bo *bo, uint32_t new_width,
 						uint32_t new_height);
 
@@ -87,8 +87,10 @@ ARMSOCCreatePixmap2(ScreenPtr pScreen, int width, int height,
 	if (!priv)
 		return NULL;
 
+	/* scanout is only a preference here, which the budget may refuse */
 	if (usage_hint & ARMSOC_CREATE_PIXMAP_SCANOUT)
-		buf_type = ARMSOC_BO_SCANOUT;
+		buf_type = armsoc_scanout_buf_type(pARMSOC->dev,
+				width, height, bitsPerPixel);
 
 	if (width > 0 && height > 0 && depth > 0 && bitsPerPixel > 0) {
 		priv->bo = armsoc_bo_new_with_dim(pARMSOC->dev,
@@ -213,6 +215,11 @@ ARMSOCModifyPixmapHeader(PixmapPtr pPixmap, int width, int height,
 	    armsoc_bo_bpp(priv->bo) != pPixmap->drawable.bitsPerPixel) {
 		/* re-allocate buffer! */
 		armsoc_bo_unreference(priv->bo);
+		if (buf_type == ARMSOC_BO_SCANOUT)
+			buf_type = armsoc_scanout_buf_type(pARMSOC->dev,
+					pPixmap->drawable.width,
+					pPixmap->drawable.height,
+					pPixmap->drawable.bitsPerPixel);
 		priv->bo = armsoc_bo_new_with_dim(pARMSOC->dev,
 				pPixmap->drawable.width,
 				pPixmap->drawable.height,
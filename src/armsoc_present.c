@@ -0,0 +1,360 @@
+/* -*- mode: C; c-file-style: "k&r"; tab-width 4; indent-tabs-mode: t; -*- */
+
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_DRI3
+
+#include <string.h>
+
+#include "armsoc_driver.h"
+#include "armsoc_dumb.h"
+#include "drmmode_driver.h"
+
+#include "present.h"
+#include "windowstr.h"
+
+/*
+ * Present backend. Flips go through drmmode_page_flip() like DRI2 flips
+ * do, and MSC based waits are queued as vblank events where the kernel
+ * driver supports them. Without vblank support frames are counted and
+ * waited for with the CRTC's frame clock instead.
+ */
+
+struct ARMSOCPresentVblank {
+	struct ARMSOCFlipEvent base;
+	struct xorg_list link;
+	uint64_t event_id;
+	Bool aborted;
+};
+
+struct ARMSOCPresentFlip {
+	struct ARMSOCFlipEvent base;
+	ScrnInfoPtr pScrn;
+	uint64_t event_id;
+	struct armsoc_bo *bo;
+	/* flip events still to come */
+	int pending;
+	/* used to complete flips that generate no events */
+	OsTimerPtr timer;
+};
+
+/* vblank events queued but not yet delivered */
+static struct xorg_list vblank_queue;
+
+static RRCrtcPtr
+ARMSOCPresentGetCrtc(WindowPtr pWin)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pWin->drawable.pScreen);
+	xf86CrtcPtr crtc;
+	BoxRec box;
+
+	box.x1 = pWin->drawable.x;
+	box.y1 = pWin->drawable.y;
+	box.x2 = box.x1 + pWin->drawable.width;
+	box.y2 = box.y1 + pWin->drawable.height;
+
+	crtc = drmmode_crtc_covering_box(pScrn, &box);
+	return crtc ? crtc->randr_crtc : NULL;
+}
+
+static int
+ARMSOCPresentGetUstMsc(RRCrtcPtr crtc, CARD64 *ust, CARD64 *msc)
+{
+	xf86CrtcPtr xf86_crtc = crtc->devPrivate;
+	ScrnInfoPtr pScrn = xf86_crtc->scrn;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	drmVBlank vbl;
+
+	if (!pARMSOC->drmmode_interface->vblank_query_supported) {
+		drmmode_crtc_get_ust_msc(xf86_crtc, ust, msc);
+		return Success;
+	}
+
+	vbl.request.type = DRM_VBLANK_RELATIVE |
+			drmmode_crtc_vblank_pipe(xf86_crtc);
+	vbl.request.sequence = 0;
+	if (drmWaitVBlank(pARMSOC->drmFD, &vbl))
+		return BadMatch;
+
+	*ust = ((CARD64)vbl.reply.tval_sec * 1000000) + vbl.reply.tval_usec;
+	*msc = vbl.reply.sequence;
+	return Success;
+}
+
+static void
+ARMSOCPresentVblankHandler(struct ARMSOCFlipEvent *event, unsigned int frame,
+		unsigned int tv_sec, unsigned int tv_usec)
+{
+	struct ARMSOCPresentVblank *vblank =
+			(struct ARMSOCPresentVblank *)event;
+
+	xorg_list_del(&vblank->link);
+	if (!vblank->aborted)
+		present_event_notify(vblank->event_id,
+				((uint64_t)tv_sec * 1000000) + tv_usec, frame);
+	free(vblank);
+}
+
+static int
+ARMSOCPresentQueueVblank(RRCrtcPtr crtc, uint64_t event_id, uint64_t msc)
+{
+	xf86CrtcPtr xf86_crtc = crtc->devPrivate;
+	ScrnInfoPtr pScrn = xf86_crtc->scrn;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct ARMSOCPresentVblank *vblank;
+	drmVBlank vbl;
+
+	vblank = calloc(1, sizeof(*vblank));
+	if (!vblank)
+		return BadAlloc;
+
+	vblank->base.handler = ARMSOCPresentVblankHandler;
+	vblank->event_id = event_id;
+
+	if (!pARMSOC->drmmode_interface->vblank_query_supported) {
+		if (!drmmode_crtc_queue_msc(xf86_crtc, msc, &vblank->base)) {
+			free(vblank);
+			return BadAlloc;
+		}
+		xorg_list_add(&vblank->link, &vblank_queue);
+		return Success;
+	}
+
+	vbl.request.type = DRM_VBLANK_ABSOLUTE | DRM_VBLANK_EVENT |
+			drmmode_crtc_vblank_pipe(xf86_crtc);
+	vbl.request.sequence = msc;
+	vbl.request.signal = (unsigned long)vblank;
+	if (drmWaitVBlank(pARMSOC->drmFD, &vbl)) {
+		DEBUG_MSG("drmWaitVBlank failed: %s", strerror(errno));
+		free(vblank);
+		return BadAlloc;
+	}
+
+	xorg_list_add(&vblank->link, &vblank_queue);
+	return Success;
+}
+
+static void
+ARMSOCPresentAbortVblank(RRCrtcPtr crtc, uint64_t event_id, uint64_t msc)
+{
+	struct ARMSOCPresentVblank *vblank;
+
+	/* The kernel can't take the event back, so just ignore it when
+	 * it arrives */
+	xorg_list_for_each_entry(vblank, &vblank_queue, link) {
+		if (vblank->event_id == event_id) {
+			vblank->aborted = TRUE;
+			break;
+		}
+	}
+}
+
+static void
+ARMSOCPresentFlush(WindowPtr pWin)
+{
+	/* Rendering is done by the CPU, there is nothing to flush */
+}
+
+static void
+ARMSOCPresentFlipComplete(struct ARMSOCPresentFlip *flip, uint64_t ust,
+		uint64_t msc)
+{
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(flip->pScrn);
+
+	set_scanout_bo(flip->pScrn, flip->bo);
+	pARMSOC->pending_flips--;
+	present_event_notify(flip->event_id, ust, msc);
+	armsoc_bo_unreference(flip->bo);
+	free(flip);
+}
+
+static void
+ARMSOCPresentFlipHandler(struct ARMSOCFlipEvent *event, unsigned int frame,
+		unsigned int tv_sec, unsigned int tv_usec)
+{
+	struct ARMSOCPresentFlip *flip = (struct ARMSOCPresentFlip *)event;
+
+	if (--flip->pending > 0)
+		return;
+
+	ARMSOCPresentFlipComplete(flip,
+			((uint64_t)tv_sec * 1000000) + tv_usec, frame);
+}
+
+static CARD32
+ARMSOCPresentFlipTimer(OsTimerPtr timer, CARD32 now, pointer arg)
+{
+	struct ARMSOCPresentFlip *flip = arg;
+
+	TimerFree(flip->timer);
+	ARMSOCPresentFlipComplete(flip, GetTimeInMicros(), 0);
+	return 0;
+}
+
+/*
+ * Flip the whole screen to the given bo. Present must not be told about
+ * completion before the flip request returns, so flips that produce no
+ * events are completed from a timer instead.
+ */
+static Bool
+ARMSOCPresentDoFlip(ScreenPtr pScreen, uint64_t event_id,
+		struct armsoc_bo *bo, Bool async)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct ARMSOCPresentFlip *flip;
+	int ret;
+
+	flip = calloc(1, sizeof(*flip));
+	if (!flip)
+		return FALSE;
+
+	flip->base.handler = ARMSOCPresentFlipHandler;
+	flip->pScrn = pScrn;
+	flip->event_id = event_id;
+	flip->bo = bo;
+	armsoc_bo_reference(bo);
+
+	ret = drmmode_page_flip(&pScreen->root->drawable, bo, &flip->base,
+			async);
+	if (ret < 0)
+		ret = -(ret + 1);
+	if (ret == 0 && pARMSOC->drmmode_interface->use_page_flip_events) {
+		armsoc_bo_unreference(bo);
+		free(flip);
+		return FALSE;
+	}
+
+	pARMSOC->pending_flips++;
+	if (pARMSOC->drmmode_interface->use_page_flip_events) {
+		flip->pending = ret;
+	} else {
+		flip->timer = TimerSet(NULL, 0, 1, ARMSOCPresentFlipTimer,
+				flip);
+		if (!flip->timer)
+			ARMSOCPresentFlipComplete(flip, GetTimeInMicros(), 0);
+	}
+
+	return TRUE;
+}
+
+static Bool
+ARMSOCPresentCheckFlip(RRCrtcPtr crtc, WindowPtr pWin, PixmapPtr pPixmap,
+		Bool sync_flip)
+{
+	ScreenPtr pScreen = pWin->drawable.pScreen;
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct armsoc_bo *bo;
+
+	if (pARMSOC->NoFlip || !pScrn->vtSema || drmmode_crtc_shadowed(pScrn))
+		return FALSE;
+
+	if (pPixmap->drawable.width != pScrn->virtualX ||
+			pPixmap->drawable.height != pScrn->virtualY ||
+			pPixmap->drawable.bitsPerPixel != pScrn->bitsPerPixel ||
+			pPixmap->drawable.depth != pScrn->depth)
+		return FALSE;
+
+	bo = armsoc_bo_from_drawable(&pPixmap->drawable);
+	if (!bo)
+		return FALSE;
+
+	if (!armsoc_bo_get_fb(bo) && armsoc_bo_add_fb(bo)) {
+		DEBUG_MSG("pixmap %p can't be scanned out", pPixmap);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static Bool
+ARMSOCPresentFlip(RRCrtcPtr crtc, uint64_t event_id, uint64_t target_msc,
+		PixmapPtr pPixmap, Bool sync_flip)
+{
+	ScreenPtr pScreen = pPixmap->drawable.pScreen;
+	struct armsoc_bo *bo = armsoc_bo_from_drawable(&pPixmap->drawable);
+
+	if (!bo)
+		return FALSE;
+
+	return ARMSOCPresentDoFlip(pScreen, event_id, bo, !sync_flip);
+}
+
+static void
+ARMSOCPresentUnflip(ScreenPtr pScreen, uint64_t event_id)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+
+	if (pScrn->vtSema &&
+			ARMSOCPresentDoFlip(pScreen, event_id, pARMSOC->fb_bo,
+					FALSE))
+		return;
+
+	/* Put the screen pixmap back with a modeset instead */
+	set_scanout_bo(pScrn, pARMSOC->fb_bo);
+	if (pScrn->vtSema)
+		xf86SetDesiredModes(pScrn);
+	present_event_notify(event_id, GetTimeInMicros(), 0);
+}
+
+static present_screen_info_rec armsoc_present_screen_info = {
+	.version = PRESENT_SCREEN_INFO_VERSION,
+
+	.get_crtc = ARMSOCPresentGetCrtc,
+	.get_ust_msc = ARMSOCPresentGetUstMsc,
+	.queue_vblank = ARMSOCPresentQueueVblank,
+	.abort_vblank = ARMSOCPresentAbortVblank,
+	.flush = ARMSOCPresentFlush,
+
+	.capabilities = PresentCapabilityNone,
+	.check_flip = ARMSOCPresentCheckFlip,
+	.flip = ARMSOCPresentFlip,
+	.unflip = ARMSOCPresentUnflip,
+};
+
+Bool
+ARMSOCPresentScreenInit(ScreenPtr pScreen)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+
+	xorg_list_init(&vblank_queue);
+
+	if (drmmode_async_flip_supported(pScrn))
+		armsoc_present_screen_info.capabilities |=
+				PresentCapabilityAsync;
+
+	if (!present_screen_init(pScreen, &armsoc_present_screen_info)) {
+		WARNING_MSG("present_screen_init failed");
+		return FALSE;
+	}
+
+	INFO_MSG("Present enabled");
+	return TRUE;
+}
+
+#endif /* HAVE_DRI3 */
@@ -34,6 +34,8 @@
 
 #include "xf86DDC.h"
 #include "xf86RandR12.h"
+#include "windowstr.h"
+#include "gcstruct.h"
 
 #ifdef HAVE_XEXTPROTO_71
 #include <X11/extensions/dpmsconst.h>
@@ -51,17 +53,190 @@
 #include <libudev.h>
 #include "drmmode_driver.h"
 
-struct drmmode_cursor_rec {
-	/* hardware cursor: */
+#ifndef DRM_PLANE_TYPE_OVERLAY
+#define DRM_PLANE_TYPE_OVERLAY 0
+#define DRM_PLANE_TYPE_PRIMARY 1
+#define DRM_PLANE_TYPE_CURSOR 2
+#endif
+
+/* Number of cursor images kept loaded in buffers of their own */
+#define ARMSOC_CURSOR_IMAGES 4
+
+struct drmmode_cursor_image {
 	struct armsoc_bo *bo;
-	int x, y;
-	 /* These are used for HWCURSOR_API_PLANE */
-	drmModePlane *ovr;
+	/* This is used for HWCURSOR_API_PLANE */
 	uint32_t fb_id;
 	/* This is used for HWCURSOR_API_STANDARD */
 	uint32_t handle;
+	/* hash of the ARGB image in the buffer, if loaded */
+	Bool loaded;
+	uint32_t hash;
+	/* for picking the least recently used image to replace */
+	unsigned long last_used;
+};
+
+struct drmmode_cursor_rec {
+	/* hardware cursor: */
+	struct drmmode_cursor_image images[ARMSOC_CURSOR_IMAGES];
+	int num_images;
+	/* the image being shown, never written to */
+	struct drmmode_cursor_image *current;
+	unsigned long use_count;
+	/* trailing update of positions latched within a frame */
+	OsTimerPtr timer;
+	/* position updates sent to the kernel, and those superseded before
+	 * they were sent */
+	unsigned long updates;
+	unsigned long coalesced;
+	 /* These are used for HWCURSOR_API_PLANE. ovr is set when there are
+	  * not enough planes for one per CRTC and all of them share it, then
+	  * owner is the CRTC it was last shown on.
+	  */
+	drmModePlane *ovr;
+	xf86CrtcPtr owner;
+};
+
+/* Property of a KMS object, looked up by name */
+struct drmmode_prop_info {
+	const char *name;
+	/* the lookup succeeds without it */
+	Bool optional;
+	uint32_t prop_id;
+	/* value at the time of the lookup */
+	uint64_t value;
+};
+
+/* Properties the driver uses, as indices into the tables below. Those
+ * for atomic commits have to be there when atomic modesetting is used, the
+ * others are optional.
+ */
+enum drmmode_crtc_prop {
+	DRMMODE_CRTC_ACTIVE,
+	DRMMODE_CRTC_MODE_ID,
+	DRMMODE_CRTC_UNDERSCAN,
+	DRMMODE_CRTC_UNDERSCAN_HBORDER,
+	DRMMODE_CRTC_UNDERSCAN_VBORDER,
+	DRMMODE_CRTC_GAMMA_LUT,
+	DRMMODE_CRTC_GAMMA_LUT_SIZE,
+	DRMMODE_CRTC_DEGAMMA_LUT,
+	DRMMODE_CRTC_CTM,
+	DRMMODE_CRTC_VRR_ENABLED,
+	DRMMODE_CRTC__COUNT
+};
+
+enum drmmode_connector_prop {
+	DRMMODE_CONNECTOR_CRTC_ID,
+	DRMMODE_CONNECTOR__COUNT
+};
+
+enum drmmode_plane_prop {
+	DRMMODE_PLANE_TYPE,
+	DRMMODE_PLANE_FB_ID,
+	DRMMODE_PLANE_CRTC_ID,
+	DRMMODE_PLANE_SRC_X,
+	DRMMODE_PLANE_SRC_Y,
+	DRMMODE_PLANE_SRC_W,
+	DRMMODE_PLANE_SRC_H,
+	DRMMODE_PLANE_CRTC_X,
+	DRMMODE_PLANE_CRTC_Y,
+	DRMMODE_PLANE_CRTC_W,
+	DRMMODE_PLANE_CRTC_H,
+	DRMMODE_PLANE_ROTATION,
+	DRMMODE_PLANE_ZPOS,
+	DRMMODE_PLANE_IN_FORMATS,
+	DRMMODE_PLANE__COUNT
+};
+
+static const struct drmmode_prop_info crtc_props[DRMMODE_CRTC__COUNT] = {
+	[DRMMODE_CRTC_ACTIVE] = { .name = "ACTIVE" },
+	[DRMMODE_CRTC_MODE_ID] = { .name = "MODE_ID" },
+	[DRMMODE_CRTC_UNDERSCAN] = { .name = "underscan", .optional = TRUE },
+	[DRMMODE_CRTC_UNDERSCAN_HBORDER] = {
+		.name = "underscan hborder", .optional = TRUE },
+	[DRMMODE_CRTC_UNDERSCAN_VBORDER] = {
+		.name = "underscan vborder", .optional = TRUE },
+	[DRMMODE_CRTC_GAMMA_LUT] = { .name = "GAMMA_LUT", .optional = TRUE },
+	[DRMMODE_CRTC_GAMMA_LUT_SIZE] = {
+		.name = "GAMMA_LUT_SIZE", .optional = TRUE },
+	[DRMMODE_CRTC_DEGAMMA_LUT] = {
+		.name = "DEGAMMA_LUT", .optional = TRUE },
+	[DRMMODE_CRTC_CTM] = { .name = "CTM", .optional = TRUE },
+	[DRMMODE_CRTC_VRR_ENABLED] = {
+		.name = "VRR_ENABLED", .optional = TRUE },
+};
+
+static const struct drmmode_prop_info
+connector_props[DRMMODE_CONNECTOR__COUNT] = {
+	[DRMMODE_CONNECTOR_CRTC_ID] = { .name = "CRTC_ID" },
+};
+
+static const struct drmmode_prop_info plane_props[DRMMODE_PLANE__COUNT] = {
+	[DRMMODE_PLANE_TYPE] = { .name = "type" },
+	[DRMMODE_PLANE_FB_ID] = { .name = "FB_ID" },
+	[DRMMODE_PLANE_CRTC_ID] = { .name = "CRTC_ID" },
+	[DRMMODE_PLANE_SRC_X] = { .name = "SRC_X" },
+	[DRMMODE_PLANE_SRC_Y] = { .name = "SRC_Y" },
+	[DRMMODE_PLANE_SRC_W] = { .name = "SRC_W" },
+	[DRMMODE_PLANE_SRC_H] = { .name = "SRC_H" },
+	[DRMMODE_PLANE_CRTC_X] = { .name = "CRTC_X" },
+	[DRMMODE_PLANE_CRTC_Y] = { .name = "CRTC_Y" },
+	[DRMMODE_PLANE_CRTC_W] = { .name = "CRTC_W" },
+	[DRMMODE_PLANE_CRTC_H] = { .name = "CRTC_H" },
+	[DRMMODE_PLANE_ROTATION] = { .name = "rotation", .optional = TRUE },
+	[DRMMODE_PLANE_ZPOS] = { .name = "zpos", .optional = TRUE },
+	[DRMMODE_PLANE_IN_FORMATS] = { .name = "IN_FORMATS", .optional = TRUE },
+};
+
+/* A format and layout a plane can scan out */
+struct drmmode_format_modifier {
+	uint32_t format;
+	uint64_t modifier;
+};
+
+/* Opaque formats windows are shown on overlay planes in */
+static const uint32_t drmmode_overlay_formats[] = {
+	DRM_FORMAT_XRGB8888,
+	DRM_FORMAT_RGB565,
+	DRM_FORMAT_XRGB2101010,
+};
+
+/* Overlay plane that DRI2 windows can be shown on */
+struct drmmode_overlay {
+	uint32_t plane_id;
+	/* mask of CRTC indices the plane can be used with */
+	uint32_t possible_crtcs;
+	/* mask of the drmmode_overlay_formats the plane can scan out */
+	uint32_t formats;
+	/* the window currently shown on the plane, the buffer it is shown
+	 * from and where, in screen coordinates. bo is NULL while unused.
+	 */
+	struct armsoc_bo *bo;
+	XID draw_id;
+	xf86CrtcPtr crtc;
+	BoxRec box;
+	/* used with atomic modesetting only */
+	struct drmmode_prop_info props[DRMMODE_PLANE__COUNT];
+};
+
+/* Per-window overlay state, kept in the window's devPrivates */
+struct drmmode_overlay_window {
+	/* an overlay plane refused the window at box, in screen
+	 * coordinates: it is not promoted again until it moves or resizes */
+	Bool rejected;
+	BoxRec box;
+	/* the refusal was logged already */
+	Bool warned;
 };
 
+static DevPrivateKeyRec drmmode_overlay_window_key;
+
+static struct drmmode_overlay_window *
+drmmode_overlay_window(DrawablePtr pDraw)
+{
+	return dixLookupPrivate(&((WindowPtr)pDraw)->devPrivates,
+			&drmmode_overlay_window_key);
+}
+
 struct drmmode_rec {
 	int fd;
 	drmModeResPtr mode_res;
@@ -69,19 +244,110 @@ struct drmmode_rec {
 	struct udev_monitor *uevent_monitor;
 	InputHandlerProc uevent_handler;
 	struct drmmode_cursor_rec *cursor;
+	/* kernel accepts DRM_MODE_PAGE_FLIP_ASYNC */
+	Bool async_flip;
+	/* modesets and flips go through atomic commits */
+	Bool atomic;
+	struct drmmode_overlay *overlays;
+	int num_overlays;
+	/* bumped whenever connector or CRTC properties may have changed */
+	unsigned int props_epoch;
+	/* set while RandR is told about a hotplug whose connector was
+	 * probed already, so that detect need not probe any connector */
+	Bool hotplug_probed;
+	uint32_t edid_prop_id;
+	uint32_t vrr_capable_prop_id;
+	/* fb of the scanout from before it was resized in place, removed
+	 * once no CRTC shows it any more */
+	uint32_t retired_fb_id;
+	/* drmmode_crtc_queue_msc() requests not completed yet */
+	struct xorg_list msc_waits;
 };
 
 struct drmmode_crtc_private_rec {
 	struct drmmode_rec *drmmode;
 	uint32_t crtc_id;
 	int cursor_visible;
+	/* cursor position relative to the CRTC, whether it changed since it
+	 * was last sent to the kernel and when that was, in us */
+	int cursor_x, cursor_y;
+	Bool cursor_pending;
+	CARD64 cursor_updated;
+	/* plane the cursor is shown with, for HWCURSOR_API_PLANE */
+	drmModePlane *cursor_ovr;
 	/* settings retained on last good modeset */
 	int last_good_x;
 	int last_good_y;
 	int underscan_x;
 	int underscan_y;
+	/* value of the "crop" entry of the underscan property, if any */
+	Bool has_underscan_crop;
+	uint64_t underscan_crop;
 	Rotation last_good_rotation;
 	DisplayModePtr last_good_mode;
+	/* When a drawable covering just this CRTC is being flipped, the
+	 * CRTC scans out that drawable's buffer from its origin instead of
+	 * the root framebuffer at (x, y). NULL while on the root framebuffer.
+	 */
+	struct armsoc_bo *scanout_bo;
+	XID scanout_draw_id;
+	/* index in the kernel's list of CRTCs */
+	int index;
+	/* looked up once, values kept up to date as we change them */
+	struct drmmode_prop_info props[DRMMODE_CRTC__COUNT];
+	/* used with atomic modesetting only */
+	uint32_t primary_plane_id;
+	struct drmmode_prop_info primary_props[DRMMODE_PLANE__COUNT];
+	uint32_t mode_blob_id;
+	/* rotations the primary plane can do, and whether it is doing the
+	 * CRTC's rotation rather than a shadow */
+	Rotation hw_rotations;
+	uint64_t hw_rotation_values[6];
+	Bool hw_rotate;
+	/* what the primary plane can scan out, from its IN_FORMATS */
+	struct drmmode_format_modifier *in_formats;
+	int num_in_formats;
+	/* the shadow xf86CrtcRotate() renders a rotated CRTC to when the
+	 * hardware cannot rotate it */
+	struct armsoc_bo *shadow_bo;
+	/* colour correction: the gamma ramp and colour transformation
+	 * matrix last asked for, sent to the kernel with the next flip or
+	 * flush if color_pending, and the blobs holding what the kernel has
+	 * now. What the kernel refused is color_failed, and only tried
+	 * again once it changes or the CRTC is set. */
+	int legacy_gamma_size;
+	CARD16 *gamma;
+	int gamma_size;
+	Bool has_ctm;
+	uint64_t ctm[9];
+	Bool color_pending;
+	Bool color_failed;
+	uint32_t gamma_blob_id;
+	uint32_t ctm_blob_id;
+	/* blobs of the atomic colour commit being built, if color_staged */
+	Bool color_staged;
+	uint32_t new_gamma_blob_id;
+	uint32_t new_ctm_blob_id;
+	/* what the kernel was showing when we started, for SeamlessBoot.
+	 * Only valid until the first modeset. */
+	Bool boot_mode_valid;
+	drmModeModeInfo boot_mode;
+	uint32_t boot_fb_id;
+	int boot_x, boot_y;
+	/* frame clock, for kernels without vblank queries and to align
+	 * cursor updates to: the time in us and count of a vblank, the last
+	 * one or one that flipped */
+	xf86CrtcPtr crtc;
+	struct xorg_list clock_link;
+	uint64_t clock_ust;
+	uint64_t clock_msc;
+	/* when the clock was last put onto the kernel's vblank timestamps */
+	uint64_t clock_checked;
+	/* window variable refresh was turned on for, 0 if none */
+	XID vrr_draw_id;
+	/* the kernel refused to turn it on, not asked again until the
+	 * monitor or mode changes */
+	Bool vrr_failed;
 };
 
 struct drmmode_prop_rec {
@@ -103,48 +369,73 @@ struct drmmode_output_priv {
 	drmModeConnectorPtr connector;
 	drmModeEncoderPtr *encoders;
 	drmModePropertyBlobPtr edid_blob;
+	uint32_t edid_hash;
 	int num_props;
 	struct drmmode_prop_rec *props;
 	int enc_mask;   /* encoders present (mask of encoder indices) */
 	int enc_clones; /* encoder clones possible (mask of encoder indices) */
+	/* used with atomic modesetting only */
+	struct drmmode_prop_info atomic_props[DRMMODE_CONNECTOR__COUNT];
+	/* properties of the CRTC the connector is routed to, and the
+	 * props_epoch they and the connector were last read at */
+	drmModeObjectPropertiesPtr crtc_props;
+	unsigned int props_epoch;
+	/* the "CTM" output property, applied to the output's CRTC */
+	Atom ctm_atom;
+	Bool has_ctm;
+	uint64_t ctm[9];
+	/* the monitor can refresh at a variable rate, read with the modes */
+	Bool vrr_capable;
 };
 
 static void drmmode_output_dpms(xf86OutputPtr output, int mode);
+#ifdef HAVE_STRUCT_DRM_COLOR_LUT
+static void drmmode_crtc_update_ctm(xf86CrtcPtr crtc);
+static void drmmode_output_create_ctm(xf86OutputPtr output);
+#endif
 static Bool resize_scanout_bo(ScrnInfoPtr pScrn, int width, int height);
+static void drmmode_crtc_clock_advance(xf86CrtcPtr crtc, uint64_t now);
+static uint64_t drmmode_crtc_last_vblank(xf86CrtcPtr crtc, uint64_t now);
 
-static void drmmode_get_underscan(int fd, uint32_t crtc_id, int *outx, int *outy)
-{
-	int crop = 0, i;
-	int x = 0, y = 0;
+/* all CRTCs, to find the one a page flip event is for */
+static struct xorg_list drmmode_clocks = { &drmmode_clocks, &drmmode_clocks };
 
-	drmModePropertyPtr prop;
-	drmModeObjectPropertiesPtr crtcprops;
-	crtcprops = drmModeObjectGetProperties(fd, crtc_id,
-	                                       DRM_MODE_OBJECT_CRTC);
+/*
+ * FNV-1a over 32 bit words, to tell cursor images or EDIDs seen before.
+ */
+static uint32_t
+drmmode_hash(const void *data, int count)
+{
+	const uint32_t *words = data;
+	uint32_t hash = 2166136261u;
+	int i;
 
-	for (i = 0; i < crtcprops->count_props; i++) {
-		prop = drmModeGetProperty(fd, crtcprops->props[i]);
-		if (!strcmp(prop->name, "underscan")) {
-			int e;
-			for (e = 0; e < prop->count_enums; e++) {
-				if (prop->enums[e].value == crtcprops->prop_values[i] &&
-				    !strcmp(prop->enums[e].name, "crop"))
-					crop = 1;
-			}
-		}
-		if (!strcmp(prop->name, "underscan vborder"))
-			y = crtcprops->prop_values[i];
-		if (!strcmp(prop->name, "underscan hborder"))
-			x = crtcprops->prop_values[i];
-		drmModeFreeProperty(prop);
+	for (i = 0; i < count; i++) {
+		hash ^= words[i];
+		hash *= 16777619u;
 	}
 
-	if (!crop) {
+	return hash;
+}
+
+/*
+ * Get the border the CRTC crops off the mode, from the cached values of its
+ * underscan properties.
+ */
+static void
+drmmode_get_underscan(struct drmmode_crtc_private_rec *drmmode_crtc,
+		int *outx, int *outy)
+{
+	struct drmmode_prop_info *props = drmmode_crtc->props;
+
+	if (drmmode_crtc->has_underscan_crop &&
+			props[DRMMODE_CRTC_UNDERSCAN].value ==
+				drmmode_crtc->underscan_crop) {
+		*outx = props[DRMMODE_CRTC_UNDERSCAN_HBORDER].value;
+		*outy = props[DRMMODE_CRTC_UNDERSCAN_VBORDER].value;
+	} else {
 		*outx = 0;
 		*outy = 0;
-	} else {
-		*outx = x;
-		*outy = y;
 	}
 }
 
@@ -232,1584 +523,4900 @@ drmmode_crtc_dpms(xf86CrtcPtr drmmode_crtc, int mode)
 	/* TODO: MIDEGL-1431: Implement this function */
 }
 
-/* Revert mode is odd with underscan properties present.
- * We must use the current properties instead of the one
- * saved with the mode.  We also need to change the mode
- * so it saves the current property values, so it's not
- * quite a real revert.
- *
- * this is all rather  untested because I don't know how to
- * cause a revert to occur on demand.
- * if this proves problematic, the next best solution might
- * be to set the properties based on the underscan values
- * encoded in the mode, but this could confusing to the UI.
+static void
+drmmode_crtc_set_scanout_bo(struct drmmode_crtc_private_rec *drmmode_crtc,
+		struct armsoc_bo *bo, XID draw_id)
+{
+	struct armsoc_bo *old_bo = drmmode_crtc->scanout_bo;
+
+	if (bo)
+		armsoc_bo_reference(bo);
+	drmmode_crtc->scanout_bo = bo;
+	drmmode_crtc->scanout_draw_id = bo ? draw_id : 0;
+	if (old_bo)
+		armsoc_bo_unreference(old_bo);
+}
+
+/*
+ * Look up the IDs and current values of an object's properties by name.
+ * Returns FALSE if a property that is not optional is missing.
  */
-static int
-drmmode_revert_mode(xf86CrtcPtr crtc, uint32_t *output_ids, int output_count)
+static Bool
+drmmode_prop_info_init(int fd, uint32_t obj_id, uint32_t obj_type,
+		struct drmmode_prop_info *info,
+		const struct drmmode_prop_info *template, int count)
 {
-	ScrnInfoPtr pScrn = crtc->scrn;
-	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
-	uint32_t fb_id;
-	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
-	drmModeModeInfo kmode;
-	int xu, yu;
+	drmModeObjectPropertiesPtr props;
+	int i, j;
 
-	drmmode_get_underscan(drmmode_crtc->drmmode->fd,
-	                      drmmode_crtc->crtc_id, &xu, &yu);
+	memcpy(info, template, count * sizeof(*info));
 
-	if (!drmmode_crtc->last_good_mode) {
-		DEBUG_MSG("No last good values to use");
+	props = drmModeObjectGetProperties(fd, obj_id, obj_type);
+	if (!props)
 		return FALSE;
-	}
 
-	/* revert to last good settings */
-	DEBUG_MSG("Reverting to last_good values");
-	if (!resize_scanout_bo(pScrn,
-			drmmode_crtc->last_good_mode->HDisplay,
-			drmmode_crtc->last_good_mode->VDisplay)) {
-		ERROR_MSG("Could not revert to last good mode");
-		return FALSE;
-	}
+	for (i = 0; i < props->count_props; i++) {
+		drmModePropertyPtr prop = drmModeGetProperty(fd,
+				props->props[i]);
 
-	fb_id = armsoc_bo_get_fb(pARMSOC->scanout);
-	drmmode_ConvertToKMode(crtc->scrn, &kmode,
-			drmmode_crtc->last_good_mode);
-	drmModeSetCrtc(drmmode_crtc->drmmode->fd,
-			drmmode_crtc->crtc_id,
-			fb_id,
-			drmmode_crtc->last_good_x,
-			drmmode_crtc->last_good_y,
-			output_ids, output_count, &kmode);
-	drmmode_crtc->underscan_x = xu;
-	drmmode_crtc->underscan_y = yu;
+		if (!prop)
+			continue;
 
-	/* update the underscan params so the mouse doesn't
-	 * get confused. */
-	drmmode_crtc->last_good_mode->HSkew = (xu << 8) + yu;
-	/* let RandR know we changed things */
-	xf86RandR12TellChanged(pScrn->pScreen);
+		for (j = 0; j < count; j++) {
+			if (!strcmp(prop->name, info[j].name)) {
+				info[j].prop_id = prop->prop_id;
+				info[j].value = props->prop_values[i];
+			}
+		}
+		drmModeFreeProperty(prop);
+	}
+	drmModeFreeObjectProperties(props);
+
+	for (j = 0; j < count; j++)
+		if (!info[j].prop_id && !info[j].optional)
+			return FALSE;
 
 	return TRUE;
 }
 
+/*
+ * Look up the value of the entry of an enum property with the given name.
+ */
 static Bool
-drmmode_set_mode_major(xf86CrtcPtr crtc, DisplayModePtr mode,
-		Rotation rotation, int x, int y)
+drmmode_prop_enum_value(int fd, uint32_t prop_id, const char *name,
+		uint64_t *value)
 {
-	ScrnInfoPtr pScrn = crtc->scrn;
-	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
-	xf86CrtcConfigPtr   xf86_config = XF86_CRTC_CONFIG_PTR(crtc->scrn);
-	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
-	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
-	uint32_t *output_ids = NULL;
-	int output_count = 0;
-	int ret = TRUE;
-	int err;
+	drmModePropertyPtr prop;
+	Bool found = FALSE;
 	int i;
-	uint32_t fb_id;
-	drmModeModeInfo kmode;
-	drmModeCrtcPtr newcrtc = NULL;
-	int xu, yu;
-
-	TRACE_ENTER();
 
-	fb_id = armsoc_bo_get_fb(pARMSOC->scanout);
-
-	if (fb_id == 0) {
-		DEBUG_MSG("create framebuffer: %dx%d",
-				pScrn->virtualX, pScrn->virtualY);
+	prop = drmModeGetProperty(fd, prop_id);
+	if (!prop)
+		return FALSE;
 
-		err = armsoc_bo_add_fb(pARMSOC->scanout);
-		if (err) {
-			ERROR_MSG(
-					"Failed to add framebuffer to the scanout buffer");
-			return FALSE;
+	for (i = 0; i < prop->count_enums; i++) {
+		if (!strcmp(prop->enums[i].name, name)) {
+			*value = prop->enums[i].value;
+			found = TRUE;
+			break;
 		}
-
-		fb_id = armsoc_bo_get_fb(pARMSOC->scanout);
-		if (0 == fb_id)
-			return FALSE;
 	}
+	drmModeFreeProperty(prop);
+	return found;
+}
 
-	/* Set the new mode: */
-	crtc->mode = *mode;
-	crtc->x = x;
-	crtc->y = y;
-	crtc->rotation = rotation;
-
-	output_ids = calloc(sizeof(uint32_t), xf86_config->num_output);
-	if (!output_ids) {
-		ERROR_MSG(
-				"memory allocation failed in drmmode_set_mode_major()");
-		ret = FALSE;
-		goto cleanup;
-	}
+/*
+ * Keep the cached value of a CRTC property up to date when changing it.
+ */
+static void
+drmmode_crtc_prop_changed(ScrnInfoPtr pScrn, uint32_t crtc_id,
+		uint32_t prop_id, uint64_t value)
+{
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	int i, j;
 
-	for (i = 0; i < xf86_config->num_output; i++) {
-		xf86OutputPtr output = xf86_config->output[i];
-		struct drmmode_output_priv *drmmode_output;
+	for (i = 0; i < config->num_crtc; i++) {
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				config->crtc[i]->driver_private;
 
-		if (output->crtc != crtc)
+		if (drmmode_crtc->crtc_id != crtc_id)
 			continue;
 
-		drmmode_output = output->driver_private;
-		output_ids[output_count] =
-				drmmode_output->connector->connector_id;
-		output_count++;
+		for (j = 0; j < DRMMODE_CRTC__COUNT; j++)
+			if (drmmode_crtc->props[j].prop_id == prop_id)
+				drmmode_crtc->props[j].value = value;
 	}
+}
 
-	if (!xf86CrtcRotate(crtc)) {
-		ERROR_MSG(
-				"failed to assign rotation in drmmode_set_mode_major()");
-		ret = FALSE;
-		goto cleanup;
-	}
+/*
+ * Atomic modesetting. Used instead of the legacy calls when enabled and
+ * usable. Modesets, which also change what the connectors are routed to,
+ * are checked with a TEST_ONLY commit first so that the legacy path can
+ * take over without side effects. Flips and other updates are committed
+ * straight away: the kernel applies all of a commit or none of it.
+ */
+#ifdef DRM_CLIENT_CAP_ATOMIC
+static int
+drmmode_atomic_add(drmModeAtomicReqPtr req, uint32_t obj_id,
+		const struct drmmode_prop_info *info, uint64_t value)
+{
+	return drmModeAtomicAddProperty(req, obj_id, info->prop_id, value) < 0;
+}
 
-	if (crtc->funcs->gamma_set)
-		crtc->funcs->gamma_set(crtc, crtc->gamma_red, crtc->gamma_green,
-				       crtc->gamma_blue, crtc->gamma_size);
+/* names of the bits of the plane "rotation" property, which are in the
+ * same order as RandR's */
+static const char *const drmmode_rotation_names[] = {
+	"rotate-0", "rotate-90", "rotate-180", "rotate-270",
+	"reflect-x", "reflect-y",
+};
 
-	drmmode_ConvertToKMode(crtc->scrn, &kmode, mode);
+/*
+ * Find which rotations the primary plane of a CRTC can do.
+ */
+static void
+drmmode_crtc_rotation_init(struct drmmode_crtc_private_rec *drmmode_crtc)
+{
+	uint32_t prop_id =
+			drmmode_crtc->primary_props[DRMMODE_PLANE_ROTATION].prop_id;
+	uint64_t value;
+	int i;
 
-	err = drmModeSetCrtc(drmmode->fd, drmmode_crtc->crtc_id,
-			fb_id, x, y, output_ids, output_count, &kmode);
-	if (err) {
-		ERROR_MSG(
-				"drm failed to set mode: %s", strerror(-err));
+	drmmode_crtc->hw_rotations = 0;
+	if (!prop_id)
+		return;
 
-		ret = FALSE;
-		if (!drmmode_revert_mode(crtc, output_ids, output_count))
-			goto cleanup;
-		else
-			goto done_setting;
+	for (i = 0; i < ARRAY_SIZE(drmmode_rotation_names); i++) {
+		if (!drmmode_prop_enum_value(drmmode_crtc->drmmode->fd,
+				prop_id, drmmode_rotation_names[i], &value))
+			continue;
+		drmmode_crtc->hw_rotations |= 1 << i;
+		drmmode_crtc->hw_rotation_values[i] = 1ULL << value;
 	}
+}
 
-	/* get the actual crtc info */
-	newcrtc = drmModeGetCrtc(drmmode->fd, drmmode_crtc->crtc_id);
-	if (!newcrtc) {
-		ERROR_MSG("couldn't get actual mode back");
+static uint64_t
+drmmode_crtc_rotation_value(struct drmmode_crtc_private_rec *drmmode_crtc,
+		Rotation rotation)
+{
+	uint64_t value = 0;
+	int i;
 
-		ret = FALSE;
-		if (!drmmode_revert_mode(crtc, output_ids, output_count))
-			goto cleanup;
-		else
-			goto done_setting;
+	for (i = 0; i < ARRAY_SIZE(drmmode_rotation_names); i++)
+		if (rotation & (1 << i))
+			value |= drmmode_crtc->hw_rotation_values[i];
+	return value;
+}
+
+/*
+ * Show fb_id on the whole of the CRTC, scanning out from (x, y).
+ */
+static int
+drmmode_atomic_add_primary(drmModeAtomicReqPtr req, xf86CrtcPtr crtc,
+		uint32_t fb_id, int x, int y)
+{
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	const struct drmmode_prop_info *props = drmmode_crtc->primary_props;
+	uint32_t plane_id = drmmode_crtc->primary_plane_id;
+	uint64_t w = crtc->mode.HDisplay;
+	uint64_t h = crtc->mode.VDisplay;
+	uint64_t src_w = w, src_h = h;
+	Rotation rotation = RR_Rotate_0;
+	int ret = 0;
+
+	/* a plane rotated by 90 or 270 degrees reads a transposed area */
+	if (drmmode_crtc->hw_rotate) {
+		rotation = crtc->rotation;
+		if (rotation & (RR_Rotate_90 | RR_Rotate_270)) {
+			src_w = h;
+			src_h = w;
+		}
 	}
+	if (props[DRMMODE_PLANE_ROTATION].prop_id &&
+			drmmode_crtc->hw_rotations)
+		ret |= drmmode_atomic_add(req, plane_id,
+				&props[DRMMODE_PLANE_ROTATION],
+				drmmode_crtc_rotation_value(drmmode_crtc,
+					rotation));
+
+	ret |= drmmode_atomic_add(req, plane_id, &props[DRMMODE_PLANE_FB_ID],
+			fb_id);
+	ret |= drmmode_atomic_add(req, plane_id,
+			&props[DRMMODE_PLANE_CRTC_ID], drmmode_crtc->crtc_id);
+	/* source coordinates are 16.16 fixed point */
+	ret |= drmmode_atomic_add(req, plane_id, &props[DRMMODE_PLANE_SRC_X],
+			(uint64_t)x << 16);
+	ret |= drmmode_atomic_add(req, plane_id, &props[DRMMODE_PLANE_SRC_Y],
+			(uint64_t)y << 16);
+	ret |= drmmode_atomic_add(req, plane_id, &props[DRMMODE_PLANE_SRC_W],
+			src_w << 16);
+	ret |= drmmode_atomic_add(req, plane_id, &props[DRMMODE_PLANE_SRC_H],
+			src_h << 16);
+	ret |= drmmode_atomic_add(req, plane_id,
+			&props[DRMMODE_PLANE_CRTC_X], 0);
+	ret |= drmmode_atomic_add(req, plane_id,
+			&props[DRMMODE_PLANE_CRTC_Y], 0);
+	ret |= drmmode_atomic_add(req, plane_id,
+			&props[DRMMODE_PLANE_CRTC_W], w);
+	ret |= drmmode_atomic_add(req, plane_id,
+			&props[DRMMODE_PLANE_CRTC_H], h);
+	return ret;
+}
 
-	if (kmode.hdisplay != newcrtc->mode.hdisplay ||
-		kmode.vdisplay != newcrtc->mode.vdisplay) {
+static int
+drmmode_atomic_commit(struct drmmode_rec *drmmode, drmModeAtomicReqPtr req,
+		uint32_t flags, void *user_data)
+{
+	int ret;
 
-		ERROR_MSG(
-			"drm did not set requested mode! (requested %dx%d, actual %dx%d)",
-			kmode.hdisplay, kmode.vdisplay,
-			newcrtc->mode.hdisplay,
-			newcrtc->mode.vdisplay);
-
-		ret = FALSE;
-		if (!drmmode_revert_mode(crtc, output_ids, output_count))
-			goto cleanup;
-		else
-			goto done_setting;
+	/* events can't be requested for test commits */
+	if (flags & DRM_MODE_ATOMIC_ALLOW_MODESET) {
+		ret = drmModeAtomicCommit(drmmode->fd, req,
+				DRM_MODE_ATOMIC_TEST_ONLY |
+				DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+		if (ret)
+			return ret;
 	}
 
-	drmmode_get_underscan(drmmode->fd, drmmode_crtc->crtc_id, &xu, &yu);
-	drmmode_crtc->underscan_x = xu;
-	drmmode_crtc->underscan_y = yu;
+	return drmModeAtomicCommit(drmmode->fd, req, flags, user_data);
+}
 
-	/* When called on a resize, crtc->mode already contains the
-	 * resized values so we can't use this for recovery.
-	 * We can't read it out of the crtc either as mode_valid is 0.
-	 * Instead we save the last good mode set here & fallback to
-	 * that on failure.
-	 */
-	DEBUG_MSG("Saving last good values");
-	drmmode_crtc->last_good_x = crtc->x;
-	drmmode_crtc->last_good_y = crtc->y;
-	drmmode_crtc->last_good_rotation = crtc->rotation;
-	if (drmmode_crtc->last_good_mode) {
-		if (drmmode_crtc->last_good_mode->name)
-			free(drmmode_crtc->last_good_mode->name);
-		free(drmmode_crtc->last_good_mode);
+/*
+ * Set the mode, outputs and framebuffer of a CRTC in a single commit.
+ */
+static int
+drmmode_crtc_atomic_set(xf86CrtcPtr crtc, uint32_t fb_id, int x, int y,
+		drmModeModeInfo *kmode)
+{
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(crtc->scrn);
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
+	drmModeAtomicReqPtr req;
+	uint32_t blob_id;
+	int i, ret;
+
+	if (drmModeCreatePropertyBlob(drmmode->fd, kmode, sizeof(*kmode),
+			&blob_id))
+		return -1;
+
+	req = drmModeAtomicAlloc();
+	if (!req) {
+		drmModeDestroyPropertyBlob(drmmode->fd, blob_id);
+		return -1;
 	}
-	drmmode_crtc->last_good_mode = xf86DuplicateMode(&crtc->mode);
 
-	ret = TRUE;
+	ret = drmmode_atomic_add(req, drmmode_crtc->crtc_id,
+			&drmmode_crtc->props[DRMMODE_CRTC_ACTIVE], 1);
+	ret |= drmmode_atomic_add(req, drmmode_crtc->crtc_id,
+			&drmmode_crtc->props[DRMMODE_CRTC_MODE_ID], blob_id);
 
-done_setting:
-	/* Turn on any outputs on this crtc that may have been disabled: */
 	for (i = 0; i < xf86_config->num_output; i++) {
 		xf86OutputPtr output = xf86_config->output[i];
-
-		if (output->crtc != crtc)
+		struct drmmode_output_priv *drmmode_output =
+				output->driver_private;
+		struct drmmode_prop_info info;
+
+		if (output->crtc == crtc) {
+			ret |= drmmode_atomic_add(req,
+					drmmode_output->output_id,
+					&drmmode_output->atomic_props[
+						DRMMODE_CONNECTOR_CRTC_ID],
+					drmmode_crtc->crtc_id);
 			continue;
+		}
 
-		drmmode_output_dpms(output, DPMSModeOn);
+		/* connectors the CRTC drove before but no longer does are
+		 * taken off it in the same commit */
+		if (drmmode_prop_info_init(drmmode->fd,
+				drmmode_output->output_id,
+				DRM_MODE_OBJECT_CONNECTOR, &info,
+				&connector_props[DRMMODE_CONNECTOR_CRTC_ID], 1) &&
+				info.value == drmmode_crtc->crtc_id)
+			ret |= drmmode_atomic_add(req,
+					drmmode_output->output_id,
+					&drmmode_output->atomic_props[
+						DRMMODE_CONNECTOR_CRTC_ID], 0);
 	}
 
-	/* if hw cursor is initialized, reload it */
-	if (drmmode->cursor)
-		xf86_reload_cursors(pScrn->pScreen);
-
-cleanup:
-	if (newcrtc)
-		drmModeFreeCrtc(newcrtc);
+	ret |= drmmode_atomic_add_primary(req, crtc, fb_id, x, y);
 
-	if (output_ids)
-		free(output_ids);
+	if (!ret)
+		ret = drmmode_atomic_commit(drmmode, req,
+				DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+	drmModeAtomicFree(req);
 
-	if (!ret && !drmmode_crtc->last_good_mode) {
-		/* If there was a problem, restore the last good mode: */
-		crtc->x = drmmode_crtc->last_good_x;
-		crtc->y = drmmode_crtc->last_good_y;
-		crtc->rotation = drmmode_crtc->last_good_rotation;
-		crtc->mode = *drmmode_crtc->last_good_mode;
+	if (ret) {
+		drmModeDestroyPropertyBlob(drmmode->fd, blob_id);
+		return ret;
 	}
 
-	TRACE_EXIT();
-	return ret;
+	if (drmmode_crtc->mode_blob_id)
+		drmModeDestroyPropertyBlob(drmmode->fd,
+				drmmode_crtc->mode_blob_id);
+	drmmode_crtc->mode_blob_id = blob_id;
+	return 0;
 }
 
-static void
-drmmode_hide_cursor(xf86CrtcPtr crtc)
+/*
+ * Point an active CRTC's primary plane at a different framebuffer.
+ */
+static int
+drmmode_crtc_atomic_set_fb(xf86CrtcPtr crtc, uint32_t fb_id, int x, int y)
 {
 	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
-	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
-	struct drmmode_cursor_rec *cursor = drmmode->cursor;
-	ScrnInfoPtr pScrn = crtc->scrn;
-	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
-
-	if (!cursor)
-		return;
+	drmModeAtomicReqPtr req;
+	int ret;
 
-	drmmode_crtc->cursor_visible = FALSE;
+	req = drmModeAtomicAlloc();
+	if (!req)
+		return -1;
 
-	if (pARMSOC->drmmode_interface->cursor_api == HWCURSOR_API_PLANE) {
-		/* set plane's fb_id to 0 to disable it */
-		drmModeSetPlane(drmmode->fd, cursor->ovr->plane_id,
-				drmmode_crtc->crtc_id, 0, 0,
-				0, 0, 0, 0, 0, 0, 0, 0);
-	} else { /* HWCURSOR_API_STANDARD */
-		/* set handle to 0 to disable the cursor */
-		drmModeSetCursor(drmmode->fd, drmmode_crtc->crtc_id,
-				 0, 0, 0);
-	}
+	ret = drmmode_atomic_add_primary(req, crtc, fb_id, x, y);
+	if (!ret)
+		ret = drmmode_atomic_commit(drmmode_crtc->drmmode, req, 0,
+				NULL);
+	drmModeAtomicFree(req);
+	return ret;
 }
 
 /*
- * The argument "update_image" controls whether the cursor image needs
- * to be updated by the HW or not. This is ignored by HWCURSOR_API_PLANE
- * which doesn't allow changing the cursor possition without updating
- * the image too.
+ * Read the formats and modifiers the primary plane of a CRTC can scan out
+ * from its IN_FORMATS blob. Planes without it only do linear buffers.
  */
 static void
-drmmode_show_cursor_image(xf86CrtcPtr crtc, Bool update_image)
+drmmode_crtc_in_formats_init(struct drmmode_crtc_private_rec *drmmode_crtc)
 {
-	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
-	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
-	struct drmmode_cursor_rec *cursor = drmmode->cursor;
-	int crtc_x, crtc_y, src_x, src_y;
-	int w, h, pad;
-	ScrnInfoPtr pScrn = crtc->scrn;
-	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
-
-	if (!cursor)
+#ifdef FORMAT_BLOB_CURRENT
+	const struct drmmode_prop_info *info =
+			&drmmode_crtc->primary_props[DRMMODE_PLANE_IN_FORMATS];
+	drmModePropertyBlobPtr blob;
+	struct drm_format_modifier_blob *data;
+	struct drm_format_modifier *mods;
+	uint32_t *formats;
+	uint32_t i, j;
+	int n = 0;
+
+	if (!info->prop_id || !info->value)
 		return;
 
-	drmmode_crtc->cursor_visible = TRUE;
+	blob = drmModeGetPropertyBlob(drmmode_crtc->drmmode->fd, info->value);
+	if (!blob)
+		return;
 
-	w = pARMSOC->drmmode_interface->cursor_width;
-	h = pARMSOC->drmmode_interface->cursor_height;
-	pad = pARMSOC->drmmode_interface->cursor_padding;
+	data = blob->data;
+	formats = (uint32_t *)((char *)data + data->formats_offset);
+	mods = (struct drm_format_modifier *)((char *)data +
+			data->modifiers_offset);
+
+	/* each modifier has a mask of the 64 formats from its offset on */
+	for (i = 0; i < data->count_modifiers; i++)
+		for (j = 0; j < 64; j++)
+			if ((mods[i].formats & (1ULL << j)) &&
+					mods[i].offset + j < data->count_formats)
+				n++;
+
+	drmmode_crtc->in_formats = calloc(n, sizeof(*drmmode_crtc->in_formats));
+	if (drmmode_crtc->in_formats) {
+		for (i = 0; i < data->count_modifiers; i++) {
+			for (j = 0; j < 64; j++) {
+				struct drmmode_format_modifier *fm;
+
+				if (!(mods[i].formats & (1ULL << j)) ||
+						mods[i].offset + j >=
+						data->count_formats)
+					continue;
+
+				fm = &drmmode_crtc->in_formats[
+						drmmode_crtc->num_in_formats++];
+				fm->format = formats[mods[i].offset + j];
+				fm->modifier = mods[i].modifier;
+			}
+		}
+	}
 
-	/* get padded width */
-	w = w + 2 * pad;
-	/* get x of padded cursor */
-	crtc_x = cursor->x - pad;
-	crtc_y = cursor->y;
+	drmModeFreePropertyBlob(blob);
+#endif
+}
 
-	if (pARMSOC->drmmode_interface->cursor_api == HWCURSOR_API_PLANE) {
-		src_x = 0;
-		src_y = 0;
+static Bool
+drmmode_crtc_has_modifier(struct drmmode_crtc_private_rec *drmmode_crtc,
+		uint32_t format, uint64_t modifier)
+{
+	int i;
 
-		/* calculate clipped x, y, w & h if cursor is off edges */
-		if (crtc_x < 0) {
-			src_x += -crtc_x;
-			w -= -crtc_x;
-			crtc_x = 0;
-		}
+	for (i = 0; i < drmmode_crtc->num_in_formats; i++)
+		if (drmmode_crtc->in_formats[i].format == format &&
+				drmmode_crtc->in_formats[i].modifier == modifier)
+			return TRUE;
+	return FALSE;
+}
 
-		if (crtc_y < 0) {
-			src_y += -crtc_y;
-			h -= -crtc_y;
-			crtc_y = 0;
-		}
+/*
+ * The modifiers buffers of the given format can be flipped to with on all
+ * enabled CRTCs. Returns how many there are, in an array the caller frees.
+ * Without atomic modesetting the primary planes are not known and this
+ * finds none.
+ */
+int
+drmmode_scanout_modifiers(ScrnInfoPtr pScrn, uint32_t format,
+		uint64_t **modifiers)
+{
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	uint64_t *mods = NULL;
+	Bool seen = FALSE;
+	int i, j, count = 0;
 
-		if ((crtc_x + w) > crtc->mode.HDisplay)
-			w = crtc->mode.HDisplay - crtc_x;
+	for (i = 0; i < config->num_crtc; i++) {
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				config->crtc[i]->driver_private;
 
-		if ((crtc_y + h) > crtc->mode.VDisplay)
-			h = crtc->mode.VDisplay - crtc_y;
+		if (!config->crtc[i]->enabled)
+			continue;
 
-		crtc_x += drmmode_crtc->underscan_x;
-		crtc_y += drmmode_crtc->underscan_y;
+		if (!seen) {
+			seen = TRUE;
+			mods = calloc(drmmode_crtc->num_in_formats,
+					sizeof(*mods));
+			if (!mods)
+				break;
+			for (j = 0; j < drmmode_crtc->num_in_formats; j++)
+				if (drmmode_crtc->in_formats[j].format ==
+						format)
+					mods[count++] = drmmode_crtc->
+							in_formats[j].modifier;
+			continue;
+		}
 
-		/* note src coords (last 4 args) are in Q16 format */
-		drmModeSetPlane(drmmode->fd, cursor->ovr->plane_id,
-			drmmode_crtc->crtc_id, cursor->fb_id, 0,
-			crtc_x, crtc_y, w, h, src_x<<16, src_y<<16,
-			w<<16, h<<16);
-	} else {
-		if (update_image)
-			drmModeSetCursor(drmmode->fd,
-					 drmmode_crtc->crtc_id,
-					 cursor->handle, w, h);
-		drmModeMoveCursor(drmmode->fd,
-				  drmmode_crtc->crtc_id,
-				  crtc_x, crtc_y);
+		/* keep those this CRTC can do too */
+		for (j = 0; j < count; )
+			if (drmmode_crtc_has_modifier(drmmode_crtc, format,
+					mods[j]))
+				j++;
+			else
+				mods[j] = mods[--count];
 	}
-}
 
-static void
-drmmode_show_cursor(xf86CrtcPtr crtc)
-{
-	drmmode_show_cursor_image(crtc, TRUE);
+	if (!count) {
+		free(mods);
+		mods = NULL;
+	}
+	*modifiers = mods;
+	return count;
 }
 
+/*
+ * Look up everything needed for atomic commits, and turn them on if it is
+ * all there. Otherwise stay with the legacy interfaces.
+ */
 static void
-drmmode_set_cursor_position(xf86CrtcPtr crtc, int x, int y)
+drmmode_atomic_init(ScrnInfoPtr pScrn, struct drmmode_rec *drmmode)
 {
-	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
-	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
-	struct drmmode_cursor_rec *cursor = drmmode->cursor;
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	drmModePlaneResPtr plane_res = NULL;
+	int i, j, k;
 
-	if (!cursor)
+	if (drmSetClientCap(drmmode->fd, DRM_CLIENT_CAP_ATOMIC, 1)) {
+		WARNING_MSG("Atomic modesetting not supported by the kernel");
 		return;
+	}
 
-	cursor->x = x;
-	cursor->y = y;
+	plane_res = drmModeGetPlaneResources(drmmode->fd);
+	if (!plane_res)
+		goto fail;
 
-	/*
-	 * Show the cursor at a different possition without updating the image
-	 * when possible (HWCURSOR_API_PLANE doesn't have a way to update
-	 * cursor position without updating the image too).
-	 */
-	drmmode_show_cursor_image(crtc, FALSE);
-}
+	for (i = 0; i < xf86_config->num_crtc; i++) {
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				xf86_config->crtc[i]->driver_private;
+
+		if (!drmmode_prop_info_init(drmmode->fd, drmmode_crtc->crtc_id,
+				DRM_MODE_OBJECT_CRTC, drmmode_crtc->props,
+				crtc_props, DRMMODE_CRTC__COUNT))
+			goto fail;
+
+		/* find a primary plane not taken by another CRTC */
+		for (j = 0; j < plane_res->count_planes &&
+				!drmmode_crtc->primary_plane_id; j++) {
+			struct drmmode_prop_info info[DRMMODE_PLANE__COUNT];
+			uint32_t plane_id = plane_res->planes[j];
+			drmModePlanePtr plane;
+			Bool usable;
+
+			for (k = 0; k < i; k++) {
+				struct drmmode_crtc_private_rec *other =
+					xf86_config->crtc[k]->driver_private;
+
+				if (other->primary_plane_id == plane_id)
+					break;
+			}
+			if (k < i)
+				continue;
 
-/*
- * The cursor format is ARGB so the image can be copied straight over.
- * Columns of CURSORPAD blank pixels are maintained down either side
- * of the destination image. This is a workaround for a bug causing
- * corruption when the cursor reaches the screen edges in some DRM
- * drivers.
- */
-static void set_cursor_image(xf86CrtcPtr crtc, uint32_t *d, CARD32 *s)
-{
-	ScrnInfoPtr pScrn = crtc->scrn;
-	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
-	int row;
-	void *dst;
-	const char *src_row;
-	char *dst_row;
-	uint32_t cursorh = pARMSOC->drmmode_interface->cursor_height;
-	uint32_t cursorw = pARMSOC->drmmode_interface->cursor_width;
-	uint32_t cursorpad = pARMSOC->drmmode_interface->cursor_padding;
+			plane = drmModeGetPlane(drmmode->fd, plane_id);
+			if (!plane)
+				continue;
 
-	dst = d;
-	for (row = 0; row < cursorh; row += 1) {
-		/* we're operating with ARGB data (4 bytes per pixel) */
-		src_row = (const char *)s + row * 4 * cursorw;
-		dst_row = (char *)dst + row * 4 * (cursorw + 2 * cursorpad);
+			usable = (plane->possible_crtcs &
+					(1 << drmmode_crtc->index)) &&
+				drmmode_prop_info_init(drmmode->fd, plane_id,
+					DRM_MODE_OBJECT_PLANE, info,
+					plane_props, DRMMODE_PLANE__COUNT) &&
+				info[DRMMODE_PLANE_TYPE].value ==
+					DRM_PLANE_TYPE_PRIMARY;
+			drmModeFreePlane(plane);
+
+			if (usable) {
+				drmmode_crtc->primary_plane_id = plane_id;
+				memcpy(drmmode_crtc->primary_props, info,
+						sizeof(info));
+				drmmode_crtc_rotation_init(drmmode_crtc);
+				drmmode_crtc_in_formats_init(drmmode_crtc);
+			}
+		}
 
-		/* set first CURSORPAD pixels in row to 0 */
-		memset(dst_row, 0, (4 * cursorpad));
-		/* copy cursor image pixel row across */
-		memcpy(dst_row + (4 * cursorpad), src_row, 4 * cursorw);
-		/* set last CURSORPAD pixels in row to 0 */
-		memset(dst_row + 4 * (cursorpad + cursorw),
-				0, (4 * cursorpad));
+		if (!drmmode_crtc->primary_plane_id)
+			goto fail;
+	}
+
+	for (i = 0; i < xf86_config->num_output; i++) {
+		struct drmmode_output_priv *drmmode_output =
+				xf86_config->output[i]->driver_private;
+
+		if (!drmmode_prop_info_init(drmmode->fd,
+				drmmode_output->output_id,
+				DRM_MODE_OBJECT_CONNECTOR,
+				drmmode_output->atomic_props, connector_props,
+				DRMMODE_CONNECTOR__COUNT))
+			goto fail;
+	}
+
+	drmModeFreePlaneResources(plane_res);
+	drmmode->atomic = TRUE;
+	INFO_MSG("Using atomic modesetting");
+	return;
+
+fail:
+	if (plane_res)
+		drmModeFreePlaneResources(plane_res);
+	for (i = 0; i < xf86_config->num_crtc; i++) {
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				xf86_config->crtc[i]->driver_private;
+
+		drmmode_crtc->primary_plane_id = 0;
+		drmmode_crtc->hw_rotations = 0;
+		free(drmmode_crtc->in_formats);
+		drmmode_crtc->in_formats = NULL;
+		drmmode_crtc->num_in_formats = 0;
 	}
+	WARNING_MSG("Atomic modesetting not usable, using legacy modesetting");
+	drmSetClientCap(drmmode->fd, DRM_CLIENT_CAP_ATOMIC, 0);
 }
+#endif /* DRM_CLIENT_CAP_ATOMIC */
 
-static void
-drmmode_load_cursor_argb(xf86CrtcPtr crtc, CARD32 *image)
+/*
+ * Point an active CRTC at a different framebuffer without changing its
+ * mode or outputs.
+ */
+static int
+drmmode_crtc_set_fb(xf86CrtcPtr crtc, uint32_t fb_id, int x, int y)
 {
-	uint32_t *d;
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(crtc->scrn);
 	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
-	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
-	struct drmmode_cursor_rec *cursor = drmmode->cursor;
-	int visible;
+	uint32_t *output_ids;
+	int output_count = 0;
+	drmModeModeInfo kmode;
+	int i, ret;
 
-	if (!cursor)
-		return;
+#ifdef DRM_CLIENT_CAP_ATOMIC
+	if (drmmode_crtc->drmmode->atomic &&
+			!drmmode_crtc_atomic_set_fb(crtc, fb_id, x, y))
+		return 0;
+#endif
 
-	visible = drmmode_crtc->cursor_visible;
+	output_ids = calloc(sizeof(uint32_t), xf86_config->num_output);
+	if (!output_ids)
+		return -ENOMEM;
 
-	if (visible)
-		drmmode_hide_cursor(crtc);
+	for (i = 0; i < xf86_config->num_output; i++) {
+		xf86OutputPtr output = xf86_config->output[i];
+		struct drmmode_output_priv *drmmode_output;
 
-	d = armsoc_bo_map(cursor->bo);
-	if (!d) {
-		xf86DrvMsg(crtc->scrn->scrnIndex, X_ERROR,
-			"load_cursor_argb map failure\n");
-		if (visible)
-			drmmode_show_cursor_image(crtc, TRUE);
-		return;
-	}
+		if (output->crtc != crtc)
+			continue;
 
-	set_cursor_image(crtc, d, image);
+		drmmode_output = output->driver_private;
+		output_ids[output_count++] =
+				drmmode_output->connector->connector_id;
+	}
 
-	if (visible)
-		drmmode_show_cursor_image(crtc, TRUE);
+	drmmode_ConvertToKMode(crtc->scrn, &kmode, &crtc->mode);
+	ret = drmModeSetCrtc(drmmode_crtc->drmmode->fd, drmmode_crtc->crtc_id,
+			fb_id, x, y, output_ids, output_count, &kmode);
+	free(output_ids);
+	return ret;
 }
 
-static Bool
-drmmode_cursor_init_plane(ScreenPtr pScreen)
-{
-	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
-	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
-	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
-	struct drmmode_cursor_rec *cursor;
-	drmModePlaneRes *plane_resources;
-	drmModePlane *ovr;
-	int w, h, pad;
-	uint32_t handles[4], pitches[4], offsets[4]; /* we only use [0] */
-
-	if (drmmode->cursor) {
-		INFO_MSG("cursor already initialized");
-		return TRUE;
-	}
-
-	if (!xf86LoaderCheckSymbol("drmModeGetPlaneResources")) {
-		ERROR_MSG(
-				"HW cursor not supported (needs libdrm 2.4.30 or higher)");
-		return FALSE;
-	}
-
-	/* find an unused plane which can be used as a mouse cursor.  Note
-	 * that we cheat a bit, in order to not burn one overlay per crtc,
-	 * and only show the mouse cursor on one crtc at a time
-	 */
-	plane_resources = drmModeGetPlaneResources(drmmode->fd);
-	if (!plane_resources) {
-		ERROR_MSG("HW cursor: drmModeGetPlaneResources failed: %s",
-						strerror(errno));
-		return FALSE;
-	}
+/* Revert mode is odd with underscan properties present.
+ * We must use the current properties instead of the one
+ * saved with the mode.  We also need to change the mode
+ * so it saves the current property values, so it's not
+ * quite a real revert.
+ *
+ * this is all rather  untested because I don't know how to
+ * cause a revert to occur on demand.
+ * if this proves problematic, the next best solution might
+ * be to set the properties based on the underscan values
+ * encoded in the mode, but this could confusing to the UI.
+ */
+static int
+drmmode_revert_mode(xf86CrtcPtr crtc, uint32_t *output_ids, int output_count)
+{
+	ScrnInfoPtr pScrn = crtc->scrn;
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	uint32_t fb_id;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	drmModeModeInfo kmode;
+	int xu, yu;
 
-	if (plane_resources->count_planes < 1) {
-		ERROR_MSG("not enough planes for HW cursor");
-		drmModeFreePlaneResources(plane_resources);
-		return FALSE;
-	}
+	drmmode_get_underscan(drmmode_crtc, &xu, &yu);
 
-	ovr = drmModeGetPlane(drmmode->fd, plane_resources->planes[0]);
-	if (!ovr) {
-		ERROR_MSG("HW cursor: drmModeGetPlane failed: %s",
-					strerror(errno));
-		drmModeFreePlaneResources(plane_resources);
+	if (!drmmode_crtc->last_good_mode) {
+		DEBUG_MSG("No last good values to use");
 		return FALSE;
 	}
 
-	if (pARMSOC->drmmode_interface->init_plane_for_cursor &&
-		pARMSOC->drmmode_interface->init_plane_for_cursor(
-				drmmode->fd, ovr->plane_id)) {
-		ERROR_MSG("Failed driver-specific cursor initialization");
-		drmModeFreePlaneResources(plane_resources);
+	/* revert to last good settings */
+	DEBUG_MSG("Reverting to last_good values");
+	if (!resize_scanout_bo(pScrn,
+			drmmode_crtc->last_good_mode->HDisplay,
+			drmmode_crtc->last_good_mode->VDisplay)) {
+		ERROR_MSG("Could not revert to last good mode");
 		return FALSE;
 	}
 
-	cursor = calloc(1, sizeof(struct drmmode_cursor_rec));
-	if (!cursor) {
-		ERROR_MSG("HW cursor: calloc failed");
-		drmModeFreePlane(ovr);
-		drmModeFreePlaneResources(plane_resources);
-		return FALSE;
-	}
+	fb_id = armsoc_bo_get_fb(pARMSOC->scanout);
+	drmmode_ConvertToKMode(crtc->scrn, &kmode,
+			drmmode_crtc->last_good_mode);
+	drmModeSetCrtc(drmmode_crtc->drmmode->fd,
+			drmmode_crtc->crtc_id,
+			fb_id,
+			drmmode_crtc->last_good_x,
+			drmmode_crtc->last_good_y,
+			output_ids, output_count, &kmode);
+	drmmode_crtc->underscan_x = xu;
+	drmmode_crtc->underscan_y = yu;
 
-	cursor->ovr = ovr;
+	/* update the underscan params so the mouse doesn't
+	 * get confused. */
+	drmmode_crtc->last_good_mode->HSkew = (xu << 8) + yu;
+	/* let RandR know we changed things */
+	xf86RandR12TellChanged(pScrn->pScreen);
 
-	w = pARMSOC->drmmode_interface->cursor_width;
-	h = pARMSOC->drmmode_interface->cursor_height;
-	pad = pARMSOC->drmmode_interface->cursor_padding;
+	return TRUE;
+}
 
-	/* allow for cursor padding in the bo */
-	cursor->bo  = armsoc_bo_new_with_dim(pARMSOC->dev,
-				w + 2 * pad, h,
-				0, 32, ARMSOC_BO_SCANOUT);
+/*
+ * Compare the timings of two kernel modes, ignoring name and type.
+ */
+static Bool
+drmmode_kmode_equal(const drmModeModeInfo *a, const drmModeModeInfo *b)
+{
+	return a->clock == b->clock &&
+		a->hdisplay == b->hdisplay &&
+		a->hsync_start == b->hsync_start &&
+		a->hsync_end == b->hsync_end &&
+		a->htotal == b->htotal &&
+		a->hskew == b->hskew &&
+		a->vdisplay == b->vdisplay &&
+		a->vsync_start == b->vsync_start &&
+		a->vsync_end == b->vsync_end &&
+		a->vtotal == b->vtotal &&
+		a->vscan == b->vscan &&
+		a->flags == b->flags;
+}
 
-	if (!cursor->bo) {
-		ERROR_MSG("HW cursor: buffer allocation failed");
-		free(cursor);
-		drmModeFreePlane(ovr);
-		drmModeFreePlaneResources(plane_resources);
-		return FALSE;
-	}
+/*
+ * If the kernel is already showing kmode on exactly the outputs we want
+ * on this CRTC (the boot splash or console did the modeset), just move
+ * the CRTC to our framebuffer. Returns 0 if it did, non-zero if a full
+ * modeset is needed.
+ */
+static int
+drmmode_crtc_keep_boot_mode(xf86CrtcPtr crtc, uint32_t fb_id, int x, int y,
+		drmModeModeInfo *kmode)
+{
+	ScrnInfoPtr pScrn = crtc->scrn;
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
+	int i, ret;
 
-	handles[0] = armsoc_bo_handle(cursor->bo);
-	pitches[0] = armsoc_bo_pitch(cursor->bo);
-	offsets[0] = 0;
+	if (!drmmode_crtc->boot_mode_valid)
+		return -1;
 
-	/* allow for cursor padding in the fb */
-	if (drmModeAddFB2(drmmode->fd, w + 2 * pad, h, DRM_FORMAT_ARGB8888,
-			handles, pitches, offsets, &cursor->fb_id, 0)) {
-		ERROR_MSG("HW cursor: drmModeAddFB2 failed: %s",
-					strerror(errno));
-		armsoc_bo_unreference(cursor->bo);
-		free(cursor);
-		drmModeFreePlane(ovr);
-		drmModeFreePlaneResources(plane_resources);
-		return FALSE;
-	}
+	/* only the first modeset can find the boot state */
+	drmmode_crtc->boot_mode_valid = FALSE;
 
-	if (!xf86_cursors_init(pScreen, w, h, HARDWARE_CURSOR_ARGB)) {
-		ERROR_MSG("xf86_cursors_init() failed");
-		if (drmModeRmFB(drmmode->fd, cursor->fb_id))
-			ERROR_MSG("drmModeRmFB() failed");
+	if (crtc->rotation != RR_Rotate_0 ||
+			!drmmode_kmode_equal(kmode, &drmmode_crtc->boot_mode))
+		return -1;
 
-		armsoc_bo_unreference(cursor->bo);
-		free(cursor);
-		drmModeFreePlane(ovr);
-		drmModeFreePlaneResources(plane_resources);
-		return FALSE;
+	for (i = 0; i < xf86_config->num_output; i++) {
+		xf86OutputPtr output = xf86_config->output[i];
+		struct drmmode_output_priv *drmmode_output =
+				output->driver_private;
+		drmModeEncoderPtr enc;
+		Bool on_crtc = FALSE;
+
+		enc = drmModeGetEncoder(drmmode->fd,
+				drmmode_output->connector->encoder_id);
+		if (enc) {
+			on_crtc = enc->crtc_id == drmmode_crtc->crtc_id;
+			drmModeFreeEncoder(enc);
+		}
+		if (on_crtc != (output->crtc == crtc))
+			return -1;
 	}
 
-	INFO_MSG("HW cursor initialized");
-	drmmode->cursor = cursor;
-	drmModeFreePlaneResources(plane_resources);
-	return TRUE;
+#ifdef DRM_CLIENT_CAP_ATOMIC
+	if (drmmode->atomic)
+		return drmmode_crtc_set_fb(crtc, fb_id, x, y);
+#endif
+	/* A page flip never modesets. It keeps the CRTC's current
+	 * position, and no event is asked for as nobody waits on it. */
+	if (x != drmmode_crtc->boot_x || y != drmmode_crtc->boot_y)
+		return -1;
+	ret = drmModePageFlip(drmmode->fd, drmmode_crtc->crtc_id, fb_id, 0,
+			NULL);
+	if (!ret)
+		INFO_MSG("CRTC %d: kept the boot mode", drmmode_crtc->crtc_id);
+	return ret;
 }
 
-static Bool
-drmmode_cursor_init_standard(ScreenPtr pScreen)
+/*
+ * SeamlessBoot: copy what the kernel is showing on each CRTC into the
+ * scanout buffer, where that CRTC is going to show it, so that the
+ * screen does not change when we take over. The old framebuffer is read
+ * through its GEM handle, which needs DRM master.
+ */
+Bool
+drmmode_copy_boot_fb(ScrnInfoPtr pScrn)
 {
-	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
 	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
-	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
-	struct drmmode_cursor_rec *cursor;
-	int w, h, pad;
-
-	if (drmmode->cursor) {
-		INFO_MSG("cursor already initialized");
-		return TRUE;
-	}
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	struct armsoc_bo *scanout = pARMSOC->scanout;
+	pixman_format_code_t dst_format = ARMSOCScreenFormat(pScrn);
+	int dst_width, dst_height, dst_cpp, dst_pitch;
+	unsigned char *dst;
+	Bool ret = FALSE;
+	int i;
 
-	if (!xf86LoaderCheckSymbol("drmModeSetCursor") ||
-	    !xf86LoaderCheckSymbol("drmModeMoveCursor")) {
-		ERROR_MSG(
-				"Standard HW cursor not supported (needs libdrm 2.4.3 or higher)");
+	dst = armsoc_bo_map(scanout);
+	if (!dst) {
+		ERROR_MSG("Couldn't map scanout bo");
 		return FALSE;
 	}
 
-	cursor = calloc(1, sizeof(struct drmmode_cursor_rec));
-	if (!cursor) {
-		ERROR_MSG("HW cursor (standard): calloc failed");
-		return FALSE;
-	}
+	dst_width = armsoc_bo_width(scanout);
+	dst_height = armsoc_bo_height(scanout);
+	dst_cpp = (armsoc_bo_bpp(scanout) + 7) / 8;
+	dst_pitch = armsoc_bo_pitch(scanout);
 
-	w = pARMSOC->drmmode_interface->cursor_width;
-	h = pARMSOC->drmmode_interface->cursor_height;
-	pad = pARMSOC->drmmode_interface->cursor_padding;
+	for (i = 0; i < xf86_config->num_crtc; i++) {
+		xf86CrtcPtr crtc = xf86_config->crtc[i];
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				crtc->driver_private;
+		struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
+		struct armsoc_bo *bo;
+		drmModeFBPtr fb;
+		pixman_format_code_t src_format;
+		unsigned char *src;
+		int width, height, src_cpp;
+
+		if (!drmmode_crtc->boot_mode_valid || !crtc->desiredMode.HDisplay)
+			continue;
 
-	/* allow for cursor padding in the bo */
-	cursor->bo  = armsoc_bo_new_with_dim(pARMSOC->dev,
-				w + 2 * pad, h,
-				0, 32, ARMSOC_BO_SCANOUT);
+		fb = drmModeGetFB(drmmode->fd, drmmode_crtc->boot_fb_id);
+		if (!fb)
+			continue;
+		if (!fb->handle) {
+			WARNING_MSG("CRTC %d: cannot read the boot framebuffer",
+					drmmode_crtc->crtc_id);
+			drmModeFreeFB(fb);
+			continue;
+		}
 
-	if (!cursor->bo) {
-		ERROR_MSG("HW cursor (standard): buffer allocation failed");
-		free(cursor);
-		return FALSE;
-	}
+		/* the bo owns the handle from here on */
+		bo = armsoc_bo_from_handle(pARMSOC->dev, fb->handle,
+				fb->width, fb->height, fb->depth, fb->bpp,
+				fb->pitch);
+		drmModeFreeFB(fb);
+		if (!bo)
+			continue;
 
-	cursor->handle = armsoc_bo_handle(cursor->bo);
+		src = armsoc_bo_map(bo);
+		src_format = ARMSOCDepthFormat(armsoc_bo_depth(bo),
+				armsoc_bo_bpp(bo));
+		src_cpp = (armsoc_bo_bpp(bo) + 7) / 8;
+		if (!src || !src_format) {
+			WARNING_MSG("CRTC %d: cannot copy the boot framebuffer (depth %d, %dbpp)",
+					drmmode_crtc->crtc_id,
+					armsoc_bo_depth(bo), armsoc_bo_bpp(bo));
+			armsoc_bo_unreference(bo);
+			continue;
+		}
 
-	if (!xf86_cursors_init(pScreen, w, h, HARDWARE_CURSOR_ARGB)) {
-		ERROR_MSG("xf86_cursors_init() failed");
-		if (drmModeRmFB(drmmode->fd, cursor->fb_id))
-			ERROR_MSG("drmModeRmFB() failed");
+		width = min(crtc->desiredMode.HDisplay,
+				(int)armsoc_bo_width(bo) - drmmode_crtc->boot_x);
+		width = min(width, dst_width - crtc->desiredX);
+		height = min(crtc->desiredMode.VDisplay,
+				(int)armsoc_bo_height(bo) - drmmode_crtc->boot_y);
+		height = min(height, dst_height - crtc->desiredY);
+
+		if (width > 0 && height > 0) {
+			armsoc_bo_cpu_prep(scanout, ARMSOC_GEM_WRITE);
+			ret |= ARMSOCCopyConvert(src +
+					drmmode_crtc->boot_y *
+					armsoc_bo_pitch(bo) +
+					drmmode_crtc->boot_x * src_cpp,
+					armsoc_bo_pitch(bo), src_format,
+					dst + crtc->desiredY * dst_pitch +
+					crtc->desiredX * dst_cpp,
+					dst_pitch, dst_format, width, height);
+			armsoc_bo_cpu_fini(scanout, ARMSOC_GEM_WRITE);
+		}
 
-		armsoc_bo_unreference(cursor->bo);
-		free(cursor);
-		return FALSE;
+		armsoc_bo_unreference(bo);
 	}
 
-	INFO_MSG("HW cursor initialized");
-	drmmode->cursor = cursor;
-	return TRUE;
+	return ret;
 }
 
-Bool drmmode_cursor_init(ScreenPtr pScreen)
+static Bool
+drmmode_set_mode_major(xf86CrtcPtr crtc, DisplayModePtr mode,
+		Rotation rotation, int x, int y)
 {
-	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	ScrnInfoPtr pScrn = crtc->scrn;
 	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	xf86CrtcConfigPtr   xf86_config = XF86_CRTC_CONFIG_PTR(crtc->scrn);
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
+	uint32_t *output_ids = NULL;
+	int output_count = 0;
+	int ret = TRUE;
+	int err;
+	int i;
+	uint32_t fb_id;
+	drmModeModeInfo kmode;
+	drmModeCrtcPtr newcrtc = NULL;
+	int xu, yu;
 
-	INFO_MSG("HW cursor init()");
+	TRACE_ENTER();
 
-	if (pARMSOC->drmmode_interface->cursor_api == HWCURSOR_API_PLANE)
-		return drmmode_cursor_init_plane(pScreen);
-	else /* HWCURSOR_API_STANDARD */
-		return drmmode_cursor_init_standard(pScreen);
-}
+	fb_id = armsoc_bo_get_fb(pARMSOC->scanout);
 
-void drmmode_cursor_fini(ScreenPtr pScreen)
-{
-	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
-	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
-	struct drmmode_cursor_rec *cursor = drmmode->cursor;
-	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	if (fb_id == 0) {
+		DEBUG_MSG("create framebuffer: %dx%d",
+				pScrn->virtualX, pScrn->virtualY);
 
-	if (!cursor)
-		return;
+		err = armsoc_bo_add_fb(pARMSOC->scanout);
+		if (err) {
+			ERROR_MSG(
+					"Failed to add framebuffer to the scanout buffer");
+			return FALSE;
+		}
 
-	drmmode->cursor = NULL;
-	xf86_cursors_fini(pScreen);
-	if (pARMSOC->drmmode_interface->cursor_api == HWCURSOR_API_PLANE)
-		drmModeRmFB(drmmode->fd, cursor->fb_id);
-	armsoc_bo_unreference(cursor->bo);
-	if (pARMSOC->drmmode_interface->cursor_api == HWCURSOR_API_PLANE)
-		drmModeFreePlane(cursor->ovr);
-	free(cursor);
-}
+		fb_id = armsoc_bo_get_fb(pARMSOC->scanout);
+		if (0 == fb_id)
+			return FALSE;
+	}
 
+	/* the clock counts in periods of the old mode up to here */
+	drmmode_crtc_clock_advance(crtc, GetTimeInMicros());
 
-#if 1 == ARMSOC_SUPPORT_GAMMA
-static void
-drmmode_gamma_set(xf86CrtcPtr crtc, CARD16 *red, CARD16 *green, CARD16 *blue,
-		int size)
-{
-	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
-	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
-	int ret;
+	/* Set the new mode: */
+	crtc->mode = *mode;
+	crtc->x = x;
+	crtc->y = y;
+	crtc->rotation = rotation;
 
-	ret = drmModeCrtcSetGamma(drmmode->fd, drmmode_crtc->crtc_id,
-			size, red, green, blue);
-	if (ret != 0) {
-		xf86DrvMsg(crtc->scrn->scrnIndex, X_ERROR,
-				"failed to set gamma: %s\n", strerror(-ret));
+	output_ids = calloc(sizeof(uint32_t), xf86_config->num_output);
+	if (!output_ids) {
+		ERROR_MSG(
+				"memory allocation failed in drmmode_set_mode_major()");
+		ret = FALSE;
+		goto cleanup;
 	}
-}
-#endif
 
-static const xf86CrtcFuncsRec drmmode_crtc_funcs = {
-		.dpms = drmmode_crtc_dpms,
+	for (i = 0; i < xf86_config->num_output; i++) {
+		xf86OutputPtr output = xf86_config->output[i];
+		struct drmmode_output_priv *drmmode_output;
+
+		if (output->crtc != crtc)
+			continue;
+
+		drmmode_output = output->driver_private;
+		output_ids[output_count] =
+				drmmode_output->connector->connector_id;
+		output_count++;
+	}
+
+	/* Rotate with the primary plane if it can, otherwise the server
+	 * renders the CRTC rotated into a shadow which is scanned out */
+	drmmode_crtc->hw_rotate = drmmode->atomic &&
+			rotation != RR_Rotate_0 && !crtc->transformPresent &&
+			(rotation & drmmode_crtc->hw_rotations) == rotation;
+#if XF86_CRTC_VERSION >= 7
+	crtc->driverIsPerformingTransform = drmmode_crtc->hw_rotate ?
+			XF86DriverTransformOutput : XF86DriverTransformNone;
+#elif XF86_CRTC_VERSION >= 5
+	crtc->driverIsPerformingTransform = drmmode_crtc->hw_rotate;
+#else
+	drmmode_crtc->hw_rotate = FALSE;
+#endif
+
+	if (!xf86CrtcRotate(crtc)) {
+		ERROR_MSG(
+				"failed to assign rotation in drmmode_set_mode_major()");
+		ret = FALSE;
+		goto cleanup;
+	}
+
+	if (crtc->rotatedData && drmmode_crtc->shadow_bo) {
+		fb_id = armsoc_bo_get_fb(drmmode_crtc->shadow_bo);
+		x = y = 0;
+	}
+
+#ifdef HAVE_STRUCT_DRM_COLOR_LUT
+	drmmode_crtc_update_ctm(crtc);
+#endif
+	if (crtc->funcs->gamma_set)
+		crtc->funcs->gamma_set(crtc, crtc->gamma_red, crtc->gamma_green,
+				       crtc->gamma_blue, crtc->gamma_size);
+
+	drmmode_ConvertToKMode(crtc->scrn, &kmode, mode);
+
+	/* Whatever happens below the CRTC ends up on the root framebuffer */
+	drmmode_crtc_set_scanout_bo(drmmode_crtc, NULL, 0);
+
+	err = drmmode_crtc_keep_boot_mode(crtc, fb_id, x, y, &kmode);
+#ifdef DRM_CLIENT_CAP_ATOMIC
+	if (err && drmmode->atomic)
+		err = drmmode_crtc_atomic_set(crtc, fb_id, x, y, &kmode);
+#endif
+	/* the legacy interface cannot rotate the plane */
+	if (err && !drmmode_crtc->hw_rotate)
+		err = drmModeSetCrtc(drmmode->fd, drmmode_crtc->crtc_id,
+				fb_id, x, y, output_ids, output_count, &kmode);
+	if (err) {
+		ERROR_MSG(
+				"drm failed to set mode: %s", strerror(-err));
+
+		ret = FALSE;
+		if (!drmmode_revert_mode(crtc, output_ids, output_count))
+			goto cleanup;
+		else
+			goto done_setting;
+	}
+
+	/* get the actual crtc info */
+	newcrtc = drmModeGetCrtc(drmmode->fd, drmmode_crtc->crtc_id);
+	if (!newcrtc) {
+		ERROR_MSG("couldn't get actual mode back");
+
+		ret = FALSE;
+		if (!drmmode_revert_mode(crtc, output_ids, output_count))
+			goto cleanup;
+		else
+			goto done_setting;
+	}
+
+	if (kmode.hdisplay != newcrtc->mode.hdisplay ||
+		kmode.vdisplay != newcrtc->mode.vdisplay) {
+
+		ERROR_MSG(
+			"drm did not set requested mode! (requested %dx%d, actual %dx%d)",
+			kmode.hdisplay, kmode.vdisplay,
+			newcrtc->mode.hdisplay,
+			newcrtc->mode.vdisplay);
+
+		ret = FALSE;
+		if (!drmmode_revert_mode(crtc, output_ids, output_count))
+			goto cleanup;
+		else
+			goto done_setting;
+	}
+
+	drmmode_get_underscan(drmmode_crtc, &xu, &yu);
+	drmmode_crtc->underscan_x = xu;
+	drmmode_crtc->underscan_y = yu;
+
+	/* When called on a resize, crtc->mode already contains the
+	 * resized values so we can't use this for recovery.
+	 * We can't read it out of the crtc either as mode_valid is 0.
+	 * Instead we save the last good mode set here & fallback to
+	 * that on failure.
+	 */
+	DEBUG_MSG("Saving last good values");
+	drmmode_crtc->last_good_x = crtc->x;
+	drmmode_crtc->last_good_y = crtc->y;
+	drmmode_crtc->last_good_rotation = crtc->rotation;
+	if (drmmode_crtc->last_good_mode) {
+		if (drmmode_crtc->last_good_mode->name)
+			free(drmmode_crtc->last_good_mode->name);
+		free(drmmode_crtc->last_good_mode);
+	}
+	drmmode_crtc->last_good_mode = xf86DuplicateMode(&crtc->mode);
+
+	ret = TRUE;
+
+done_setting:
+	/* outputs may be routed to a different CRTC now */
+	drmmode->props_epoch++;
+	drmmode_crtc->vrr_failed = FALSE;
+	drmmode_crtc->color_failed = FALSE;
+
+	/* Turn on any outputs on this crtc that may have been disabled: */
+	for (i = 0; i < xf86_config->num_output; i++) {
+		xf86OutputPtr output = xf86_config->output[i];
+
+		if (output->crtc != crtc)
+			continue;
+
+		drmmode_output_dpms(output, DPMSModeOn);
+	}
+
+	/* if hw cursor is initialized, reload it */
+	if (drmmode->cursor)
+		xf86_reload_cursors(pScrn->pScreen);
+
+cleanup:
+	if (newcrtc)
+		drmModeFreeCrtc(newcrtc);
+
+	if (output_ids)
+		free(output_ids);
+
+	if (!ret && !drmmode_crtc->last_good_mode) {
+		/* If there was a problem, restore the last good mode: */
+		crtc->x = drmmode_crtc->last_good_x;
+		crtc->y = drmmode_crtc->last_good_y;
+		crtc->rotation = drmmode_crtc->last_good_rotation;
+		crtc->mode = *drmmode_crtc->last_good_mode;
+	}
+
+	TRACE_EXIT();
+	return ret;
+}
+
+static void
+drmmode_hide_cursor(xf86CrtcPtr crtc)
+{
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
+	struct drmmode_cursor_rec *cursor = drmmode->cursor;
+	ScrnInfoPtr pScrn = crtc->scrn;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+
+	if (!cursor)
+		return;
+
+	drmmode_crtc->cursor_visible = FALSE;
+	drmmode_crtc->cursor_pending = FALSE;
+
+	if (pARMSOC->drmmode_interface->cursor_api == HWCURSOR_API_PLANE) {
+		/* a shared plane may have moved on to another CRTC already */
+		if (cursor->ovr && cursor->owner != crtc)
+			return;
+
+		/* set plane's fb_id to 0 to disable it */
+		drmModeSetPlane(drmmode->fd, drmmode_crtc->cursor_ovr->plane_id,
+				drmmode_crtc->crtc_id, 0, 0,
+				0, 0, 0, 0, 0, 0, 0, 0);
+	} else { /* HWCURSOR_API_STANDARD */
+		/* set handle to 0 to disable the cursor */
+		drmModeSetCursor(drmmode->fd, drmmode_crtc->crtc_id,
+				 0, 0, 0);
+	}
+}
+
+/*
+ * The argument "update_image" controls whether the cursor image needs
+ * to be updated by the HW or not. This is ignored by HWCURSOR_API_PLANE
+ * which doesn't allow changing the cursor possition without updating
+ * the image too.
+ */
+static void
+drmmode_show_cursor_image(xf86CrtcPtr crtc, Bool update_image)
+{
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
+	struct drmmode_cursor_rec *cursor = drmmode->cursor;
+	int crtc_x, crtc_y, src_x, src_y;
+	int w, h, pad;
+	ScrnInfoPtr pScrn = crtc->scrn;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+
+	if (!cursor)
+		return;
+
+	drmmode_crtc->cursor_visible = TRUE;
+	drmmode_crtc->cursor_pending = FALSE;
+	drmmode_crtc->cursor_updated = GetTimeInMicros();
+	cursor->updates++;
+
+	w = pARMSOC->drmmode_interface->cursor_width;
+	h = pARMSOC->drmmode_interface->cursor_height;
+	pad = pARMSOC->drmmode_interface->cursor_padding;
+
+	/* get padded width */
+	w = w + 2 * pad;
+	/* get x of padded cursor */
+	crtc_x = drmmode_crtc->cursor_x - pad;
+	crtc_y = drmmode_crtc->cursor_y;
+
+	if (pARMSOC->drmmode_interface->cursor_api == HWCURSOR_API_PLANE) {
+		src_x = 0;
+		src_y = 0;
+
+		/* calculate clipped x, y, w & h if cursor is off edges */
+		if (crtc_x < 0) {
+			src_x += -crtc_x;
+			w -= -crtc_x;
+			crtc_x = 0;
+		}
+
+		if (crtc_y < 0) {
+			src_y += -crtc_y;
+			h -= -crtc_y;
+			crtc_y = 0;
+		}
+
+		if ((crtc_x + w) > crtc->mode.HDisplay)
+			w = crtc->mode.HDisplay - crtc_x;
+
+		if ((crtc_y + h) > crtc->mode.VDisplay)
+			h = crtc->mode.VDisplay - crtc_y;
+
+		crtc_x += drmmode_crtc->underscan_x;
+		crtc_y += drmmode_crtc->underscan_y;
+
+		if (cursor->ovr)
+			cursor->owner = crtc;
+
+		/* note src coords (last 4 args) are in Q16 format */
+		drmModeSetPlane(drmmode->fd, drmmode_crtc->cursor_ovr->plane_id,
+			drmmode_crtc->crtc_id, cursor->current->fb_id, 0,
+			crtc_x, crtc_y, w, h, src_x<<16, src_y<<16,
+			w<<16, h<<16);
+	} else {
+		if (update_image)
+			drmModeSetCursor(drmmode->fd,
+					 drmmode_crtc->crtc_id,
+					 cursor->current->handle, w, h);
+		drmModeMoveCursor(drmmode->fd,
+				  drmmode_crtc->crtc_id,
+				  crtc_x, crtc_y);
+	}
+}
+
+static void
+drmmode_show_cursor(xf86CrtcPtr crtc)
+{
+	drmmode_show_cursor_image(crtc, TRUE);
+}
+
+/* refresh period of the CRTC's mode, in us */
+static int64_t
+drmmode_crtc_frame_period(xf86CrtcPtr crtc)
+{
+	DisplayModePtr mode = &crtc->mode;
+	int64_t period;
+
+	if (!mode->Clock || !mode->HTotal || !mode->VTotal)
+		return 16667;
+
+	period = (int64_t)mode->HTotal * mode->VTotal * 1000 / mode->Clock;
+	if (mode->Flags & V_INTERLACE)
+		period /= 2;
+	if (mode->Flags & V_DBLSCAN)
+		period *= 2;
+	return max(period, 1);
+}
+
+/*
+ * Send the latched cursor position of the CRTCs that have not been sent
+ * one since their last vblank. Returns the time in ms until the next
+ * vblank of a CRTC with a position still latched, or 0 if none is left.
+ */
+static CARD32
+drmmode_cursor_flush_due(ScrnInfoPtr pScrn)
+{
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	CARD64 now = GetTimeInMicros();
+	CARD32 next = 0;
+	int i;
+
+	for (i = 0; i < config->num_crtc; i++) {
+		xf86CrtcPtr crtc = config->crtc[i];
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				crtc->driver_private;
+		CARD64 vblank;
+		CARD32 wait;
+
+		if (!drmmode_crtc->cursor_pending)
+			continue;
+
+		vblank = drmmode_crtc_last_vblank(crtc, now);
+		if (drmmode_crtc->cursor_updated < vblank) {
+			drmmode_show_cursor_image(crtc, FALSE);
+			continue;
+		}
+
+		wait = (vblank + drmmode_crtc_frame_period(crtc) - now + 999)
+				/ 1000;
+		if (!next || wait < next)
+			next = wait;
+	}
+
+	return next;
+}
+
+static CARD32
+drmmode_cursor_timer(OsTimerPtr timer, CARD32 now, pointer arg)
+{
+	return drmmode_cursor_flush_due(arg);
+}
+
+/*
+ * Called from the block handler, so that positions latched while handling
+ * input are sent before going to sleep when their frame is over already.
+ */
+void
+drmmode_cursor_flush(ScrnInfoPtr pScrn)
+{
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+
+	if (drmmode->cursor)
+		drmmode_cursor_flush_due(pScrn);
+}
+
+static void
+drmmode_set_cursor_position(xf86CrtcPtr crtc, int x, int y)
+{
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
+	struct drmmode_cursor_rec *cursor = drmmode->cursor;
+	CARD64 now, vblank;
+
+	if (!cursor)
+		return;
+
+	drmmode_crtc->cursor_x = x;
+	drmmode_crtc->cursor_y = y;
+
+	/*
+	 * The first move in a frame is shown straight away, so the cursor
+	 * never lags behind the pointer. Later moves within the same frame
+	 * only update the position, which is sent once the frame is over
+	 * by the block handler or the timer, whichever comes first. Frames
+	 * are counted from the CRTC's vblanks, so that the position sent
+	 * is the one the display latches at the next of them. The display
+	 * could not show more than one position per frame anyway, and
+	 * HWCURSOR_API_PLANE needs a full drmModeSetPlane for each.
+	 */
+	now = GetTimeInMicros();
+	vblank = drmmode_crtc_last_vblank(crtc, now);
+	if (drmmode_crtc->cursor_updated < vblank) {
+		/*
+		 * Show the cursor at a different possition without updating
+		 * the image when possible (HWCURSOR_API_PLANE doesn't have a
+		 * way to update cursor position without updating the image
+		 * too).
+		 */
+		drmmode_show_cursor_image(crtc, FALSE);
+		return;
+	}
+
+	if (drmmode_crtc->cursor_pending)
+		cursor->coalesced++;
+	drmmode_crtc->cursor_pending = TRUE;
+
+	cursor->timer = TimerSet(cursor->timer, 0,
+			(vblank + drmmode_crtc_frame_period(crtc) - now + 999)
+			/ 1000, drmmode_cursor_timer, crtc->scrn);
+}
+
+/*
+ * The cursor format is ARGB so the image can be copied straight over.
+ * Columns of CURSORPAD blank pixels are maintained down either side
+ * of the destination image. This is a workaround for a bug causing
+ * corruption when the cursor reaches the screen edges in some DRM
+ * drivers.
+ */
+static void set_cursor_image(xf86CrtcPtr crtc, uint32_t *d, CARD32 *s)
+{
+	ScrnInfoPtr pScrn = crtc->scrn;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	int row;
+	void *dst;
+	const char *src_row;
+	char *dst_row;
+	uint32_t cursorh = pARMSOC->drmmode_interface->cursor_height;
+	uint32_t cursorw = pARMSOC->drmmode_interface->cursor_width;
+	uint32_t cursorpad = pARMSOC->drmmode_interface->cursor_padding;
+
+	dst = d;
+	for (row = 0; row < cursorh; row += 1) {
+		/* we're operating with ARGB data (4 bytes per pixel) */
+		src_row = (const char *)s + row * 4 * cursorw;
+		dst_row = (char *)dst + row * 4 * (cursorw + 2 * cursorpad);
+
+		/* set first CURSORPAD pixels in row to 0 */
+		memset(dst_row, 0, (4 * cursorpad));
+		/* copy cursor image pixel row across */
+		memcpy(dst_row + (4 * cursorpad), src_row, 4 * cursorw);
+		/* set last CURSORPAD pixels in row to 0 */
+		memset(dst_row + 4 * (cursorpad + cursorw),
+				0, (4 * cursorpad));
+	}
+}
+
+/*
+ * Does the cursor buffer hold the given image? Compared row by row as the
+ * buffer is padded.
+ */
+static Bool
+cursor_image_equal(xf86CrtcPtr crtc, const uint32_t *d, const CARD32 *s)
+{
+	ScrnInfoPtr pScrn = crtc->scrn;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	uint32_t cursorh = pARMSOC->drmmode_interface->cursor_height;
+	uint32_t cursorw = pARMSOC->drmmode_interface->cursor_width;
+	uint32_t cursorpad = pARMSOC->drmmode_interface->cursor_padding;
+	int row;
+
+	for (row = 0; row < cursorh; row++) {
+		if (memcmp(d + row * (cursorw + 2 * cursorpad) + cursorpad,
+				s + row * cursorw, 4 * cursorw))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Switch to the cursor image, loading it into the least recently used
+ * buffer unless it is loaded already. The buffer being shown is never
+ * written to while there is another one, so loading an image neither
+ * tears nor needs the cursor hidden.
+ */
+static void
+drmmode_load_cursor_argb(xf86CrtcPtr crtc, CARD32 *image)
+{
+	uint32_t *d;
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
+	struct drmmode_cursor_rec *cursor = drmmode->cursor;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(crtc->scrn);
+	struct drmmode_cursor_image *img, *victim = NULL;
+	uint32_t hash;
+	int visible, i;
+
+	if (!cursor)
+		return;
+
+	visible = drmmode_crtc->cursor_visible;
+	hash = drmmode_hash(image,
+			pARMSOC->drmmode_interface->cursor_width *
+			pARMSOC->drmmode_interface->cursor_height);
+
+	for (i = 0; i < cursor->num_images; i++) {
+		img = &cursor->images[i];
+
+		if (img->loaded && img->hash == hash) {
+			d = armsoc_bo_map(img->bo);
+			if (d && cursor_image_equal(crtc, d, image))
+				break;
+		}
+
+		if (cursor->num_images > 1 && img == cursor->current)
+			continue;
+		if (!victim || img->last_used < victim->last_used)
+			victim = img;
+	}
+
+	if (i < cursor->num_images) {
+		/* seen before, no copy needed */
+		img = &cursor->images[i];
+	} else {
+		img = victim;
+
+		/* with a single buffer, it has to be rewritten in place */
+		if (visible && img == cursor->current)
+			drmmode_hide_cursor(crtc);
+
+		d = armsoc_bo_map(img->bo);
+		if (!d) {
+			xf86DrvMsg(crtc->scrn->scrnIndex, X_ERROR,
+				"load_cursor_argb map failure\n");
+			if (visible)
+				drmmode_show_cursor_image(crtc, TRUE);
+			return;
+		}
+
+		set_cursor_image(crtc, d, image);
+		img->loaded = TRUE;
+		img->hash = hash;
+	}
+
+	img->last_used = ++cursor->use_count;
+	cursor->current = img;
+
+	if (visible)
+		drmmode_show_cursor_image(crtc, TRUE);
+}
+
+/*
+ * Allocate the buffers for the cursor images, with a framebuffer around
+ * each for HWCURSOR_API_PLANE. At least one is needed, more are just nice
+ * to have.
+ */
+static Bool
+drmmode_cursor_images_init(ScrnInfoPtr pScrn, struct drmmode_cursor_rec *cursor)
+{
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+	int w, h, pad, i;
+	uint32_t handles[4], pitches[4], offsets[4]; /* we only use [0] */
+
+	w = pARMSOC->drmmode_interface->cursor_width;
+	h = pARMSOC->drmmode_interface->cursor_height;
+	pad = pARMSOC->drmmode_interface->cursor_padding;
+
+	for (i = 0; i < ARMSOC_CURSOR_IMAGES; i++) {
+		struct drmmode_cursor_image *img = &cursor->images[i];
+
+		/* allow for cursor padding in the bo */
+		img->bo = armsoc_bo_new_with_dim(pARMSOC->dev,
+					w + 2 * pad, h,
+					0, 32, ARMSOC_BO_SCANOUT);
+		if (!img->bo)
+			break;
+
+		if (pARMSOC->drmmode_interface->cursor_api !=
+				HWCURSOR_API_PLANE) {
+			img->handle = armsoc_bo_handle(img->bo);
+			continue;
+		}
+
+		handles[0] = armsoc_bo_handle(img->bo);
+		pitches[0] = armsoc_bo_pitch(img->bo);
+		offsets[0] = 0;
+
+		/* allow for cursor padding in the fb */
+		if (drmModeAddFB2(drmmode->fd, w + 2 * pad, h,
+				DRM_FORMAT_ARGB8888, handles, pitches, offsets,
+				&img->fb_id, 0)) {
+			ERROR_MSG("HW cursor: drmModeAddFB2 failed: %s",
+						strerror(errno));
+			armsoc_bo_unreference(img->bo);
+			img->bo = NULL;
+			break;
+		}
+	}
+
+	if (i == 0) {
+		ERROR_MSG("HW cursor: buffer allocation failed");
+		return FALSE;
+	}
+
+	cursor->num_images = i;
+	cursor->current = &cursor->images[0];
+	return TRUE;
+}
+
+static void
+drmmode_cursor_images_fini(ScrnInfoPtr pScrn,
+		struct drmmode_cursor_rec *cursor)
+{
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+	int i;
+
+	for (i = 0; i < cursor->num_images; i++) {
+		struct drmmode_cursor_image *img = &cursor->images[i];
+
+		if (img->fb_id && drmModeRmFB(drmmode->fd, img->fb_id))
+			ERROR_MSG("drmModeRmFB() failed");
+		armsoc_bo_unreference(img->bo);
+	}
+
+	cursor->num_images = 0;
+	cursor->current = NULL;
+}
+
+/*
+ * Is the plane used for the cursor of any CRTC?
+ */
+static Bool
+drmmode_plane_is_cursor(ScrnInfoPtr pScrn, uint32_t plane_id)
+{
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	int i;
+
+	for (i = 0; i < config->num_crtc; i++) {
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				config->crtc[i]->driver_private;
+
+		if (drmmode_crtc->cursor_ovr &&
+				drmmode_crtc->cursor_ovr->plane_id == plane_id)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+static void
+drmmode_cursor_planes_fini(ScrnInfoPtr pScrn,
+		struct drmmode_cursor_rec *cursor)
+{
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	int i;
+
+	for (i = 0; i < config->num_crtc; i++) {
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				config->crtc[i]->driver_private;
+
+		if (!cursor->ovr && drmmode_crtc->cursor_ovr)
+			drmModeFreePlane(drmmode_crtc->cursor_ovr);
+		drmmode_crtc->cursor_ovr = NULL;
+	}
+
+	if (cursor->ovr)
+		drmModeFreePlane(cursor->ovr);
+	cursor->ovr = NULL;
+	cursor->owner = NULL;
+}
+
+/*
+ * The type of a plane. Only overlay planes are listed without atomic
+ * modesetting, which is when the kernel lists them all.
+ */
+static uint64_t
+drmmode_plane_type(struct drmmode_rec *drmmode, uint32_t plane_id)
+{
+#ifdef DRM_CLIENT_CAP_ATOMIC
+	struct drmmode_prop_info info;
+
+	if (drmmode->atomic && drmmode_prop_info_init(drmmode->fd, plane_id,
+			DRM_MODE_OBJECT_PLANE, &info,
+			&plane_props[DRMMODE_PLANE_TYPE], 1))
+		return info.value;
+#endif
+	return DRM_PLANE_TYPE_OVERLAY;
+}
+
+/* number of CRTCs in a possible_crtcs mask */
+static int
+drmmode_crtc_count(uint32_t possible_crtcs)
+{
+	int count = 0;
+
+	for (; possible_crtcs; possible_crtcs &= possible_crtcs - 1)
+		count++;
+	return count;
+}
+
+/*
+ * Give each CRTC a plane of its own for the cursor, so that it can be
+ * shown on every head at once and moving between heads only updates the
+ * position on each plane. Cursor planes are used, and overlay planes too
+ * if overlays is set. The CRTCs with the fewest planes to choose from are
+ * served first, each with a cursor plane if it can have one and else the
+ * plane the fewest other CRTCs can use. Returns FALSE if there are not
+ * enough planes that can be used with the CRTCs.
+ */
+static Bool
+drmmode_cursor_planes_per_crtc(ScrnInfoPtr pScrn,
+		drmModePlaneRes *plane_resources, Bool overlays)
+{
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	int count = plane_resources->count_planes;
+	drmModePlanePtr *planes;
+	Bool *cursor_type;
+	Bool ret = TRUE;
+	int c, i, n;
+
+	planes = calloc(count, sizeof(*planes));
+	cursor_type = calloc(count, sizeof(*cursor_type));
+	if (!planes || !cursor_type) {
+		free(planes);
+		free(cursor_type);
+		return FALSE;
+	}
+
+	for (i = 0; i < count; i++) {
+		uint32_t plane_id = plane_resources->planes[i];
+		uint64_t type = drmmode_plane_type(drmmode, plane_id);
+
+		if (type == DRM_PLANE_TYPE_PRIMARY ||
+				(type == DRM_PLANE_TYPE_OVERLAY && !overlays))
+			continue;
+
+		planes[i] = drmModeGetPlane(drmmode->fd, plane_id);
+		cursor_type[i] = type == DRM_PLANE_TYPE_CURSOR;
+	}
+
+	for (n = 0; n < config->num_crtc && ret; n++) {
+		struct drmmode_crtc_private_rec *drmmode_crtc = NULL;
+		int best_choice = count + 1, best = -1;
+
+		/* the CRTC left with the fewest planes to choose from */
+		for (c = 0; c < config->num_crtc; c++) {
+			struct drmmode_crtc_private_rec *other =
+					config->crtc[c]->driver_private;
+			int choice = 0;
+
+			if (other->cursor_ovr)
+				continue;
+
+			for (i = 0; i < count; i++)
+				if (planes[i] && (planes[i]->possible_crtcs &
+						(1 << other->index)))
+					choice++;
+
+			if (choice < best_choice) {
+				best_choice = choice;
+				drmmode_crtc = other;
+			}
+		}
+
+		for (i = 0; i < count; i++) {
+			if (!planes[i] || !(planes[i]->possible_crtcs &
+					(1 << drmmode_crtc->index)))
+				continue;
+
+			if (best < 0 || cursor_type[i] > cursor_type[best] ||
+					(cursor_type[i] == cursor_type[best] &&
+					drmmode_crtc_count(
+						planes[i]->possible_crtcs) <
+					drmmode_crtc_count(
+						planes[best]->possible_crtcs)))
+				best = i;
+		}
+
+		if (best < 0) {
+			ret = FALSE;
+			break;
+		}
+
+		drmmode_crtc->cursor_ovr = planes[best];
+		planes[best] = NULL;
+	}
+
+	for (i = 0; i < count; i++)
+		if (planes[i])
+			drmModeFreePlane(planes[i]);
+	free(planes);
+	free(cursor_type);
+	return ret;
+}
+
+/*
+ * Fall back to a single plane for all CRTCs.  Note that we cheat a bit,
+ * in order to not burn one overlay per crtc, and only show the mouse
+ * cursor on one crtc at a time
+ */
+static Bool
+drmmode_cursor_plane_shared(ScrnInfoPtr pScrn,
+		struct drmmode_cursor_rec *cursor,
+		drmModePlaneRes *plane_resources)
+{
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	int i, pick = -1;
+
+	/* a cursor plane if there is one, with atomic modesetting the CRTCs'
+	 * primary planes are listed too */
+	for (i = 0; i < plane_resources->count_planes; i++) {
+		uint64_t type = drmmode_plane_type(drmmode,
+				plane_resources->planes[i]);
+
+		if (type == DRM_PLANE_TYPE_CURSOR) {
+			pick = i;
+			break;
+		}
+		if (type != DRM_PLANE_TYPE_PRIMARY && pick < 0)
+			pick = i;
+	}
+
+	if (pick < 0) {
+		ERROR_MSG("not enough planes for HW cursor");
+		return FALSE;
+	}
+
+	cursor->ovr = drmModeGetPlane(drmmode->fd,
+			plane_resources->planes[pick]);
+	if (!cursor->ovr) {
+		ERROR_MSG("HW cursor: drmModeGetPlane failed: %s",
+					strerror(errno));
+		return FALSE;
+	}
+
+	for (i = 0; i < config->num_crtc; i++) {
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				config->crtc[i]->driver_private;
+
+		drmmode_crtc->cursor_ovr = cursor->ovr;
+	}
+
+	return TRUE;
+}
+
+static Bool
+drmmode_cursor_init_plane(ScreenPtr pScreen)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	struct drmmode_cursor_rec *cursor;
+	drmModePlaneRes *plane_resources;
+	Bool ok;
+	int w, h, i;
+
+	if (drmmode->cursor) {
+		INFO_MSG("cursor already initialized");
+		return TRUE;
+	}
+
+	if (!xf86LoaderCheckSymbol("drmModeGetPlaneResources")) {
+		ERROR_MSG(
+				"HW cursor not supported (needs libdrm 2.4.30 or higher)");
+		return FALSE;
+	}
+
+	plane_resources = drmModeGetPlaneResources(drmmode->fd);
+	if (!plane_resources) {
+		ERROR_MSG("HW cursor: drmModeGetPlaneResources failed: %s",
+						strerror(errno));
+		return FALSE;
+	}
+
+	cursor = calloc(1, sizeof(struct drmmode_cursor_rec));
+	if (!cursor) {
+		ERROR_MSG("HW cursor: calloc failed");
+		drmModeFreePlaneResources(plane_resources);
+		return FALSE;
+	}
+
+	/* overlay planes are left to windows if they are to have them */
+	ok = drmmode_cursor_planes_per_crtc(pScrn, plane_resources, FALSE);
+	if (!ok && !pARMSOC->overlays) {
+		drmmode_cursor_planes_fini(pScrn, cursor);
+		ok = drmmode_cursor_planes_per_crtc(pScrn, plane_resources,
+				TRUE);
+	}
+	if (!ok) {
+		drmmode_cursor_planes_fini(pScrn, cursor);
+		if (!drmmode_cursor_plane_shared(pScrn, cursor,
+				plane_resources))
+			goto fail;
+	}
+
+	drmModeFreePlaneResources(plane_resources);
+	plane_resources = NULL;
+
+	for (i = 0; i < config->num_crtc; i++) {
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				config->crtc[i]->driver_private;
+
+		if (i && cursor->ovr)
+			break;
+
+		if (pARMSOC->drmmode_interface->init_plane_for_cursor &&
+			pARMSOC->drmmode_interface->init_plane_for_cursor(
+				drmmode->fd, drmmode_crtc->cursor_ovr->plane_id)) {
+			ERROR_MSG("Failed driver-specific cursor initialization");
+			goto fail;
+		}
+	}
+
+	w = pARMSOC->drmmode_interface->cursor_width;
+	h = pARMSOC->drmmode_interface->cursor_height;
+
+	/* the framebuffers of the cursor images are shown on whichever
+	 * planes need them */
+	if (!drmmode_cursor_images_init(pScrn, cursor))
+		goto fail;
+
+	if (!xf86_cursors_init(pScreen, w, h, HARDWARE_CURSOR_ARGB)) {
+		ERROR_MSG("xf86_cursors_init() failed");
+		drmmode_cursor_images_fini(pScrn, cursor);
+		goto fail;
+	}
+
+	INFO_MSG("HW cursor initialized, %s",
+			cursor->ovr ? "one plane shared by all CRTCs" :
+				"one plane per CRTC");
+	drmmode->cursor = cursor;
+	return TRUE;
+
+fail:
+	drmmode_cursor_planes_fini(pScrn, cursor);
+	free(cursor);
+	if (plane_resources)
+		drmModeFreePlaneResources(plane_resources);
+	return FALSE;
+}
+
+static Bool
+drmmode_cursor_init_standard(ScreenPtr pScreen)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+	struct drmmode_cursor_rec *cursor;
+	int w, h;
+
+	if (drmmode->cursor) {
+		INFO_MSG("cursor already initialized");
+		return TRUE;
+	}
+
+	if (!xf86LoaderCheckSymbol("drmModeSetCursor") ||
+	    !xf86LoaderCheckSymbol("drmModeMoveCursor")) {
+		ERROR_MSG(
+				"Standard HW cursor not supported (needs libdrm 2.4.3 or higher)");
+		return FALSE;
+	}
+
+	cursor = calloc(1, sizeof(struct drmmode_cursor_rec));
+	if (!cursor) {
+		ERROR_MSG("HW cursor (standard): calloc failed");
+		return FALSE;
+	}
+
+	w = pARMSOC->drmmode_interface->cursor_width;
+	h = pARMSOC->drmmode_interface->cursor_height;
+
+	if (!drmmode_cursor_images_init(pScrn, cursor)) {
+		free(cursor);
+		return FALSE;
+	}
+
+	if (!xf86_cursors_init(pScreen, w, h, HARDWARE_CURSOR_ARGB)) {
+		ERROR_MSG("xf86_cursors_init() failed");
+		drmmode_cursor_images_fini(pScrn, cursor);
+		free(cursor);
+		return FALSE;
+	}
+
+	INFO_MSG("HW cursor initialized");
+	drmmode->cursor = cursor;
+	return TRUE;
+}
+
+Bool drmmode_cursor_init(ScreenPtr pScreen)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+
+	INFO_MSG("HW cursor init()");
+
+	if (pARMSOC->drmmode_interface->cursor_api == HWCURSOR_API_PLANE)
+		return drmmode_cursor_init_plane(pScreen);
+	else /* HWCURSOR_API_STANDARD */
+		return drmmode_cursor_init_standard(pScreen);
+}
+
+void drmmode_cursor_fini(ScreenPtr pScreen)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+	struct drmmode_cursor_rec *cursor = drmmode->cursor;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+
+	if (!cursor)
+		return;
+
+	drmmode->cursor = NULL;
+	TimerFree(cursor->timer);
+	INFO_MSG("HW cursor: %lu position updates, %lu coalesced",
+			cursor->updates, cursor->coalesced);
+	xf86_cursors_fini(pScreen);
+	drmmode_cursor_images_fini(pScrn, cursor);
+	if (pARMSOC->drmmode_interface->cursor_api == HWCURSOR_API_PLANE)
+		drmmode_cursor_planes_fini(pScrn, cursor);
+	free(cursor);
+}
+
+
+/*
+ * Entry i of a gamma ramp resampled from size to count entries.
+ */
+static uint16_t
+drmmode_gamma_sample(const CARD16 *ramp, int size, int i, int count)
+{
+	uint64_t pos, frac;
+	int j;
+
+	if (count == size)
+		return ramp[i];
+	if (count < 2 || size < 2)
+		return ramp[0];
+
+	/* position in the ramp in 16.16 fixed point */
+	pos = ((uint64_t)i * (size - 1) << 16) / (count - 1);
+	j = pos >> 16;
+	frac = pos & 0xffff;
+	if (j >= size - 1)
+		return ramp[size - 1];
+	return (ramp[j] * (0x10000 - frac) + ramp[j + 1] * frac) >> 16;
+}
+
+/*
+ * Without GAMMA_LUT, load the ramp into the legacy gamma table straight
+ * away, at the size the kernel has for it.
+ */
+static void
+drmmode_crtc_legacy_gamma(xf86CrtcPtr crtc)
+{
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	int count = drmmode_crtc->legacy_gamma_size;
+	int size = drmmode_crtc->gamma_size;
+	uint16_t *lut;
+	int i, ret;
+
+	if (count <= 0)
+		return;
+
+	lut = malloc(3 * count * sizeof(*lut));
+	if (!lut)
+		return;
+
+	for (i = 0; i < count; i++) {
+		lut[i] = drmmode_gamma_sample(drmmode_crtc->gamma, size,
+				i, count);
+		lut[count + i] = drmmode_gamma_sample(
+				drmmode_crtc->gamma + size, size, i, count);
+		lut[2 * count + i] = drmmode_gamma_sample(
+				drmmode_crtc->gamma + 2 * size, size, i, count);
+	}
+
+	ret = drmModeCrtcSetGamma(drmmode_crtc->drmmode->fd,
+			drmmode_crtc->crtc_id, count, lut, lut + count,
+			lut + 2 * count);
+	if (ret != 0) {
+		xf86DrvMsg(crtc->scrn->scrnIndex, X_ERROR,
+				"failed to set gamma: %s\n", strerror(-ret));
+	}
+	free(lut);
+}
+
+static void
+drmmode_gamma_set(xf86CrtcPtr crtc, CARD16 *red, CARD16 *green, CARD16 *blue,
+		int size)
+{
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+
+	if (size != drmmode_crtc->gamma_size) {
+		free(drmmode_crtc->gamma);
+		drmmode_crtc->gamma = malloc(3 * size * sizeof(CARD16));
+		drmmode_crtc->gamma_size = drmmode_crtc->gamma ? size : 0;
+		if (!drmmode_crtc->gamma)
+			return;
+	}
+	memcpy(drmmode_crtc->gamma, red, size * sizeof(CARD16));
+	memcpy(drmmode_crtc->gamma + size, green, size * sizeof(CARD16));
+	memcpy(drmmode_crtc->gamma + 2 * size, blue, size * sizeof(CARD16));
+
+#ifdef HAVE_STRUCT_DRM_COLOR_LUT
+	if (drmmode_crtc->props[DRMMODE_CRTC_GAMMA_LUT].prop_id &&
+			drmmode_crtc->props[DRMMODE_CRTC_GAMMA_LUT_SIZE].value) {
+		/* sent along with the next flip, or before we block */
+		drmmode_crtc->color_pending = TRUE;
+		drmmode_crtc->color_failed = FALSE;
+		return;
+	}
+#endif
+	drmmode_crtc_legacy_gamma(crtc);
+}
+
+#ifdef HAVE_STRUCT_DRM_COLOR_LUT
+/*
+ * Make blobs of the CRTC's gamma ramp, resampled to the size of its
+ * GAMMA_LUT, and of its CTM. A blob id of 0 turns the stage off.
+ */
+static int
+drmmode_crtc_color_blobs(struct drmmode_crtc_private_rec *drmmode_crtc,
+		uint32_t *gamma_blob_id, uint32_t *ctm_blob_id)
+{
+	int fd = drmmode_crtc->drmmode->fd;
+	int count = drmmode_crtc->props[DRMMODE_CRTC_GAMMA_LUT_SIZE].value;
+	int size = drmmode_crtc->gamma_size;
+	int i, ret = 0;
+
+	*gamma_blob_id = *ctm_blob_id = 0;
+
+	if (drmmode_crtc->props[DRMMODE_CRTC_GAMMA_LUT].prop_id &&
+			drmmode_crtc->gamma && count > 0) {
+		struct drm_color_lut *lut = calloc(count, sizeof(*lut));
+
+		if (!lut)
+			return -1;
+		for (i = 0; i < count; i++) {
+			lut[i].red = drmmode_gamma_sample(drmmode_crtc->gamma,
+					size, i, count);
+			lut[i].green = drmmode_gamma_sample(
+					drmmode_crtc->gamma + size,
+					size, i, count);
+			lut[i].blue = drmmode_gamma_sample(
+					drmmode_crtc->gamma + 2 * size,
+					size, i, count);
+		}
+		ret = drmModeCreatePropertyBlob(fd, lut,
+				count * sizeof(*lut), gamma_blob_id);
+		free(lut);
+		if (ret)
+			return ret;
+	}
+
+	if (drmmode_crtc->props[DRMMODE_CRTC_CTM].prop_id &&
+			drmmode_crtc->has_ctm) {
+		struct drm_color_ctm ctm;
+
+		memcpy(ctm.matrix, drmmode_crtc->ctm, sizeof(ctm.matrix));
+		ret = drmModeCreatePropertyBlob(fd, &ctm, sizeof(ctm),
+				ctm_blob_id);
+		if (ret && *gamma_blob_id) {
+			drmModeDestroyPropertyBlob(fd, *gamma_blob_id);
+			*gamma_blob_id = 0;
+		}
+	}
+	return ret;
+}
+
+/*
+ * Keep the blobs the kernel took, or else the ones it still has.
+ */
+static void
+drmmode_crtc_color_done(struct drmmode_crtc_private_rec *drmmode_crtc,
+		uint32_t gamma_blob_id, uint32_t ctm_blob_id, Bool ok)
+{
+	int fd = drmmode_crtc->drmmode->fd;
+
+	/* the kernel holds on to blobs in use, ours can go once replaced */
+	if (ok) {
+		if (drmmode_crtc->gamma_blob_id)
+			drmModeDestroyPropertyBlob(fd,
+					drmmode_crtc->gamma_blob_id);
+		if (drmmode_crtc->ctm_blob_id)
+			drmModeDestroyPropertyBlob(fd,
+					drmmode_crtc->ctm_blob_id);
+		drmmode_crtc->gamma_blob_id = gamma_blob_id;
+		drmmode_crtc->ctm_blob_id = ctm_blob_id;
+	} else {
+		if (gamma_blob_id)
+			drmModeDestroyPropertyBlob(fd, gamma_blob_id);
+		if (ctm_blob_id)
+			drmModeDestroyPropertyBlob(fd, ctm_blob_id);
+	}
+}
+
+/*
+ * Settle the colour correction of a CRTC once the kernel took it or not.
+ * What it refused stays pending.
+ */
+static void
+drmmode_crtc_color_result(struct drmmode_crtc_private_rec *drmmode_crtc,
+		uint32_t gamma_blob_id, uint32_t ctm_blob_id, Bool ok)
+{
+	drmmode_crtc_color_done(drmmode_crtc, gamma_blob_id, ctm_blob_id, ok);
+	drmmode_crtc->color_pending = !ok;
+	drmmode_crtc->color_failed = !ok;
+}
+
+#ifdef DRM_CLIENT_CAP_ATOMIC
+/*
+ * Add the pending colour correction of a CRTC to an atomic request. The
+ * new blobs are staged until drmmode_crtc_color_unstage() is told whether
+ * the commit went through. DEGAMMA_LUT is turned off: the CTM works on
+ * the values the framebuffer holds.
+ */
+static int
+drmmode_crtc_color_stage(drmModeAtomicReqPtr req,
+		struct drmmode_crtc_private_rec *drmmode_crtc)
+{
+	const struct drmmode_prop_info *props = drmmode_crtc->props;
+	uint32_t crtc_id = drmmode_crtc->crtc_id;
+	uint32_t gamma_blob_id, ctm_blob_id;
+	int ret = 0;
+
+	if (drmmode_crtc_color_blobs(drmmode_crtc, &gamma_blob_id,
+			&ctm_blob_id)) {
+		drmmode_crtc->color_failed = TRUE;
+		return -1;
+	}
+
+	if (props[DRMMODE_CRTC_GAMMA_LUT].prop_id)
+		ret |= drmmode_atomic_add(req, crtc_id,
+				&props[DRMMODE_CRTC_GAMMA_LUT], gamma_blob_id);
+	if (props[DRMMODE_CRTC_DEGAMMA_LUT].prop_id)
+		ret |= drmmode_atomic_add(req, crtc_id,
+				&props[DRMMODE_CRTC_DEGAMMA_LUT], 0);
+	if (props[DRMMODE_CRTC_CTM].prop_id)
+		ret |= drmmode_atomic_add(req, crtc_id,
+				&props[DRMMODE_CRTC_CTM], ctm_blob_id);
+
+	drmmode_crtc->color_staged = TRUE;
+	drmmode_crtc->new_gamma_blob_id = gamma_blob_id;
+	drmmode_crtc->new_ctm_blob_id = ctm_blob_id;
+	return ret;
+}
+
+static void
+drmmode_crtc_color_unstage(struct drmmode_crtc_private_rec *drmmode_crtc,
+		Bool ok)
+{
+	if (!drmmode_crtc->color_staged)
+		return;
+
+	drmmode_crtc_color_result(drmmode_crtc,
+			drmmode_crtc->new_gamma_blob_id,
+			drmmode_crtc->new_ctm_blob_id, ok);
+	drmmode_crtc->color_staged = FALSE;
+}
+
+/*
+ * Add the pending colour correction of the CRTCs in crtc_mask to an atomic
+ * flip. Returns whether any was added.
+ */
+static Bool
+drmmode_color_stage_flip(ScrnInfoPtr pScrn, drmModeAtomicReqPtr req,
+		unsigned int crtc_mask)
+{
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	Bool staged = FALSE;
+	int i;
+
+	for (i = 0; i < config->num_crtc; i++) {
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				config->crtc[i]->driver_private;
+		int cursor = drmModeAtomicGetCursor(req);
+
+		if (!(crtc_mask & (1 << i)) ||
+				!drmmode_crtc->color_pending ||
+				drmmode_crtc->color_failed)
+			continue;
+
+		if (drmmode_crtc_color_stage(req, drmmode_crtc)) {
+			/* the flip goes ahead without it */
+			drmModeAtomicSetCursor(req, cursor);
+			drmmode_crtc_color_unstage(drmmode_crtc, FALSE);
+			continue;
+		}
+		staged = TRUE;
+	}
+	return staged;
+}
+
+/*
+ * Settle the colour correction added to an atomic flip. If the flip failed
+ * for other reasons than the colour correction being refused, it is tried
+ * again with the next one.
+ */
+static void
+drmmode_color_unstage_flip(ScrnInfoPtr pScrn, Bool ok, Bool refused)
+{
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	int i;
+
+	for (i = 0; i < config->num_crtc; i++) {
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				config->crtc[i]->driver_private;
+		Bool staged = drmmode_crtc->color_staged;
+
+		drmmode_crtc_color_unstage(drmmode_crtc, ok);
+		if (staged && !ok && !refused)
+			drmmode_crtc->color_failed = FALSE;
+	}
+	if (refused)
+		ERROR_MSG("failed to set colour correction");
+}
+#endif
+
+/*
+ * Send the colour correction of the CRTCs that changed it to the kernel.
+ * With atomic modesetting it goes along with the next flip of the CRTC,
+ * and only while no flip is pending does it get a commit of its own here,
+ * a single one for all CRTCs. Any number of gamma or CTM changes before
+ * then end up in one update.
+ */
+void
+drmmode_color_flush(ScrnInfoPtr pScrn)
+{
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+#ifdef DRM_CLIENT_CAP_ATOMIC
+	drmModeAtomicReqPtr req = NULL;
+#endif
+	int i, ret = 0, failed = 0;
+
+#ifdef DRM_CLIENT_CAP_ATOMIC
+	if (drmmode->atomic && ARMSOCPTR(pScrn)->pending_flips > 0)
+		return;
+#endif
+
+	for (i = 0; i < config->num_crtc; i++) {
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				config->crtc[i]->driver_private;
+		const struct drmmode_prop_info *props = drmmode_crtc->props;
+		uint32_t gamma_blob_id, ctm_blob_id;
+		uint32_t crtc_id = drmmode_crtc->crtc_id;
+
+		if (!drmmode_crtc->color_pending || drmmode_crtc->color_failed)
+			continue;
+
+#ifdef DRM_CLIENT_CAP_ATOMIC
+		if (drmmode->atomic) {
+			if (!req)
+				req = drmModeAtomicAlloc();
+			if (!req || drmmode_crtc_color_stage(req,
+					drmmode_crtc))
+				ret = -1;
+			continue;
+		}
+#endif
+		if (drmmode_crtc_color_blobs(drmmode_crtc, &gamma_blob_id,
+				&ctm_blob_id)) {
+			ERROR_MSG("CRTC %d: cannot create colour blobs",
+					crtc_id);
+			drmmode_crtc->color_failed = TRUE;
+			continue;
+		}
+
+		ret = 0;
+		if (props[DRMMODE_CRTC_GAMMA_LUT].prop_id)
+			ret |= drmModeObjectSetProperty(drmmode->fd,
+				crtc_id, DRM_MODE_OBJECT_CRTC,
+				props[DRMMODE_CRTC_GAMMA_LUT].prop_id,
+				gamma_blob_id);
+		if (props[DRMMODE_CRTC_DEGAMMA_LUT].prop_id)
+			ret |= drmModeObjectSetProperty(drmmode->fd,
+				crtc_id, DRM_MODE_OBJECT_CRTC,
+				props[DRMMODE_CRTC_DEGAMMA_LUT].prop_id,
+				0);
+		if (props[DRMMODE_CRTC_CTM].prop_id)
+			ret |= drmModeObjectSetProperty(drmmode->fd,
+				crtc_id, DRM_MODE_OBJECT_CRTC,
+				props[DRMMODE_CRTC_CTM].prop_id,
+				ctm_blob_id);
+		drmmode_crtc_color_result(drmmode_crtc, gamma_blob_id,
+				ctm_blob_id, !ret);
+		failed |= ret;
+	}
+
+#ifdef DRM_CLIENT_CAP_ATOMIC
+	if (drmmode->atomic) {
+		if (req && !ret)
+			ret = drmmode_atomic_commit(drmmode, req, 0, NULL);
+		drmModeAtomicFree(req);
+		failed |= ret;
+
+		for (i = 0; i < config->num_crtc; i++) {
+			struct drmmode_crtc_private_rec *drmmode_crtc =
+					config->crtc[i]->driver_private;
+
+			drmmode_crtc_color_unstage(drmmode_crtc, !ret);
+		}
+	}
+#endif
+	if (failed)
+		ERROR_MSG("failed to set colour correction");
+}
+
+/*
+ * Let go of the colour blobs of a CRTC. The kernel keeps those still in
+ * use for as long as it needs them.
+ */
+static void
+drmmode_crtc_color_fini(struct drmmode_crtc_private_rec *drmmode_crtc)
+{
+	int fd = drmmode_crtc->drmmode->fd;
+
+	if (drmmode_crtc->gamma_blob_id)
+		drmModeDestroyPropertyBlob(fd, drmmode_crtc->gamma_blob_id);
+	if (drmmode_crtc->ctm_blob_id)
+		drmModeDestroyPropertyBlob(fd, drmmode_crtc->ctm_blob_id);
+	drmmode_crtc->gamma_blob_id = 0;
+	drmmode_crtc->ctm_blob_id = 0;
+	drmmode_crtc->color_pending = TRUE;
+}
+
+/*
+ * Give the CRTC the CTM of the output(s) it drives.
+ */
+static void
+drmmode_crtc_update_ctm(xf86CrtcPtr crtc)
+{
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(crtc->scrn);
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	Bool has_ctm = FALSE;
+	uint64_t ctm[9];
+	int i;
+
+	if (!drmmode_crtc->props[DRMMODE_CRTC_CTM].prop_id)
+		return;
+
+	for (i = 0; i < config->num_output; i++) {
+		struct drmmode_output_priv *drmmode_output =
+				config->output[i]->driver_private;
+
+		if (config->output[i]->crtc != crtc ||
+				!drmmode_output->has_ctm)
+			continue;
+		has_ctm = TRUE;
+		memcpy(ctm, drmmode_output->ctm, sizeof(ctm));
+		break;
+	}
+
+	if (has_ctm == drmmode_crtc->has_ctm && (!has_ctm ||
+			!memcmp(ctm, drmmode_crtc->ctm, sizeof(ctm))))
+		return;
+
+	drmmode_crtc->has_ctm = has_ctm;
+	if (has_ctm)
+		memcpy(drmmode_crtc->ctm, ctm, sizeof(ctm));
+	drmmode_crtc->color_pending = TRUE;
+	drmmode_crtc->color_failed = FALSE;
+}
+#else
+void
+drmmode_color_flush(ScrnInfoPtr pScrn)
+{
+}
+
+static void
+drmmode_crtc_color_fini(struct drmmode_crtc_private_rec *drmmode_crtc)
+{
+}
+#endif
+
+static void *
+drmmode_shadow_allocate(xf86CrtcPtr crtc, int width, int height)
+{
+	ScrnInfoPtr pScrn = crtc->scrn;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct armsoc_bo *bo;
+	void *data;
+
+	bo = armsoc_bo_new_with_dim(pARMSOC->dev, width, height,
+			pScrn->depth, pScrn->bitsPerPixel, ARMSOC_BO_SCANOUT);
+	if (!bo) {
+		ERROR_MSG("Couldn't allocate shadow for rotated CRTC");
+		return NULL;
+	}
+
+	data = armsoc_bo_map(bo);
+	if (!data || armsoc_bo_clear(bo) ||
+			(!armsoc_bo_get_fb(bo) && armsoc_bo_add_fb(bo))) {
+		ERROR_MSG("Couldn't set up shadow for rotated CRTC");
+		armsoc_bo_unreference(bo);
+		return NULL;
+	}
+
+	drmmode_crtc->shadow_bo = bo;
+	return data;
+}
+
+static PixmapPtr
+drmmode_shadow_create(xf86CrtcPtr crtc, void *data, int width, int height)
+{
+	ScrnInfoPtr pScrn = crtc->scrn;
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	PixmapPtr pPixmap;
+
+	if (!data)
+		data = drmmode_shadow_allocate(crtc, width, height);
+	if (!data)
+		return NULL;
+
+	pPixmap = GetScratchPixmapHeader(pScrn->pScreen, width, height,
+			pScrn->depth, pScrn->bitsPerPixel,
+			armsoc_bo_pitch(drmmode_crtc->shadow_bo), data);
+	if (!pPixmap)
+		ERROR_MSG("Couldn't create pixmap for rotated CRTC");
+	return pPixmap;
+}
+
+static void
+drmmode_shadow_destroy(xf86CrtcPtr crtc, PixmapPtr pPixmap, void *data)
+{
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+
+	if (pPixmap)
+		FreeScratchPixmapHeader(pPixmap);
+
+	if (data && drmmode_crtc->shadow_bo) {
+		armsoc_bo_unreference(drmmode_crtc->shadow_bo);
+		drmmode_crtc->shadow_bo = NULL;
+	}
+}
+
+/*
+ * Whether a CRTC scans out a shadow rather than the root window, which
+ * flipping the root window would bypass.
+ */
+Bool
+drmmode_crtc_shadowed(ScrnInfoPtr pScrn)
+{
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	int i;
+
+	for (i = 0; i < config->num_crtc; i++)
+		if (config->crtc[i]->enabled && config->crtc[i]->rotatedData)
+			return TRUE;
+	return FALSE;
+}
+
+/*
+ * Whether the monitor on a connector can refresh at a variable rate, from
+ * the property values read with the connector.
+ */
+static Bool
+drmmode_connector_vrr_capable(struct drmmode_rec *drmmode,
+		drmModeConnectorPtr connector)
+{
+	drmModePropertyPtr prop;
+	int i;
+
+	for (i = 0; i < connector->count_props; i++) {
+		/* property IDs are the same for every connector */
+		if (!drmmode->vrr_capable_prop_id) {
+			prop = drmModeGetProperty(drmmode->fd,
+					connector->props[i]);
+			if (!prop)
+				continue;
+
+			if (!strcmp(prop->name, "vrr_capable"))
+				drmmode->vrr_capable_prop_id = prop->prop_id;
+			drmModeFreeProperty(prop);
+		}
+
+		if (connector->props[i] == drmmode->vrr_capable_prop_id)
+			return connector->prop_values[i] != 0;
+	}
+
+	return FALSE;
+}
+
+/*
+ * Whether the monitor on any output of the CRTC can refresh at a variable
+ * rate, as of the last time the outputs' modes were read.
+ */
+static Bool
+drmmode_crtc_vrr_capable(xf86CrtcPtr crtc)
+{
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(crtc->scrn);
+	int i;
+
+	for (i = 0; i < config->num_output; i++) {
+		xf86OutputPtr output = config->output[i];
+		struct drmmode_output_priv *drmmode_output =
+				output->driver_private;
+
+		if (output->crtc == crtc && drmmode_output->vrr_capable)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+static void
+drmmode_crtc_set_vrr(xf86CrtcPtr crtc, Bool enable)
+{
+	ScrnInfoPtr pScrn = crtc->scrn;
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
+	struct drmmode_prop_info *info =
+			&drmmode_crtc->props[DRMMODE_CRTC_VRR_ENABLED];
+#ifdef DRM_CLIENT_CAP_ATOMIC
+	drmModeAtomicReqPtr req;
+#endif
+	int ret;
+
+	if (!info->prop_id || !info->value == !enable)
+		return;
+
+	if (enable && (drmmode_crtc->vrr_failed ||
+			!drmmode_crtc_vrr_capable(crtc)))
+		return;
+
+#ifdef DRM_CLIENT_CAP_ATOMIC
+	if (drmmode->atomic) {
+		req = drmModeAtomicAlloc();
+		ret = !req || drmmode_atomic_add(req, drmmode_crtc->crtc_id,
+				info, enable) ||
+				drmmode_atomic_commit(drmmode, req, 0, NULL);
+		drmModeAtomicFree(req);
+	} else
+#endif
+		ret = drmModeObjectSetProperty(drmmode->fd,
+				drmmode_crtc->crtc_id, DRM_MODE_OBJECT_CRTC,
+				info->prop_id, enable);
+
+	if (ret) {
+		DEBUG_MSG("CRTC %d: cannot turn variable refresh %s: %s",
+				drmmode_crtc->crtc_id, enable ? "on" : "off",
+				strerror(errno));
+		drmmode_crtc->vrr_failed = enable;
+		return;
+	}
+
+	info->value = enable;
+	DEBUG_MSG("CRTC %d: variable refresh %s", drmmode_crtc->crtc_id,
+			enable ? "on" : "off");
+}
+
+/*
+ * Turn variable refresh on for the enabled CRTCs in crtc_mask on behalf of
+ * a window, and off for those it was turned on for the window before.
+ */
+void
+drmmode_set_vrr(DrawablePtr pDraw, unsigned int crtc_mask)
+{
+	xf86CrtcConfigPtr config =
+			XF86_CRTC_CONFIG_PTR(xf86ScreenToScrn(pDraw->pScreen));
+	int i;
+
+	for (i = 0; i < config->num_crtc; i++) {
+		xf86CrtcPtr crtc = config->crtc[i];
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				crtc->driver_private;
+
+		if (crtc->enabled && (crtc_mask & (1 << i))) {
+			drmmode_crtc->vrr_draw_id = pDraw->id;
+			drmmode_crtc_set_vrr(crtc, TRUE);
+		} else if (drmmode_crtc->vrr_draw_id == pDraw->id) {
+			drmmode_crtc->vrr_draw_id = 0;
+			drmmode_crtc_set_vrr(crtc, FALSE);
+		}
+	}
+}
+
+/*
+ * Turn variable refresh off where the window it was turned on for has
+ * gone or is no longer shown, or everywhere if all is set.
+ */
+static void
+drmmode_vrr_validate(ScrnInfoPtr pScrn, Bool all)
+{
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	int i;
+
+	for (i = 0; i < config->num_crtc; i++) {
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				config->crtc[i]->driver_private;
+		DrawablePtr pDraw;
+
+		if (!drmmode_crtc->vrr_draw_id)
+			continue;
+
+		if (!all && dixLookupDrawable(&pDraw,
+				drmmode_crtc->vrr_draw_id, serverClient,
+				M_WINDOW, DixReadAccess) == Success &&
+				((WindowPtr)pDraw)->viewable)
+			continue;
+
+		drmmode_crtc->vrr_draw_id = 0;
+		drmmode_crtc_set_vrr(config->crtc[i], FALSE);
+	}
+}
+
+static void
+drmmode_crtc_destroy(xf86CrtcPtr crtc)
+{
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+
+	xorg_list_del(&drmmode_crtc->clock_link);
+	drmmode_crtc_color_fini(drmmode_crtc);
+	free(drmmode_crtc->gamma);
+	drmmode_crtc->gamma = NULL;
+	drmmode_crtc->gamma_size = 0;
+}
+
+static const xf86CrtcFuncsRec drmmode_crtc_funcs = {
+		.dpms = drmmode_crtc_dpms,
 		.set_mode_major = drmmode_set_mode_major,
+		.shadow_allocate = drmmode_shadow_allocate,
+		.shadow_create = drmmode_shadow_create,
+		.shadow_destroy = drmmode_shadow_destroy,
 		.set_cursor_position = drmmode_set_cursor_position,
 		.show_cursor = drmmode_show_cursor,
 		.hide_cursor = drmmode_hide_cursor,
 		.load_cursor_argb = drmmode_load_cursor_argb,
-#if 1 == ARMSOC_SUPPORT_GAMMA
 		.gamma_set = drmmode_gamma_set,
+		.destroy = drmmode_crtc_destroy,
+};
+
+
+static void
+drmmode_crtc_init(ScrnInfoPtr pScrn, struct drmmode_rec *drmmode, int num)
+{
+	xf86CrtcPtr crtc;
+	struct drmmode_crtc_private_rec *drmmode_crtc;
+	drmModeCrtcPtr kcrtc;
+
+	TRACE_ENTER();
+
+	crtc = xf86CrtcCreate(pScrn, &drmmode_crtc_funcs);
+	if (crtc == NULL)
+		return;
+
+	drmmode_crtc = xnfcalloc(sizeof(struct drmmode_crtc_private_rec), 1);
+	drmmode_crtc->crtc_id = drmmode->mode_res->crtcs[num];
+	drmmode_crtc->index = num;
+	drmmode_crtc->drmmode = drmmode;
+	drmmode_crtc->last_good_mode = NULL;
+	drmmode_crtc->crtc = crtc;
+	xorg_list_add(&drmmode_crtc->clock_link, &drmmode_clocks);
+
+	/* atomic only properties are not listed yet, that is fine here */
+	drmmode_prop_info_init(drmmode->fd, drmmode_crtc->crtc_id,
+			DRM_MODE_OBJECT_CRTC, drmmode_crtc->props,
+			crtc_props, DRMMODE_CRTC__COUNT);
+	if (drmmode_crtc->props[DRMMODE_CRTC_UNDERSCAN].prop_id)
+		drmmode_crtc->has_underscan_crop = drmmode_prop_enum_value(
+				drmmode->fd,
+				drmmode_crtc->props[DRMMODE_CRTC_UNDERSCAN].prop_id,
+				"crop", &drmmode_crtc->underscan_crop);
+
+	kcrtc = drmModeGetCrtc(drmmode->fd, drmmode_crtc->crtc_id);
+	if (kcrtc) {
+		drmmode_crtc->legacy_gamma_size = kcrtc->gamma_size;
+		if (ARMSOCPTR(pScrn)->seamlessBoot && kcrtc->mode_valid &&
+				kcrtc->buffer_id) {
+			drmmode_crtc->boot_mode_valid = TRUE;
+			drmmode_crtc->boot_mode = kcrtc->mode;
+			drmmode_crtc->boot_fb_id = kcrtc->buffer_id;
+			drmmode_crtc->boot_x = kcrtc->x;
+			drmmode_crtc->boot_y = kcrtc->y;
+		}
+		drmModeFreeCrtc(kcrtc);
+	}
+
+	INFO_MSG("Got CRTC: %d (id: %d)",
+			num, drmmode_crtc->crtc_id);
+	crtc->driver_private = drmmode_crtc;
+
+	TRACE_EXIT();
+	return;
+}
+
+static xf86OutputStatus
+drmmode_output_detect(xf86OutputPtr output)
+{
+	/* go to the hw and retrieve a new output struct */
+	struct drmmode_output_priv *drmmode_output = output->driver_private;
+	struct drmmode_rec *drmmode = drmmode_output->drmmode;
+	xf86OutputStatus status;
+
+	if (!drmmode->hotplug_probed) {
+		drmModeFreeConnector(drmmode_output->connector);
+
+		drmmode_output->connector =
+				drmModeGetConnector(drmmode->fd,
+						drmmode_output->output_id);
+		drmmode->props_epoch++;
+	}
+
+	switch (drmmode_output->connector->connection) {
+	case DRM_MODE_CONNECTED:
+		status = XF86OutputStatusConnected;
+		break;
+	case DRM_MODE_DISCONNECTED:
+		status = XF86OutputStatusDisconnected;
+		/* the server drops the monitor info of a disconnected output,
+		 * so the same monitor plugged back in must be parsed again */
+		drmmode_output->edid_hash = 0;
+		break;
+	default:
+	case DRM_MODE_UNKNOWNCONNECTION:
+		status = XF86OutputStatusUnknown;
+		break;
+	}
+	return status;
+}
+
+static Bool
+drmmode_output_mode_valid(xf86OutputPtr output, DisplayModePtr mode)
+{
+	if (mode->type & M_T_DEFAULT)
+		/* Default modes are harmful here. */
+		return MODE_BAD;
+
+	return MODE_OK;
+}
+
+/*
+ * Get the EDID blob of a connector, if it has one.
+ */
+static drmModePropertyBlobPtr
+drmmode_connector_get_edid(struct drmmode_rec *drmmode,
+		drmModeConnectorPtr connector)
+{
+	drmModePropertyPtr prop;
+	int i;
+
+	for (i = 0; i < connector->count_props; i++) {
+		/* property IDs are the same for every connector */
+		if (!drmmode->edid_prop_id) {
+			prop = drmModeGetProperty(drmmode->fd,
+					connector->props[i]);
+			if (!prop)
+				continue;
+
+			if ((prop->flags & DRM_MODE_PROP_BLOB) &&
+					!strcmp(prop->name, "EDID"))
+				drmmode->edid_prop_id = prop->prop_id;
+			drmModeFreeProperty(prop);
+		}
+
+		if (connector->props[i] == drmmode->edid_prop_id)
+			return connector->prop_values[i] ?
+				drmModeGetPropertyBlob(drmmode->fd,
+					connector->prop_values[i]) : NULL;
+	}
+
+	return NULL;
+}
+
+static DisplayModePtr
+drmmode_output_get_modes(xf86OutputPtr output)
+{
+	ScrnInfoPtr pScrn = output->scrn;
+	struct drmmode_output_priv *drmmode_output = output->driver_private;
+	drmModeConnectorPtr connector = drmmode_output->connector;
+	struct drmmode_rec *drmmode = drmmode_output->drmmode;
+	DisplayModePtr modes = NULL;
+	drmModePropertyBlobPtr blob;
+	xf86MonPtr ddc_mon = NULL;
+	uint32_t hash;
+	int i;
+	drmModeEncoderPtr enc;
+	drmModeModeInfoPtr boot_mode = NULL;
+	int xu, yu;
+
+	xu = yu = 0;
+	enc = drmModeGetEncoder(drmmode->fd, connector->encoder_id);
+	if (enc) {
+		xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+
+		for (i = 0; i < config->num_crtc; i++) {
+			struct drmmode_crtc_private_rec *drmmode_crtc =
+					config->crtc[i]->driver_private;
+
+			if (drmmode_crtc->crtc_id != enc->crtc_id)
+				continue;
+
+			drmmode_get_underscan(drmmode_crtc, &xu, &yu);
+			if (drmmode_crtc->boot_mode_valid)
+				boot_mode = &drmmode_crtc->boot_mode;
+		}
+		drmModeFreeEncoder(enc);
+	}
+
+	/* a new monitor may take variable refresh where the last did not */
+	drmmode_output->vrr_capable =
+			drmmode_connector_vrr_capable(drmmode, connector);
+	if (output->crtc) {
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				output->crtc->driver_private;
+
+		drmmode_crtc->vrr_failed = FALSE;
+	}
+
+	/* an EDID we have seen before need not be parsed again, as long as
+	 * the output still has the monitor info from last time */
+	blob = drmmode_connector_get_edid(drmmode, connector);
+	hash = blob ? drmmode_hash(blob->data, blob->length / 4) : 0;
+	if (blob && drmmode_output->edid_blob && output->MonInfo &&
+			hash == drmmode_output->edid_hash &&
+			blob->length == drmmode_output->edid_blob->length) {
+		drmModeFreePropertyBlob(blob);
+	} else if (blob) {
+		if (drmmode_output->edid_blob)
+			drmModeFreePropertyBlob(drmmode_output->edid_blob);
+		drmmode_output->edid_blob = blob;
+		drmmode_output->edid_hash = hash;
+
+		ddc_mon = xf86InterpretEDID(pScrn->scrnIndex,
+				drmmode_output->edid_blob->data);
+	} else {
+		drmmode_output->edid_hash = 0;
+	}
+
+	if (ddc_mon) {
+		if (drmmode_output->edid_blob->length > 128)
+			ddc_mon->flags |= MONITOR_EDID_COMPLETE_RAWDATA;
+		xf86OutputSetEDID(output, ddc_mon);
+		xf86SetDDCproperties(pScrn, ddc_mon);
+	}
+
+	DEBUG_MSG("count_modes: %d", connector->count_modes);
+
+	/* With SeamlessBoot the mode the output is already running at
+	 * becomes the preferred one, so we keep it rather than modeset */
+	if (boot_mode) {
+		for (i = 0; i < connector->count_modes; i++)
+			if (drmmode_kmode_equal(&connector->modes[i],
+					boot_mode))
+				break;
+		if (i == connector->count_modes)
+			boot_mode = NULL;
+	}
+
+	/* modes should already be available */
+	for (i = 0; i < connector->count_modes; i++) {
+		DisplayModePtr mode = xnfalloc(sizeof(DisplayModeRec));
+
+		drmmode_ConvertFromKMode(pScrn, &connector->modes[i], mode, xu, yu);
+		if (boot_mode) {
+			if (drmmode_kmode_equal(&connector->modes[i],
+					boot_mode))
+				mode->type |= M_T_PREFERRED;
+			else
+				mode->type &= ~M_T_PREFERRED;
+		}
+		modes = xf86ModesAdd(modes, mode);
+	}
+	return modes;
+}
+
+static void
+drmmode_output_destroy(xf86OutputPtr output)
+{
+	struct drmmode_output_priv *drmmode_output = output->driver_private;
+	int i;
+
+	if (drmmode_output->edid_blob)
+		drmModeFreePropertyBlob(drmmode_output->edid_blob);
+
+	if (drmmode_output->crtc_props)
+		drmModeFreeObjectProperties(drmmode_output->crtc_props);
+
+	for (i = 0; i < drmmode_output->num_props; i++) {
+		drmModeFreeProperty(drmmode_output->props[i].mode_prop);
+		free(drmmode_output->props[i].atoms);
+	}
+	free(drmmode_output->props);
+
+	for (i = 0; i < drmmode_output->connector->count_encoders; i++)
+		drmModeFreeEncoder(drmmode_output->encoders[i]);
+
+	free(drmmode_output->encoders);
+
+	drmModeFreeConnector(drmmode_output->connector);
+	free(drmmode_output);
+	output->driver_private = NULL;
+}
+
+static void
+drmmode_output_dpms(xf86OutputPtr output, int mode)
+{
+	struct drmmode_output_priv *drmmode_output = output->driver_private;
+	drmModeConnectorPtr connector = drmmode_output->connector;
+	drmModePropertyPtr prop;
+	struct drmmode_rec *drmmode = drmmode_output->drmmode;
+	int mode_id = -1, i;
+
+	for (i = 0; i < connector->count_props; i++) {
+		prop = drmModeGetProperty(drmmode->fd, connector->props[i]);
+		if (!prop)
+			continue;
+		if ((prop->flags & DRM_MODE_PROP_ENUM) &&
+		    !strcmp(prop->name, "DPMS")) {
+			mode_id = connector->props[i];
+			drmModeFreeProperty(prop);
+			break;
+		}
+		drmModeFreeProperty(prop);
+	}
+
+	if (mode_id < 0)
+		return;
+
+	drmModeConnectorSetProperty(drmmode->fd, connector->connector_id,
+			mode_id, mode);
+}
+
+static Bool
+drmmode_property_ignore(drmModePropertyPtr prop)
+{
+	if (!prop)
+		return TRUE;
+	/* ignore blob prop */
+	if (prop->flags & DRM_MODE_PROP_BLOB)
+		return TRUE;
+	/* ignore standard property */
+	if (!strcmp(prop->name, "EDID") ||
+			!strcmp(prop->name, "DPMS") ||
+			!strcmp(prop->name, "mode"))
+		return TRUE;
+
+	return FALSE;
+}
+
+static void
+drmmode_output_create_resources(xf86OutputPtr output)
+{
+	struct drmmode_output_priv *drmmode_output = output->driver_private;
+	drmModeConnectorPtr connector = drmmode_output->connector;
+	struct drmmode_rec *drmmode = drmmode_output->drmmode;
+	drmModePropertyPtr drmmode_prop;
+	uint32_t value;
+	int i, j, err;
+	drmModeEncoderPtr enc;
+	drmModeObjectPropertiesPtr crtcprops;
+
+	enc = drmModeGetEncoder(drmmode->fd, connector->encoder_id);
+	crtcprops = drmModeObjectGetProperties(drmmode->fd, enc->crtc_id, DRM_MODE_OBJECT_CRTC);
+	drmmode_output->props =
+		calloc(connector->count_props + crtcprops->count_props,
+				sizeof(struct drmmode_prop_rec));
+	if (!drmmode_output->props) {
+		drmModeFreeObjectProperties(crtcprops);
+		return;
+	}
+
+	drmmode_output->num_props = 0;
+	for (i = 0; i < connector->count_props; i++) {
+		drmmode_prop = drmModeGetProperty(drmmode->fd,
+			connector->props[i]);
+		if (drmmode_property_ignore(drmmode_prop)) {
+			drmModeFreeProperty(drmmode_prop);
+			continue;
+		}
+		drmmode_output->props[drmmode_output->num_props].mode_prop =
+				drmmode_prop;
+		drmmode_output->props[drmmode_output->num_props].index = i;
+		drmmode_output->props[drmmode_output->num_props].drm_object_id = connector->connector_id;
+		drmmode_output->props[drmmode_output->num_props].drm_object =
+				DRM_MODE_OBJECT_CONNECTOR;
+
+		drmmode_output->num_props++;
+	}
+	for (i = 0; i < crtcprops->count_props; i++) {
+		drmmode_prop = drmModeGetProperty(drmmode->fd,
+			crtcprops->props[i]);
+
+		if (drmmode_property_ignore(drmmode_prop)) {
+			drmModeFreeProperty(drmmode_prop);
+			continue;
+		}
+		drmmode_output->props[drmmode_output->num_props].mode_prop =
+				drmmode_prop;
+		drmmode_output->props[drmmode_output->num_props].index = i;
+		drmmode_output->props[drmmode_output->num_props].drm_object_id = enc->crtc_id;
+		drmmode_output->props[drmmode_output->num_props].drm_object =
+				DRM_MODE_OBJECT_CRTC;
+
+		drmmode_output->num_props++;
+	}
+
+	for (i = 0; i < drmmode_output->num_props; i++) {
+		struct drmmode_prop_rec *p = &drmmode_output->props[i];
+		drmmode_prop = p->mode_prop;
+
+		if (p->drm_object == DRM_MODE_OBJECT_CONNECTOR)
+			value = drmmode_output->connector->prop_values[p->index];
+		else
+			value = crtcprops->prop_values[p->index];
+
+		if (drmmode_prop->flags & DRM_MODE_PROP_RANGE) {
+			INT32 range[2];
+
+			p->num_atoms = 1;
+			p->atoms = calloc(p->num_atoms, sizeof(Atom));
+			if (!p->atoms)
+				continue;
+			p->atoms[0] = MakeAtom(drmmode_prop->name,
+						strlen(drmmode_prop->name),
+						TRUE);
+			range[0] = drmmode_prop->values[0];
+			range[1] = drmmode_prop->values[1];
+			err = RRConfigureOutputProperty(output->randr_output,
+					p->atoms[0],
+					FALSE, TRUE,
+					drmmode_prop->flags &
+						DRM_MODE_PROP_IMMUTABLE ?
+							TRUE : FALSE,
+					2, range);
+
+			if (err != 0)
+				xf86DrvMsg(output->scrn->scrnIndex, X_ERROR,
+						"RRConfigureOutputProperty error, %d\n",
+						err);
+
+			err = RRChangeOutputProperty(output->randr_output,
+					p->atoms[0],
+					XA_INTEGER, 32, PropModeReplace, 1,
+					&value, FALSE, FALSE);
+			if (err != 0)
+				xf86DrvMsg(output->scrn->scrnIndex, X_ERROR,
+						"RRChangeOutputProperty error, %d\n",
+						err);
+
+		} else if (drmmode_prop->flags & DRM_MODE_PROP_ENUM) {
+			p->num_atoms = drmmode_prop->count_enums + 1;
+			p->atoms = calloc(p->num_atoms, sizeof(Atom));
+			if (!p->atoms)
+				continue;
+			p->atoms[0] = MakeAtom(drmmode_prop->name,
+						strlen(drmmode_prop->name),
+						TRUE);
+			for (j = 1; j <= drmmode_prop->count_enums; j++) {
+				struct drm_mode_property_enum *e =
+						&drmmode_prop->enums[j-1];
+				p->atoms[j] = MakeAtom(e->name,
+							strlen(e->name), TRUE);
+			}
+			err = RRConfigureOutputProperty(output->randr_output,
+					p->atoms[0],
+					FALSE, FALSE,
+					drmmode_prop->flags &
+						DRM_MODE_PROP_IMMUTABLE ?
+							TRUE : FALSE,
+					p->num_atoms - 1,
+					(INT32 *)&p->atoms[1]);
+
+			if (err != 0)
+				xf86DrvMsg(output->scrn->scrnIndex, X_ERROR,
+						"RRConfigureOutputProperty error, %d\n",
+						err);
+
+			for (j = 0; j < drmmode_prop->count_enums; j++)
+				if (drmmode_prop->enums[j].value == value)
+					break;
+			/* there's always a matching value */
+			err = RRChangeOutputProperty(output->randr_output,
+					p->atoms[0],
+					XA_ATOM, 32, PropModeReplace, 1,
+					&p->atoms[j+1], FALSE, FALSE);
+			if (err != 0)
+				xf86DrvMsg(output->scrn->scrnIndex, X_ERROR,
+						"RRChangeOutputProperty error, %d\n",
+						err);
+		}
+	}
+	drmModeFreeObjectProperties(crtcprops);
+
+#ifdef HAVE_STRUCT_DRM_COLOR_LUT
+	drmmode_output_create_ctm(output);
+#endif
+}
+
+#ifdef HAVE_STRUCT_DRM_COLOR_LUT
+/* S31.32 sign-magnitude 1.0, CTM values are sent as low then high word */
+#define DRMMODE_CTM_ONE		(1ULL << 32)
+
+/*
+ * "CTM" is a 3x3 colour transformation matrix applied to whatever the
+ * output shows, in row-major order, like the kernel's CTM property.
+ * Each entry is an S31.32 sign-magnitude fixed point number as two 32
+ * bit integers, low word first.
+ */
+static void
+drmmode_output_create_ctm(xf86OutputPtr output)
+{
+	struct drmmode_output_priv *drmmode_output = output->driver_private;
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(output->scrn);
+	uint32_t identity[18] = { 0 };
+	int i, err;
+
+	for (i = 0; i < config->num_crtc; i++) {
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				config->crtc[i]->driver_private;
+
+		if (drmmode_crtc->props[DRMMODE_CRTC_CTM].prop_id)
+			break;
+	}
+	if (i == config->num_crtc)
+		return;
+
+	for (i = 0; i < 3; i++)
+		identity[2 * (i * 3 + i) + 1] = DRMMODE_CTM_ONE >> 32;
+
+	drmmode_output->ctm_atom = MakeAtom("CTM", strlen("CTM"), TRUE);
+	err = RRConfigureOutputProperty(output->randr_output,
+			drmmode_output->ctm_atom, FALSE, FALSE, FALSE, 0, NULL);
+	if (err == 0)
+		err = RRChangeOutputProperty(output->randr_output,
+				drmmode_output->ctm_atom, XA_INTEGER, 32,
+				PropModeReplace, ARRAY_SIZE(identity),
+				identity, FALSE, FALSE);
+	if (err != 0) {
+		xf86DrvMsg(output->scrn->scrnIndex, X_ERROR,
+				"Cannot create CTM property, %d\n", err);
+		drmmode_output->ctm_atom = None;
+	}
+}
+
+static Bool
+drmmode_output_set_ctm(xf86OutputPtr output, RRPropertyValuePtr value)
+{
+	struct drmmode_output_priv *drmmode_output = output->driver_private;
+	const uint32_t *v = value->data;
+	Bool identity = TRUE;
+	int i;
+
+	if (value->type != XA_INTEGER || value->format != 32 ||
+			value->size != 18)
+		return FALSE;
+
+	for (i = 0; i < 9; i++) {
+		drmmode_output->ctm[i] = (uint64_t)v[2 * i + 1] << 32 |
+				v[2 * i];
+		if (drmmode_output->ctm[i] !=
+				(i % 4 ? 0 : DRMMODE_CTM_ONE))
+			identity = FALSE;
+	}
+	/* no matrix is cheaper than an identity matrix */
+	drmmode_output->has_ctm = !identity;
+
+	if (output->crtc)
+		drmmode_crtc_update_ctm(output->crtc);
+	return TRUE;
+}
+#endif
+
+/*
+ * Keep the cached connector up to date with a property we changed, in case
+ * it cannot be re-read without a probe, and have the CRTC's re-read.
+ */
+static void
+drmmode_output_prop_changed(xf86OutputPtr output,
+		struct drmmode_prop_rec *p, uint64_t value)
+{
+	struct drmmode_output_priv *drmmode_output = output->driver_private;
+
+	if (p->drm_object == DRM_MODE_OBJECT_CONNECTOR &&
+			p->index < drmmode_output->connector->count_props)
+		drmmode_output->connector->prop_values[p->index] = value;
+	else if (p->drm_object == DRM_MODE_OBJECT_CRTC)
+		drmmode_crtc_prop_changed(output->scrn, p->drm_object_id,
+				p->mode_prop->prop_id, value);
+
+	drmmode_output->drmmode->props_epoch++;
+}
+
+static Bool
+drmmode_output_set_property(xf86OutputPtr output, Atom property,
+		RRPropertyValuePtr value)
+{
+	struct drmmode_output_priv *drmmode_output = output->driver_private;
+	struct drmmode_rec *drmmode = drmmode_output->drmmode;
+	int i, ret;
+
+#ifdef HAVE_STRUCT_DRM_COLOR_LUT
+	if (drmmode_output->ctm_atom && property == drmmode_output->ctm_atom)
+		return drmmode_output_set_ctm(output, value);
+#endif
+
+	for (i = 0; i < drmmode_output->num_props; i++) {
+		struct drmmode_prop_rec *p = &drmmode_output->props[i];
+
+		if (p->atoms[0] != property)
+			continue;
+
+		if (p->mode_prop->flags & DRM_MODE_PROP_RANGE) {
+			uint32_t val;
+
+			if (value->type != XA_INTEGER || value->format != 32 ||
+					value->size != 1)
+				return FALSE;
+			val = *(uint32_t *)value->data;
+
+			ret = drmModeObjectSetProperty(drmmode->fd,
+					p->drm_object_id,
+					p->drm_object,
+					p->mode_prop->prop_id, (uint64_t)val);
+
+			if (ret)
+				return FALSE;
+
+			drmmode_output_prop_changed(output, p, val);
+			return TRUE;
+
+		} else if (p->mode_prop->flags & DRM_MODE_PROP_ENUM) {
+			Atom	atom;
+			const char	*name;
+			int		j;
+
+			if (value->type != XA_ATOM ||
+					value->format != 32 ||
+					value->size != 1)
+				return FALSE;
+
+			memcpy(&atom, value->data, 4);
+			name = NameForAtom(atom);
+			if (name == NULL)
+				return FALSE;
+
+			/* search for matching name string, then
+			 * set its value down
+			 */
+			for (j = 0; j < p->mode_prop->count_enums; j++) {
+				if (!strcmp(p->mode_prop->enums[j].name,
+						name)) {
+					ret = drmModeObjectSetProperty(
+						drmmode->fd,
+						p->drm_object_id,
+						p->drm_object,
+						p->mode_prop->prop_id,
+						p->mode_prop->enums[j].value);
+
+					if (ret)
+						return FALSE;
+
+					drmmode_output_prop_changed(output, p,
+						p->mode_prop->enums[j].value);
+					return TRUE;
+				}
+			}
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/*
+ * Re-read the connector and the properties of its CRTC if they may have
+ * changed since they were last read. This does not probe the connector,
+ * which may mean reading the EDID: that only happens on detect.
+ */
+static void
+drmmode_output_refresh(xf86OutputPtr output)
+{
+	struct drmmode_output_priv *drmmode_output = output->driver_private;
+	struct drmmode_rec *drmmode = drmmode_output->drmmode;
+	drmModeEncoderPtr enc;
+
+	if (drmmode_output->props_epoch == drmmode->props_epoch &&
+			drmmode_output->crtc_props)
+		return;
+
+#ifdef HAVE_DRMMODEGETCONNECTORCURRENT
+	{
+		drmModeConnectorPtr connector;
+
+		connector = drmModeGetConnectorCurrent(drmmode->fd,
+				drmmode_output->output_id);
+		if (connector) {
+			drmModeFreeConnector(drmmode_output->connector);
+			drmmode_output->connector = connector;
+		}
+	}
 #endif
+
+	if (drmmode_output->crtc_props)
+		drmModeFreeObjectProperties(drmmode_output->crtc_props);
+	drmmode_output->crtc_props = NULL;
+
+	enc = drmModeGetEncoder(drmmode->fd,
+			drmmode_output->connector->encoder_id);
+	if (enc) {
+		if (enc->crtc_id)
+			drmmode_output->crtc_props =
+				drmModeObjectGetProperties(drmmode->fd,
+					enc->crtc_id, DRM_MODE_OBJECT_CRTC);
+		drmModeFreeEncoder(enc);
+	}
+
+	drmmode_output->props_epoch = drmmode->props_epoch;
+}
+
+static Bool
+drmmode_output_get_property(xf86OutputPtr output, Atom property)
+{
+
+	struct drmmode_output_priv *drmmode_output = output->driver_private;
+	uint32_t value;
+	int err, i;
+
+	if (output->scrn->vtSema)
+		drmmode_output_refresh(output);
+
+	for (i = 0; i < drmmode_output->num_props; i++) {
+		struct drmmode_prop_rec *p = &drmmode_output->props[i];
+		if (p->atoms[0] != property)
+			continue;
+
+		if (p->drm_object == DRM_MODE_OBJECT_CRTC) {
+			if (!drmmode_output->crtc_props ||
+					p->index >= drmmode_output->crtc_props->count_props)
+				return FALSE;
+			value = drmmode_output->crtc_props->prop_values[p->index];
+		} else
+			value = drmmode_output->connector->prop_values[p->index];
+
+		if (p->mode_prop->flags & DRM_MODE_PROP_RANGE) {
+			err = RRChangeOutputProperty(output->randr_output,
+					property, XA_INTEGER, 32,
+					PropModeReplace, 1, &value,
+					FALSE, FALSE);
+
+			return !err;
+		} else if (p->mode_prop->flags & DRM_MODE_PROP_ENUM) {
+			int		j;
+
+			/* search for matching name string, then set
+			 * its value down
+			 */
+			for (j = 0; j < p->mode_prop->count_enums; j++) {
+				if (p->mode_prop->enums[j].value == value)
+					break;
+			}
+
+			err = RRChangeOutputProperty(output->randr_output,
+						property,
+						XA_ATOM, 32, PropModeReplace, 1,
+						&p->atoms[j+1], FALSE, FALSE);
+
+			return !err;
+		}
+	}
+
+	return FALSE;
+}
+
+static const xf86OutputFuncsRec drmmode_output_funcs = {
+		.create_resources = drmmode_output_create_resources,
+		.dpms = drmmode_output_dpms,
+		.detect = drmmode_output_detect,
+		.mode_valid = drmmode_output_mode_valid,
+		.get_modes = drmmode_output_get_modes,
+		.set_property = drmmode_output_set_property,
+		.get_property = drmmode_output_get_property,
+		.destroy = drmmode_output_destroy
+};
+
+const char *output_names[] = { "None",
+		"VGA",
+		"DVI-I",
+		"DVI-D",
+		"DVI-A",
+		"Composite",
+		"SVIDEO",
+		"LVDS",
+		"CTV",
+		"DIN",
+		"DP",
+		"HDMI",
+		"HDMI",
+		"TV",
+		"eDP",
 };
+#define NUM_OUTPUT_NAMES (sizeof(output_names) / sizeof(output_names[0]))
+
+static void
+drmmode_output_init(ScrnInfoPtr pScrn, struct drmmode_rec *drmmode, int num)
+{
+	xf86OutputPtr output;
+	drmModeConnectorPtr connector;
+	drmModeEncoderPtr *encoders = NULL;
+	struct drmmode_output_priv *drmmode_output;
+	char name[32];
+	int i;
+
+	TRACE_ENTER();
+
+	connector = drmModeGetConnector(drmmode->fd, drmmode->mode_res->connectors[num]);
+	if (!connector)
+		goto exit;
+
+	encoders = calloc(sizeof(drmModeEncoderPtr), connector->count_encoders);
+	if (!encoders)
+		goto free_connector_exit;
+
+	for (i = 0; i < connector->count_encoders; i++) {
+		encoders[i] = drmModeGetEncoder(drmmode->fd, connector->encoders[i]);
+		if (!encoders[i])
+			goto free_encoders_exit;
+	}
+
+	if (connector->connector_type >= NUM_OUTPUT_NAMES)
+		snprintf(name, 32, "Unknown%d-%d", connector->connector_type, connector->connector_type_id);
+	else
+		snprintf(name, 32, "%s-%d", output_names[connector->connector_type], connector->connector_type_id);
+
+	output = xf86OutputCreate(pScrn, &drmmode_output_funcs, name);
+	if (!output)
+		goto free_encoders_exit;
+
+	drmmode_output = calloc(sizeof(struct drmmode_output_priv), 1);
+	if (!drmmode_output) {
+		xf86OutputDestroy(output);
+		goto free_encoders_exit;
+	}
+
+	drmmode_output->output_id = drmmode->mode_res->connectors[num];
+	drmmode_output->connector = connector;
+	drmmode_output->encoders = encoders;
+	drmmode_output->drmmode = drmmode;
+
+	output->mm_width = connector->mmWidth;
+	output->mm_height = connector->mmHeight;
+	output->driver_private = drmmode_output;
+
+	/*
+	 * Determine which crtcs are supported by all the encoders which
+	 * are valid for the connector of this output.
+	 */
+	output->possible_crtcs = 0xffffffff;
+	for (i = 0; i < connector->count_encoders; i++)
+		output->possible_crtcs &= encoders[i]->possible_crtcs;
+	/*
+	 * output->possible_crtcs is a bitmask arranged by index of crtcs for this screen while
+	 * encoders->possible_crtcs covers all crtcs supported by the drm. If we have selected
+	 * one crtc per screen, it must be at index 0.
+	 */
+	if (ARMSOCPTR(pScrn)->crtcNum >= 0)
+		output->possible_crtcs = (output->possible_crtcs >> (ARMSOCPTR(pScrn)->crtcNum)) & 1;
+
+	output->possible_clones = 0; /* set after all outputs initialized */
+	output->interlaceAllowed = TRUE;
+	goto exit;
+
+free_encoders_exit:
+	for (i = 0; i < connector->count_encoders; i++)
+		drmModeFreeEncoder(encoders[i]);
+
+free_connector_exit:
+	drmModeFreeConnector(connector);
+
+exit:
+	TRACE_EXIT();
+	return;
+
+}
+static void
+drmmode_clones_init(ScrnInfoPtr pScrn, struct drmmode_rec *drmmode)
+{
+	int i;
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+
+	/* For each output generate enc_mask, a mask of encoders present,
+	 * and enc_clones, a mask of possible clone encoders
+	 */
+	for (i = 0; i < xf86_config->num_output; i++) {
+		xf86OutputPtr output = xf86_config->output[i];
+		struct drmmode_output_priv *drmmode_output = output->driver_private;
+		int j;
+
+		drmmode_output->enc_clones = 0xffffffff;
+		drmmode_output->enc_mask = 0;
+
+		for (j = 0; j < drmmode_output->connector->count_encoders; j++) {
+			int k;
+
+			/* set index ordered mask of encoders on this output */
+			for (k = 0; k < drmmode->mode_res->count_encoders; k++) {
+				if (drmmode->mode_res->encoders[k] == drmmode_output->encoders[j]->encoder_id)
+					drmmode_output->enc_mask |= (1 << k);
+			}
+			/* set mask for encoder clones possible with all encoders on this output */
+			drmmode_output->enc_clones &= drmmode_output->encoders[j]->possible_clones;
+		}
+	}
+
+	/* Output j is a possible clone of output i if the enc_mask for j matches the enc_clones for i */
+	for (i = 0; i < xf86_config->num_output; i++) {
+		xf86OutputPtr output = xf86_config->output[i];
+		struct drmmode_output_priv *drmmode_output = output->driver_private;
+		int j;
+
+		output->possible_clones = 0;
+		if (drmmode_output->enc_clones == 0)
+			continue;
+
+		for (j = 0; j < xf86_config->num_output; j++) {
+			struct drmmode_output_priv *clone = xf86_config->output[j]->driver_private;
+
+			if ((i != j) &&
+				(clone->enc_mask != 0) &&
+				(drmmode_output->enc_clones == clone->enc_mask))
+
+				output->possible_clones |= (1 << j);
+		}
+	}
+}
+
+void set_scanout_bo(ScrnInfoPtr pScrn, struct armsoc_bo *bo)
+{
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct armsoc_bo *old_bo = pARMSOC->scanout;
+
+	/* It had better have a framebuffer if we're scanning it out */
+	assert(armsoc_bo_get_fb(bo));
 
+	armsoc_bo_reference(bo);
+	pARMSOC->scanout = bo;
+	if (old_bo)
+		armsoc_bo_unreference(old_bo);
+}
 
-static void
-drmmode_crtc_init(ScrnInfoPtr pScrn, struct drmmode_rec *drmmode, int num)
+static Bool resize_scanout_bo(ScrnInfoPtr pScrn, int width, int height)
 {
-	xf86CrtcPtr crtc;
-	struct drmmode_crtc_private_rec *drmmode_crtc;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	ScreenPtr pScreen = pScrn->pScreen;
+	uint32_t pitch;
 
 	TRACE_ENTER();
+	DEBUG_MSG("Resize: %dx%d", width, height);
 
-	crtc = xf86CrtcCreate(pScrn, &drmmode_crtc_funcs);
-	if (crtc == NULL)
-		return;
+	pScrn->virtualX = width;
+	pScrn->virtualY = height;
 
-	drmmode_crtc = xnfcalloc(sizeof(struct drmmode_crtc_private_rec), 1);
-	drmmode_crtc->crtc_id = drmmode->mode_res->crtcs[num];
-	drmmode_crtc->drmmode = drmmode;
-	drmmode_crtc->last_good_mode = NULL;
+	if ((width != armsoc_bo_width(pARMSOC->scanout))
+	      || (height != armsoc_bo_height(pARMSOC->scanout))
+	      || (pScrn->bitsPerPixel != armsoc_bo_bpp(pARMSOC->scanout))) {
+		struct armsoc_bo *scanout = pARMSOC->scanout;
+		struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+		uint32_t old_width = armsoc_bo_width(scanout);
+		uint32_t old_height = armsoc_bo_height(scanout);
+		uint32_t old_pitch = armsoc_bo_pitch(scanout);
+		struct armsoc_bo *new_scanout;
 
-	INFO_MSG("Got CRTC: %d (id: %d)",
-			num, drmmode_crtc->crtc_id);
-	crtc->driver_private = drmmode_crtc;
+		/* A new pitch would move the pixels the CRTCs are still
+		 * scanning out, that takes a new buffer. */
+		if (pScrn->bitsPerPixel == armsoc_bo_bpp(scanout) &&
+				armsoc_bo_resize_fits(scanout, width, height) &&
+				armsoc_bo_resize_pitch(scanout, width) ==
+					old_pitch) {
+			/* Reshape the buffer we have, which is much cheaper
+			 * than a new one. The CRTCs keep showing the old fb
+			 * until they are moved to the new one. */
+			DEBUG_MSG("resizing existing scanout buffer");
+			if (drmmode->retired_fb_id)
+				drmModeRmFB(drmmode->fd, drmmode->retired_fb_id);
+			drmmode->retired_fb_id = armsoc_bo_detach_fb(scanout);
+
+			if (armsoc_bo_resize(scanout, width, height))
+				return FALSE;
+
+			/* with the pitch kept, only what the resize
+			 * uncovered needs clearing */
+			pitch = armsoc_bo_pitch(scanout);
+			if (width > old_width &&
+					armsoc_bo_clear_area(scanout,
+						old_width, 0,
+						width - old_width,
+						min(height, old_height)))
+				return FALSE;
+			if (height > old_height &&
+					armsoc_bo_clear_area(scanout,
+						0, old_height, width,
+						height - old_height))
+				return FALSE;
+
+			if (armsoc_bo_add_fb(scanout)) {
+				ERROR_MSG(
+						"Failed to add framebuffer to the existing scanout buffer");
+				return FALSE;
+			}
+		} else {
+			/* allocate new scanout buffer */
+			new_scanout = armsoc_bo_new_with_dim(pARMSOC->dev,
+					width, height,
+					pScrn->depth, pScrn->bitsPerPixel,
+					ARMSOC_BO_SCANOUT);
+			if (!new_scanout) {
+				ERROR_MSG("allocate new scanout buffer failed");
+				return FALSE;
+			}
+
+			DEBUG_MSG("allocated new scanout buffer okay");
+			pitch = armsoc_bo_pitch(new_scanout);
+			/* clear new BO and add FB */
+			if (armsoc_bo_clear(new_scanout)) {
+				armsoc_bo_unreference(new_scanout);
+				return FALSE;
+			}
+
+			/* pooled buffers may come with one */
+			if (!armsoc_bo_get_fb(new_scanout) &&
+					armsoc_bo_add_fb(new_scanout)) {
+				ERROR_MSG(
+						"Failed to add framebuffer to the new scanout buffer");
+				armsoc_bo_unreference(new_scanout);
+				return FALSE;
+			}
+
+			/* Handle dma_buf fd that may be attached to old bo */
+			if (armsoc_bo_has_dmabuf(scanout)) {
+				int res;
+
+				armsoc_bo_clear_dmabuf(scanout);
+				res = armsoc_bo_set_dmabuf(new_scanout);
+				if (res) {
+					ERROR_MSG(
+							"Unable to attach dma_buf fd to new scanout buffer - %d (%s)\n",
+							res, strerror(res));
+					armsoc_bo_unreference(new_scanout);
+					return FALSE;
+				}
+			}
+			/* use new scanout buffer */
+			set_scanout_bo(pScrn, new_scanout);
+			/* set_scanout_bo takes its own reference, we have
+			 * no other hold on this bo. */
+			armsoc_bo_unreference(new_scanout);
+		}
+		pScrn->displayWidth = pitch / ((pScrn->bitsPerPixel + 7) / 8);
+	} else
+		pitch = armsoc_bo_pitch(pARMSOC->scanout);
+
+	if (pScreen && pScreen->ModifyPixmapHeader) {
+		PixmapPtr rootPixmap = pScreen->GetScreenPixmap(pScreen);
+
+		pScreen->ModifyPixmapHeader(rootPixmap,
+				pScrn->virtualX, pScrn->virtualY,
+				pScrn->depth, pScrn->bitsPerPixel, pitch,
+				armsoc_bo_map(pARMSOC->scanout));
+
+		/* Bump the serial number to ensure that all existing DRI2
+		 * buffers are invalidated.
+		 *
+		 * This is particularly required for when the resolution is
+		 * changed and then reverted to the original size without a
+		 * DRI2 client/s getting a new buffer. Without this, the
+		 * drawable is the same size and serial number so the old
+		 * DRI2Buffer will be returned, even though the backing buffer
+		 * has been deleted.
+		 */
+		rootPixmap->drawable.serialNumber = NEXT_SERIAL_NUMBER;
+	}
 
+	/* Now that we've bound this bo to the root pixmap, we need to be
+	 * sure we tie its lifetime to that pixmap. The root pixmap is not
+	 * one of the ones we're typically asked to CreateBuffers for.
+	 * The best match I can find here is to assume it has taken over
+	 * the allocation provided to fbScreenInit. */
+	if (pARMSOC->fb_bo != pARMSOC->scanout) {
+		armsoc_bo_unreference(pARMSOC->fb_bo);
+		pARMSOC->fb_bo = pARMSOC->scanout;
+		armsoc_bo_reference(pARMSOC->fb_bo);
+	}
 	TRACE_EXIT();
-	return;
+	return TRUE;
 }
 
-static xf86OutputStatus
-drmmode_output_detect(xf86OutputPtr output)
+/*
+ * The fb of the scanout from before an in-place resize, removed once the
+ * CRTCs flipping away from it have finished: removing an fb a CRTC still
+ * scans out turns the CRTC off.
+ */
+struct drmmode_retired_fb {
+	struct ARMSOCFlipEvent base;
+	struct drmmode_rec *drmmode;
+	uint32_t fb_id;
+	/* flips not completed yet, plus one while CRTCs are being moved */
+	int pending;
+};
+
+static Bool drmmode_crtc_queue_vblank(xf86CrtcPtr crtc,
+		struct ARMSOCFlipEvent *event);
+
+static void
+drmmode_retired_fb_unref(struct drmmode_retired_fb *retired)
 {
-	/* go to the hw and retrieve a new output struct */
-	struct drmmode_output_priv *drmmode_output = output->driver_private;
-	struct drmmode_rec *drmmode = drmmode_output->drmmode;
-	xf86OutputStatus status;
-	drmModeFreeConnector(drmmode_output->connector);
+	if (--retired->pending > 0)
+		return;
 
-	drmmode_output->connector =
-			drmModeGetConnector(drmmode->fd,
-					drmmode_output->output_id);
+	drmModeRmFB(retired->drmmode->fd, retired->fb_id);
+	free(retired);
+}
 
-	switch (drmmode_output->connector->connection) {
-	case DRM_MODE_CONNECTED:
-		status = XF86OutputStatusConnected;
-		break;
-	case DRM_MODE_DISCONNECTED:
-		status = XF86OutputStatusDisconnected;
-		break;
-	default:
-	case DRM_MODE_UNKNOWNCONNECTION:
-		status = XF86OutputStatusUnknown;
-		break;
+static void
+drmmode_retired_fb_handler(struct ARMSOCFlipEvent *event,
+		unsigned int frame, unsigned int tv_sec, unsigned int tv_usec)
+{
+	drmmode_retired_fb_unref((struct drmmode_retired_fb *)event);
+}
+
+/*
+ * Page flip a CRTC to fb_id on legacy KMS, keeping retired until the flip
+ * is done: from the flip event, or the vblank event after it where the
+ * driver has no flip events.
+ */
+static Bool
+drmmode_crtc_flip_retiring(xf86CrtcPtr crtc, uint32_t fb_id,
+		struct drmmode_retired_fb *retired)
+{
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(crtc->scrn);
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	int fd = drmmode_crtc->drmmode->fd;
+
+	if (!retired)
+		return FALSE;
+
+	if (pARMSOC->drmmode_interface->use_page_flip_events) {
+		if (drmModePageFlip(fd, drmmode_crtc->crtc_id, fb_id,
+				DRM_MODE_PAGE_FLIP_EVENT, &retired->base))
+			return FALSE;
+	} else if (drmModePageFlip(fd, drmmode_crtc->crtc_id, fb_id, 0,
+				NULL) ||
+			!drmmode_crtc_queue_vblank(crtc, &retired->base)) {
+		/* set the CRTC, which waits for the flip if it went out */
+		return FALSE;
 	}
-	return status;
+
+	retired->pending++;
+	return TRUE;
 }
 
+/*
+ * A CRTC whose mode and position are what the kernel already has only
+ * needs pointing at the new root framebuffer, and not even that if it
+ * shows it already. On legacy KMS that is a page flip, which keeps the
+ * CRTC's scanout offset, or drmModeSetCrtc if the driver refuses the
+ * flip or the end of the flip cannot be waited for. Returns FALSE if a
+ * full modeset is needed.
+ */
 static Bool
-drmmode_output_mode_valid(xf86OutputPtr output, DisplayModePtr mode)
+drmmode_crtc_update_fb(xf86CrtcPtr crtc, uint32_t fb_id,
+		struct drmmode_retired_fb *retired)
 {
-	if (mode->type & M_T_DEFAULT)
-		/* Default modes are harmful here. */
-		return MODE_BAD;
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
+	drmModeModeInfo kmode;
+	drmModeCrtcPtr kcrtc;
+	Bool ret;
 
-	return MODE_OK;
+	if (crtc->rotation != RR_Rotate_0 || drmmode_crtc->scanout_bo)
+		return FALSE;
+
+	kcrtc = drmModeGetCrtc(drmmode->fd, drmmode_crtc->crtc_id);
+	if (!kcrtc)
+		return FALSE;
+
+	drmmode_ConvertToKMode(crtc->scrn, &kmode, &crtc->mode);
+	ret = kcrtc->mode_valid && kcrtc->x == crtc->x &&
+			kcrtc->y == crtc->y &&
+			drmmode_kmode_equal(&kcrtc->mode, &kmode);
+	if (ret && kcrtc->buffer_id != fb_id && (drmmode->atomic ||
+			!drmmode_crtc_flip_retiring(crtc, fb_id, retired)))
+		ret = !drmmode_crtc_set_fb(crtc, fb_id, crtc->x, crtc->y);
+
+	drmModeFreeCrtc(kcrtc);
+	return ret;
 }
 
-static DisplayModePtr
-drmmode_output_get_modes(xf86OutputPtr output)
+static Bool
+drmmode_xf86crtc_resize(ScrnInfoPtr pScrn, int width, int height)
 {
-	ScrnInfoPtr pScrn = output->scrn;
-	struct drmmode_output_priv *drmmode_output = output->driver_private;
-	drmModeConnectorPtr connector = drmmode_output->connector;
-	struct drmmode_rec *drmmode = drmmode_output->drmmode;
-	DisplayModePtr modes = NULL;
-	drmModePropertyPtr prop;
-	xf86MonPtr ddc_mon = NULL;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+	struct drmmode_retired_fb *retired = NULL;
 	int i;
-	drmModeEncoderPtr enc;
-	int xu, yu;
+	xf86CrtcConfigPtr xf86_config;
+	uint32_t fb_id;
+
+	TRACE_ENTER();
+	if (!resize_scanout_bo(pScrn, width, height))
+		return FALSE;
+
+	/* the fb from before an in-place resize goes once nothing can
+	 * still be flipping away from it. Without a way to tell, CRTCs are
+	 * set rather than flipped, and it goes straight away. */
+	if (drmmode->retired_fb_id) {
+		retired = calloc(1, sizeof(*retired));
+		if (retired) {
+			retired->base.handler = drmmode_retired_fb_handler;
+			retired->drmmode = drmmode;
+			retired->fb_id = drmmode->retired_fb_id;
+			retired->pending = 1;
+			drmmode->retired_fb_id = 0;
+		}
+	}
+
+	/* Framebuffer needs to be reset on all CRTCs, not just
+	 * those that have repositioned, but those that have not
+	 * need no modeset for it */
+	fb_id = armsoc_bo_get_fb(pARMSOC->scanout);
+	xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	for (i = 0; i < xf86_config->num_crtc; i++) {
+		xf86CrtcPtr crtc = xf86_config->crtc[i];
+
+		if (!crtc->enabled)
+			continue;
+
+		if (fb_id && pScrn->vtSema &&
+				drmmode_crtc_update_fb(crtc, fb_id, retired))
+			continue;
+
+		drmmode_set_mode_major(crtc, &crtc->mode,
+				crtc->rotation, crtc->x, crtc->y);
+	}
+
+	if (retired)
+		drmmode_retired_fb_unref(retired);
+	if (drmmode->retired_fb_id) {
+		drmModeRmFB(drmmode->fd, drmmode->retired_fb_id);
+		drmmode->retired_fb_id = 0;
+	}
+
+	TRACE_EXIT();
+	return TRUE;
+}
+
+static const xf86CrtcConfigFuncsRec drmmode_xf86crtc_config_funcs = {
+		.resize = drmmode_xf86crtc_resize
+};
+
+
+Bool drmmode_pre_init(ScrnInfoPtr pScrn, int fd, int cpp)
+{
+	struct drmmode_rec *drmmode;
+	int i;
+
+	TRACE_ENTER();
+
+	drmmode = calloc(1, sizeof *drmmode);
+	if (!drmmode)
+		return FALSE;
+
+	drmmode->fd = fd;
+	xorg_list_init(&drmmode->msc_waits);
+
+	xf86CrtcConfigInit(pScrn, &drmmode_xf86crtc_config_funcs);
+
+
+	drmmode->cpp = cpp;
+	drmmode->mode_res = drmModeGetResources(drmmode->fd);
+	if (!drmmode->mode_res) {
+		free(drmmode);
+		return FALSE;
+	} else {
+		DEBUG_MSG("Got KMS resources");
+		DEBUG_MSG("  %d connectors, %d encoders",
+				drmmode->mode_res->count_connectors,
+				drmmode->mode_res->count_encoders);
+		DEBUG_MSG("  %d crtcs, %d fbs",
+				drmmode->mode_res->count_crtcs,
+				drmmode->mode_res->count_fbs);
+		DEBUG_MSG("  %dx%d minimum resolution",
+				drmmode->mode_res->min_width,
+				drmmode->mode_res->min_height);
+		DEBUG_MSG("  %dx%d maximum resolution",
+				drmmode->mode_res->max_width,
+				drmmode->mode_res->max_height);
+	}
+	xf86CrtcSetSizeRange(pScrn, 320, 200, drmmode->mode_res->max_width,
+			drmmode->mode_res->max_height);
 
-	enc = drmModeGetEncoder(drmmode->fd, connector->encoder_id);
-	drmmode_get_underscan(drmmode->fd, enc->crtc_id, &xu, &yu);
-	/* look for an EDID property */
-	for (i = 0; i < connector->count_props; i++) {
-		prop = drmModeGetProperty(drmmode->fd, connector->props[i]);
-		if (!prop)
-			continue;
+#ifdef DRM_CAP_ASYNC_PAGE_FLIP
+	{
+		uint64_t value = 0;
 
-		if ((prop->flags & DRM_MODE_PROP_BLOB) &&
-		    !strcmp(prop->name, "EDID")) {
-			if (drmmode_output->edid_blob)
-				drmModeFreePropertyBlob(
-						drmmode_output->edid_blob);
-			drmmode_output->edid_blob =
-					drmModeGetPropertyBlob(drmmode->fd,
-						connector->prop_values[i]);
-		}
-		drmModeFreeProperty(prop);
+		if (!drmGetCap(drmmode->fd, DRM_CAP_ASYNC_PAGE_FLIP, &value))
+			drmmode->async_flip = value != 0;
 	}
+#endif
+	INFO_MSG("Asynchronous page flips are %s",
+			drmmode->async_flip ? "supported" : "not supported");
 
-	if (drmmode_output->edid_blob)
-		ddc_mon = xf86InterpretEDID(pScrn->scrnIndex,
-				drmmode_output->edid_blob->data);
+	if (ARMSOCPTR(pScrn)->crtcNum == -1) {
+		INFO_MSG("Adding all CRTCs");
+		for (i = 0; i < drmmode->mode_res->count_crtcs; i++)
+			drmmode_crtc_init(pScrn, drmmode, i);
+	} else if (ARMSOCPTR(pScrn)->crtcNum < drmmode->mode_res->count_crtcs) {
+		drmmode_crtc_init(pScrn, drmmode, ARMSOCPTR(pScrn)->crtcNum);
+	} else {
+		ERROR_MSG(
+				"Specified more Screens in xorg.conf than there are DRM CRTCs");
+		return FALSE;
+	}
 
-	if (ddc_mon) {
-		if (drmmode_output->edid_blob->length > 128)
-			ddc_mon->flags |= MONITOR_EDID_COMPLETE_RAWDATA;
-		xf86OutputSetEDID(output, ddc_mon);
-		xf86SetDDCproperties(pScrn, ddc_mon);
+	if (ARMSOCPTR(pScrn)->crtcNum != -1) {
+		if (ARMSOCPTR(pScrn)->crtcNum <
+				drmmode->mode_res->count_connectors)
+			drmmode_output_init(pScrn,
+					drmmode, ARMSOCPTR(pScrn)->crtcNum);
+		else
+			return FALSE;
+	} else {
+		for (i = 0; i < drmmode->mode_res->count_connectors; i++)
+			drmmode_output_init(pScrn, drmmode, i);
 	}
+	drmmode_clones_init(pScrn, drmmode);
 
-	DEBUG_MSG("count_modes: %d", connector->count_modes);
+	if (ARMSOCPTR(pScrn)->atomic) {
+#ifdef DRM_CLIENT_CAP_ATOMIC
+		drmmode_atomic_init(pScrn, drmmode);
+#else
+		WARNING_MSG("Atomic modesetting not supported by libdrm");
+#endif
+	}
 
-	/* modes should already be available */
-	for (i = 0; i < connector->count_modes; i++) {
-		DisplayModePtr mode = xnfalloc(sizeof(DisplayModeRec));
+	xf86InitialConfiguration(pScrn, TRUE);
 
-		drmmode_ConvertFromKMode(pScrn, &connector->modes[i], mode, xu, yu);
-		modes = xf86ModesAdd(modes, mode);
-	}
-	return modes;
+	TRACE_EXIT();
+
+	return TRUE;
 }
 
-static void
-drmmode_output_destroy(xf86OutputPtr output)
+void
+drmmode_adjust_frame(ScrnInfoPtr pScrn, int x, int y)
 {
-	struct drmmode_output_priv *drmmode_output = output->driver_private;
-	int i;
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	xf86OutputPtr output = config->output[config->compat_output];
+	xf86CrtcPtr crtc = output->crtc;
 
-	if (drmmode_output->edid_blob)
-		drmModeFreePropertyBlob(drmmode_output->edid_blob);
+	if (!crtc || !crtc->enabled)
+		return;
 
-	for (i = 0; i < drmmode_output->num_props; i++) {
-		drmModeFreeProperty(drmmode_output->props[i].mode_prop);
-		free(drmmode_output->props[i].atoms);
-	}
-	free(drmmode_output->props);
+	drmmode_set_mode_major(crtc, &crtc->mode, crtc->rotation, x, y);
+}
 
-	for (i = 0; i < drmmode_output->connector->count_encoders; i++)
-		drmModeFreeEncoder(drmmode_output->encoders[i]);
+/*
+ * Frame clock
+ *
+ * Kernel drivers without vblank queries give us no frame counter, so each
+ * CRTC keeps its own: the time and count of a vblank, moved onto the real
+ * vblank whenever a page flip event says when one was and extrapolated by
+ * the refresh period in between. Cursor updates are aligned to it too, on
+ * every kernel.
+ */
 
-	free(drmmode_output->encoders);
+/* how often the clock is put onto the kernel's vblanks where it has
+ * vblank queries, in us */
+#define DRMMODE_CLOCK_CHECK_INTERVAL 1000000
 
-	drmModeFreeConnector(drmmode_output->connector);
-	free(drmmode_output);
-	output->driver_private = NULL;
-}
+struct drmmode_msc_wait {
+	struct xorg_list link;
+	OsTimerPtr timer;
+	xf86CrtcPtr crtc;
+	uint64_t msc;
+	struct ARMSOCFlipEvent *event;
+};
 
+/* move the clock to the last vblank before now */
 static void
-drmmode_output_dpms(xf86OutputPtr output, int mode)
+drmmode_crtc_clock_advance(xf86CrtcPtr crtc, uint64_t now)
 {
-	struct drmmode_output_priv *drmmode_output = output->driver_private;
-	drmModeConnectorPtr connector = drmmode_output->connector;
-	drmModePropertyPtr prop;
-	struct drmmode_rec *drmmode = drmmode_output->drmmode;
-	int mode_id = -1, i;
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	int64_t period = drmmode_crtc_frame_period(crtc);
+	uint64_t frames;
 
-	for (i = 0; i < connector->count_props; i++) {
-		prop = drmModeGetProperty(drmmode->fd, connector->props[i]);
-		if (!prop)
-			continue;
-		if ((prop->flags & DRM_MODE_PROP_ENUM) &&
-		    !strcmp(prop->name, "DPMS")) {
-			mode_id = connector->props[i];
-			drmModeFreeProperty(prop);
-			break;
-		}
-		drmModeFreeProperty(prop);
+	if (!drmmode_crtc->clock_ust) {
+		drmmode_crtc->clock_ust = now;
+		return;
 	}
 
-	if (mode_id < 0)
+	if (now <= drmmode_crtc->clock_ust)
 		return;
 
-	drmModeConnectorSetProperty(drmmode->fd, connector->connector_id,
-			mode_id, mode);
+	frames = (now - drmmode_crtc->clock_ust) / period;
+	drmmode_crtc->clock_msc += frames;
+	drmmode_crtc->clock_ust += frames * period;
 }
 
-static Bool
-drmmode_property_ignore(drmModePropertyPtr prop)
+/* a vblank was at ust, put the clock's phase onto it */
+static void
+drmmode_crtc_clock_sync(xf86CrtcPtr crtc, uint64_t ust)
 {
-	if (!prop)
-		return TRUE;
-	/* ignore blob prop */
-	if (prop->flags & DRM_MODE_PROP_BLOB)
-		return TRUE;
-	/* ignore standard property */
-	if (!strcmp(prop->name, "EDID") ||
-			!strcmp(prop->name, "DPMS") ||
-			!strcmp(prop->name, "mode"))
-		return TRUE;
-
-	return FALSE;
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	int64_t period = drmmode_crtc_frame_period(crtc);
+	int64_t delta, frames;
+
+	if (drmmode_crtc->clock_ust) {
+		delta = (int64_t)(ust - drmmode_crtc->clock_ust);
+		frames = (delta + (delta < 0 ? -period : period) / 2) / period;
+		if (frames < 0 && (uint64_t)-frames > drmmode_crtc->clock_msc)
+			frames = -(int64_t)drmmode_crtc->clock_msc;
+		drmmode_crtc->clock_msc += frames;
+	}
+	drmmode_crtc->clock_ust = ust;
 }
 
-static void
-drmmode_output_create_resources(xf86OutputPtr output)
+/* when vblank msc was or will be */
+static uint64_t
+drmmode_crtc_msc_ust(xf86CrtcPtr crtc, uint64_t msc)
 {
-	struct drmmode_output_priv *drmmode_output = output->driver_private;
-	drmModeConnectorPtr connector = drmmode_output->connector;
-	struct drmmode_rec *drmmode = drmmode_output->drmmode;
-	drmModePropertyPtr drmmode_prop;
-	uint32_t value;
-	int i, j, err;
-	drmModeEncoderPtr enc;
-	drmModeObjectPropertiesPtr crtcprops;
-
-	enc = drmModeGetEncoder(drmmode->fd, connector->encoder_id);
-	crtcprops = drmModeObjectGetProperties(drmmode->fd, enc->crtc_id, DRM_MODE_OBJECT_CRTC);
-	drmmode_output->props =
-		calloc(connector->count_props + crtcprops->count_props,
-				sizeof(struct drmmode_prop_rec));
-	if (!drmmode_output->props) {
-		drmModeFreeObjectProperties(crtcprops);
-		return;
-	}
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	int64_t period = drmmode_crtc_frame_period(crtc);
 
-	drmmode_output->num_props = 0;
-	for (i = 0; i < connector->count_props; i++) {
-		drmmode_prop = drmModeGetProperty(drmmode->fd,
-			connector->props[i]);
-		if (drmmode_property_ignore(drmmode_prop)) {
-			drmModeFreeProperty(drmmode_prop);
-			continue;
-		}
-		drmmode_output->props[drmmode_output->num_props].mode_prop =
-				drmmode_prop;
-		drmmode_output->props[drmmode_output->num_props].index = i;
-		drmmode_output->props[drmmode_output->num_props].drm_object_id = connector->connector_id;
-		drmmode_output->props[drmmode_output->num_props].drm_object =
-				DRM_MODE_OBJECT_CONNECTOR;
+	return drmmode_crtc->clock_ust +
+			(int64_t)(msc - drmmode_crtc->clock_msc) * period;
+}
 
-		drmmode_output->num_props++;
-	}
-	for (i = 0; i < crtcprops->count_props; i++) {
-		drmmode_prop = drmModeGetProperty(drmmode->fd,
-			crtcprops->props[i]);
+/*
+ * Current frame count and the time of its vblank, from the frame clock.
+ */
+void
+drmmode_crtc_get_ust_msc(xf86CrtcPtr crtc, uint64_t *ust, uint64_t *msc)
+{
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
 
-		if (drmmode_property_ignore(drmmode_prop)) {
-			drmModeFreeProperty(drmmode_prop);
-			continue;
-		}
-		drmmode_output->props[drmmode_output->num_props].mode_prop =
-				drmmode_prop;
-		drmmode_output->props[drmmode_output->num_props].index = i;
-		drmmode_output->props[drmmode_output->num_props].drm_object_id = enc->crtc_id;
-		drmmode_output->props[drmmode_output->num_props].drm_object =
-				DRM_MODE_OBJECT_CRTC;
+	drmmode_crtc_clock_advance(crtc, GetTimeInMicros());
+	*ust = drmmode_crtc->clock_ust;
+	*msc = drmmode_crtc->clock_msc;
+}
 
-		drmmode_output->num_props++;
+/*
+ * Time in us of the CRTC's last vblank at or before now, from its frame
+ * clock. Where the kernel answers vblank queries, the clock is put onto
+ * the kernel's vblank timestamps every so often, as it may not have seen
+ * a flip event in a while to keep it in step.
+ */
+static uint64_t
+drmmode_crtc_last_vblank(xf86CrtcPtr crtc, uint64_t now)
+{
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(crtc->scrn);
+	drmVBlank vbl;
+
+	if (pARMSOC->drmmode_interface->vblank_query_supported &&
+			now - drmmode_crtc->clock_checked >=
+				DRMMODE_CLOCK_CHECK_INTERVAL) {
+		drmmode_crtc->clock_checked = now;
+		vbl.request.type = DRM_VBLANK_RELATIVE |
+				drmmode_crtc_vblank_pipe(crtc);
+		vbl.request.sequence = 0;
+		if (!drmWaitVBlank(pARMSOC->drmFD, &vbl) &&
+				(vbl.reply.tval_sec || vbl.reply.tval_usec))
+			drmmode_crtc_clock_sync(crtc,
+					(uint64_t)vbl.reply.tval_sec * 1000000 +
+					vbl.reply.tval_usec);
 	}
 
-	for (i = 0; i < drmmode_output->num_props; i++) {
-		struct drmmode_prop_rec *p = &drmmode_output->props[i];
-		drmmode_prop = p->mode_prop;
-
-		if (p->drm_object == DRM_MODE_OBJECT_CONNECTOR)
-			value = drmmode_output->connector->prop_values[p->index];
-		else
-			value = crtcprops->prop_values[p->index];
+	drmmode_crtc_clock_advance(crtc, now);
+	return drmmode_crtc->clock_ust;
+}
 
-		if (drmmode_prop->flags & DRM_MODE_PROP_RANGE) {
-			INT32 range[2];
+static void
+drmmode_msc_wait_complete(struct drmmode_msc_wait *wait)
+{
+	uint64_t ust;
 
-			p->num_atoms = 1;
-			p->atoms = calloc(p->num_atoms, sizeof(Atom));
-			if (!p->atoms)
-				continue;
-			p->atoms[0] = MakeAtom(drmmode_prop->name,
-						strlen(drmmode_prop->name),
-						TRUE);
-			range[0] = drmmode_prop->values[0];
-			range[1] = drmmode_prop->values[1];
-			err = RRConfigureOutputProperty(output->randr_output,
-					p->atoms[0],
-					FALSE, TRUE,
-					drmmode_prop->flags &
-						DRM_MODE_PROP_IMMUTABLE ?
-							TRUE : FALSE,
-					2, range);
+	xorg_list_del(&wait->link);
+	TimerFree(wait->timer);
 
-			if (err != 0)
-				xf86DrvMsg(output->scrn->scrnIndex, X_ERROR,
-						"RRConfigureOutputProperty error, %d\n",
-						err);
+	drmmode_crtc_clock_advance(wait->crtc, GetTimeInMicros());
+	ust = drmmode_crtc_msc_ust(wait->crtc, wait->msc);
+	wait->event->handler(wait->event, wait->msc, ust / 1000000,
+			ust % 1000000);
+	free(wait);
+}
 
-			err = RRChangeOutputProperty(output->randr_output,
-					p->atoms[0],
-					XA_INTEGER, 32, PropModeReplace, 1,
-					&value, FALSE, FALSE);
-			if (err != 0)
-				xf86DrvMsg(output->scrn->scrnIndex, X_ERROR,
-						"RRChangeOutputProperty error, %d\n",
-						err);
+static CARD32
+drmmode_msc_wait_timer(OsTimerPtr timer, CARD32 now, pointer arg)
+{
+	drmmode_msc_wait_complete(arg);
+	return 0;
+}
 
-		} else if (drmmode_prop->flags & DRM_MODE_PROP_ENUM) {
-			p->num_atoms = drmmode_prop->count_enums + 1;
-			p->atoms = calloc(p->num_atoms, sizeof(Atom));
-			if (!p->atoms)
-				continue;
-			p->atoms[0] = MakeAtom(drmmode_prop->name,
-						strlen(drmmode_prop->name),
-						TRUE);
-			for (j = 1; j <= drmmode_prop->count_enums; j++) {
-				struct drm_mode_property_enum *e =
-						&drmmode_prop->enums[j-1];
-				p->atoms[j] = MakeAtom(e->name,
-							strlen(e->name), TRUE);
-			}
-			err = RRConfigureOutputProperty(output->randr_output,
-					p->atoms[0],
-					FALSE, FALSE,
-					drmmode_prop->flags &
-						DRM_MODE_PROP_IMMUTABLE ?
-							TRUE : FALSE,
-					p->num_atoms - 1,
-					(INT32 *)&p->atoms[1]);
+/*
+ * Deliver event once the frame clock of the CRTC reaches msc, the way the
+ * kernel delivers vblank events. Returns FALSE if it cannot be queued.
+ */
+Bool
+drmmode_crtc_queue_msc(xf86CrtcPtr crtc, uint64_t msc,
+		struct ARMSOCFlipEvent *event)
+{
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct drmmode_msc_wait *wait;
+	uint64_t now = GetTimeInMicros();
+	uint64_t when;
+	CARD32 delay = 1;
 
-			if (err != 0)
-				xf86DrvMsg(output->scrn->scrnIndex, X_ERROR,
-						"RRConfigureOutputProperty error, %d\n",
-						err);
+	wait = calloc(1, sizeof(*wait));
+	if (!wait)
+		return FALSE;
 
-			for (j = 0; j < drmmode_prop->count_enums; j++)
-				if (drmmode_prop->enums[j].value == value)
-					break;
-			/* there's always a matching value */
-			err = RRChangeOutputProperty(output->randr_output,
-					p->atoms[0],
-					XA_ATOM, 32, PropModeReplace, 1,
-					&p->atoms[j+1], FALSE, FALSE);
-			if (err != 0)
-				xf86DrvMsg(output->scrn->scrnIndex, X_ERROR,
-						"RRChangeOutputProperty error, %d\n",
-						err);
-		}
+	drmmode_crtc_clock_advance(crtc, now);
+	when = drmmode_crtc_msc_ust(crtc, msc);
+	if (when > now)
+		delay = max((when - now + 999) / 1000, 1);
+
+	wait->crtc = crtc;
+	wait->msc = msc;
+	wait->event = event;
+	/* never complete from within the request */
+	wait->timer = TimerSet(NULL, 0, delay, drmmode_msc_wait_timer, wait);
+	if (!wait->timer) {
+		free(wait);
+		return FALSE;
 	}
-	drmModeFreeObjectProperties(crtcprops);
+
+	xorg_list_add(&wait->link, &drmmode_crtc->drmmode->msc_waits);
+	return TRUE;
 }
 
-static Bool
-drmmode_output_set_property(xf86OutputPtr output, Atom property,
-		RRPropertyValuePtr value)
+/*
+ * Page Flipping
+ */
+
+static void
+page_flip_handler(int fd, unsigned int sequence, unsigned int tv_sec,
+		unsigned int tv_usec, void *user_data)
 {
-	struct drmmode_output_priv *drmmode_output = output->driver_private;
-	struct drmmode_rec *drmmode = drmmode_output->drmmode;
-	int i, ret;
+	struct ARMSOCFlipEvent *event = user_data;
 
-	for (i = 0; i < drmmode_output->num_props; i++) {
-		struct drmmode_prop_rec *p = &drmmode_output->props[i];
+	event->handler(event, sequence, tv_sec, tv_usec);
+}
 
-		if (p->atoms[0] != property)
-			continue;
+#if DRM_EVENT_CONTEXT_VERSION >= 3
+/*
+ * Flip events say which CRTC flipped, so the CRTC's frame clock can be
+ * kept in step, and report its count where the kernel has none.
+ */
+static void
+page_flip_handler2(int fd, unsigned int sequence, unsigned int tv_sec,
+		unsigned int tv_usec, unsigned int crtc_id, void *user_data)
+{
+	struct drmmode_crtc_private_rec *drmmode_crtc;
 
-		if (p->mode_prop->flags & DRM_MODE_PROP_RANGE) {
-			uint32_t val;
+	xorg_list_for_each_entry(drmmode_crtc, &drmmode_clocks, clock_link) {
+		xf86CrtcPtr crtc = drmmode_crtc->crtc;
 
-			if (value->type != XA_INTEGER || value->format != 32 ||
-					value->size != 1)
-				return FALSE;
-			val = *(uint32_t *)value->data;
+		if (drmmode_crtc->crtc_id != crtc_id ||
+				drmmode_crtc->drmmode->fd != fd)
+			continue;
 
-			ret = drmModeObjectSetProperty(drmmode->fd,
-					p->drm_object_id,
-					p->drm_object,
-					p->mode_prop->prop_id, (uint64_t)val);
+		if (tv_sec || tv_usec)
+			drmmode_crtc_clock_sync(crtc,
+					(uint64_t)tv_sec * 1000000 + tv_usec);
+		if (!ARMSOCPTR(crtc->scrn)->drmmode_interface->
+				vblank_query_supported)
+			sequence = drmmode_crtc->clock_msc;
+		break;
+	}
 
-			if (ret)
-				return FALSE;
+	page_flip_handler(fd, sequence, tv_sec, tv_usec, user_data);
+}
+#endif
 
-			return TRUE;
+static drmEventContext event_context = {
+		.version = DRM_EVENT_CONTEXT_VERSION,
+		.vblank_handler = page_flip_handler,
+		.page_flip_handler = page_flip_handler,
+#if DRM_EVENT_CONTEXT_VERSION >= 3
+		.page_flip_handler2 = page_flip_handler2,
+#endif
+};
 
-		} else if (p->mode_prop->flags & DRM_MODE_PROP_ENUM) {
-			Atom	atom;
-			const char	*name;
-			int		j;
+Bool
+drmmode_async_flip_supported(ScrnInfoPtr pScrn)
+{
+	return drmmode_from_scrn(pScrn)->async_flip;
+}
 
-			if (value->type != XA_ATOM ||
-					value->format != 32 ||
-					value->size != 1)
-				return FALSE;
+/*
+ * Return the enabled CRTC showing the largest part of the given box, or
+ * NULL if it is not visible on any of them.
+ */
+xf86CrtcPtr
+drmmode_crtc_covering_box(ScrnInfoPtr pScrn, BoxPtr box)
+{
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	xf86CrtcPtr best = NULL;
+	int i, best_coverage = 0;
 
-			memcpy(&atom, value->data, 4);
-			name = NameForAtom(atom);
-			if (name == NULL)
-				return FALSE;
+	for (i = 0; i < config->num_crtc; i++) {
+		xf86CrtcPtr crtc = config->crtc[i];
+		int x1, y1, x2, y2, coverage;
 
-			/* search for matching name string, then
-			 * set its value down
-			 */
-			for (j = 0; j < p->mode_prop->count_enums; j++) {
-				if (!strcmp(p->mode_prop->enums[j].name,
-						name)) {
-					ret = drmModeObjectSetProperty(
-						drmmode->fd,
-						p->drm_object_id,
-						p->drm_object,
-						p->mode_prop->prop_id,
-						p->mode_prop->enums[j].value);
+		if (!crtc->enabled)
+			continue;
 
-					if (ret)
-						return FALSE;
+		x1 = max(box->x1, crtc->x);
+		y1 = max(box->y1, crtc->y);
+		x2 = min(box->x2, crtc->x + crtc->mode.HDisplay);
+		y2 = min(box->y2, crtc->y + crtc->mode.VDisplay);
+		if (x1 >= x2 || y1 >= y2)
+			continue;
 
-					return TRUE;
-				}
-			}
-			return FALSE;
+		coverage = (x2 - x1) * (y2 - y1);
+		if (coverage > best_coverage) {
+			best_coverage = coverage;
+			best = crtc;
 		}
 	}
-	return TRUE;
+
+	return best;
+}
+
+/*
+ * Return the bits selecting the CRTC in a drmWaitVBlank request.
+ */
+uint32_t
+drmmode_crtc_vblank_pipe(xf86CrtcPtr crtc)
+{
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	drmModeResPtr mode_res = drmmode_crtc->drmmode->mode_res;
+	int i;
+
+	for (i = 0; i < mode_res->count_crtcs; i++)
+		if (mode_res->crtcs[i] == drmmode_crtc->crtc_id)
+			break;
+
+	if (i == 0 || i == mode_res->count_crtcs)
+		return 0;
+	if (i == 1)
+		return DRM_VBLANK_SECONDARY;
+	return (i << DRM_VBLANK_HIGH_CRTC_SHIFT) & DRM_VBLANK_HIGH_CRTC_MASK;
 }
 
+/*
+ * Get the screen area of a window drawn straight into the root pixmap and
+ * not obscured or clipped anywhere, which is what can be shown from a
+ * buffer of its own. Returns FALSE for any other drawable.
+ */
 static Bool
-drmmode_output_get_property(xf86OutputPtr output, Atom property)
+drmmode_drawable_box(DrawablePtr pDraw, BoxPtr box)
 {
+	ScreenPtr pScreen = pDraw->pScreen;
+	WindowPtr pWin = (WindowPtr)pDraw;
+	BoxPtr clip;
 
-	struct drmmode_output_priv *drmmode_output = output->driver_private;
-	struct drmmode_rec *drmmode = drmmode_output->drmmode;
-	uint32_t value;
-	int err, i;
-	drmModeEncoderPtr enc;
-	drmModeObjectPropertiesPtr crtcprops;
+	if (pDraw->type != DRAWABLE_WINDOW)
+		return FALSE;
 
-	if (output->scrn->vtSema) {
-		drmModeFreeConnector(drmmode_output->connector);
-		drmmode_output->connector =
-				drmModeGetConnector(drmmode->fd,
-						drmmode_output->output_id);
-	}
+	if (pScreen->GetWindowPixmap(pWin) !=
+			pScreen->GetWindowPixmap(pScreen->root))
+		return FALSE;
 
-	for (i = 0; i < drmmode_output->num_props; i++) {
-		struct drmmode_prop_rec *p = &drmmode_output->props[i];
-		if (p->atoms[0] != property)
-			continue;
+	box->x1 = pDraw->x;
+	box->y1 = pDraw->y;
+	box->x2 = pDraw->x + pDraw->width;
+	box->y2 = pDraw->y + pDraw->height;
 
-		if (p->drm_object == DRM_MODE_OBJECT_CRTC) {
-			enc = drmModeGetEncoder(drmmode->fd, drmmode_output->connector->encoder_id);
-			crtcprops = drmModeObjectGetProperties(drmmode->fd, enc->crtc_id, DRM_MODE_OBJECT_CRTC);
-			value = crtcprops->prop_values[p->index];
-			drmModeFreeObjectProperties(crtcprops);
-		} else
-			value = drmmode_output->connector->prop_values[p->index];
+	if (RegionNumRects(&pWin->clipList) != 1)
+		return FALSE;
 
-		if (p->mode_prop->flags & DRM_MODE_PROP_RANGE) {
-			err = RRChangeOutputProperty(output->randr_output,
-					property, XA_INTEGER, 32,
-					PropModeReplace, 1, &value,
-					FALSE, FALSE);
+	clip = RegionExtents(&pWin->clipList);
+	return clip->x1 == box->x1 && clip->y1 == box->y1 &&
+			clip->x2 == box->x2 && clip->y2 == box->y2;
+}
 
-			return !err;
-		} else if (p->mode_prop->flags & DRM_MODE_PROP_ENUM) {
-			int		j;
+/*
+ * Return a mask (by index in the CRTC config) of the enabled CRTCs whose
+ * viewport is exactly covered by the given window, so that the window's
+ * buffers can be scanned out on those CRTCs directly. The window has to be
+ * unobscured and drawn straight to the root pixmap.
+ */
+unsigned int
+drmmode_crtcs_for_drawable(DrawablePtr pDraw)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pDraw->pScreen);
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	BoxRec box;
+	unsigned int mask = 0;
+	int i;
 
-			/* search for matching name string, then set
-			 * its value down
-			 */
-			for (j = 0; j < p->mode_prop->count_enums; j++) {
-				if (p->mode_prop->enums[j].value == value)
-					break;
-			}
+	if (!drmmode_drawable_box(pDraw, &box))
+		return 0;
 
-			err = RRChangeOutputProperty(output->randr_output,
-						property,
-						XA_ATOM, 32, PropModeReplace, 1,
-						&p->atoms[j+1], FALSE, FALSE);
+	for (i = 0; i < config->num_crtc; i++) {
+		xf86CrtcPtr crtc = config->crtc[i];
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				crtc->driver_private;
 
-			return !err;
-		}
+		if (!crtc->enabled)
+			continue;
+
+		if (crtc->x != box.x1 || crtc->y != box.y1 ||
+				crtc->mode.HDisplay != pDraw->width ||
+				crtc->mode.VDisplay != pDraw->height)
+			continue;
+
+		/* The buffer must match what the CRTC scans out pixel for
+		 * pixel: no shadow rotation and no underscan border.
+		 */
+		if (crtc->rotation != RR_Rotate_0 || crtc->transformPresent ||
+				drmmode_crtc->underscan_x ||
+				drmmode_crtc->underscan_y)
+			continue;
+
+		mask |= 1 << i;
 	}
 
-	return FALSE;
+	return mask;
 }
 
-static const xf86OutputFuncsRec drmmode_output_funcs = {
-		.create_resources = drmmode_output_create_resources,
-		.dpms = drmmode_output_dpms,
-		.detect = drmmode_output_detect,
-		.mode_valid = drmmode_output_mode_valid,
-		.get_modes = drmmode_output_get_modes,
-		.set_property = drmmode_output_set_property,
-		.get_property = drmmode_output_get_property,
-		.destroy = drmmode_output_destroy
-};
+/*
+ * Return the buffer currently scanned out on behalf of the given window by
+ * the CRTCs it covers, if any.
+ */
+struct armsoc_bo *
+drmmode_scanout_bo_for_drawable(DrawablePtr pDraw)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pDraw->pScreen);
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	unsigned int crtc_mask = drmmode_crtcs_for_drawable(pDraw);
+	int i;
 
-const char *output_names[] = { "None",
-		"VGA",
-		"DVI-I",
-		"DVI-D",
-		"DVI-A",
-		"Composite",
-		"SVIDEO",
-		"LVDS",
-		"CTV",
-		"DIN",
-		"DP",
-		"HDMI",
-		"HDMI",
-		"TV",
-		"eDP",
-};
-#define NUM_OUTPUT_NAMES (sizeof(output_names) / sizeof(output_names[0]))
+	for (i = 0; i < config->num_crtc; i++) {
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				config->crtc[i]->driver_private;
 
-static void
-drmmode_output_init(ScrnInfoPtr pScrn, struct drmmode_rec *drmmode, int num)
+		if (!(crtc_mask & (1 << i)))
+			continue;
+
+		if (drmmode_crtc->scanout_bo &&
+				drmmode_crtc->scanout_draw_id == pDraw->id)
+			return drmmode_crtc->scanout_bo;
+	}
+
+	return NULL;
+}
+
+/*
+ * Put the CRTCs scanning out the given buffer (or every CRTC with a buffer
+ * of its own if bo is NULL) back on the root framebuffer.
+ */
+void
+drmmode_scanout_restore(ScrnInfoPtr pScrn, struct armsoc_bo *bo)
 {
-	xf86OutputPtr output;
-	drmModeConnectorPtr connector;
-	drmModeEncoderPtr *encoders = NULL;
-	struct drmmode_output_priv *drmmode_output;
-	char name[32];
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
 	int i;
 
-	TRACE_ENTER();
+	for (i = 0; i < config->num_crtc; i++) {
+		xf86CrtcPtr crtc = config->crtc[i];
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				crtc->driver_private;
 
-	connector = drmModeGetConnector(drmmode->fd, drmmode->mode_res->connectors[num]);
-	if (!connector)
-		goto exit;
+		if (!drmmode_crtc->scanout_bo)
+			continue;
 
-	encoders = calloc(sizeof(drmModeEncoderPtr), connector->count_encoders);
-	if (!encoders)
-		goto free_connector_exit;
+		if (bo && drmmode_crtc->scanout_bo != bo)
+			continue;
+
+		if (crtc->enabled && pScrn->vtSema && drmmode_crtc_set_fb(crtc,
+				armsoc_bo_get_fb(pARMSOC->scanout),
+				crtc->x, crtc->y))
+			ERROR_MSG("failed to restore root framebuffer: %s",
+					strerror(errno));
+
+		drmmode_crtc_set_scanout_bo(drmmode_crtc, NULL, 0);
+	}
+}
+
+/*
+ * Copy the contents of a buffer that was scanned out in place of a window
+ * back into the window, so the root framebuffer is up to date before the
+ * CRTC is switched back to it.
+ */
+static void
+drmmode_copy_bo_to_drawable(DrawablePtr pDraw, struct armsoc_bo *bo)
+{
+	GCPtr pGC;
+
+	pGC = GetScratchGC(pDraw->depth, pDraw->pScreen);
+	if (!pGC)
+		return;
 
-	for (i = 0; i < connector->count_encoders; i++) {
-		encoders[i] = drmModeGetEncoder(drmmode->fd, connector->encoders[i]);
-		if (!encoders[i])
-			goto free_encoders_exit;
-	}
+	ValidateGC(pDraw, pGC);
+	ARMSOCCopyBoToDrawable(bo, pDraw, pGC);
+	FreeScratchGC(pGC);
+}
 
-	if (connector->connector_type >= NUM_OUTPUT_NAMES)
-		snprintf(name, 32, "Unknown%d-%d", connector->connector_type, connector->connector_type_id);
-	else
-		snprintf(name, 32, "%s-%d", output_names[connector->connector_type], connector->connector_type_id);
+/*
+ * Called from the block handler: windows that were flipped on a subset of
+ * the CRTCs may since have been moved, obscured or destroyed without
+ * swapping again. Hand those CRTCs back to the root framebuffer.
+ */
+static void drmmode_overlay_validate(ScrnInfoPtr pScrn);
 
-	output = xf86OutputCreate(pScrn, &drmmode_output_funcs, name);
-	if (!output)
-		goto free_encoders_exit;
+void
+drmmode_scanout_validate(ScrnInfoPtr pScrn)
+{
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	int i;
 
-	drmmode_output = calloc(sizeof(struct drmmode_output_priv), 1);
-	if (!drmmode_output) {
-		xf86OutputDestroy(output);
-		goto free_encoders_exit;
-	}
+	for (i = 0; i < config->num_crtc; i++) {
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				config->crtc[i]->driver_private;
+		struct armsoc_bo *bo = drmmode_crtc->scanout_bo;
+		DrawablePtr pDraw;
 
-	drmmode_output->output_id = drmmode->mode_res->connectors[num];
-	drmmode_output->connector = connector;
-	drmmode_output->encoders = encoders;
-	drmmode_output->drmmode = drmmode;
+		if (!bo)
+			continue;
 
-	output->mm_width = connector->mmWidth;
-	output->mm_height = connector->mmHeight;
-	output->driver_private = drmmode_output;
+		if (dixLookupDrawable(&pDraw, drmmode_crtc->scanout_draw_id,
+				serverClient, M_WINDOW, DixWriteAccess)
+				!= Success) {
+			drmmode_scanout_restore(pScrn, bo);
+			continue;
+		}
 
-	/*
-	 * Determine which crtcs are supported by all the encoders which
-	 * are valid for the connector of this output.
-	 */
-	output->possible_crtcs = 0xffffffff;
-	for (i = 0; i < connector->count_encoders; i++)
-		output->possible_crtcs &= encoders[i]->possible_crtcs;
-	/*
-	 * output->possible_crtcs is a bitmask arranged by index of crtcs for this screen while
-	 * encoders->possible_crtcs covers all crtcs supported by the drm. If we have selected
-	 * one crtc per screen, it must be at index 0.
-	 */
-	if (ARMSOCPTR(pScrn)->crtcNum >= 0)
-		output->possible_crtcs = (output->possible_crtcs >> (ARMSOCPTR(pScrn)->crtcNum)) & 1;
+		if (drmmode_crtcs_for_drawable(pDraw) & (1 << i))
+			continue;
 
-	output->possible_clones = 0; /* set after all outputs initialized */
-	output->interlaceAllowed = TRUE;
-	goto exit;
+		armsoc_bo_reference(bo);
+		drmmode_copy_bo_to_drawable(pDraw, bo);
+		drmmode_scanout_restore(pScrn, bo);
+		armsoc_bo_unreference(bo);
+	}
 
-free_encoders_exit:
-	for (i = 0; i < connector->count_encoders; i++)
-		drmModeFreeEncoder(encoders[i]);
+	drmmode_overlay_validate(pScrn);
+	drmmode_vrr_validate(pScrn, FALSE);
+}
 
-free_connector_exit:
-	drmModeFreeConnector(connector);
+/* Smallest window worth an overlay plane of its own */
+#define ARMSOC_OVERLAY_MIN_SIZE 64
 
-exit:
-	TRACE_EXIT();
-	return;
+/* The bit of a format in drmmode_overlay.formats, 0 for other formats */
+static uint32_t
+drmmode_overlay_format_bit(uint32_t format)
+{
+	int i;
 
+	for (i = 0; i < ARRAY_SIZE(drmmode_overlay_formats); i++)
+		if (drmmode_overlay_formats[i] == format)
+			return 1 << i;
+	return 0;
 }
+
+/*
+ * Find the overlay planes a window can be shown on: every plane that is
+ * not taken by the hardware cursor and can scan out one of the formats
+ * windows are drawn in.
+ */
 static void
-drmmode_clones_init(ScrnInfoPtr pScrn, struct drmmode_rec *drmmode)
+drmmode_overlay_init(ScrnInfoPtr pScrn)
 {
-	int i;
-	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+	drmModePlaneResPtr plane_res;
+	int i, j;
 
-	/* For each output generate enc_mask, a mask of encoders present,
-	 * and enc_clones, a mask of possible clone encoders
-	 */
-	for (i = 0; i < xf86_config->num_output; i++) {
-		xf86OutputPtr output = xf86_config->output[i];
-		struct drmmode_output_priv *drmmode_output = output->driver_private;
-		int j;
+	if (!xf86LoaderCheckSymbol("drmModeGetPlaneResources")) {
+		WARNING_MSG("Overlays not supported (needs libdrm 2.4.30 or higher)");
+		return;
+	}
 
-		drmmode_output->enc_clones = 0xffffffff;
-		drmmode_output->enc_mask = 0;
+	if (!dixRegisterPrivateKey(&drmmode_overlay_window_key,
+			PRIVATE_WINDOW, sizeof(struct drmmode_overlay_window))) {
+		ERROR_MSG("Overlays: failed to register window private");
+		return;
+	}
 
-		for (j = 0; j < drmmode_output->connector->count_encoders; j++) {
-			int k;
+	plane_res = drmModeGetPlaneResources(drmmode->fd);
+	if (!plane_res) {
+		WARNING_MSG("Overlays: drmModeGetPlaneResources failed: %s",
+				strerror(errno));
+		return;
+	}
 
-			/* set index ordered mask of encoders on this output */
-			for (k = 0; k < drmmode->mode_res->count_encoders; k++) {
-				if (drmmode->mode_res->encoders[k] == drmmode_output->encoders[j]->encoder_id)
-					drmmode_output->enc_mask |= (1 << k);
-			}
-			/* set mask for encoder clones possible with all encoders on this output */
-			drmmode_output->enc_clones &= drmmode_output->encoders[j]->possible_clones;
-		}
+	drmmode->overlays = calloc(plane_res->count_planes,
+			sizeof(*drmmode->overlays));
+	if (!drmmode->overlays) {
+		drmModeFreePlaneResources(plane_res);
+		return;
 	}
 
-	/* Output j is a possible clone of output i if the enc_mask for j matches the enc_clones for i */
-	for (i = 0; i < xf86_config->num_output; i++) {
-		xf86OutputPtr output = xf86_config->output[i];
-		struct drmmode_output_priv *drmmode_output = output->driver_private;
-		int j;
+	for (i = 0; i < plane_res->count_planes; i++) {
+		struct drmmode_overlay *ovl =
+				&drmmode->overlays[drmmode->num_overlays];
+		uint32_t plane_id = plane_res->planes[i];
+		drmModePlanePtr plane;
 
-		output->possible_clones = 0;
-		if (drmmode_output->enc_clones == 0)
+		if (drmmode_plane_is_cursor(pScrn, plane_id))
 			continue;
 
-		for (j = 0; j < xf86_config->num_output; j++) {
-			struct drmmode_output_priv *clone = xf86_config->output[j]->driver_private;
+#ifdef DRM_CLIENT_CAP_ATOMIC
+		/* primary and cursor planes are listed too with atomic */
+		if (drmmode->atomic && (!drmmode_prop_info_init(drmmode->fd,
+				plane_id, DRM_MODE_OBJECT_PLANE, ovl->props,
+				plane_props, DRMMODE_PLANE__COUNT) ||
+				ovl->props[DRMMODE_PLANE_TYPE].value !=
+					DRM_PLANE_TYPE_OVERLAY)) {
+			memset(ovl, 0, sizeof(*ovl));
+			continue;
+		}
+#endif
 
-			if ((i != j) &&
-				(clone->enc_mask != 0) &&
-				(drmmode_output->enc_clones == clone->enc_mask))
+		plane = drmModeGetPlane(drmmode->fd, plane_id);
+		if (!plane)
+			continue;
 
-				output->possible_clones |= (1 << j);
-		}
+		for (j = 0; j < plane->count_formats; j++)
+			ovl->formats |= drmmode_overlay_format_bit(
+					plane->formats[j]);
+		ovl->plane_id = plane_id;
+		ovl->possible_crtcs = plane->possible_crtcs;
+		drmModeFreePlane(plane);
+
+		if (ovl->formats)
+			drmmode->num_overlays++;
+		else
+			memset(ovl, 0, sizeof(*ovl));
 	}
+
+	drmModeFreePlaneResources(plane_res);
+	INFO_MSG("%d overlay plane(s) available for windows",
+			drmmode->num_overlays);
 }
 
-void set_scanout_bo(ScrnInfoPtr pScrn, struct armsoc_bo *bo)
+/*
+ * Return the CRTC a window can be shown on with an overlay plane, and the
+ * window's position in screen coordinates. The window has to be unobscured,
+ * opaque and fully inside the viewport of a CRTC that scans out the root
+ * framebuffer as is.
+ */
+static xf86CrtcPtr
+drmmode_overlay_crtc(DrawablePtr pDraw, BoxPtr box)
 {
-	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
-	struct armsoc_bo *old_bo = pARMSOC->scanout;
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pDraw->pScreen);
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	int i;
 
-	/* It had better have a framebuffer if we're scanning it out */
-	assert(armsoc_bo_get_fb(bo));
+	if (!drmmode_drawable_box(pDraw, box))
+		return NULL;
 
-	armsoc_bo_reference(bo);
-	pARMSOC->scanout = bo;
-	if (old_bo)
-		armsoc_bo_unreference(old_bo);
-}
+	/* planes are blended over the root, which a window with an alpha
+	 * channel would show through */
+	if (!drmmode_overlay_format_bit(armsoc_drm_format(pDraw->depth,
+			pDraw->bitsPerPixel)))
+		return NULL;
 
-static Bool resize_scanout_bo(ScrnInfoPtr pScrn, int width, int height)
-{
-	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
-	ScreenPtr pScreen = pScrn->pScreen;
-	uint32_t pitch;
+	if (pDraw->width < ARMSOC_OVERLAY_MIN_SIZE ||
+			pDraw->height < ARMSOC_OVERLAY_MIN_SIZE)
+		return NULL;
 
-	TRACE_ENTER();
-	DEBUG_MSG("Resize: %dx%d", width, height);
+	/* many display controllers cannot start or end a plane on an odd
+	 * pixel */
+	if ((box->x1 | pDraw->width) & 1)
+		return NULL;
 
-	pScrn->virtualX = width;
-	pScrn->virtualY = height;
+	for (i = 0; i < config->num_crtc; i++) {
+		xf86CrtcPtr crtc = config->crtc[i];
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				crtc->driver_private;
 
-	if ((width != armsoc_bo_width(pARMSOC->scanout))
-	      || (height != armsoc_bo_height(pARMSOC->scanout))
-	      || (pScrn->bitsPerPixel != armsoc_bo_bpp(pARMSOC->scanout))) {
-		struct armsoc_bo *new_scanout;
+		if (!crtc->enabled || drmmode_crtc->scanout_bo)
+			continue;
 
-		/* allocate new scanout buffer */
-		new_scanout = armsoc_bo_new_with_dim(pARMSOC->dev,
-				width, height,
-				pScrn->depth, pScrn->bitsPerPixel,
-				ARMSOC_BO_SCANOUT);
-		if (!new_scanout) {
-			/* Try to use the previous buffer if the new resolution
-			 * is smaller than the one on buffer creation
-			 */
-			DEBUG_MSG(
-					"allocate new scanout buffer failed - resizing existing bo");
-			/* Remove the old fb from the bo */
-			if (armsoc_bo_rm_fb(pARMSOC->scanout))
-				return FALSE;
+		if (crtc->rotation != RR_Rotate_0 || crtc->transformPresent ||
+				drmmode_crtc->underscan_x ||
+				drmmode_crtc->underscan_y)
+			continue;
 
-			/* Resize the bo */
-			if (armsoc_bo_resize(pARMSOC->scanout, width, height)) {
-				armsoc_bo_clear(pARMSOC->scanout);
-				if (armsoc_bo_add_fb(pARMSOC->scanout))
-					ERROR_MSG(
-							"Failed to add framebuffer to the existing scanout buffer");
-				return FALSE;
-			}
+		if (box->x1 >= crtc->x && box->y1 >= crtc->y &&
+				box->x2 <= crtc->x + crtc->mode.HDisplay &&
+				box->y2 <= crtc->y + crtc->mode.VDisplay)
+			return crtc;
+	}
 
-			/* Add new fb to the bo */
-			if (armsoc_bo_clear(pARMSOC->scanout))
-				return FALSE;
+	return NULL;
+}
 
-			if (armsoc_bo_add_fb(pARMSOC->scanout)) {
-				ERROR_MSG(
-						"Failed to add framebuffer to the existing scanout buffer");
-				return FALSE;
-			}
+/*
+ * Find the overlay plane to show a window on in the given format: the one
+ * it is on already if that still works for the CRTC, or else a free one.
+ */
+static struct drmmode_overlay *
+drmmode_overlay_find(struct drmmode_rec *drmmode, DrawablePtr pDraw,
+		xf86CrtcPtr crtc, uint32_t format)
+{
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct drmmode_overlay *unused = NULL;
+	int i;
 
-			pitch = armsoc_bo_pitch(pARMSOC->scanout);
-		} else {
-			DEBUG_MSG("allocated new scanout buffer okay");
-			pitch = armsoc_bo_pitch(new_scanout);
-			/* clear new BO and add FB */
-			if (armsoc_bo_clear(new_scanout)) {
-				armsoc_bo_unreference(new_scanout);
-				return FALSE;
-			}
+	for (i = 0; i < drmmode->num_overlays; i++) {
+		struct drmmode_overlay *ovl = &drmmode->overlays[i];
 
-			if (armsoc_bo_add_fb(new_scanout)) {
-				ERROR_MSG(
-						"Failed to add framebuffer to the new scanout buffer");
-				armsoc_bo_unreference(new_scanout);
-				return FALSE;
-			}
+		if (!(ovl->possible_crtcs & (1 << drmmode_crtc->index)))
+			continue;
 
-			/* Handle dma_buf fd that may be attached to old bo */
-			if (armsoc_bo_has_dmabuf(pARMSOC->scanout)) {
-				int res;
+		if (!(ovl->formats & drmmode_overlay_format_bit(format)))
+			continue;
 
-				armsoc_bo_clear_dmabuf(pARMSOC->scanout);
-				res = armsoc_bo_set_dmabuf(new_scanout);
-				if (res) {
-					ERROR_MSG(
-							"Unable to attach dma_buf fd to new scanout buffer - %d (%s)\n",
-							res, strerror(res));
-					armsoc_bo_unreference(new_scanout);
-					return FALSE;
-				}
-			}
-			/* use new scanout buffer */
-			set_scanout_bo(pScrn, new_scanout);
-			/* set_scanout_bo takes its own reference, we have
-			 * no other hold on this bo. */
-			armsoc_bo_unreference(new_scanout);
-		}
-		pScrn->displayWidth = pitch / ((pScrn->bitsPerPixel + 7) / 8);
-	} else
-		pitch = armsoc_bo_pitch(pARMSOC->scanout);
+		if (ovl->bo && ovl->draw_id == pDraw->id)
+			return ovl;
 
-	if (pScreen && pScreen->ModifyPixmapHeader) {
-		PixmapPtr rootPixmap = pScreen->GetScreenPixmap(pScreen);
+		if (!ovl->bo && !unused)
+			unused = ovl;
+	}
 
-		pScreen->ModifyPixmapHeader(rootPixmap,
-				pScrn->virtualX, pScrn->virtualY,
-				pScrn->depth, pScrn->bitsPerPixel, pitch,
-				armsoc_bo_map(pARMSOC->scanout));
+	return unused;
+}
 
-		/* Bump the serial number to ensure that all existing DRI2
-		 * buffers are invalidated.
-		 *
-		 * This is particularly required for when the resolution is
-		 * changed and then reverted to the original size without a
-		 * DRI2 client/s getting a new buffer. Without this, the
-		 * drawable is the same size and serial number so the old
-		 * DRI2Buffer will be returned, even though the backing buffer
-		 * has been deleted.
-		 */
-		rootPixmap->drawable.serialNumber = NEXT_SERIAL_NUMBER;
-	}
+static void
+drmmode_overlay_release(ScrnInfoPtr pScrn, struct drmmode_overlay *ovl)
+{
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
 
-	/* Now that we've bound this bo to the root pixmap, we need to be
-	 * sure we tie its lifetime to that pixmap. The root pixmap is not
-	 * one of the ones we're typically asked to CreateBuffers for.
-	 * The best match I can find here is to assume it has taken over
-	 * the allocation provided to fbScreenInit. */
-	if (pARMSOC->fb_bo != pARMSOC->scanout) {
-		armsoc_bo_unreference(pARMSOC->fb_bo);
-		pARMSOC->fb_bo = pARMSOC->scanout;
-		armsoc_bo_reference(pARMSOC->fb_bo);
-	}
-	TRACE_EXIT();
-	return TRUE;
+	if (pScrn->vtSema && drmModeSetPlane(drmmode->fd, ovl->plane_id,
+			0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0))
+		ERROR_MSG("failed to disable overlay plane %u: %s",
+				ovl->plane_id, strerror(errno));
+
+	armsoc_bo_unreference(ovl->bo);
+	ovl->bo = NULL;
+	ovl->draw_id = 0;
+	ovl->crtc = NULL;
 }
 
-static Bool
-drmmode_xf86crtc_resize(ScrnInfoPtr pScrn, int width, int height)
+/*
+ * Can the window's buffers be shown on an overlay plane?
+ */
+Bool
+drmmode_overlay_possible(DrawablePtr pDraw)
 {
-	int i;
-	xf86CrtcConfigPtr xf86_config;
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pDraw->pScreen);
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+	struct drmmode_overlay_window *priv;
+	xf86CrtcPtr crtc;
+	BoxRec box;
 
-	TRACE_ENTER();
-	if (!resize_scanout_bo(pScrn, width, height))
+	if (!drmmode->num_overlays)
 		return FALSE;
 
-	/* Framebuffer needs to be reset on all CRTCs, not just
-	 * those that have repositioned */
-	xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
-	for (i = 0; i < xf86_config->num_crtc; i++) {
-		xf86CrtcPtr crtc = xf86_config->crtc[i];
-
-		if (!crtc->enabled)
-			continue;
+	crtc = drmmode_overlay_crtc(pDraw, &box);
+	if (!crtc)
+		return FALSE;
 
-		drmmode_set_mode_major(crtc, &crtc->mode,
-				crtc->rotation, crtc->x, crtc->y);
+	priv = drmmode_overlay_window(pDraw);
+	if (priv->rejected) {
+		if (!memcmp(&box, &priv->box, sizeof(box)))
+			return FALSE;
+		priv->rejected = FALSE;
 	}
 
-	TRACE_EXIT();
-	return TRUE;
+	return drmmode_overlay_find(drmmode, pDraw, crtc,
+			armsoc_drm_format(pDraw->depth, pDraw->bitsPerPixel));
 }
 
-static const xf86CrtcConfigFuncsRec drmmode_xf86crtc_config_funcs = {
-		.resize = drmmode_xf86crtc_resize
-};
-
-
-Bool drmmode_pre_init(ScrnInfoPtr pScrn, int fd, int cpp)
+/*
+ * Return the buffer an overlay plane currently shows for the window, if any.
+ */
+struct armsoc_bo *
+drmmode_overlay_bo_for_drawable(DrawablePtr pDraw)
 {
-	struct drmmode_rec *drmmode;
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pDraw->pScreen);
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
 	int i;
 
-	TRACE_ENTER();
+	for (i = 0; i < drmmode->num_overlays; i++) {
+		struct drmmode_overlay *ovl = &drmmode->overlays[i];
 
-	drmmode = calloc(1, sizeof *drmmode);
-	if (!drmmode)
-		return FALSE;
+		if (ovl->bo && ovl->draw_id == pDraw->id)
+			return ovl->bo;
+	}
 
-	drmmode->fd = fd;
+	return NULL;
+}
 
-	xf86CrtcConfigInit(pScrn, &drmmode_xf86crtc_config_funcs);
+#ifdef DRM_CLIENT_CAP_ATOMIC
+/*
+ * Move the plane to bo in a nonblocking commit, which sends a flip event
+ * once the plane shows it.
+ */
+static int
+drmmode_overlay_flip_atomic(struct drmmode_rec *drmmode,
+		struct drmmode_overlay *ovl, xf86CrtcPtr crtc, BoxPtr box,
+		struct armsoc_bo *bo, struct ARMSOCFlipEvent *event)
+{
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	const struct drmmode_prop_info *props = ovl->props;
+	uint32_t plane_id = ovl->plane_id;
+	uint64_t w = box->x2 - box->x1;
+	uint64_t h = box->y2 - box->y1;
+	drmModeAtomicReqPtr req;
+	int ret = 0;
+
+	req = drmModeAtomicAlloc();
+	if (!req)
+		return -1;
+
+	ret |= drmmode_atomic_add(req, plane_id, &props[DRMMODE_PLANE_FB_ID],
+			armsoc_bo_get_fb(bo));
+	ret |= drmmode_atomic_add(req, plane_id,
+			&props[DRMMODE_PLANE_CRTC_ID], drmmode_crtc->crtc_id);
+	ret |= drmmode_atomic_add(req, plane_id, &props[DRMMODE_PLANE_SRC_X],
+			0);
+	ret |= drmmode_atomic_add(req, plane_id, &props[DRMMODE_PLANE_SRC_Y],
+			0);
+	ret |= drmmode_atomic_add(req, plane_id, &props[DRMMODE_PLANE_SRC_W],
+			w << 16);
+	ret |= drmmode_atomic_add(req, plane_id, &props[DRMMODE_PLANE_SRC_H],
+			h << 16);
+	ret |= drmmode_atomic_add(req, plane_id,
+			&props[DRMMODE_PLANE_CRTC_X], box->x1 - crtc->x);
+	ret |= drmmode_atomic_add(req, plane_id,
+			&props[DRMMODE_PLANE_CRTC_Y], box->y1 - crtc->y);
+	ret |= drmmode_atomic_add(req, plane_id,
+			&props[DRMMODE_PLANE_CRTC_W], w);
+	ret |= drmmode_atomic_add(req, plane_id,
+			&props[DRMMODE_PLANE_CRTC_H], h);
+	if (!ret)
+		ret = drmmode_atomic_commit(drmmode, req,
+				DRM_MODE_ATOMIC_NONBLOCK |
+				DRM_MODE_PAGE_FLIP_EVENT, event);
+
+	drmModeAtomicFree(req);
+	return ret;
+}
+#endif
 
+/*
+ * Deliver event at the CRTC's next vblank, from the kernel or from the
+ * frame clock where the kernel cannot do it.
+ */
+static Bool
+drmmode_crtc_queue_vblank(xf86CrtcPtr crtc, struct ARMSOCFlipEvent *event)
+{
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(crtc->scrn);
+	drmVBlank vbl;
+	uint64_t ust, msc;
 
-	drmmode->cpp = cpp;
-	drmmode->mode_res = drmModeGetResources(drmmode->fd);
-	if (!drmmode->mode_res) {
-		free(drmmode);
-		return FALSE;
-	} else {
-		DEBUG_MSG("Got KMS resources");
-		DEBUG_MSG("  %d connectors, %d encoders",
-				drmmode->mode_res->count_connectors,
-				drmmode->mode_res->count_encoders);
-		DEBUG_MSG("  %d crtcs, %d fbs",
-				drmmode->mode_res->count_crtcs,
-				drmmode->mode_res->count_fbs);
-		DEBUG_MSG("  %dx%d minimum resolution",
-				drmmode->mode_res->min_width,
-				drmmode->mode_res->min_height);
-		DEBUG_MSG("  %dx%d maximum resolution",
-				drmmode->mode_res->max_width,
-				drmmode->mode_res->max_height);
+	if (!pARMSOC->drmmode_interface->vblank_query_supported) {
+		drmmode_crtc_get_ust_msc(crtc, &ust, &msc);
+		return drmmode_crtc_queue_msc(crtc, msc + 1, event);
 	}
-	xf86CrtcSetSizeRange(pScrn, 320, 200, drmmode->mode_res->max_width,
-			drmmode->mode_res->max_height);
 
-	if (ARMSOCPTR(pScrn)->crtcNum == -1) {
-		INFO_MSG("Adding all CRTCs");
-		for (i = 0; i < drmmode->mode_res->count_crtcs; i++)
-			drmmode_crtc_init(pScrn, drmmode, i);
-	} else if (ARMSOCPTR(pScrn)->crtcNum < drmmode->mode_res->count_crtcs) {
-		drmmode_crtc_init(pScrn, drmmode, ARMSOCPTR(pScrn)->crtcNum);
-	} else {
-		ERROR_MSG(
-				"Specified more Screens in xorg.conf than there are DRM CRTCs");
-		return FALSE;
-	}
+	vbl.request.type = DRM_VBLANK_RELATIVE | DRM_VBLANK_EVENT |
+			drmmode_crtc_vblank_pipe(crtc);
+	vbl.request.sequence = 1;
+	vbl.request.signal = (unsigned long)event;
+	return !drmWaitVBlank(pARMSOC->drmFD, &vbl);
+}
 
-	if (ARMSOCPTR(pScrn)->crtcNum != -1) {
-		if (ARMSOCPTR(pScrn)->crtcNum <
-				drmmode->mode_res->count_connectors)
-			drmmode_output_init(pScrn,
-					drmmode, ARMSOCPTR(pScrn)->crtcNum);
-		else
-			return FALSE;
-	} else {
-		for (i = 0; i < drmmode->mode_res->count_connectors; i++)
-			drmmode_output_init(pScrn, drmmode, i);
+/*
+ * Show the given buffer of a window on an overlay plane, over the window's
+ * area of the root framebuffer. event is delivered once the plane shows
+ * the buffer, and only then can the previous one be handed back to the
+ * client: from the flip event of a nonblocking atomic commit, or from the
+ * vblank after drmModeSetPlane, which has no event of its own. If no event
+ * can be queued it is delivered straight away.
+ *
+ * Returns 0 on success. A window that a plane fails to show is not
+ * promoted again until it moves or resizes.
+ */
+int
+drmmode_overlay_flip(DrawablePtr pDraw, struct armsoc_bo *bo,
+		struct ARMSOCFlipEvent *event)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pDraw->pScreen);
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+	struct drmmode_crtc_private_rec *drmmode_crtc;
+	struct drmmode_overlay *ovl;
+	xf86CrtcPtr crtc;
+	BoxRec box;
+	Bool queued = FALSE;
+
+	if (!pScrn->vtSema)
+		return -1;
+
+	crtc = drmmode_overlay_crtc(pDraw, &box);
+	/* the client may draw in another format than the window's */
+	ovl = crtc ? drmmode_overlay_find(drmmode, pDraw, crtc,
+			armsoc_bo_format(bo)) : NULL;
+	if (!ovl)
+		return -1;
+
+	drmmode_crtc = crtc->driver_private;
+#ifdef DRM_CLIENT_CAP_ATOMIC
+	if (drmmode->atomic)
+		queued = !drmmode_overlay_flip_atomic(drmmode, ovl, crtc,
+				&box, bo, event);
+#endif
+	if (!queued && drmModeSetPlane(drmmode->fd, ovl->plane_id,
+			drmmode_crtc->crtc_id, armsoc_bo_get_fb(bo), 0,
+			box.x1 - crtc->x, box.y1 - crtc->y,
+			pDraw->width, pDraw->height,
+			0, 0, pDraw->width << 16, pDraw->height << 16)) {
+		struct drmmode_overlay_window *priv =
+				drmmode_overlay_window(pDraw);
+
+		if (!priv->warned)
+			WARNING_MSG("Overlay plane %u cannot show window 0x%lx: %s",
+					ovl->plane_id,
+					(unsigned long)pDraw->id,
+					strerror(errno));
+		priv->warned = TRUE;
+		priv->rejected = TRUE;
+		priv->box = box;
+		if (ovl->bo)
+			drmmode_overlay_release(pScrn, ovl);
+		return -1;
 	}
-	drmmode_clones_init(pScrn, drmmode);
-
-	xf86InitialConfiguration(pScrn, TRUE);
-
-	TRACE_EXIT();
 
-	return TRUE;
+	armsoc_bo_reference(bo);
+	if (ovl->bo)
+		armsoc_bo_unreference(ovl->bo);
+	ovl->bo = bo;
+	ovl->draw_id = pDraw->id;
+	ovl->crtc = crtc;
+	ovl->box = box;
+
+	if (!queued && !drmmode_crtc_queue_vblank(crtc, event))
+		event->handler(event, 0, 0, 0);
+	return 0;
 }
 
+/*
+ * Take the given window (or every window if pDraw is NULL) off its overlay
+ * plane. The window's contents must be in the root framebuffer already.
+ */
 void
-drmmode_adjust_frame(ScrnInfoPtr pScrn, int x, int y)
+drmmode_overlay_restore(ScrnInfoPtr pScrn, DrawablePtr pDraw)
 {
-	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
-	xf86OutputPtr output = config->output[config->compat_output];
-	xf86CrtcPtr crtc = output->crtc;
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+	int i;
 
-	if (!crtc || !crtc->enabled)
-		return;
+	for (i = 0; i < drmmode->num_overlays; i++) {
+		struct drmmode_overlay *ovl = &drmmode->overlays[i];
 
-	drmmode_set_mode_major(crtc, &crtc->mode, crtc->rotation, x, y);
+		if (!ovl->bo)
+			continue;
+
+		if (pDraw && ovl->draw_id != pDraw->id)
+			continue;
+
+		drmmode_overlay_release(pScrn, ovl);
+	}
 }
 
 /*
- * Page Flipping
+ * Called from the block handler like drmmode_scanout_validate(): windows
+ * shown on an overlay plane that have since been moved, resized, obscured
+ * or destroyed go back to being drawn in the root framebuffer.
  */
-
 static void
-page_flip_handler(int fd, unsigned int sequence, unsigned int tv_sec,
-		unsigned int tv_usec, void *user_data)
+drmmode_overlay_validate(ScrnInfoPtr pScrn)
 {
-	ARMSOCDRI2SwapComplete(user_data);
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+	int i;
+
+	for (i = 0; i < drmmode->num_overlays; i++) {
+		struct drmmode_overlay *ovl = &drmmode->overlays[i];
+		DrawablePtr pDraw;
+		BoxRec box;
+
+		if (!ovl->bo)
+			continue;
+
+		if (dixLookupDrawable(&pDraw, ovl->draw_id, serverClient,
+				M_WINDOW, DixWriteAccess) != Success) {
+			drmmode_overlay_release(pScrn, ovl);
+			continue;
+		}
+
+		if (drmmode_overlay_crtc(pDraw, &box) == ovl->crtc &&
+				box.x1 == ovl->box.x1 && box.y1 == ovl->box.y1 &&
+				box.x2 == ovl->box.x2 && box.y2 == ovl->box.y2)
+			continue;
+
+		drmmode_copy_bo_to_drawable(pDraw, ovl->bo);
+		drmmode_overlay_release(pScrn, ovl);
+	}
 }
 
-static drmEventContext event_context = {
-		.version = DRM_EVENT_CONTEXT_VERSION,
-		.page_flip_handler = page_flip_handler,
-};
+/*
+ * Queue a flip to the given buffer. A window covering the whole root is
+ * flipped on every enabled CRTC, otherwise only the CRTCs whose viewport
+ * the window covers exactly are flipped and the others stay on the root
+ * framebuffer.
+ *
+ * If async is set the flip is done immediately rather than at the next
+ * vblank where the kernel supports it.
+ *
+ * Returns the number of CRTCs flipped, or -(number flipped + 1) on error.
+ */
+static int drmmode_page_flip_atomic(ScrnInfoPtr pScrn, DrawablePtr draw,
+		struct armsoc_bo *bo, struct ARMSOCFlipEvent *event,
+		Bool fullscreen, unsigned int crtc_mask, uint32_t flags);
 
 int
-drmmode_page_flip(DrawablePtr draw, uint32_t fb_id, void *priv)
+drmmode_page_flip(DrawablePtr draw, struct armsoc_bo *bo,
+		struct ARMSOCFlipEvent *event, Bool async)
 {
 	ScreenPtr pScreen = draw->pScreen;
 	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
@@ -1817,28 +5424,120 @@ drmmode_page_flip(DrawablePtr draw, uint32_t fb_id, void *priv)
 	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
 	struct drmmode_crtc_private_rec *crtc = config->crtc[0]->driver_private;
 	struct drmmode_rec *mode = crtc->drmmode;
+	uint32_t fb_id = armsoc_bo_get_fb(bo);
+	unsigned int crtc_mask = 0;
+	Bool fullscreen;
 	int ret, i, failed = 0, num_flipped = 0;
 	unsigned int flags = 0;
 
 	if (pARMSOC->drmmode_interface->use_page_flip_events)
 		flags |= DRM_MODE_PAGE_FLIP_EVENT;
 
-	/* if we can flip, we must be fullscreen.. so flip all CRTC's.. */
+#ifdef DRM_MODE_PAGE_FLIP_ASYNC
+	if (async && mode->async_flip)
+		flags |= DRM_MODE_PAGE_FLIP_ASYNC;
+#endif
+
+	fullscreen = draw->width == pScrn->virtualX &&
+			draw->height == pScrn->virtualY;
+	if (!fullscreen)
+		crtc_mask = drmmode_crtcs_for_drawable(draw);
+
+	/* Async flips aren't generally supported through atomic commits */
+	if (mode->atomic && !async) {
+		ret = drmmode_page_flip_atomic(pScrn, draw, bo, event,
+				fullscreen, crtc_mask, flags);
+		if (ret >= 0)
+			return ret;
+	}
+
 	for (i = 0; i < config->num_crtc; i++) {
-		crtc = config->crtc[i]->driver_private;
+		xf86CrtcPtr xf86_crtc = config->crtc[i];
 
-		if (!config->crtc[i]->enabled)
+		crtc = xf86_crtc->driver_private;
+
+		if (!xf86_crtc->enabled)
+			continue;
+
+		if (!fullscreen && !(crtc_mask & (1 << i)))
 			continue;
 
+		/* A flip keeps the CRTC's scanout offset, so moving between
+		 * the root sized buffers (scanned out at the CRTC's viewport)
+		 * and buffers covering just this CRTC (scanned out from their
+		 * origin) needs a set_crtc first.
+		 */
+		if (fullscreen && crtc->scanout_bo) {
+			if (drmmode_crtc_set_fb(xf86_crtc, fb_id,
+					xf86_crtc->x, xf86_crtc->y)) {
+				xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+						"set crtc failed: %s\n",
+						strerror(errno));
+				failed = 1;
+				continue;
+			}
+			drmmode_crtc_set_scanout_bo(crtc, NULL, 0);
+		} else if (!fullscreen && !crtc->scanout_bo) {
+			/* Buffers covering just this CRTC need an offset of
+			 * 0,0, which a flip can only keep. Where the CRTC is
+			 * elsewhere, or the driver refuses to flip between
+			 * buffers of different sizes, it is set instead and
+			 * the event comes from the next vblank.
+			 */
+			if (!xf86_crtc->x && !xf86_crtc->y &&
+					!drmModePageFlip(mode->fd, crtc->crtc_id,
+						fb_id, flags, event)) {
+				num_flipped += 1;
+				drmmode_crtc_set_scanout_bo(crtc, bo,
+						draw->id);
+				continue;
+			}
+			if (drmmode_crtc_set_fb(xf86_crtc, fb_id, 0, 0)) {
+				xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+						"set crtc failed: %s\n",
+						strerror(errno));
+				failed = 1;
+				continue;
+			}
+			drmmode_crtc_set_scanout_bo(crtc, bo, draw->id);
+			if (!(flags & DRM_MODE_PAGE_FLIP_EVENT) ||
+					drmmode_crtc_queue_vblank(xf86_crtc,
+						event)) {
+				num_flipped += 1;
+				continue;
+			}
+			/* no vblank event to be had, flip to the buffer the
+			 * CRTC shows now for one */
+		}
+
 		ret = drmModePageFlip(mode->fd, crtc->crtc_id,
-				fb_id, flags, priv);
+				fb_id, flags, event);
+#ifdef DRM_MODE_PAGE_FLIP_ASYNC
+		if (ret && errno == EINVAL &&
+				(flags & DRM_MODE_PAGE_FLIP_ASYNC)) {
+			/* The cap is global but drivers may still refuse
+			 * async flips for some configurations. Stop asking
+			 * and flip on vblank instead.
+			 */
+			xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+					"async flip rejected, disabling async flips\n");
+			mode->async_flip = FALSE;
+			flags &= ~DRM_MODE_PAGE_FLIP_ASYNC;
+			ret = drmModePageFlip(mode->fd, crtc->crtc_id,
+					fb_id, flags, event);
+		}
+#endif
 		if (ret) {
 			xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
 					"flip queue failed: %s\n",
 					strerror(errno));
 			failed = 1;
-		} else
+		} else {
 			num_flipped += 1;
+			if (!fullscreen)
+				drmmode_crtc_set_scanout_bo(crtc, bo,
+						draw->id);
+		}
 	}
 
 	if (failed)
@@ -1847,11 +5546,182 @@ drmmode_page_flip(DrawablePtr draw, uint32_t fb_id, void *priv)
 		return num_flipped;
 }
 
+#ifdef DRM_CLIENT_CAP_ATOMIC
+/*
+ * Commit an atomic flip of the CRTCs in crtc_mask along with the colour
+ * correction they have pending, which is left out again if the flip only
+ * goes through without it.
+ */
+static int
+drmmode_atomic_flip_commit(ScrnInfoPtr pScrn, drmModeAtomicReqPtr req,
+		unsigned int crtc_mask, uint32_t flags, void *user_data)
+{
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+#ifdef HAVE_STRUCT_DRM_COLOR_LUT
+	int cursor = drmModeAtomicGetCursor(req);
+	int ret;
+
+	if (!drmmode_color_stage_flip(pScrn, req, crtc_mask))
+		return drmmode_atomic_commit(drmmode, req, flags, user_data);
+
+	ret = drmmode_atomic_commit(drmmode, req, flags, user_data);
+	if (!ret) {
+		drmmode_color_unstage_flip(pScrn, TRUE, FALSE);
+		return 0;
+	}
+
+	drmModeAtomicSetCursor(req, cursor);
+	ret = drmmode_atomic_commit(drmmode, req, flags, user_data);
+	drmmode_color_unstage_flip(pScrn, FALSE, !ret);
+	return ret;
+#else
+	return drmmode_atomic_commit(drmmode, req, flags, user_data);
+#endif
+}
+#endif
+
+/*
+ * Flip all the CRTCs in one atomic commit, so that they either all flip
+ * on the same vblank or none of them do. Buffers covering a single CRTC
+ * are scanned out from their origin and root sized ones from the CRTC's
+ * viewport, which atomic can switch between without a modeset.
+ *
+ * Returns the number of CRTCs flipped, or -1 if the legacy path should be
+ * used instead.
+ */
+static int
+drmmode_page_flip_atomic(ScrnInfoPtr pScrn, DrawablePtr draw,
+		struct armsoc_bo *bo, struct ARMSOCFlipEvent *event,
+		Bool fullscreen, unsigned int crtc_mask, uint32_t flags)
+{
+#ifdef DRM_CLIENT_CAP_ATOMIC
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	uint32_t fb_id = armsoc_bo_get_fb(bo);
+	unsigned int flipped = 0;
+	drmModeAtomicReqPtr req;
+	int i, num_flipped = 0;
+
+	req = drmModeAtomicAlloc();
+	if (!req)
+		return -1;
+
+	for (i = 0; i < config->num_crtc; i++) {
+		xf86CrtcPtr xf86_crtc = config->crtc[i];
+		int x = fullscreen ? xf86_crtc->x : 0;
+		int y = fullscreen ? xf86_crtc->y : 0;
+
+		if (!xf86_crtc->enabled)
+			continue;
+
+		if (!fullscreen && !(crtc_mask & (1 << i)))
+			continue;
+
+		if (drmmode_atomic_add_primary(req, xf86_crtc, fb_id, x, y)) {
+			drmModeAtomicFree(req);
+			return -1;
+		}
+		flipped |= 1 << i;
+		num_flipped++;
+	}
+
+	if (!num_flipped) {
+		drmModeAtomicFree(req);
+		return 0;
+	}
+
+	if (drmmode_atomic_flip_commit(pScrn, req, flipped,
+			DRM_MODE_ATOMIC_NONBLOCK |
+			(flags & DRM_MODE_PAGE_FLIP_EVENT), event)) {
+		DEBUG_MSG("atomic flip failed: %s", strerror(errno));
+		drmModeAtomicFree(req);
+		return -1;
+	}
+	drmModeAtomicFree(req);
+
+	for (i = 0; i < config->num_crtc; i++) {
+		struct drmmode_crtc_private_rec *crtc =
+				config->crtc[i]->driver_private;
+
+		if (!(flipped & (1 << i)))
+			continue;
+
+		if (fullscreen)
+			drmmode_crtc_set_scanout_bo(crtc, NULL, 0);
+		else
+			drmmode_crtc_set_scanout_bo(crtc, bo, draw->id);
+	}
+
+	return num_flipped;
+#else
+	return -1;
+#endif
+}
+
 /*
  * Hot Plug Event handling:
  * TODO: MIDEGL-1441: Do we need to keep this handler, which
  * Rob originally wrote?
  */
+/*
+ * Probe the one connector a hotplug event is about. RandR is only told if
+ * anything changed, and then re-reads the outputs without probing any of
+ * them again. Returns FALSE if the connector is not one of ours.
+ */
+static Bool
+drmmode_hotplug_connector(ScrnInfoPtr pScrn, uint32_t connector_id)
+{
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	struct drmmode_output_priv *drmmode_output = NULL;
+	drmModeConnectorPtr old, new;
+	drmModePropertyBlobPtr blob;
+	uint32_t hash = 0;
+	Bool changed;
+	int i;
+
+	for (i = 0; i < config->num_output; i++) {
+		drmmode_output = config->output[i]->driver_private;
+		if (drmmode_output->output_id == connector_id)
+			break;
+	}
+	if (i == config->num_output)
+		return FALSE;
+
+	new = drmModeGetConnector(drmmode->fd, connector_id);
+	if (!new)
+		return FALSE;
+
+	old = drmmode_output->connector;
+	blob = drmmode_connector_get_edid(drmmode, new);
+	if (blob) {
+		hash = drmmode_hash(blob->data, blob->length / 4);
+		drmModeFreePropertyBlob(blob);
+	}
+
+	changed = new->connection != old->connection ||
+		new->count_modes != old->count_modes ||
+		memcmp(new->modes, old->modes,
+			new->count_modes * sizeof(*new->modes)) ||
+		hash != drmmode_output->edid_hash;
+
+	drmmode_output->connector = new;
+	drmModeFreeConnector(old);
+	drmmode->props_epoch++;
+	drmmode_output->vrr_capable =
+			drmmode_connector_vrr_capable(drmmode, new);
+
+	INFO_MSG("hotplug on connector %u, %s", connector_id,
+			changed ? "changed" : "unchanged");
+
+	if (changed) {
+		drmmode->hotplug_probed = TRUE;
+		RRGetInfo(xf86ScrnToScreen(pScrn), TRUE);
+		drmmode->hotplug_probed = FALSE;
+	}
+
+	return TRUE;
+}
+
 static void
 drmmode_handle_uevents(int fd, void *closure)
 {
@@ -1886,7 +5756,14 @@ drmmode_handle_uevents(int fd, void *closure)
 
 	if (memcmp(&s.st_rdev, &udev_devnum, sizeof(dev_t)) == 0 &&
 			hotplug && atoi(hotplug) == 1) {
-		RRGetInfo(xf86ScrnToScreen(pScrn), TRUE);
+		const char *connector =
+				udev_device_get_property_value(dev, "CONNECTOR");
+
+		/* kernels that name the connector spare us probing the
+		 * others */
+		if (!connector || !drmmode_hotplug_connector(pScrn,
+				strtoul(connector, NULL, 10)))
+			RRGetInfo(xf86ScrnToScreen(pScrn), TRUE);
 	}
 	udev_device_unref(dev);
 }
@@ -1945,45 +5822,49 @@ drmmode_uevent_fini(ScrnInfoPtr pScrn)
 	TRACE_EXIT();
 }
 
-static void
-drmmode_wakeup_handler(pointer data, int err, pointer p)
+void
+drmmode_handle_events(int fd)
 {
-	ScrnInfoPtr pScrn = data;
-	struct drmmode_rec *drmmode;
-	fd_set *read_mask = p;
-
-	if (pScrn == NULL || err < 0)
-		return;
-
-	drmmode = drmmode_from_scrn(pScrn);
-
-	if (FD_ISSET(drmmode->fd, read_mask))
-		drmHandleEvent(drmmode->fd, &event_context);
+	drmHandleEvent(fd, &event_context);
 }
 
 void
 drmmode_wait_for_event(ScrnInfoPtr pScrn)
 {
-	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
-	drmHandleEvent(drmmode->fd, &event_context);
+	drmmode_handle_events(drmmode_from_scrn(pScrn)->fd);
 }
 
 void
 drmmode_screen_init(ScrnInfoPtr pScrn)
 {
-	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
-
 	drmmode_uevent_init(pScrn);
 
-	AddGeneralSocket(drmmode->fd);
-
-	/* Register a wakeup handler to get informed on DRM events */
-	RegisterBlockAndWakeupHandlers((BlockHandlerProcPtr)NoopDDA,
-			drmmode_wakeup_handler, pScrn);
+	/* after the cursor, which may have taken a plane already */
+	if (ARMSOCPTR(pScrn)->overlays)
+		drmmode_overlay_init(pScrn);
 }
 
 void
 drmmode_screen_fini(ScrnInfoPtr pScrn)
 {
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+	struct drmmode_msc_wait *wait, *tmp;
+	int i;
+
+	drmmode_scanout_restore(pScrn, NULL);
+	drmmode_overlay_restore(pScrn, NULL);
+	drmmode_vrr_validate(pScrn, TRUE);
+
+	for (i = 0; i < config->num_crtc; i++)
+		drmmode_crtc_color_fini(config->crtc[i]->driver_private);
+
+	/* deliver what is still waiting, so that its owner can free it */
+	xorg_list_for_each_entry_safe(wait, tmp, &drmmode->msc_waits, link)
+		drmmode_msc_wait_complete(wait);
+
+	free(drmmode->overlays);
+	drmmode->overlays = NULL;
+	drmmode->num_overlays = 0;
 	drmmode_uevent_fini(pScrn);
 }